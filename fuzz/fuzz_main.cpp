@@ -0,0 +1,38 @@
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data, size_t size);
+
+
+static void _run(std::istream& in) {
+  std::string input((std::istreambuf_iterator<char>(in)),
+    std::istreambuf_iterator<char>());
+  LLVMFuzzerTestOneInput(reinterpret_cast<const std::uint8_t*>(input.data()),
+    input.size());
+}
+
+
+// Used instead of libFuzzer: runs the fuzz target once on each file given as
+// argument, or on stdin if there are no arguments. This works with AFL, and
+// for replaying a corpus or a crashing input with any compiler.
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    _run(std::cin);
+    return 0;
+  }
+
+  for (int a = 1; a < argc; ++a) {
+    std::ifstream in(argv[a], std::ios::binary);
+    if (!in) {
+      std::cerr << "Could not open " << argv[a] << std::endl;
+      return 1;
+    }
+    _run(in);
+  }
+
+  return 0;
+}
@@ -0,0 +1,96 @@
+#include <hjson.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+
+// Prints what failed together with the input, and aborts so that the fuzzer
+// saves the input.
+static void _fail(const char *what, const std::string& input,
+  const std::string& output)
+{
+  std::fprintf(stderr, "Round trip failed: %s\n--- input:\n%s\n--- output:\n"
+    "%s\n", what, input.c_str(), output.c_str());
+  std::abort();
+}
+
+
+// Decodes the encoded text, which must succeed and give a tree equal to root.
+template<class F>
+static Hjson::Value _checkDecode(const char *what, const std::string& input,
+  const std::string& text, const Hjson::Value& root, F decode)
+{
+  Hjson::Value root2;
+  try {
+    root2 = decode(text);
+  } catch (const std::exception& e) {
+    _fail((std::string(what) + ", cannot decode the output: " +
+      e.what()).c_str(), input, text);
+  }
+
+  if (!root2.deep_equal(root)) {
+    _fail((std::string(what) + ", the decoded tree is not equal").c_str(),
+      input, text);
+  }
+  if (root2.hash() != root.hash()) {
+    _fail((std::string(what) + ", the hash is not equal").c_str(), input, text);
+  }
+  if (!Hjson::Diff(root, root2).changes.empty()) {
+    _fail((std::string(what) + ", Diff() found changes").c_str(), input,
+      text);
+  }
+
+  return root2;
+}
+
+
+// The input is first decoded as binary data, both as it is and after the
+// header of the binary format, so that the fuzzer does not have to find the
+// header. Input that is not valid (binary or text) is ignored, apart from any
+// crash or sanitizer error while trying to decode it. Valid Hjson input is
+// encoded as Hjson (with and without comments), as JSON and in the binary
+// format, and each result must decode to an equal tree. Encoding the decoded
+// Hjson again without comments must give exactly the same text.
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data, size_t size) {
+  std::string input(reinterpret_cast<const char*>(data), size);
+  Hjson::Value root;
+
+  for (const auto& bin : { input, std::string("HJB\x01", 4) + input }) {
+    try {
+      Hjson::UnmarshalBinary(bin.data(), bin.size());
+    } catch (const Hjson::syntax_error&) {
+    }
+  }
+
+  try {
+    root = Hjson::Unmarshal(input.data(), input.size());
+  } catch (const Hjson::syntax_error&) {
+    return 0;
+  }
+
+  auto unmarshal = [](const std::string& text) {
+    return Hjson::Unmarshal(text);
+  };
+
+  Hjson::EncoderOptions encOpt;
+  for (int comments = 0; comments < 2; ++comments) {
+    encOpt.comments = (comments != 0);
+    auto text = Hjson::Marshal(root, encOpt);
+    auto root2 = _checkDecode("Hjson", input, text, root, unmarshal);
+    // The whitespace around comments can change in each round trip.
+    if (!encOpt.comments && Hjson::Marshal(root2, encOpt) != text) {
+      _fail("Hjson, encoding the decoded tree gives different text", input,
+        text);
+    }
+  }
+
+  _checkDecode("JSON", input, Hjson::MarshalJson(root), root, unmarshal);
+
+  _checkDecode("binary", input, Hjson::MarshalBinary(root), root,
+    [](const std::string& bin) {
+      return Hjson::UnmarshalBinary(bin.data(), bin.size());
+    });
+
+  return 0;
+}
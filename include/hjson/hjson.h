@@ -2,9 +2,19 @@
 #define HJSON_AFOWENFOWANEFWOAFNLL
 
 #include <string>
+#include <cstdint>
 #include <memory>
-#include <map>
+#include <iterator>
+#include <utility>
+#include <cstddef>
 #include <stdexcept>
+#include <vector>
+#include <map>
+#include <type_traits>
+#include <limits>
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+# include <string_view>
+#endif
 
 #define HJSON_OP_DECL_VAL(_T, _O) \
 friend Value operator _O(_T, const Value&); \
@@ -77,6 +87,56 @@ enum class Type {
 };
 
 
+// Statistics from Unmarshal(), see DecoderOptions::stats. Each call adds to
+// the fields, so that one object can collect the totals of many calls.
+struct DecoderStats {
+  // The size of the input.
+  std::uint64_t bytes = 0;
+  // The number of values of each type in the resulting tree, indexed by
+  // static_cast<int>(Type).
+  std::uint64_t nodes[8] = {};
+  // The deepest nesting of Vectors and Maps, 0 for a single scalar value. The
+  // only field that is not a sum, but the largest value of all calls.
+  int maxDepth = 0;
+  // The heap allocations made for the nodes, containers, map elements,
+  // comments and string contents of the tree (with DecoderOptions::arena, the
+  // arena blocks instead of the objects in them). Temporary buffers used by
+  // the decoder itself are not included.
+  std::uint64_t allocations = 0;
+  std::uint64_t allocatedBytes = 0;
+  // The wall-clock time of the calls.
+  double totalSeconds = 0;
+  // The time spent skipping whitespace and comments, reading quoted strings,
+  // quoteless strings and keys, parsing numbers, and creating and inserting
+  // the values and comments of the tree. When several threads are used,
+  // these are summed over all threads. The remaining time is spent in the
+  // grammar itself.
+  double whitespaceSeconds = 0;
+  double stringSeconds = 0;
+  double numberSeconds = 0;
+  double treeSeconds = 0;
+};
+
+
+// Statistics from Marshal(), see EncoderOptions::stats. Each call adds to the
+// fields, so that one object can collect the totals of many calls.
+struct EncoderStats {
+  // The size of the output.
+  std::uint64_t bytes = 0;
+  // The number of encoded values of each type, indexed by
+  // static_cast<int>(Type).
+  std::uint64_t nodes[8] = {};
+  // The wall-clock time of the calls.
+  double totalSeconds = 0;
+  // The time spent deciding how each string and key must be quoted, summed
+  // over all threads.
+  double quoteSeconds = 0;
+  // The time spent writing the output to the stream or file, 0 for Marshal().
+  // The remaining time is spent walking the tree and formatting the output.
+  double writeSeconds = 0;
+};
+
+
 // DecoderOptions defines options for decoding from Hjson.
 struct DecoderOptions {
   // Keep all comments from the Hjson input, store them in
@@ -89,6 +149,53 @@ struct DecoderOptions {
   // If true, an Hjson::syntax_error exception is thrown from the unmarshal
   // functions if a map contains duplicate keys.
   bool duplicateKeyException = false;
+  // If larger than 0, an Hjson::syntax_error exception is thrown from the
+  // unmarshal functions if Vectors and Maps are nested more than this many
+  // levels deep (the root Vector or Map being the first level). Nesting does
+  // not use the call stack of the decoders, so any depth can be decoded if
+  // maxDepth is 0, but a limit rejects hostile input early. Also applies to
+  // UnmarshalBinary().
+  int maxDepth = 0;
+  // Allocate the nodes, comment blocks and Vector and Map storage of the
+  // resulting Value tree from a single memory arena instead of making separate
+  // heap allocations for each of them. The contents of strings and of keys
+  // that are longer than the small-string buffer of std::string are still
+  // allocated on the heap. Makes the destruction of large trees faster, at a
+  // measurable cost when unmarshalling. The memory is not released until every
+  // Value from the tree has been destroyed, even if most of the tree has been
+  // removed or replaced.
+  bool arena = false;
+  // Decode the elements of a root Vector or Map concurrently on up to this
+  // many threads, if the input is large enough (at least 128 kB). The result,
+  // including comments and syntax error messages, is the same as when a
+  // single thread is used (invalid input is decoded again on a single thread
+  // to find the error). 0 means one thread per CPU core.
+  int threads = 1;
+  // If set, Unmarshal() and UnmarshalFromFile() add statistics about the
+  // decoding to *stats, unless they throw an exception. There is no cost when
+  // stats is null. *stats must not be used by other threads during the call.
+  DecoderStats *stats = nullptr;
+  // If false, the time of each phase (e.g. DecoderStats::stringSeconds) is not
+  // measured. The clock is then only read at the start and at the end, instead
+  // of several times per value, which makes decoding with stats a few times
+  // faster.
+  bool statsPhaseTimes = true;
+  // Let Unmarshal() only find the positions of all Vectors and Maps in the
+  // input and decode the root, while the elements of every other Vector and
+  // Map are decoded when the Vector or Map is first accessed (e.g. by
+  // operator[], size() or begin()). Each access only decodes one level, so
+  // reading a few values from a large document is much faster than decoding
+  // all of it. The input is copied and kept in memory until every Vector and
+  // Map has been decoded or destroyed. The threads and stats options are
+  // ignored when lazy is true.
+  bool lazy = false;
+  // Only used if lazy is true. If true, the whole input is validated by
+  // Unmarshal(). If false, the escape sequences in quoted string values and
+  // duplicate keys (if duplicateKeyException is true) are only checked when
+  // the Vector or Map containing them is decoded, and are then thrown as
+  // Hjson::syntax_error from the Value function that accessed it. Unmarshal()
+  // is then faster, since it does not need to decode string values.
+  bool lazyValidate = true;
 };
 
 
@@ -120,25 +227,190 @@ struct EncoderOptions {
   bool omitRootBraces = false;
   // Write comments, if any are found in the Hjson::Value objects.
   bool comments = true;
+  // Encode the elements of large Vectors and Maps (at least 1024 elements)
+  // concurrently on up to this many threads. The output is the same as when a
+  // single thread is used, and is still written in bounded chunks when the
+  // output is a file or a stream. 0 means one thread per CPU core.
+  int threads = 1;
+  // If set, the encoder adds statistics about the encoding to *stats, unless
+  // it throws an exception. There is no cost when stats is null. *stats must
+  // not be used by other threads during the call.
+  EncoderStats *stats = nullptr;
+  // If false, EncoderStats::quoteSeconds is not measured, so that the clock
+  // is not read for every string and key.
+  bool statsPhaseTimes = true;
+};
+
+
+// A reference to a string that is owned by a Value, for reading the string
+// without copying it. A StringRef is only valid as long as the string it
+// refers to is not changed or destroyed.
+class StringRef {
+  const char *p;
+  size_t n;
+
+public:
+  StringRef()
+    : p(""),
+    n(0)
+  {
+  }
+
+  StringRef(const char *_p, size_t _n)
+    : p(_p),
+    n(_n)
+  {
+  }
+
+  StringRef(const char *sz)
+    : p(sz),
+    n(std::char_traits<char>::length(sz))
+  {
+  }
+
+  StringRef(const std::string& str)
+    : p(str.data()),
+    n(str.size())
+  {
+  }
+
+  const char *data() const { return p; }
+  size_t size() const { return n; }
+  bool empty() const { return !n; }
+  const char *begin() const { return p; }
+  const char *end() const { return p + n; }
+  char operator[](size_t pos) const { return p[pos]; }
+  std::string str() const { return std::string(p, n); }
+  explicit operator std::string() const { return str(); }
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+  operator std::string_view() const { return std::string_view(p, n); }
+#endif
+
+  friend bool operator ==(const StringRef& a, const StringRef& b) {
+    return a.n == b.n && !std::char_traits<char>::compare(a.p, b.p, a.n);
+  }
+  friend bool operator !=(const StringRef& a, const StringRef& b) {
+    return !(a == b);
+  }
+  friend std::ostream& operator <<(std::ostream&, const StringRef&);
 };
 
 
 class MapProxy;
+class Path;
+class CachedPath;
+class LazyDocument;
 
 
 class Value {
   friend class MapProxy;
+  friend class Path;
+  friend class CachedPath;
 
 private:
   class ValueImpl;
   class Comments;
 
+  // Null, Bool, Double and Int64 are stored directly in scalar, without any
+  // heap allocation, and prv is then null. Undefined, String, Vector and Map
+  // are stored in prv, which is shared by all copies of the Value.
   std::shared_ptr<ValueImpl> prv;
   std::shared_ptr<Comments> cm;
+  Type scalarType;
+  union {
+    bool b;
+    double d;
+    std::int64_t i;
+  } scalar;
 
   Value(std::shared_ptr<ValueImpl>, std::shared_ptr<Comments>);
+  // Makes this Value use the same data as the other Value, without changing
+  // the comments.
+  void share_data(const Value&);
+  // Used by the decoder to store comments as ranges of a buffer that is
+  // shared by all Values in the same document.
+  friend void setCommentRange(Value&, int, const std::shared_ptr<std::string>&,
+    size_t, size_t, bool);
+  friend void moveComment(Value&, int, int);
+  // Used by the decoder to reserve a Map for the number of keys it expects.
+  friend void reserveMapElements(Value&, size_t);
+  // Used by the decoder to create the Vectors and Maps of a lazily decoded
+  // document, see DecoderOptions::lazy.
+  friend Value createLazy(Type, const std::shared_ptr<LazyDocument>&, size_t);
 
 public:
+  // An element in a Map.
+  typedef std::pair<const std::string, Value> MapEntry;
+
+  // Iterator over the elements in a Map, in alphabetical key order.
+  template<class E>
+  class MapIterator {
+    friend class Value;
+    template<class F> friend class MapIterator;
+
+    E *const *p;
+
+    explicit MapIterator(E *const *_p)
+      : p(_p)
+    {
+    }
+
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef E value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef E *pointer;
+    typedef E &reference;
+
+    MapIterator()
+      : p(nullptr)
+    {
+    }
+
+    // Allows conversion from iterator to const_iterator.
+    template<class F>
+    MapIterator(const MapIterator<F>& other)
+      : p(other.p)
+    {
+    }
+
+    E &operator*() const { return **p; }
+    E *operator->() const { return *p; }
+    MapIterator &operator++() { ++p; return *this; }
+    MapIterator &operator--() { --p; return *this; }
+    MapIterator operator++(int) { auto ret = *this; ++p; return ret; }
+    MapIterator operator--(int) { auto ret = *this; --p; return ret; }
+    template<class F>
+    bool operator==(const MapIterator<F>& other) const { return p == other.p; }
+    template<class F>
+    bool operator!=(const MapIterator<F>& other) const { return p != other.p; }
+  };
+
+  // Before version 3.0 these were std::map<std::string, Value>::iterator
+  // and std::map<std::string, Value>::const_iterator. Code that names those
+  // types must use Value::iterator and Value::const_iterator instead, or
+  // auto. The iterators are still bidirectional, in the same order, and
+  // dereference to the same std::pair, but they do not convert to the
+  // std::map iterators.
+  typedef MapIterator<MapEntry> iterator;
+  typedef MapIterator<const MapEntry> const_iterator;
+
+  // A pair of iterators that can be used in a range-based for loop.
+  template<class I>
+  class MapRange {
+    I b, e;
+
+  public:
+    MapRange(I _b, I _e)
+      : b(_b),
+      e(_e)
+    {
+    }
+
+    I begin() const { return b; }
+    I end() const { return e; }
+  };
+
   Value();
   Value(bool);
   Value(float);
@@ -157,11 +429,18 @@ public:
   Value(const char*);
   Value(const std::string&);
   Value(Type);
+  // A copy of a Value of type Undefined, String, Vector or Map refers to the
+  // same data as the original, so changes made in place (like push_back() or
+  // +=) through one of them are seen through both. Use clone() to get an
+  // independent copy. Null, Bool, Double and Int64 are copied by value: after
+  // `Value b = a; b += 1;`, a is unchanged. Before version 3.0 they were
+  // also shared.
   Value(const Value&);
   Value(Value&&);
   Value(MapProxy&&);
   virtual ~Value();
 
+  // Copies like the copy constructor.
   Value& operator =(const Value&);
   Value& operator =(Value&&);
 
@@ -245,6 +524,13 @@ public:
   // to the entire tree for which the Value parameter is root. Comments are
   // ignored in the comparison.
   bool deep_equal(const Value&) const;
+  // Returns a hash of the entire tree for which this Value is the root. Trees
+  // that are equal according to deep_equal() have the same hash, so comments
+  // and the order of the keys in Maps do not affect the hash. The hash is
+  // computed on each call (element Values can be changed through references
+  // without their containers being notified, so it is not cached), and is
+  // only meant to be compared within the same process.
+  size_t hash() const;
   // Returns a full clone of the tree for which this Value is the root.
   Value clone() const;
 
@@ -271,6 +557,10 @@ public:
   // Returns the number of child elements contained in this Value if this Value
   // is of type Vector or Map. Returns 0 if this Value is of any other type.
   size_t size() const;
+  // Makes room for at least this number of child elements without further
+  // allocations, if this Value is of type Vector or Map. Does nothing if this
+  // Value is of any other type.
+  void reserve(size_t);
 
   // -- Vector specific function
   // Increases the size of this Vector by adding a Value at the end. Throws
@@ -284,6 +574,21 @@ public:
   // of type Undefined or Map. Throws Hjson::type_mismatch if this Value is of
   // any other type.
   std::string key(int) const;
+  // Like key(), but returns a reference to the key instead of a copy. The
+  // reference is valid until the element is removed from the Map.
+  const std::string& key_ref(int) const;
+  // Returns true if this Value is of type Map and contains the key.
+  bool contains(const std::string& key) const;
+  // Adds the key and value to this Map if the Map does not already contain
+  // the key, using a single lookup. The key and the value (including its
+  // comments) are moved into the Map. Returns true if the element was added.
+  // Throws Hjson::type_mismatch if this Value is of any other type than Map
+  // or Undefined.
+  bool try_emplace(std::string key, Value val);
+  // Like try_emplace(), but if the Map already contains the key the value and
+  // comments of that element are replaced (like assign_with_comments()).
+  // Returns a reference to the element.
+  Value& insert_or_assign(std::string key, Value val);
   // Returns a reference to the Value specified by the key parameter. Throws
   // Hjson::index_out_of_bounds if this Value does not contain the specified
   // key and this Value is of type Undefined or Map. Throws
@@ -292,12 +597,29 @@ public:
   Value& at(const std::string& key);
   const Value& at(const char *key) const;
   Value& at(const char *key);
+  // Returns a pointer to the Value specified by the key parameter, or a null
+  // pointer if this Value does not contain the specified key and this Value
+  // is of type Undefined or Map. Unlike the string bracket operator, no Value
+  // is created or copied. Throws Hjson::type_mismatch if this Value is of any
+  // other type.
+  const Value *find(const std::string& key) const;
+  Value *find(const std::string& key);
   // Iterations are always done in alphabetical key order. Returns a default
-  // constructed iterator if this Value is of any other type than Map.
-  std::map<std::string, Value>::iterator begin();
-  std::map<std::string, Value>::iterator end();
-  std::map<std::string, Value>::const_iterator begin() const;
-  std::map<std::string, Value>::const_iterator end() const;
+  // constructed iterator if this Value is of any other type than Map. The
+  // iterators are invalidated when an element is added to or removed from the
+  // Map, but references to the elements stay valid until the element itself
+  // is removed.
+  iterator begin();
+  iterator end();
+  const_iterator begin() const;
+  const_iterator end() const;
+  // Iterates over the elements in insertion order instead of alphabetical key
+  // order, e.g. `for (auto& elem : map.insertion_order())`. This does not need
+  // to build the sorted view that begin() and end() use. Returns an empty
+  // range if this Value is of any other type than Map. Invalidated in the
+  // same way as the iterators returned by begin() and end().
+  MapRange<iterator> insertion_order();
+  MapRange<const_iterator> insertion_order() const;
   // Removes the child element specified by the input key if this Value is of
   // type Map. Returns the number of erased elements (0 or 1). Throws
   // Hjson::type_mismatch if this Value is of any other type than Map or
@@ -311,24 +633,37 @@ public:
   double to_double() const;
   std::int64_t to_int64() const;
   std::string to_string() const;
+  // Returns a reference to the string in this Value without copying it. The
+  // reference is valid as long as the string is not changed or destroyed.
+  // Throws Hjson::type_mismatch if this Value is of any other type than
+  // String.
+  const std::string& string_ref() const;
 
   // Sets comment shown before this Value. If this Value is an element in a
   // Map, the comment is shown before the key.
   void set_comment_before(const std::string&);
   std::string get_comment_before() const;
+  StringRef get_comment_before_ref() const;
   // Sets comment shown between the key and this Value. If this Value is
   // not an element in a Map, the comment is shown between the "before"
   // comment and this Value.
   void set_comment_key(const std::string&);
   std::string get_comment_key() const;
+  StringRef get_comment_key_ref() const;
   // Sets comment shown right after "[" if this Value is a Vector, or right
   // after "{" if this Value is a Map. The comment is not shown if this Value
   // is of any other type than Vector or Map.
   void set_comment_inside(const std::string&);
   std::string get_comment_inside() const;
+  StringRef get_comment_inside_ref() const;
   // Sets comment shown after this Value.
   void set_comment_after(const std::string&);
   std::string get_comment_after() const;
+  StringRef get_comment_after_ref() const;
+
+  // The get_comment_x_ref() functions return a reference to the comment
+  // instead of a copy. The reference is valid until any comment of this Value
+  // is changed or this Value is destroyed.
 
   // Copies all comments from the other Hjson::Value.
   void set_comments(const Value&);
@@ -376,6 +711,71 @@ public:
 };
 
 
+// A path to a Value inside a tree, parsed once so that it can be looked up
+// repeatedly without creating any temporary strings or Values. Several
+// threads can use the same Path at the same time.
+class Path {
+  friend class CachedPath;
+
+private:
+  class Segment;
+
+  std::shared_ptr<const std::vector<Segment> > segments;
+
+  // Returns the element for the segment in the container, or null.
+  static const Value *child(const Value& container, const Segment&);
+
+public:
+  // Parses a JSON pointer (RFC 6901) like "/services/auth/timeouts/read",
+  // where "~1" is decoded to "/" and "~0" to "~". An empty string is the path
+  // to the root. When the path passes a Vector, the key is used as index.
+  // Throws Hjson::syntax_error if the pointer is not empty and does not start
+  // with "/", or if it contains an invalid escape sequence.
+  Path(const std::string& pointer);
+  // Creates a path from keys that are not escaped.
+  Path(const std::vector<std::string>& keys);
+
+  // Returns a pointer to the Value at this path in the tree root, or null if
+  // there is no such Value. Does not allocate memory.
+  const Value *find(const Value& root) const;
+  Value *find(Value& root) const;
+  // Like find(), but throws Hjson::index_out_of_bounds if there is no Value
+  // at this path.
+  const Value& at(const Value& root) const;
+  Value& at(Value& root) const;
+};
+
+
+// Like Path, but remembers where the Value was found the last time. The next
+// lookup only checks that the containers on the path are still the same and
+// that no elements have been removed from them, without comparing any keys.
+// The cache keeps the containers on the path alive. A CachedPath must not be
+// used by several threads at the same time.
+class CachedPath {
+private:
+  class Cache;
+
+  Path path;
+  std::unique_ptr<Cache> cache;
+
+  const Value *lookup(const Value& root);
+
+public:
+  CachedPath(const Path&);
+  CachedPath(const CachedPath&);
+  ~CachedPath();
+
+  CachedPath& operator =(const CachedPath&);
+
+  // See Path::find().
+  const Value *find(const Value& root);
+  Value *find(Value& root);
+  // See Path::at().
+  const Value& at(const Value& root);
+  Value& at(Value& root);
+};
+
+
 class StreamEncoder {
 public:
   const Value& v;
@@ -402,6 +802,172 @@ public:
 };
 
 
+// Decodes Hjson input that arrives in chunks, for example from a socket or a
+// pipe. Each chunk is parsed as far as possible when it is fed to the decoder,
+// and input that has been parsed is not kept in memory. The chunks can be
+// split anywhere, also in the middle of strings or comments.
+class IncrementalDecoder {
+public:
+  IncrementalDecoder(const DecoderOptions& options = DecoderOptions());
+  ~IncrementalDecoder();
+
+  // Parses the next chunk of input. Throws Hjson::syntax_error as soon as the
+  // input is known to be invalid, after which the decoder is reset.
+  void feed(const char *data, size_t dataSize);
+  void feed(const std::string& data);
+  // Signals the end of the input. Returns the same Value tree that
+  // `Unmarshal()` would have returned for all chunks put together, and resets
+  // the decoder so that it can be used for a new input.
+  Value finish();
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> prv;
+};
+
+
+// Decodes Hjson text exactly as `Unmarshal()` with the same options, but keeps
+// the buffers used while decoding (for strings with escape sequences and for
+// the stack of open Vectors and Maps) between calls. After the first few
+// calls, decoding documents of similar size and shape makes no heap
+// allocations except for the Value trees returned. A Decoder must not be used
+// by more than one thread at a time; use one Decoder per thread.
+class Decoder {
+public:
+  Decoder(const DecoderOptions& options = DecoderOptions());
+  ~Decoder();
+
+  Value unmarshal(const char *data, size_t dataSize);
+  // The input parameter "data" must be null-terminated.
+  Value unmarshal(const char *data);
+  Value unmarshal(const std::string& data);
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> prv;
+};
+
+
+// Encodes Value trees exactly as `Marshal()` with the same options, but keeps
+// the output buffer and the buffers used while encoding between calls. After
+// the first few calls, encoding Value trees of similar size and shape makes no
+// heap allocations. An Encoder must not be used by more than one thread at a
+// time; use one Encoder per thread.
+class Encoder {
+public:
+  Encoder(const EncoderOptions& options = EncoderOptions());
+  ~Encoder();
+
+  // Returns the same text as `Marshal()`. The returned string belongs to the
+  // Encoder and is overwritten by the next call.
+  const std::string& marshal(const Value& v);
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> prv;
+};
+
+
+// Receives the contents of Hjson input as a sequence of events, without any
+// Value tree being built. Override the functions of interest, the default
+// implementations do nothing. Keys and strings are passed as pointer and
+// length, and point straight into the input data unless the string contained
+// escape sequences or was a multiline string. The pointers are only valid
+// during the call. An exception thrown from any of the functions stops the
+// parsing and is passed on to the caller of `Unmarshal()`.
+class DecoderHandler {
+public:
+  virtual ~DecoderHandler();
+
+  virtual void on_object_begin();
+  virtual void on_object_end();
+  virtual void on_array_begin();
+  virtual void on_array_end();
+  // Called for each key in an object, followed by the events for its value.
+  virtual void on_key(const char *key, size_t keySize);
+  virtual void on_string(const char *str, size_t strSize);
+  virtual void on_int64(std::int64_t);
+  virtual void on_double(double);
+  virtual void on_bool(bool);
+  virtual void on_null();
+  // Called in input order for each run of comments (including the surrounding
+  // whitespace) that would have been stored in a Value tree, so only if
+  // DecoderOptions::comments is true.
+  virtual void on_comment(const char *comment, size_t commentSize);
+};
+
+
+// Reads a sequence of Hjson or JSON documents that follow each other in the
+// input, for example a log with one JSON object per line. A document that
+// starts with '{' or '[' ends at the matching bracket, so such documents can
+// span several lines and need no separator. Any other document (a root object
+// without braces, or a single value like a number or a string) ends at the
+// next empty line that is not inside a multiline string. Each document is
+// decoded exactly as `Unmarshal()` decodes the part of the input from the end
+// of the previous document to the end of this document, where comments after
+// a document on the same line belong to that document, and the comments after
+// the last document belong to the last document. A document is parsed where
+// it is, without a separate pass to find its end, except for the search for
+// the empty line after a document without brackets. The options lazy, threads
+// and stats are not used, and if arena is true each document gets its own
+// arena.
+class DocumentReader {
+public:
+  // Reads from a buffer, that must be kept valid while the reader is used.
+  DocumentReader(const char *data, size_t dataSize,
+    const DecoderOptions& options = DecoderOptions());
+  // Reads from the stream in blocks, so that only about as much of the input
+  // as the largest document is kept in memory.
+  DocumentReader(std::istream& in,
+    const DecoderOptions& options = DecoderOptions());
+  DocumentReader(DocumentReader&&);
+  DocumentReader& operator=(DocumentReader&&);
+  ~DocumentReader();
+
+  // Reads from the file, which is memory mapped if possible. Throws
+  // Hjson::file_error if the file cannot be opened for reading.
+  static DocumentReader fromFile(const std::string& path,
+    const DecoderOptions& options = DecoderOptions());
+
+  // Sets doc to the next document and returns true, or returns false if there
+  // are no more documents. Throws Hjson::syntax_error for invalid input, after
+  // which the reader returns false.
+  bool next(Value& doc);
+  // Reports the contents of the next document to the handler instead of
+  // creating a Value tree, like `Unmarshal(const char*, size_t,
+  // DecoderHandler&, DecoderOptions)`. Returns false if there are no more
+  // documents.
+  bool next(DecoderHandler& handler);
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> prv;
+};
+
+
+// Writes a sequence of documents that DocumentReader can read back, to a
+// stream. Each document is formatted exactly as by `Marshal()` and followed
+// by options.eol, or by two of them if the document does not start with a
+// bracket. The output is collected in a buffer and written to the stream in
+// large chunks. The option stats is not used.
+class DocumentWriter {
+public:
+  // The stream must be kept valid while the writer is used.
+  DocumentWriter(std::ostream& out,
+    const EncoderOptions& options = EncoderOptions());
+  // Calls flush(), but ignores any exception from the stream.
+  ~DocumentWriter();
+
+  void write(const Value& doc);
+  // Writes everything that is still in the buffer to the stream.
+  void flush();
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> prv;
+};
+
+
 // Returns a properly indented text representation of the input value tree.
 // Extra options can be specified in the input parameter "options".
 std::string Marshal(const Value& v, const EncoderOptions& options = EncoderOptions());
@@ -429,11 +995,55 @@ Value Unmarshal(const char *data, const DecoderOptions& options = DecoderOptions
 Value Unmarshal(const std::string& data,
   const DecoderOptions& options = DecoderOptions());
 
+// Returns all documents in the input text, read as by DocumentReader. If the
+// option threads is larger than 1 and the input is large enough (at least
+// 128 kB), the documents are decoded concurrently after a first pass has found
+// where each of them starts and checked the syntax of all input, so that the
+// errors thrown are the same as with a single thread. The documents decoded on
+// the same thread then share arenas if arena is true.
+std::vector<Value> UnmarshalDocuments(const char *data, size_t dataSize,
+  const DecoderOptions& options = DecoderOptions());
+
+// Like `UnmarshalDocuments(const char*, size_t, DecoderOptions)`.
+std::vector<Value> UnmarshalDocuments(const std::string& data,
+  const DecoderOptions& options = DecoderOptions());
+
+// Parses the input text and reports its contents to the handler, instead of
+// creating a Value tree. Throws Hjson::syntax_error for invalid input, the
+// same as `Unmarshal()` would have done, but the handler might already have
+// received events for the part of the input before the error.
+void Unmarshal(const char *data, size_t dataSize, DecoderHandler& handler,
+  const DecoderOptions& options = DecoderOptions());
+
+// Like `Unmarshal(const char*, size_t, DecoderHandler&, DecoderOptions)`.
+void Unmarshal(const std::string& data, DecoderHandler& handler,
+  const DecoderOptions& options = DecoderOptions());
+
 // Reads the entire file (in binary mode) and unmarshals it. Throws
 // Hjson::file_error if the file cannot be opened for reading.
 Value UnmarshalFromFile(const std::string& path,
   const DecoderOptions& options = DecoderOptions());
 
+// Returns a compact binary representation of the input value tree, that is
+// much faster to read with `UnmarshalBinary()` than Hjson text is to read with
+// `Unmarshal()`. All types are kept, including the difference between Int64
+// and Double, Undefined values and the insertion order of Maps. Comments are
+// included if options.comments is true, the other options are not used. The
+// format is versioned; strings, Vectors and Maps are stored with their sizes
+// so that a reader can skip them.
+std::string MarshalBinary(const Value& v,
+  const EncoderOptions& options = EncoderOptions());
+
+// Creates a Value tree from data created by `MarshalBinary()`. Throws
+// Hjson::syntax_error if the data is invalid or truncated. Only the options
+// comments and arena are used.
+Value UnmarshalBinary(const char *data, size_t dataSize,
+  const DecoderOptions& options = DecoderOptions());
+
+// Creates a Value tree from data created by `MarshalBinary()`.
+Value UnmarshalBinary(const std::string& data,
+  const DecoderOptions& options = DecoderOptions());
+
 // Returns a Value tree that is a combination of the input parameters "base"
 // and "ext".
 //
@@ -454,7 +1064,460 @@ Value UnmarshalFromFile(const std::string& path,
 Value Merge(const Value& base, const Value& ext);
 
 
+// The changes that turn one tree into another, see Diff() and Patch().
+struct Difference {
+  enum class Op {
+    // Adds value to the Map at path (after its other keys in the insertion
+    // order), or inserts value into the Vector at path.
+    Add,
+    // Removes the element at path.
+    Remove,
+    // Replaces the element at path with value.
+    Replace,
+    // Changes the insertion order of the Map at path by calling move(from,
+    // to) on it.
+    Move
+  };
+
+  struct Change {
+    Op op = Op::Replace;
+    // The keys from the root to the element (or to the Map, for Op::Move). A
+    // Vector index is written as a decimal number. Empty for the root.
+    std::vector<std::string> path;
+    // The new element for Op::Add and Op::Replace, Undefined otherwise. It is
+    // a reference to the element in the tree given to Diff(), not a clone.
+    Value value;
+    // The arguments to move() for Op::Move, 0 otherwise.
+    int from = 0;
+    int to = 0;
+
+    // Returns path as a JSON pointer (RFC 6901), like "/servers/main/port".
+    std::string pointer() const;
+  };
+
+  // In the order that they must be applied.
+  std::vector<Change> changes;
+};
+
+
+// Returns the changes that make the tree "from" equal to the tree "to"
+// according to Value::deep_equal() and with the same insertion order in all
+// Maps. Comments are ignored in the comparison. Only the elements that
+// differ are included: a Map or Vector that exists in both trees is compared
+// element by element instead of being replaced, and Vectors are compared
+// after skipping the elements that are equal at the start and at the end.
+// Containers that are shared by both trees are not traversed.
+Difference Diff(const Value& from, const Value& to);
+
+// Applies the changes from Diff() in place to "root", which must be equal to
+// the tree "from" given to Diff() (comments excepted) for the result to be
+// equal to "to". Added and replaced elements are cloned, together with their
+// comments. All other elements keep their comments, and the Vectors and Maps
+// that are not replaced stay the same containers, so Values that share them
+// also see the changes. Throws
+// Hjson::index_out_of_bounds if a path is not found in "root".
+void Patch(Value& root, const Difference& diff);
+
+// Writes Hjson text from a sequence of calls, formatted exactly as Marshal()
+// with the same options formats a Value tree containing the same values. The
+// calls must describe a single root value: a key before each value in an
+// object, and each object_begin() and array_begin() matched by
+// object_end() and array_end(). Comments and EncoderOptions::threads and
+// EncoderOptions::stats are not used. Throws std::logic_error if a call does
+// not fit the structure described so far.
+class EventEncoder {
+public:
+  EventEncoder(const EncoderOptions& options = EncoderOptions());
+  ~EventEncoder();
+
+  void object_begin();
+  void object_end();
+  void array_begin();
+  void array_end();
+  void key(const char *key, size_t keySize);
+  void key(const std::string& key);
+  void string(const char *str, size_t strSize);
+  void string(const std::string& str);
+  void int64(std::int64_t);
+  void float64(double);
+  void boolean(bool);
+  void null();
+  // Returns the output written so far, and resets the encoder so that it can
+  // be used for a new root value.
+  std::string str();
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> prv;
+};
+
+
+// UnmarshalInto() and Marshal() can read and write C++ objects directly, without
+// any Value tree, for the types that have a Binding: std::string, bool, the
+// arithmetic types, std::vector<T> and std::map<std::string, T> (when T has
+// a Binding), and structs that have been bound with HJSON_BIND().
+//
+//   struct Server {
+//     std::string host;
+//     int port = 80;
+//     std::vector<std::string> aliases;
+//   };
+//   HJSON_BIND(Server, HJSON_FIELD(host), HJSON_FIELD(port),
+//     HJSON_FIELD_NAMED(aliases, "alias"))
+//
+//   Server server;
+//   Hjson::UnmarshalInto(text, server);
+//   std::string out = Hjson::Marshal(server);
+//
+// When unmarshalling, the members for keys that are not in the input keep
+// their values, keys that are not bound are ignored, and null leaves the
+// target unchanged (so a null element in an array is default constructed).
+// Vectors and maps are cleared before their elements are read. Numbers are
+// converted to the type of the target the same way as by the conversion
+// operators of Value, but a number that is out of range for the target type
+// throws Hjson::type_mismatch, as does any other mismatch between the input
+// and the target type.
+template<class T, class Enable = void>
+struct Binding {
+  static const bool bound = false;
+};
+
+
+struct BindOps;
+
+
+// Where the decoder stores the next value: an object and the operations for
+// its type, or nowhere if ops is null.
+struct BindTarget {
+  void *obj;
+  const BindOps *ops;
+};
+
+
+// The operations used by the decoder for one type. A null function means that
+// the type cannot be read from that kind of input.
+struct BindOps {
+  // For error messages, e.g. "a number".
+  const char *name;
+  void (*string)(void *obj, const char *str, size_t strSize);
+  // The number functions return false if the number is out of range for the
+  // type.
+  bool (*int64)(void *obj, std::int64_t i);
+  bool (*float64)(void *obj, double d);
+  void (*boolean)(void *obj, bool b);
+  // Called at the start of an array or an object.
+  void (*clear)(void *obj);
+  // For arrays, adds an element and returns it.
+  BindTarget (*element)(void *obj);
+  // For objects, returns where the value for the key is stored.
+  BindTarget (*member)(void *obj, const char *key, size_t keySize);
+};
+
+
+// Decodes the input into the target. Used by UnmarshalInto() for types that
+// have a Binding.
+void UnmarshalTarget(const char *data, size_t dataSize,
+  const BindTarget& target, const DecoderOptions& options);
+
+
+// The same FNV-1a hash as bindHash(), for the keys of bound structs.
+constexpr std::uint64_t bindHashConst(const char *str, size_t strSize,
+  std::uint64_t hash = 14695981039346656037ULL)
+{
+  return strSize ? bindHashConst(str + 1, strSize - 1, (hash ^
+    static_cast<unsigned char>(*str)) * 1099511628211ULL) : hash;
 }
 
 
+std::uint64_t bindHash(const char *str, size_t strSize);
+
+
+// A member of a bound struct, created by HJSON_FIELD().
+struct BindField {
+  const char *name;
+  size_t nameSize;
+  std::uint64_t hash;
+  BindTarget (*target)(void *obj);
+  void (*write)(EventEncoder& enc, const void *obj);
+
+  template<class T, class M, M T::*P>
+  static BindTarget memberTarget(void *obj) {
+    return BindTarget{ &(static_cast<T*>(obj)->*P), &Binding<M>::ops() };
+  }
+
+  template<class T, class M, M T::*P>
+  static void writeMember(EventEncoder& enc, const void *obj) {
+    Binding<M>::write(enc, static_cast<const T*>(obj)->*P);
+  }
+};
+
+
+// The members of a bound struct, with a hash index of their keys.
+class BindFields {
+  const BindField *fields;
+  size_t count;
+  std::vector<unsigned short> index;
+
+public:
+  BindFields(const BindField *fields, size_t count);
+
+  const BindField *begin() const { return fields; }
+  const BindField *end() const { return fields + count; }
+  // Returns the member with the key, or null.
+  const BindField *find(const char *key, size_t keySize) const;
+};
+
+
+template<>
+struct Binding<std::string> {
+  static const bool bound = true;
+
+  static const BindOps& ops() {
+    static const BindOps res = { "a string",
+      [](void *obj, const char *str, size_t strSize) {
+        static_cast<std::string*>(obj)->assign(str, strSize);
+      }, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr };
+    return res;
+  }
+
+  static void write(EventEncoder& enc, const std::string& val) {
+    enc.string(val);
+  }
+};
+
+
+template<>
+struct Binding<bool> {
+  static const bool bound = true;
+
+  static const BindOps& ops() {
+    static const BindOps res = { "a bool", nullptr, nullptr, nullptr,
+      [](void *obj, bool b) {
+        *static_cast<bool*>(obj) = b;
+      }, nullptr, nullptr, nullptr };
+    return res;
+  }
+
+  static void write(EventEncoder& enc, bool val) {
+    enc.boolean(val);
+  }
+};
+
+
+template<class T>
+struct Binding<T, typename std::enable_if<std::is_arithmetic<T>::value &&
+  !std::is_same<T, bool>::value>::type>
+{
+  static const bool bound = true;
+
+  static const BindOps& ops() {
+    static const BindOps res = { "a number", nullptr,
+      [](void *obj, std::int64_t i) {
+        if (!fits(i)) {
+          return false;
+        }
+        *static_cast<T*>(obj) = static_cast<T>(i);
+        return true;
+      },
+      [](void *obj, double d) {
+        if (!fits(d)) {
+          return false;
+        }
+        *static_cast<T*>(obj) = static_cast<T>(d);
+        return true;
+      }, nullptr, nullptr, nullptr, nullptr };
+    return res;
+  }
+
+  static bool fits(std::int64_t i) {
+    return (std::is_floating_point<T>::value ||
+      std::numeric_limits<T>::digits >= 63 || fits(static_cast<double>(i))) &&
+      (std::is_signed<T>::value || i >= 0);
+  }
+
+  static bool fits(double d) {
+    if (std::is_floating_point<T>::value) {
+      const double max = static_cast<double>(std::numeric_limits<T>::max());
+      return sizeof(T) >= sizeof(double) || (d >= -max && d <= max);
+    }
+    // The conversion truncates toward zero. The upper limit is computed from
+    // max / 2 so that it stays exact for 64-bit types.
+    return d > static_cast<double>(std::numeric_limits<T>::min()) - 1.0 &&
+      d < static_cast<double>(std::numeric_limits<T>::max() / 2 + 1) * 2.0;
+  }
+
+  static void write(EventEncoder& enc, T val) {
+    if (std::is_floating_point<T>::value) {
+      enc.float64(static_cast<double>(val));
+    } else {
+      enc.int64(static_cast<std::int64_t>(val));
+    }
+  }
+};
+
+
+template<class T>
+struct Binding<std::vector<T>, typename std::enable_if<Binding<T>::bound>::type> {
+  static const bool bound = true;
+
+  static const BindOps& ops() {
+    static const BindOps res = { "an array", nullptr, nullptr, nullptr,
+      nullptr,
+      [](void *obj) {
+        static_cast<std::vector<T>*>(obj)->clear();
+      },
+      [](void *obj) -> BindTarget {
+        auto vec = static_cast<std::vector<T>*>(obj);
+        vec->emplace_back();
+        return BindTarget{ &vec->back(), &Binding<T>::ops() };
+      }, nullptr };
+    return res;
+  }
+
+  static void write(EventEncoder& enc, const std::vector<T>& val) {
+    enc.array_begin();
+    for (const auto& elem : val) {
+      Binding<T>::write(enc, elem);
+    }
+    enc.array_end();
+  }
+};
+
+
+template<class T>
+struct Binding<std::map<std::string, T>,
+  typename std::enable_if<Binding<T>::bound>::type>
+{
+  static const bool bound = true;
+
+  static const BindOps& ops() {
+    static const BindOps res = { "an object", nullptr, nullptr, nullptr,
+      nullptr,
+      [](void *obj) {
+        static_cast<std::map<std::string, T>*>(obj)->clear();
+      }, nullptr,
+      [](void *obj, const char *key, size_t keySize) -> BindTarget {
+        auto& elem = (*static_cast<std::map<std::string, T>*>(obj))[
+          std::string(key, keySize)];
+        return BindTarget{ &elem, &Binding<T>::ops() };
+      } };
+    return res;
+  }
+
+  static void write(EventEncoder& enc, const std::map<std::string, T>& val) {
+    enc.object_begin();
+    for (const auto& it : val) {
+      enc.key(it.first);
+      Binding<T>::write(enc, it.second);
+    }
+    enc.object_end();
+  }
+};
+
+
+// The base of the Bindings created by HJSON_BIND(). D is the Binding itself,
+// which has the function fields().
+template<class T, class D>
+struct StructBinding {
+  static const bool bound = true;
+
+  static const BindOps& ops() {
+    static const BindOps res = { "an object", nullptr, nullptr, nullptr,
+      nullptr, nullptr, nullptr,
+      [](void *obj, const char *key, size_t keySize) -> BindTarget {
+        auto field = D::fields().find(key, keySize);
+        return (field ? field->target(obj) : BindTarget{ nullptr, nullptr });
+      } };
+    return res;
+  }
+
+  static void write(EventEncoder& enc, const T& val) {
+    enc.object_begin();
+    for (const auto& field : D::fields()) {
+      enc.key(field.name, field.nameSize);
+      field.write(enc, &val);
+    }
+    enc.object_end();
+  }
+};
+
+
+// Unmarshals the input into out, which can be of any type that has a Binding.
+template<class T>
+typename std::enable_if<Binding<T>::bound>::type UnmarshalInto(
+  const char *data, size_t dataSize, T& out,
+  const DecoderOptions& options = DecoderOptions())
+{
+  UnmarshalTarget(data, dataSize, BindTarget{ &out, &Binding<T>::ops() },
+    options);
+}
+
+
+// Like `UnmarshalInto(const char*, size_t, T&, DecoderOptions)`.
+template<class T>
+typename std::enable_if<Binding<T>::bound>::type UnmarshalInto(
+  const std::string& data, T& out,
+  const DecoderOptions& options = DecoderOptions())
+{
+  UnmarshalInto(data.data(), data.size(), out, options);
+}
+
+
+// Like `UnmarshalInto(const char*, size_t, T&, DecoderOptions)`, for
+// null-terminated input.
+template<class T>
+typename std::enable_if<Binding<T>::bound>::type UnmarshalInto(
+  const char *data, T& out, const DecoderOptions& options = DecoderOptions())
+{
+  UnmarshalInto(data, std::char_traits<char>::length(data), out, options);
+}
+
+
+// Marshals a value of a type that has a Binding, formatted the same way as
+// `Marshal(const Value&, EncoderOptions)`. Types that can be converted to a
+// Value (e.g. std::string) use the Value overload instead.
+template<class T>
+typename std::enable_if<Binding<T>::bound &&
+  !std::is_convertible<const T&, Value>::value, std::string>::type Marshal(
+  const T& val, const EncoderOptions& options = EncoderOptions())
+{
+  EventEncoder enc(options);
+  Binding<T>::write(enc, val);
+  return enc.str();
+}
+
+
+}
+
+
+// Binds the struct T to Hjson objects, with members listed by HJSON_FIELD() or
+// HJSON_FIELD_NAMED(). Must be used in the global namespace, after the
+// bindings of any structs used as members of T. The keys are hashed at compile
+// time and looked up in a hash index when decoding.
+#define HJSON_BIND(T, ...) \
+namespace Hjson { \
+template<> \
+struct Binding<T> : public StructBinding<T, Binding<T> > { \
+  static const BindFields& fields() { \
+    typedef T HjsonBound; \
+    static const BindField list[] = { __VA_ARGS__ }; \
+    static const BindFields res(list, sizeof(list) / sizeof(list[0])); \
+    return res; \
+  } \
+}; \
+}
+
+// A member of the struct in HJSON_BIND(), using the member name as key.
+#define HJSON_FIELD(member) HJSON_FIELD_NAMED(member, #member)
+
+// A member of the struct in HJSON_BIND(), with a key that is a string literal.
+#define HJSON_FIELD_NAMED(member, key) \
+  ::Hjson::BindField{ key, sizeof(key) - 1, \
+    ::Hjson::bindHashConst(key, sizeof(key) - 1), \
+    &::Hjson::BindField::memberTarget<HjsonBound, \
+      decltype(HjsonBound::member), &HjsonBound::member>, \
+    &::Hjson::BindField::writeMember<HjsonBound, \
+      decltype(HjsonBound::member), &HjsonBound::member> }
+
+
 #endif
@@ -1,8 +1,32 @@
+#include <cstring>
+
+
 void perf_multithread();
+void perf_marshal();
+void perf_large();
+void perf_numbers();
+void perf_suite(const char *jsonPath);
+bool perf_complexity();
+
 
+// Without arguments all performance tests are run. With the argument "suite"
+// only the benchmark suite is run, and its results are also written as JSON
+// to the file given as the second argument (if any). With the argument
+// "complexity" only the worst-case complexity test is run. The exit code is 1
+// if the complexity test found any super-linear scaling.
+int main(int argc, char **argv) {
+  if (argc > 1 && !std::strcmp(argv[1], "suite")) {
+    perf_suite(argc > 2 ? argv[2] : nullptr);
+    return 0;
+  } else if (argc > 1 && !std::strcmp(argv[1], "complexity")) {
+    return perf_complexity() ? 0 : 1;
+  }
 
-int main() {
+  perf_marshal();
+  perf_large();
+  perf_numbers();
   perf_multithread();
+  perf_suite(nullptr);
 
-  return 0;
+  return perf_complexity() ? 0 : 1;
 }
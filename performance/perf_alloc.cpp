@@ -0,0 +1,122 @@
+#include "perf_alloc.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+
+// Every allocation in perfbin goes through these replacements of the global
+// operator new and operator delete, so that the benchmarks can report the
+// number of allocations and the peak memory use of each operation. The size of
+// each allocation is stored in front of it.
+static const std::size_t _allocHeader = 16;
+static std::atomic<std::size_t> _allocCount(0);
+static std::atomic<std::size_t> _allocBytes(0);
+static std::atomic<std::size_t> _liveBytes(0);
+static std::atomic<std::size_t> _peakBytes(0);
+
+
+static void *_allocate(std::size_t size) {
+  auto p = static_cast<char*>(std::malloc(size + _allocHeader));
+  if (!p) {
+    return nullptr;
+  }
+  *reinterpret_cast<std::size_t*>(p) = size;
+
+  _allocCount.fetch_add(1, std::memory_order_relaxed);
+  _allocBytes.fetch_add(size, std::memory_order_relaxed);
+  auto live = _liveBytes.fetch_add(size, std::memory_order_relaxed) + size;
+  auto peak = _peakBytes.load(std::memory_order_relaxed);
+  while (live > peak && !_peakBytes.compare_exchange_weak(peak, live,
+    std::memory_order_relaxed))
+  {
+  }
+
+  return p + _allocHeader;
+}
+
+
+static void _deallocate(void *ptr) {
+  if (ptr) {
+    auto p = static_cast<char*>(ptr) - _allocHeader;
+    _liveBytes.fetch_sub(*reinterpret_cast<std::size_t*>(p),
+      std::memory_order_relaxed);
+    std::free(p);
+  }
+}
+
+
+void *operator new(std::size_t size) {
+  auto p = _allocate(size);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+
+void *operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+
+void *operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return _allocate(size);
+}
+
+
+void *operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return _allocate(size);
+}
+
+
+void operator delete(void *p) noexcept {
+  _deallocate(p);
+}
+
+
+void operator delete[](void *p) noexcept {
+  _deallocate(p);
+}
+
+
+// Used instead of the two above from C++14 on.
+void operator delete(void *p, std::size_t) noexcept {
+  _deallocate(p);
+}
+
+
+void operator delete[](void *p, std::size_t) noexcept {
+  _deallocate(p);
+}
+
+
+void operator delete(void *p, const std::nothrow_t&) noexcept {
+  _deallocate(p);
+}
+
+
+void operator delete[](void *p, const std::nothrow_t&) noexcept {
+  _deallocate(p);
+}
+
+
+static std::size_t _startCount, _startBytes, _startLive;
+
+
+void perf_alloc_start() {
+  _startCount = _allocCount.load();
+  _startBytes = _allocBytes.load();
+  _startLive = _liveBytes.load();
+  _peakBytes.store(_startLive);
+}
+
+
+AllocStats perf_alloc_stop() {
+  AllocStats ret;
+  ret.count = _allocCount.load() - _startCount;
+  ret.bytes = _allocBytes.load() - _startBytes;
+  ret.peakBytes = _peakBytes.load() - _startLive;
+
+  return ret;
+}
@@ -0,0 +1,23 @@
+#ifndef HJSONPERF_ALLOC_H
+#define HJSONPERF_ALLOC_H
+
+#include <cstddef>
+
+
+// The allocations made between perf_alloc_start() and perf_alloc_stop().
+struct AllocStats {
+  std::size_t count;
+  std::size_t bytes;
+  // The peak memory use above what was in use when perf_alloc_start() was
+  // called.
+  std::size_t peakBytes;
+};
+
+
+// Every allocation in perfbin is counted, see perf_alloc.cpp. Only one
+// measurement can be made at a time.
+void perf_alloc_start();
+AllocStats perf_alloc_stop();
+
+
+#endif
@@ -0,0 +1,324 @@
+#include <hjson.h>
+#include "perf_alloc.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Each input is generated in _steps sizes, each twice as large as the one
+// before, starting at _baseSize bytes.
+static const size_t _baseSize = 1 << 18;
+static const int _steps = 4;
+// Each operation is repeated until it has run for at least this long, and at
+// least _minIterations times. The fastest time is used.
+static const double _minSeconds = 0.2;
+static const int _minIterations = 3;
+// The growth exponents (1 for linear growth, 2 for quadratic growth) above
+// which an operation is reported as super-linear. The margins allow for
+// timing noise and for the caches getting less effective with larger inputs.
+static const double _maxTimeExponent = 1.35;
+static const double _maxMemoryExponent = 1.2;
+
+
+// A kind of input that has been known to trigger, or could trigger,
+// super-linear behaviour in the decoder or the encoder.
+class Shape {
+public:
+  const char *name;
+  // Returns an input of roughly this many bytes.
+  std::function<std::string(size_t)> make;
+  Hjson::EncoderOptions encOpt;
+  // True if the input is a sequence of documents, that is only read with
+  // DocumentReader.
+  bool sequence;
+};
+
+
+class Point {
+public:
+  size_t bytes;
+  double seconds;
+  size_t peakBytes;
+};
+
+
+static double _seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+    start).count();
+}
+
+
+// The slope of the least-squares line through the points in a log-log plot.
+static double _exponent(const std::vector<Point>& points,
+  double (*get)(const Point&))
+{
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  for (const auto& pt : points) {
+    double x = std::log(static_cast<double>(pt.bytes));
+    double y = std::log(std::max(get(pt), 1e-9));
+    sx += x;
+    sy += y;
+    sxx += x * x;
+    sxy += x * y;
+  }
+  double n = static_cast<double>(points.size());
+
+  return (n * sxy - sx * sy) / (n * sxx - sx * sx);
+}
+
+
+// f() returns a number that depends on the result, so that the calls cannot
+// be optimized away. The first call only measures the peak memory use.
+static Point _measure(size_t bytes, size_t *sink,
+  const std::function<size_t()>& f)
+{
+  Point pt;
+  pt.bytes = bytes;
+
+  perf_alloc_start();
+  *sink += f();
+  pt.peakBytes = perf_alloc_stop().peakBytes;
+
+  pt.seconds = 1e9;
+  double total = 0;
+  for (int a = 0; a < _minIterations || total < _minSeconds; ++a) {
+    auto start = std::chrono::steady_clock::now();
+    *sink += f();
+    double t = _seconds(start);
+    pt.seconds = std::min(pt.seconds, t);
+    total += t;
+  }
+
+  return pt;
+}
+
+
+static size_t _unmarshal(const std::string& text, Hjson::Value *out) {
+  try {
+    *out = Hjson::Unmarshal(text);
+    return out->size() + 1;
+  } catch (const Hjson::syntax_error& e) {
+    *out = Hjson::Value();
+    return std::string(e.what()).size();
+  }
+}
+
+
+static size_t _readDocuments(const std::string& text) {
+  std::istringstream in(text);
+  Hjson::DocumentReader reader(in);
+  Hjson::Value doc;
+  size_t count = 0;
+
+  try {
+    while (reader.next(doc)) {
+      ++count;
+    }
+  } catch (const Hjson::syntax_error& e) {
+    count += std::string(e.what()).size();
+  }
+
+  return count;
+}
+
+
+static std::string _repeat(const std::string& unit, size_t bytes) {
+  std::string ret;
+  ret.reserve(bytes + unit.size());
+  while (ret.size() < bytes) {
+    ret += unit;
+  }
+
+  return ret;
+}
+
+
+// Lines like "key_7: 7", with an optional comment before each line.
+static std::string _numberedLines(const char *prefix, size_t bytes,
+  const char *comment = "")
+{
+  std::string ret;
+  ret.reserve(bytes + 64);
+  for (size_t a = 0; ret.size() < bytes; ++a) {
+    auto sA = std::to_string(a);
+    ret += comment;
+    ret += prefix + sA + ": " + sA + "\n";
+  }
+
+  return ret;
+}
+
+
+static std::vector<Shape> _shapes() {
+  std::vector<Shape> ret;
+  Shape sh;
+  sh.sequence = false;
+
+  sh.name = "long quoted key";
+  sh.make = [](size_t n) {
+    return "{\"" + std::string(n, 'k') + "\": 1}";
+  };
+  ret.push_back(sh);
+
+  sh.name = "long quoteless key";
+  sh.make = [](size_t n) {
+    return "{" + std::string(n, 'k') + ": 1}";
+  };
+  ret.push_back(sh);
+
+  sh.name = "long quoteless line";
+  sh.make = [](size_t n) {
+    return "a: " + _repeat("word, 'x' [y] {z} ", n) + "\n";
+  };
+  ret.push_back(sh);
+
+  sh.name = "long escaped string";
+  sh.make = [](size_t n) {
+    return "[\"" + _repeat("\\t\\\" \\\\ \\u00e9\\n", n) + "\"]";
+  };
+  ret.push_back(sh);
+
+  sh.name = "multiline quote runs";
+  sh.make = [](size_t n) {
+    return "a:\n  '''\n  " + _repeat("''x'' ", n) + "\n  '''\n";
+  };
+  ret.push_back(sh);
+
+  sh.name = "unterminated multiline";
+  sh.make = [](size_t n) {
+    return "a:\n  '''\n" + _repeat("  '' line\n", n);
+  };
+  ret.push_back(sh);
+
+  sh.name = "many keys";
+  sh.make = [](size_t n) {
+    return "{\n" + _numberedLines("key_", n) + "}\n";
+  };
+  ret.push_back(sh);
+
+  sh.name = "many comments";
+  sh.make = [](size_t n) {
+    return _repeat("# comment\n// comment\n/* block */\n", n / 2) + "{\n" +
+      _numberedLines("  key_", n / 2, "  # c\n  /* k */\n") + "}\n";
+  };
+  ret.push_back(sh);
+
+  // The indentation would make the output grow quadratically with the depth.
+  sh.encOpt.indentBy = "";
+  sh.name = "deep arrays";
+  sh.make = [](size_t n) {
+    return std::string(n / 2, '[') + std::string(n / 2, ']');
+  };
+  ret.push_back(sh);
+
+  sh.name = "deep objects";
+  sh.make = [](size_t n) {
+    return _repeat("{a:", n * 3 / 4) + std::string(n / 4, '}');
+  };
+  ret.push_back(sh);
+  sh.encOpt = Hjson::EncoderOptions();
+
+  sh.name = "error at end";
+  sh.make = [](size_t n) {
+    return "{\n" + _numberedLines("key_", n) + "]\n";
+  };
+  ret.push_back(sh);
+
+  sh.name = "braceless error at end";
+  sh.make = [](size_t n) {
+    return _numberedLines("key_", n) + "key: {\n";
+  };
+  ret.push_back(sh);
+
+  sh.sequence = true;
+  sh.name = "many documents";
+  sh.make = [](size_t n) {
+    return _repeat("{a: 1, b: [2, 3]}\n", n) + "{a: [}\n";
+  };
+  ret.push_back(sh);
+
+  return ret;
+}
+
+
+static void _printRow(const std::string& name, const std::string& operation,
+  const std::vector<Point>& points, double timeExp, double memExp, bool flag)
+{
+  std::cout << std::left << std::setw(24) << name << std::setw(16) <<
+    operation << std::right;
+  for (const auto& pt : points) {
+    std::cout << std::setw(10) << std::fixed << std::setprecision(2) <<
+      pt.seconds * 1000;
+  }
+  std::cout << "  time^" << std::setprecision(2) << timeExp << "  memory^" <<
+    memExp << (flag ? "  SUPER-LINEAR" : "") << std::endl;
+}
+
+
+// Returns false if any operation scaled super-linearly in time or memory.
+bool perf_complexity() {
+  bool ok = true;
+  size_t sink = 0;
+
+  std::cout << "Worst-case complexity, ms for inputs of " << _baseSize / 1024 <<
+    " kB to " << (_baseSize << (_steps - 1)) / 1024 << " kB:" << std::endl;
+
+  for (const auto& shape : _shapes()) {
+    std::vector<Point> decode, encode, stream;
+
+    for (int step = 0; step < _steps; ++step) {
+      auto text = shape.make(_baseSize << step);
+      Hjson::Value root;
+
+      stream.push_back(_measure(text.size(), &sink, [&] {
+        return _readDocuments(text);
+      }));
+      if (shape.sequence) {
+        continue;
+      }
+      decode.push_back(_measure(text.size(), &sink, [&] {
+        Hjson::Value val;
+        return _unmarshal(text, &val);
+      }));
+      _unmarshal(text, &root);
+      if (root.defined()) {
+        encode.push_back(_measure(text.size(), &sink, [&] {
+          return Hjson::Marshal(root, shape.encOpt).size();
+        }));
+      }
+    }
+
+    auto check = [&](const char *operation, const std::vector<Point>& pts) {
+      if (pts.size() < 2) {
+        return;
+      }
+      double timeExp = _exponent(pts, [](const Point& pt) {
+        return pt.seconds;
+      });
+      double memExp = _exponent(pts, [](const Point& pt) {
+        return static_cast<double>(pt.peakBytes);
+      });
+      bool flag = (timeExp > _maxTimeExponent || memExp > _maxMemoryExponent);
+      ok = ok && !flag;
+      _printRow(shape.name, operation, pts, timeExp, memExp, flag);
+    };
+
+    check("Unmarshal", decode);
+    check("DocumentReader", stream);
+    check("Marshal", encode);
+  }
+
+  // Also output the sum, to prove that the calls have not been optimized away.
+  std::cout << "Complexity done (checksum " << sink << "): " <<
+    (ok ? "all operations scale linearly" : "super-linear scaling found") <<
+    std::endl;
+
+  return ok;
+}
@@ -0,0 +1,202 @@
+#include <hjson.h>
+
+#include <chrono>
+#include <iostream>
+#include <new>
+#include <thread>
+
+
+static double _seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+    start).count();
+}
+
+
+// Throughput of Unmarshal() on a generated document of roughly the given size,
+// to make sure that the decoder does not get slower.
+static void _run_throughput(size_t targetSize) {
+  std::string doc;
+  doc.reserve(targetSize + 256);
+  doc += "[\n";
+  for (size_t a = 0; doc.size() < targetSize; ++a) {
+    auto sA = std::to_string(a);
+    doc += "  {\n    id: " + sA + "\n    name: record " + sA +
+      "\n    ratio: 0." + sA + "\n    enabled: true\n    # a comment\n"
+      "    text: '''\n      multiline\n      string\n      '''\n  }\n";
+  }
+  doc += "]\n";
+
+  auto start = std::chrono::steady_clock::now();
+  auto root = Hjson::Unmarshal(doc);
+  double elapsed = _seconds(start);
+
+  std::cout << "Unmarshal " << (doc.size() >> 20) << " MB: " << elapsed <<
+    " seconds (" << (doc.size() / elapsed / (1 << 20)) << " MB/s, " <<
+    root.size() << " elements)" << std::endl;
+}
+
+
+// Throughput of Unmarshal() and Marshal() on a large document when using one
+// thread per CPU core, compared to a single thread.
+static void _run_parallel(size_t targetSize) {
+  std::string doc;
+  doc.reserve(targetSize + 256);
+  doc += "[\n";
+  for (size_t a = 0; doc.size() < targetSize; ++a) {
+    auto sA = std::to_string(a);
+    doc += "  {\n    id: " + sA + "\n    name: record " + sA +
+      "\n    ratio: 0." + sA + "\n    # a comment\n    tags: [1, 2]\n  }\n";
+  }
+  doc += "]\n";
+
+  Hjson::DecoderOptions decOpt;
+  Hjson::EncoderOptions encOpt;
+  double times[4];
+  std::string out[2];
+
+  for (int a = 0; a < 2; ++a) {
+    decOpt.threads = encOpt.threads = (a ? 0 : 1);
+
+    auto start = std::chrono::steady_clock::now();
+    auto root = Hjson::Unmarshal(doc, decOpt);
+    times[a * 2] = _seconds(start);
+
+    start = std::chrono::steady_clock::now();
+    out[a] = Hjson::Marshal(root, encOpt);
+    times[a * 2 + 1] = _seconds(start);
+  }
+  bool ok = (out[0] == out[1] && out[0].size() > targetSize / 2);
+
+  std::cout << "Parallel " << (doc.size() >> 20) << " MB: unmarshal " <<
+    times[0] << " s (1 thread), " << times[2] << " s (" <<
+    std::thread::hardware_concurrency() << " cores), marshal " << times[1] <<
+    " s (1 thread), " << times[3] << " s (all cores) (" <<
+    (ok ? "correct" : "WRONG RESULT") << ")" << std::endl;
+}
+
+
+// Parses a document that is larger than INT_MAX bytes, where the interesting
+// parts are placed after the 2 GB mark. Almost all of the document is
+// whitespace and comments so that the resulting tree stays small.
+static void _run_beyond_2gb() {
+  const size_t padSize = (size_t(1) << 31) + (size_t(1) << 20);
+  std::string doc;
+  Hjson::DecoderOptions decOpt;
+  decOpt.comments = false;
+
+  try {
+    doc.reserve(padSize + 256);
+  } catch (const std::bad_alloc&) {
+    std::cout << "Unmarshal > 2 GB: skipped, not enough memory" << std::endl;
+    return;
+  }
+
+  doc += "{\n  first: 1\n";
+  std::string padLine = "  # padding padding padding padding padding padding\n";
+  while (doc.size() < padSize) {
+    doc += padLine;
+  }
+  doc += "  \"quoted key\": quoteless value\n"
+    "  ml:\n    '''\n    multi\n    line\n    '''\n"
+    "  last: 2\n}\n";
+
+  auto start = std::chrono::steady_clock::now();
+  auto root = Hjson::Unmarshal(doc, decOpt);
+  double elapsed = _seconds(start);
+
+  bool ok = root.size() == 4 && root["first"] == 1 &&
+    root["quoted key"] == "quoteless value" && root["ml"] == "multi\nline" &&
+    root["last"] == 2;
+
+  // Syntax errors past the 2 GB mark must be reported, not crash.
+  doc[doc.size() - 2] = ']';
+  try {
+    Hjson::Unmarshal(doc, decOpt);
+    ok = false;
+  } catch (const Hjson::syntax_error&) {
+  }
+
+  std::cout << "Unmarshal " << (doc.size() >> 20) << " MB: " << elapsed <<
+    " seconds (" << (ok ? "correct" : "WRONG RESULT") << ")" << std::endl;
+}
+
+
+// A single object with very many keys: creation, lookup by key, access by
+// insertion index and Marshal() in insertion order.
+static void _run_wide_object(int numKeys) {
+  auto start = std::chrono::steady_clock::now();
+
+  Hjson::Value root;
+  for (int a = 0; a < numKeys; ++a) {
+    root["key" + std::to_string(a)] = a;
+  }
+  double createTime = _seconds(start);
+
+  start = std::chrono::steady_clock::now();
+  std::int64_t sum = 0;
+  for (int a = 0; a < numKeys; ++a) {
+    sum += root["key" + std::to_string(a)].to_int64();
+  }
+  for (int a = 0; a < numKeys; ++a) {
+    sum += root[a].to_int64();
+  }
+  double lookupTime = _seconds(start);
+
+  start = std::chrono::steady_clock::now();
+  auto out = Hjson::Marshal(root);
+  double marshalTime = _seconds(start);
+
+  std::cout << "Object with " << numKeys << " keys: create " << createTime <<
+    " s, lookup " << lookupTime << " s, marshal " << marshalTime << " s (" <<
+    ((sum == std::int64_t(numKeys) * (numKeys - 1) && out.size() > 0) ?
+    "correct" : "WRONG RESULT") << ")" << std::endl;
+}
+
+
+// Large vectors of numbers: creation, iterating and summing, and parsing.
+static void _run_numeric_vector(int numElems) {
+  auto start = std::chrono::steady_clock::now();
+
+  Hjson::Value root;
+  for (int a = 0; a < numElems; ++a) {
+    if (a % 2) {
+      root.push_back(a);
+    } else {
+      root.push_back(a * 0.5);
+    }
+  }
+  double createTime = _seconds(start);
+
+  start = std::chrono::steady_clock::now();
+  double sum = 0;
+  for (int loop = 0; loop < 10; ++loop) {
+    for (int a = 0; a < int(root.size()); ++a) {
+      sum += root[a].to_double();
+    }
+  }
+  double sumTime = _seconds(start);
+
+  std::string doc = Hjson::MarshalJson(root);
+  start = std::chrono::steady_clock::now();
+  auto root2 = Hjson::Unmarshal(doc);
+  double parseTime = _seconds(start);
+
+  start = std::chrono::steady_clock::now();
+  root = Hjson::Value();
+  root2 = Hjson::Value();
+  double destroyTime = _seconds(start);
+
+  std::cout << "Vector with " << numElems << " numbers: create " <<
+    createTime << " s, sum 10 times " << sumTime << " s, parse " << parseTime <<
+    " s, destroy " << destroyTime << " s (" << (sum > 0 ? "correct" :
+    "WRONG RESULT") << ")" << std::endl;
+}
+
+
+void perf_large() {
+  _run_numeric_vector(5000000);
+  _run_wide_object(200000);
+  _run_throughput(size_t(64) << 20);
+  _run_parallel(size_t(64) << 20);
+  _run_beyond_2gb();
+}
@@ -0,0 +1,88 @@
+#include <hjson.h>
+
+#include <chrono>
+#include <iostream>
+
+
+// Many calls to Marshal() on a small Hjson document, where the per-call setup
+// cost of the encoder dominates.
+static size_t _run_small(int loops) {
+  size_t outSize = 0;
+
+  auto root = Hjson::Unmarshal(R"(
+name: hjson
+version: 2
+enabled: true
+ratio: 0.25
+tags: [
+  config
+  "quoted, string"
+  42
+]
+)");
+
+  for (int a = 0; a < loops; ++a) {
+    outSize += Hjson::Marshal(root).size();
+  }
+
+  return outSize;
+}
+
+
+// Fewer calls to Marshal() on a document where almost all of the time is
+// spent deciding how each string must be quoted and escaped.
+static size_t _run_strings(int loops) {
+  size_t outSize = 0;
+  Hjson::Value root;
+
+  for (int a = 0; a < 200; ++a) {
+    auto key = "key number " + std::to_string(a);
+
+    switch (a % 5) {
+    case 0:
+      root[key] = "a plain quoteless string value that is fairly long " +
+        std::to_string(a);
+      break;
+    case 1:
+      root[key] = "multiline\nstring with \\ backslash\nand 'quotes'\n";
+      break;
+    case 2:
+      root[key] = "needs \"escapes\" \x01 and \xe2\x80\xa8 unicode";
+      break;
+    case 3:
+      root[key] = " leading and trailing whitespace ";
+      break;
+    default:
+      root[key] = "true, followed by a comma";
+      break;
+    }
+  }
+
+  for (int a = 0; a < loops; ++a) {
+    outSize += Hjson::Marshal(root).size();
+    outSize += Hjson::MarshalJson(root).size();
+  }
+
+  return outSize;
+}
+
+
+template<class F>
+static void _time(const char *name, F f) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  size_t outSize = f();
+
+  std::chrono::steady_clock::time_point stop = std::chrono::steady_clock::now();
+
+  // Also output the total output size, to prove that the marshal calls have not
+  // been optimized away.
+  std::cout << name << ": " << std::chrono::duration<double>(stop -
+    start).count() << " seconds (output size " << outSize << ")" << std::endl;
+}
+
+
+void perf_marshal() {
+  _time("Marshal small documents", [] { return _run_small(50000); });
+  _time("Marshal string-heavy documents", [] { return _run_strings(500); });
+}
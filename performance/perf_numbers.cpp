@@ -0,0 +1,212 @@
+#include <hjson.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <locale>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#define HJSONPERF_HAVE_CHARCONV 1
+#endif
+
+
+static double _seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+    start).count();
+}
+
+
+// kind 0: Integers of varying length.
+// kind 1: Decimals with few digits, like prices or coordinates.
+// kind 2: Doubles that need all 17 significant digits.
+static Hjson::Value _number(std::mt19937_64& rng, int kind) {
+  switch (kind) {
+  case 0:
+    return static_cast<std::int64_t>(rng() >> (rng() % 64)) - 1000;
+  case 1:
+    return static_cast<double>(rng() % 10000000) / 1000;
+  default:
+    return std::ldexp(static_cast<double>(rng() >> 11),
+      static_cast<int>(rng() % 200) - 153);
+  }
+}
+
+
+// Unmarshal() and Marshal() of a document that contains nothing but numbers,
+// so that the time is dominated by the number conversions. The fallback for
+// the numbers that the built-in code does not handle is chosen by the CMake
+// option HJSON_NUMBER_PARSER, so this part only measures that one.
+static void _run_numbers(const char *label, int numElems, int kind) {
+  std::mt19937_64 rng(4711);
+  Hjson::Value vec;
+
+  for (int a = 0; a < numElems; ++a) {
+    vec.push_back(_number(rng, kind));
+  }
+
+  Hjson::EncoderOptions encOpt;
+  encOpt.comments = false;
+
+  auto start = std::chrono::steady_clock::now();
+  auto doc = Hjson::Marshal(vec, encOpt);
+  double marshalTime = _seconds(start);
+
+  Hjson::DecoderOptions decOpt;
+  decOpt.comments = false;
+
+  start = std::chrono::steady_clock::now();
+  auto root = Hjson::Unmarshal(doc, decOpt);
+  double unmarshalTime = _seconds(start);
+
+  if (!root.deep_equal(vec)) {
+    std::cout << "Numbers did not survive the round trip!" << std::endl;
+  }
+
+  std::cout << "Numbers (" << HJSON_NUMBER_PARSER_NAME << ", " << label << ", " <<
+    numElems << " elements): Marshal " << marshalTime << " seconds, Unmarshal " <<
+    unmarshalTime << " seconds" << std::endl;
+}
+
+
+// One way of converting a double to text and back. format() appends to out.
+class NumberBackend {
+public:
+  const char *name;
+  void (*format)(double d, std::string *out);
+  double (*parse)(const std::string& text);
+};
+
+
+static void _formatStringStream(double d, std::string *out) {
+  std::ostringstream oss;
+  oss.imbue(std::locale::classic());
+  oss.precision(17);
+  oss << d;
+  *out += oss.str();
+}
+
+
+static double _parseStringStream(const std::string& text) {
+  std::istringstream iss(text);
+  iss.imbue(std::locale::classic());
+  double ret = 0;
+  iss >> ret;
+  return ret;
+}
+
+
+static void _formatStrToD(double d, std::string *out) {
+  char buf[32];
+  int len = std::snprintf(buf, sizeof(buf), "%.17g", d);
+  out->append(buf, len);
+}
+
+
+static double _parseStrToD(const std::string& text) {
+  return std::strtod(text.c_str(), nullptr);
+}
+
+
+#if HJSONPERF_HAVE_CHARCONV
+static void _formatCharConv(double d, std::string *out) {
+  char buf[32];
+  auto res = std::to_chars(buf, buf + sizeof(buf), d);
+  out->append(buf, res.ptr);
+}
+
+
+static double _parseCharConv(const std::string& text) {
+  double ret = 0;
+  std::from_chars(text.data(), text.data() + text.size(), ret);
+  return ret;
+}
+#endif
+
+
+// The built-in code that Marshal() and Unmarshal() use for most numbers,
+// whichever HJSON_NUMBER_PARSER is configured. The times include creating a
+// Value for each number, which the other backends do not need.
+static void _formatBuiltIn(double d, std::string *out) {
+  *out += Hjson::Value(d).to_string();
+}
+
+
+static double _parseBuiltIn(const std::string& text) {
+  return Hjson::Value(text).to_double();
+}
+
+
+// Converts the same numbers with each of the backends that HJSON_NUMBER_PARSER
+// can select, in the same run, so that they can be compared side by side. The
+// text of each number is parsed back with the same backend, and must give the
+// same double.
+static void _compare_backends(const char *label, int numElems, int kind) {
+  std::vector<NumberBackend> backends = {
+    { "StringStream", _formatStringStream, _parseStringStream },
+    { "StrToD", _formatStrToD, _parseStrToD },
+#if HJSONPERF_HAVE_CHARCONV
+    { "CharConv", _formatCharConv, _parseCharConv },
+#endif
+    { "built-in", _formatBuiltIn, _parseBuiltIn },
+  };
+
+  std::mt19937_64 rng(4711);
+  std::vector<double> numbers;
+  numbers.reserve(numElems);
+  for (int a = 0; a < numElems; ++a) {
+    numbers.push_back(_number(rng, kind).to_double());
+  }
+
+  std::cout << "Number conversion (" << label << ", " << numElems <<
+    " numbers):" << std::endl;
+
+  for (const auto& backend : backends) {
+    std::vector<std::string> texts(numbers.size());
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t a = 0; a < numbers.size(); ++a) {
+      backend.format(numbers[a], &texts[a]);
+    }
+    double formatTime = _seconds(start);
+
+    bool same = true;
+    start = std::chrono::steady_clock::now();
+    for (size_t a = 0; a < numbers.size(); ++a) {
+      same = (backend.parse(texts[a]) == numbers[a]) && same;
+    }
+    double parseTime = _seconds(start);
+
+    std::cout << "  " << backend.name << ": format " << formatTime <<
+      " seconds, parse " << parseTime << " seconds" << std::endl;
+    if (!same) {
+      std::cout << "  " << backend.name << ": numbers did not survive the "
+        "round trip!" << std::endl;
+    }
+  }
+
+#if !HJSONPERF_HAVE_CHARCONV
+  std::cout << "  CharConv: not available, needs std::to_chars() for doubles "
+    "(C++17)" << std::endl;
+#endif
+}
+
+
+void perf_numbers() {
+  _compare_backends("integers", 1000000, 0);
+  _compare_backends("short decimals", 1000000, 1);
+  _compare_backends("17 digit doubles", 1000000, 2);
+
+  _run_numbers("integers", 2000000, 0);
+  _run_numbers("short decimals", 2000000, 1);
+  _run_numbers("17 digit doubles", 2000000, 2);
+}
@@ -0,0 +1,374 @@
+#include <hjson.h>
+#include "perf_alloc.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+
+// Each operation is repeated until it has run for at least this long, and at
+// least _minIterations times.
+static const double _minSeconds = 0.5;
+static const size_t _minIterations = 5;
+static const size_t _maxIterations = 1000;
+
+
+class Corpus {
+public:
+  std::string name;
+  std::string text;
+};
+
+
+// Options used for the same corpus, to see what each option costs.
+class Variant {
+public:
+  const char *name;
+  Hjson::DecoderOptions decOpt;
+  Hjson::EncoderOptions encOpt;
+  // Only the operations that depend on the options are run for the other
+  // variants than the first one.
+  bool allOperations;
+};
+
+
+class Result {
+public:
+  std::string corpus, variant, operation;
+  size_t bytes;
+  int iterations;
+  // Milliseconds.
+  double min, p50, p90, p99;
+  size_t allocations, allocatedBytes, peakBytes;
+};
+
+
+static double _seconds(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+    start).count();
+}
+
+
+// Nearest-rank percentile of the sorted times.
+static double _percentile(const std::vector<double>& sorted, double p) {
+  size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+  return sorted[std::max<size_t>(rank, 1) - 1];
+}
+
+
+// The first call of f() is not timed, it only counts the allocations and the
+// peak memory use above what was in use before the call. The other calls are
+// timed. f() returns a number that depends on the result, so that the calls
+// cannot be optimized away.
+template<class F>
+static Result _measure(const Corpus& corpus, const Variant& variant,
+  const char *operation, size_t *sink, F f)
+{
+  Result res;
+  res.corpus = corpus.name;
+  res.variant = variant.name;
+  res.operation = operation;
+  res.bytes = corpus.text.size();
+
+  perf_alloc_start();
+  *sink += f();
+  auto alloc = perf_alloc_stop();
+  res.allocations = alloc.count;
+  res.allocatedBytes = alloc.bytes;
+  res.peakBytes = alloc.peakBytes;
+
+  std::vector<double> times;
+  double total = 0;
+  while (times.size() < _minIterations || (total < _minSeconds &&
+    times.size() < _maxIterations))
+  {
+    auto start = std::chrono::steady_clock::now();
+    *sink += f();
+    times.push_back(_seconds(start) * 1000);
+    total += times.back() / 1000;
+  }
+
+  std::sort(times.begin(), times.end());
+  res.iterations = static_cast<int>(times.size());
+  res.min = times.front();
+  res.p50 = _percentile(times, 0.5);
+  res.p90 = _percentile(times, 0.9);
+  res.p99 = _percentile(times, 0.99);
+
+  return res;
+}
+
+
+// Nested objects, 200 levels deep.
+static Corpus _deepCorpus() {
+  Corpus c = { "deep", "[\n" };
+
+  for (int tree = 0; tree < 100; ++tree) {
+    for (int level = 0; level < 200; ++level) {
+      c.text += "{\nlevel: " + std::to_string(level) + "\nname: node " +
+        std::to_string(tree) + "\nratio: 0.5\nchild: ";
+    }
+    c.text += "null\n";
+    for (int level = 0; level < 200; ++level) {
+      c.text += "}\n";
+    }
+  }
+  c.text += "]\n";
+
+  return c;
+}
+
+
+// A single object with very many keys.
+static Corpus _wideCorpus() {
+  Corpus c = { "wide", "{\n" };
+
+  for (int a = 0; a < 100000; ++a) {
+    auto sA = std::to_string(a);
+    switch (a % 3) {
+    case 0:
+      c.text += "  key_" + sA + ": " + sA + "\n";
+      break;
+    case 1:
+      c.text += "  key_" + sA + ": value " + sA + "\n";
+      break;
+    default:
+      c.text += "  key_" + sA + ": true\n";
+      break;
+    }
+  }
+  c.text += "}\n";
+
+  return c;
+}
+
+
+// A large array of integers and doubles.
+static Corpus _numericCorpus() {
+  Corpus c = { "numeric", "[\n" };
+  std::mt19937_64 rng(4711);
+
+  for (int a = 0; a < 300000; ++a) {
+    switch (a % 3) {
+    case 0:
+      c.text += std::to_string(static_cast<std::int64_t>(rng() >> (rng() % 64)) -
+        1000);
+      break;
+    case 1:
+      c.text += Hjson::Value(static_cast<double>(rng() % 10000000) /
+        1000).to_string();
+      break;
+    default:
+      c.text += Hjson::Value(std::ldexp(static_cast<double>(rng() >> 11),
+        static_cast<int>(rng() % 200) - 153)).to_string();
+      break;
+    }
+    c.text += "\n";
+  }
+  c.text += "]\n";
+
+  return c;
+}
+
+
+// Quoted strings with escapes, quoteless strings and multiline strings.
+static Corpus _stringCorpus() {
+  Corpus c = { "strings", "{\n" };
+
+  for (int a = 0; a < 20000; ++a) {
+    auto sA = std::to_string(a);
+    c.text += "  quoted_" + sA + ": \"tab\\t quote\\\" backslash \\\\ "
+      "unicode \\u00e9\\u2028 line\\nfeed " + sA + "\"\n";
+    c.text += "  quoteless_" + sA + ": just some text, with a comma " + sA +
+      "\n";
+    c.text += "  multiline_" + sA + ":\n    '''\n    first line\n"
+      "      indented 'line'\n    last line " + sA + "\n    '''\n";
+  }
+  c.text += "}\n";
+
+  return c;
+}
+
+
+// Every element has comments before, after and between key and value.
+static Corpus _commentedCorpus() {
+  Corpus c = { "commented", "# header comment\n{\n" };
+
+  for (int a = 0; a < 20000; ++a) {
+    auto sA = std::to_string(a);
+    c.text += "  # line comment " + sA + "\n  // another line comment\n"
+      "  /* block\n     comment */\n  key_" + sA + ": /* key */ " + sA +
+      " # after\n\n";
+  }
+  c.text += "  /* last */\n}\n# footer comment\n";
+
+  return c;
+}
+
+
+// Large records followed by small ones at the same depth, to see the memory
+// use when the size of one Map is a bad guess for the size of the next one.
+static Corpus _mixedMapsCorpus() {
+  Corpus c = { "mixed maps", "[\n" };
+
+  for (int a = 0; a < 200; ++a) {
+    c.text += "  {\n";
+    for (int key = 0; key < 2000; ++key) {
+      c.text += "    k" + std::to_string(key) + ": " + std::to_string(a) + "\n";
+    }
+    c.text += "  }\n  { a: { x: 1 } }\n";
+  }
+  c.text += "]\n";
+
+  return c;
+}
+
+
+static std::vector<Variant> _variants() {
+  std::vector<Variant> ret(5);
+
+  ret[0].name = "default";
+  ret[0].allOperations = true;
+
+  ret[1].name = "no comments";
+  ret[1].decOpt.comments = false;
+  ret[1].encOpt.comments = false;
+
+  ret[2].name = "whitespaceAsComments";
+  ret[2].decOpt.whitespaceAsComments = true;
+
+  ret[3].name = "alphabetical order";
+  ret[3].encOpt.preserveInsertionOrder = false;
+
+  // Unmarshal only decodes the root, Marshal decodes everything else.
+  ret[4].name = "lazy";
+  ret[4].decOpt.lazy = true;
+
+  return ret;
+}
+
+
+static void _print(const Result& res) {
+  // Throughput relative to the size of the Hjson text of the corpus.
+  double mbps = res.bytes / (res.p50 / 1000) / (1 << 20);
+
+  std::cout << "Suite " << std::left << std::setw(10) << res.corpus <<
+    std::setw(21) << res.variant << std::setw(12) << res.operation <<
+    std::right << std::fixed << std::setprecision(2) << " p50 " <<
+    std::setw(8) << res.p50 << " ms, p90 " << std::setw(8) << res.p90 <<
+    " ms, p99 " << std::setw(8) << res.p99 << " ms, " << std::setw(8) <<
+    mbps << " MB/s, " << std::setw(8) << 1000 / res.p50 << " ops/s, " <<
+    res.allocations << " allocs, peak " << (res.peakBytes >> 10) << " kB" <<
+    std::defaultfloat << std::endl;
+}
+
+
+static Hjson::Value _toValue(const Result& res) {
+  Hjson::Value ret;
+  ret["corpus"] = res.corpus;
+  ret["variant"] = res.variant;
+  ret["operation"] = res.operation;
+  ret["bytes"] = res.bytes;
+  ret["iterations"] = res.iterations;
+  ret["min_ms"] = res.min;
+  ret["p50_ms"] = res.p50;
+  ret["p90_ms"] = res.p90;
+  ret["p99_ms"] = res.p99;
+  ret["mb_per_s"] = res.bytes / (res.p50 / 1000) / (1 << 20);
+  ret["ops_per_s"] = 1000 / res.p50;
+  ret["allocations"] = res.allocations;
+  ret["allocated_bytes"] = res.allocatedBytes;
+  ret["peak_bytes"] = res.peakBytes;
+
+  return ret;
+}
+
+
+// Runs every operation on every corpus and prints the results. If jsonPath is
+// set, the results are also written to that file as JSON, to be compared
+// between releases.
+void perf_suite(const char *jsonPath) {
+  std::vector<Corpus> corpora;
+  corpora.push_back(_deepCorpus());
+  corpora.push_back(_wideCorpus());
+  corpora.push_back(_numericCorpus());
+  corpora.push_back(_stringCorpus());
+  corpora.push_back(_commentedCorpus());
+  corpora.push_back(_mixedMapsCorpus());
+
+  std::vector<Result> results;
+  size_t sink = 0;
+
+  for (const auto& corpus : corpora) {
+    for (const auto& variant : _variants()) {
+      auto root = Hjson::Unmarshal(corpus.text, variant.decOpt);
+      auto copy = root.clone();
+
+      results.push_back(_measure(corpus, variant, "Unmarshal", &sink, [&] {
+        return Hjson::Unmarshal(corpus.text, variant.decOpt).size();
+      }));
+      _print(results.back());
+
+      results.push_back(_measure(corpus, variant, "Marshal", &sink, [&] {
+        return Hjson::Marshal(root, variant.encOpt).size();
+      }));
+      _print(results.back());
+
+      if (!variant.allOperations) {
+        continue;
+      }
+
+      results.push_back(_measure(corpus, variant, "MarshalJson", &sink, [&] {
+        return Hjson::MarshalJson(root).size();
+      }));
+      _print(results.back());
+
+      results.push_back(_measure(corpus, variant, "clone", &sink, [&] {
+        return root.clone().size();
+      }));
+      _print(results.back());
+
+      results.push_back(_measure(corpus, variant, "Merge", &sink, [&] {
+        return Hjson::Merge(root, copy).size();
+      }));
+      _print(results.back());
+
+      results.push_back(_measure(corpus, variant, "deep_equal", &sink, [&] {
+        return size_t(root.deep_equal(copy));
+      }));
+      _print(results.back());
+
+      results.push_back(_measure(corpus, variant, "hash", &sink, [&] {
+        return root.hash();
+      }));
+      _print(results.back());
+    }
+  }
+
+  // Also output the sum, to prove that the calls have not been optimized away.
+  std::cout << "Suite done (checksum " << sink << ")" << std::endl;
+
+  if (jsonPath) {
+    Hjson::Value doc;
+    doc["format"] = 1;
+    doc["number_parser"] = HJSON_NUMBER_PARSER_NAME;
+    Hjson::Value list(Hjson::Type::Vector);
+    for (const auto& res : results) {
+      list.push_back(_toValue(res));
+    }
+    doc["results"] = list;
+
+    std::ofstream out(jsonPath, std::ios::binary);
+    out << Hjson::MarshalJson(doc) << "\n";
+    if (!out) {
+      std::cerr << "Could not write " << jsonPath << std::endl;
+    }
+  }
+}
@@ -0,0 +1,516 @@
+#include "hjson.h"
+#include <cstring>
+#include <vector>
+
+
+namespace Hjson {
+
+
+// The binary format, version 1. Multibyte integers are little endian, varint
+// is an unsigned LEB128 integer.
+//
+//   document = "HJB" version:u8 value
+//   value    = tag:u8 [comments] payload
+//   comments = before:string key:string inside:string after:string
+//   string   = size:varint bytes
+//
+// The payload depends on the type in the tag:
+//
+//   BT_UNDEFINED, BT_NULL, BT_FALSE, BT_TRUE: nothing
+//   BT_DOUBLE: IEEE 754 double as u64
+//   BT_INT64:  zigzag encoded varint
+//   BT_STRING: string
+//   BT_VECTOR: size:u64 count:varint value*
+//   BT_MAP:    size:u64 count:varint (key:string value)*
+//
+// The size of a Vector or Map is the number of bytes after the size field up
+// to the end of the container, so that the container can be skipped without
+// reading its elements. The elements of a Map are in insertion order.
+enum BinaryTag : unsigned char {
+  BT_UNDEFINED,
+  BT_NULL,
+  BT_FALSE,
+  BT_TRUE,
+  BT_DOUBLE,
+  BT_INT64,
+  BT_STRING,
+  BT_VECTOR,
+  BT_MAP,
+  // Set in the tag if the value has comments.
+  BT_COMMENTS = 0x80
+};
+
+
+static const char _binaryMagic[] = "HJB";
+static const unsigned char _binaryVersion = 1;
+
+
+class Arena;
+
+
+std::shared_ptr<Arena> createArena(size_t sizeHint);
+Arena *useArena(Arena *arena);
+void sealArena(Arena *arena);
+void setCommentRange(Value& val, int slot,
+  const std::shared_ptr<std::string>& source, size_t pos, size_t size,
+  bool append);
+
+
+struct BinaryEncoder {
+  std::string out;
+  bool comments;
+};
+
+
+struct BinaryDecoder {
+  const unsigned char *data;
+  size_t dataSize;
+  size_t pos;
+  bool comments;
+  // The text of all comments in the document, shared by the Values.
+  std::shared_ptr<std::string> commentText;
+  // DecoderOptions::maxDepth.
+  int maxDepth;
+};
+
+
+static void _binPutU64(BinaryEncoder *e, std::uint64_t u) {
+  char buf[8];
+  for (int a = 0; a < 8; ++a) {
+    buf[a] = static_cast<char>(u >> (8 * a));
+  }
+  e->out.append(buf, 8);
+}
+
+
+static void _binPutVarint(BinaryEncoder *e, std::uint64_t u) {
+  char buf[10];
+  size_t n = 0;
+  for (; u >= 0x80; u >>= 7) {
+    buf[n++] = static_cast<char>(u | 0x80);
+  }
+  buf[n++] = static_cast<char>(u);
+  e->out.append(buf, n);
+}
+
+
+static void _binPutString(BinaryEncoder *e, StringRef str) {
+  _binPutVarint(e, str.size());
+  e->out.append(str.data(), str.size());
+}
+
+
+static void _binValue(BinaryEncoder *e, const Value& value) {
+  unsigned char tag;
+
+  switch (value.type()) {
+  case Type::Undefined:
+    tag = BT_UNDEFINED;
+    break;
+  case Type::Null:
+    tag = BT_NULL;
+    break;
+  case Type::Bool:
+    tag = (value ? BT_TRUE : BT_FALSE);
+    break;
+  case Type::Double:
+    tag = BT_DOUBLE;
+    break;
+  case Type::Int64:
+    tag = BT_INT64;
+    break;
+  case Type::String:
+    tag = BT_STRING;
+    break;
+  case Type::Vector:
+    tag = BT_VECTOR;
+    break;
+  default:
+    tag = BT_MAP;
+    break;
+  }
+
+  if (e->comments) {
+    StringRef cm[] = {
+      value.get_comment_before_ref(),
+      value.get_comment_key_ref(),
+      value.get_comment_inside_ref(),
+      value.get_comment_after_ref()
+    };
+
+    if (!cm[0].empty() || !cm[1].empty() || !cm[2].empty() || !cm[3].empty()) {
+      e->out.push_back(static_cast<char>(tag | BT_COMMENTS));
+      for (const auto& str : cm) {
+        _binPutString(e, str);
+      }
+    } else {
+      e->out.push_back(static_cast<char>(tag));
+    }
+  } else {
+    e->out.push_back(static_cast<char>(tag));
+  }
+
+  switch (tag) {
+  case BT_DOUBLE:
+    {
+      double d = value.to_double();
+      std::uint64_t u;
+      std::memcpy(&u, &d, sizeof(u));
+      _binPutU64(e, u);
+    }
+    break;
+  case BT_INT64:
+    {
+      auto i = value.to_int64();
+      _binPutVarint(e, (static_cast<std::uint64_t>(i) << 1) ^
+        static_cast<std::uint64_t>(i >> 63));
+    }
+    break;
+  case BT_STRING:
+    _binPutString(e, value.string_ref());
+    break;
+  case BT_VECTOR:
+  case BT_MAP:
+    {
+      // The size is written when it is known.
+      size_t sizePos = e->out.size();
+      _binPutU64(e, 0);
+      _binPutVarint(e, value.size());
+
+      if (tag == BT_MAP) {
+        for (const auto& it : value.insertion_order()) {
+          _binPutString(e, it.first);
+          _binValue(e, it.second);
+        }
+      } else {
+        for (int index = 0; size_t(index) < value.size(); ++index) {
+          _binValue(e, value[index]);
+        }
+      }
+
+      std::uint64_t size = e->out.size() - sizePos - 8;
+      for (int a = 0; a < 8; ++a) {
+        e->out[sizePos + a] = static_cast<char>(size >> (8 * a));
+      }
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+
+// Returns a compact binary representation of the value tree, see
+// `MarshalBinary()` in hjson.h.
+std::string MarshalBinary(const Value& v, const EncoderOptions& options) {
+  BinaryEncoder e;
+  e.comments = options.comments;
+
+  e.out.append(_binaryMagic, 3);
+  e.out.push_back(static_cast<char>(_binaryVersion));
+  _binValue(&e, v);
+
+  return std::move(e.out);
+}
+
+
+static void _binError(const BinaryDecoder *d, const std::string& what) {
+  throw syntax_error("Invalid binary Hjson data: " + what + " at byte " +
+    std::to_string(d->pos));
+}
+
+
+static inline void _binCheckSize(const BinaryDecoder *d, std::uint64_t size) {
+  if (d->pos > d->dataSize || size > d->dataSize - d->pos) {
+    _binError(d, "unexpected end of data");
+  }
+}
+
+
+static std::uint64_t _binGetU64(BinaryDecoder *d) {
+  _binCheckSize(d, 8);
+
+  std::uint64_t u = 0;
+  for (int a = 7; a >= 0; --a) {
+    u = (u << 8) | d->data[d->pos + a];
+  }
+  d->pos += 8;
+
+  return u;
+}
+
+
+static std::uint64_t _binGetVarint(BinaryDecoder *d) {
+  std::uint64_t u = 0;
+
+  for (int shift = 0; ; shift += 7) {
+    _binCheckSize(d, 1);
+    unsigned char c = d->data[d->pos++];
+    if (shift == 63 && c > 1) {
+      _binError(d, "integer out of range");
+    }
+    u |= static_cast<std::uint64_t>(c & 0x7f) << shift;
+    if (!(c & 0x80)) {
+      return u;
+    }
+  }
+}
+
+
+// Returns the size of the string at the current position and moves past it,
+// the string starts at d->pos - size.
+static size_t _binSkipString(BinaryDecoder *d) {
+  auto size = _binGetVarint(d);
+  _binCheckSize(d, size);
+  d->pos += size_t(size);
+
+  return size_t(size);
+}
+
+
+// A Vector or Map that is being read by _binValue().
+struct BinFrame {
+  Value container;
+  bool isMap;
+  // The number of elements left to read.
+  std::uint64_t count;
+  // The end of the container, and the end of the data outside of it.
+  size_t end, dataSize;
+  // The key of the next element of a Map.
+  std::string key;
+  // The comments of the container itself, set when it is complete.
+  size_t cmPos[4], cmSize[4];
+};
+
+
+// Reads the tag of a value and moves past it and its comments, which are then
+// at cmPos and cmSize (the sizes are 0 if the value has no comments). Returns
+// the tag without BT_COMMENTS.
+static unsigned char _binTag(BinaryDecoder *d, size_t *cmPos, size_t *cmSize) {
+  _binCheckSize(d, 1);
+
+  unsigned char tag = d->data[d->pos++];
+  if (!(tag & BT_COMMENTS)) {
+    for (int a = 0; a < 4; ++a) {
+      cmSize[a] = 0;
+    }
+    return tag;
+  }
+
+  for (int a = 0; a < 4; ++a) {
+    cmSize[a] = _binSkipString(d);
+    cmPos[a] = d->pos - cmSize[a];
+  }
+
+  return tag & ~BT_COMMENTS;
+}
+
+
+static void _binSetComments(BinaryDecoder *d, Value& val, const size_t *cmPos,
+  const size_t *cmSize)
+{
+  if (!d->comments) {
+    return;
+  }
+
+  auto& text = *d->commentText;
+  for (int a = 0; a < 4; ++a) {
+    if (cmSize[a]) {
+      setCommentRange(val, a, d->commentText, text.size(), cmSize[a], false);
+      text.append(reinterpret_cast<const char*>(d->data) + cmPos[a],
+        cmSize[a]);
+    }
+  }
+}
+
+
+// Reads the header of a Vector or Map inside depth other containers, and
+// returns the empty container. Sets *count to the number of elements and *end
+// to the end of the container, and restricts the reads to the container.
+// *dataSize is set to the end of the data outside of it.
+static Value _binContainer(BinaryDecoder *d, bool isMap, size_t depth,
+  std::uint64_t *count, size_t *end, size_t *dataSize)
+{
+  auto size = _binGetU64(d);
+  _binCheckSize(d, size);
+  *end = d->pos + size_t(size);
+  *dataSize = d->dataSize;
+  // The count is also part of the container.
+  d->dataSize = *end;
+  *count = _binGetVarint(d);
+  // Each element needs at least one byte. This also keeps a few bytes of
+  // input from reserving a huge container.
+  if (*count > *end - d->pos) {
+    _binError(d, "invalid element count");
+  }
+
+  if (d->maxDepth > 0 && depth >= static_cast<size_t>(d->maxDepth)) {
+    _binError(d, "exceeded the maximum depth of " +
+      std::to_string(d->maxDepth) + " nested containers");
+  }
+
+  Value ret(isMap ? Type::Map : Type::Vector);
+  ret.reserve(size_t(*count));
+
+  return ret;
+}
+
+
+static Value _binPayload(BinaryDecoder *d, unsigned char tag) {
+  switch (tag) {
+  case BT_UNDEFINED:
+    return Value();
+  case BT_NULL:
+    return Value(Type::Null);
+  case BT_FALSE:
+  case BT_TRUE:
+    return Value(tag == BT_TRUE);
+  case BT_DOUBLE:
+    {
+      auto u = _binGetU64(d);
+      double val;
+      std::memcpy(&val, &u, sizeof(val));
+      return Value(val);
+    }
+  case BT_INT64:
+    {
+      auto u = _binGetVarint(d);
+      return Value(static_cast<std::int64_t>((u >> 1) ^ (0 - (u & 1))));
+    }
+  case BT_STRING:
+    {
+      size_t size = _binSkipString(d);
+      return Value(std::string(reinterpret_cast<const char*>(d->data) +
+        d->pos - size, size));
+    }
+  default:
+    --d->pos;
+    _binError(d, "unknown type");
+  }
+
+  return Value();
+}
+
+
+// Adds val to the container of f.
+static void _binAdd(BinaryDecoder *d, BinFrame& f, const Value& val) {
+  if (f.isMap) {
+    if (!f.container.try_emplace(std::move(f.key), val)) {
+      _binError(d, "duplicate key");
+    }
+  } else {
+    f.container.push_back(val);
+  }
+  --f.count;
+}
+
+
+// Reads a value, including all Vectors and Maps nested in it. The open
+// containers are kept in an explicit stack instead of recursing for each of
+// them, so that untrusted input cannot overflow the call stack.
+static Value _binValue(BinaryDecoder *d) {
+  std::vector<BinFrame> stack;
+
+  for (;;) {
+    size_t cmPos[4], cmSize[4];
+    unsigned char tag = _binTag(d, cmPos, cmSize);
+
+    if (tag == BT_VECTOR || tag == BT_MAP) {
+      stack.emplace_back();
+      auto& f = stack.back();
+      f.container = _binContainer(d, tag == BT_MAP, stack.size() - 1, &f.count,
+        &f.end, &f.dataSize);
+      f.isMap = (tag == BT_MAP);
+      std::memcpy(f.cmPos, cmPos, sizeof(cmPos));
+      std::memcpy(f.cmSize, cmSize, sizeof(cmSize));
+    } else {
+      Value elem(_binPayload(d, tag));
+      _binSetComments(d, elem, cmPos, cmSize);
+      if (stack.empty()) {
+        return elem;
+      }
+      _binAdd(d, stack.back(), elem);
+    }
+
+    // Close every container that is complete.
+    while (!stack.back().count) {
+      auto& top = stack.back();
+      if (d->pos != top.end) {
+        _binError(d, "invalid container size");
+      }
+      d->dataSize = top.dataSize;
+      Value elem(std::move(top.container));
+      _binSetComments(d, elem, top.cmPos, top.cmSize);
+      stack.pop_back();
+      if (stack.empty()) {
+        return elem;
+      }
+      _binAdd(d, stack.back(), elem);
+    }
+
+    auto& top = stack.back();
+    if (top.isMap) {
+      size_t keySize = _binSkipString(d);
+      top.key.assign(reinterpret_cast<const char*>(d->data) + d->pos - keySize,
+        keySize);
+    }
+  }
+}
+
+
+static Value _binDocument(BinaryDecoder *d) {
+  if (d->dataSize < 4 || std::memcmp(d->data, _binaryMagic, 3)) {
+    _binError(d, "missing header");
+  }
+  d->pos = 4;
+  if (d->data[3] != _binaryVersion) {
+    _binError(d, "unsupported version " + std::to_string(d->data[3]));
+  }
+
+  auto ret = _binValue(d);
+  if (d->pos != d->dataSize) {
+    _binError(d, "unexpected data after the root value");
+  }
+
+  return ret;
+}
+
+
+// Creates a Value tree from data created by `MarshalBinary()`.
+Value UnmarshalBinary(const char *data, size_t dataSize,
+  const DecoderOptions& options)
+{
+  BinaryDecoder d = {
+    reinterpret_cast<const unsigned char*>(data),
+    dataSize,
+    0,
+    options.comments,
+    std::make_shared<std::string>(),
+    options.maxDepth
+  };
+
+  if (!options.arena) {
+    return _binDocument(&d);
+  }
+
+  auto arena = createArena(dataSize);
+  Arena *prev = useArena(arena.get());
+  try {
+    auto ret = _binDocument(&d);
+    useArena(prev);
+    sealArena(arena.get());
+    return ret;
+  } catch (...) {
+    useArena(prev);
+    sealArena(arena.get());
+    throw;
+  }
+}
+
+
+Value UnmarshalBinary(const std::string& data, const DecoderOptions& options) {
+  return UnmarshalBinary(data.data(), data.size(), options);
+}
+
+
+}
@@ -1,9 +1,55 @@
 #include "hjson.h"
 #include <vector>
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <exception>
 #include <fstream>
+#include <mutex>
+#include <set>
+#include <system_error>
+#include <thread>
+#include <unordered_set>
+#if HJSON_USE_SIMD
+# if defined(__AVX2__)
+#  include <immintrin.h>
+#  define HJSON_SIMD_AVX2 1
+#  define HJSON_SIMD_WIDTH 32
+# elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define HJSON_SIMD_SSE2 1
+#  define HJSON_SIMD_WIDTH 16
+# elif defined(__ARM_NEON) || defined(_M_ARM64)
+#  include <arm_neon.h>
+#  define HJSON_SIMD_NEON 1
+#  define HJSON_SIMD_WIDTH 16
+# endif
+# if defined(HJSON_SIMD_WIDTH) && defined(_MSC_VER)
+#  include <intrin.h>
+# endif
+#endif
+#ifndef HJSON_SIMD_WIDTH
+# define HJSON_SIMD_WIDTH 0
+#endif
+#if defined(_WIN32)
+# ifndef WIN32_LEAN_AND_MEAN
+#  define WIN32_LEAN_AND_MEAN
+# endif
+# ifndef NOMINMAX
+#  define NOMINMAX
+# endif
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
 
 
 namespace Hjson {
@@ -13,46 +59,221 @@ class CommentInfo {
 public:
   bool hasComment;
   // cmStart is the first char of the key, cmEnd is the first char after the key.
-  int cmStart, cmEnd;
+  size_t cmStart, cmEnd;
 };
 
 
+// A string in the input data, or in a buffer owned by the caller.
+class StringView {
+public:
+  const char *data;
+  size_t size;
+
+  std::string str() const {
+    return std::string(data, size);
+  }
+};
+
+
+// Thrown when DecoderOptions::maxDepth is exceeded. Unlike other syntax
+// errors, it does not make the decoder try to read a root without braces as a
+// single value instead.
+class depth_error : public syntax_error {
+  using syntax_error::syntax_error;
+};
+
+
+class DecodeScratch;
+
+
 class Parser {
 public:
   const unsigned char *data;
   size_t dataSize;
-  int indexNext;
+  size_t indexNext;
   unsigned char ch;
   DecoderOptions opt;
+  // Set when the parser has tried to read beyond the end of data.
+  bool atEnd;
+  // The number of line feeds, the length of the current line and the first
+  // characters of the current line before the start of data, when data is
+  // only a window of the input.
+  size_t linesBefore;
+  size_t cutLineLen;
+  const std::string *cutLineHead;
+  // The number of Vectors and Maps that the current position is nested in,
+  // outside of the current call to _readContainer().
+  size_t depth;
+  // The buffers kept by a Decoder between calls, or nullptr.
+  DecodeScratch *scratch;
 };
 
 
-bool tryParseNumber(Value *pNumber, const char *text, size_t textSize, bool stopAtNext);
-static Value _readValue(Parser *p);
+class Arena;
+
+
+bool tryParseNumber(std::int64_t *pInt, double *pDouble, bool *pIsInt,
+  const char *text, size_t textSize, bool stopAtNext);
+std::shared_ptr<Arena> createArena(size_t sizeHint);
+Arena *useArena(Arena *arena);
+void sealArena(Arena *arena);
+DecoderStats *countAllocations(DecoderStats *stats);
+void setCommentRange(Value& val, int slot,
+  const std::shared_ptr<std::string>& source, size_t pos, size_t size,
+  bool append);
+void moveComment(Value& val, int toSlot, int fromSlot);
+void reserveMapElements(Value& val, size_t size);
+Value createLazy(Type type, const std::shared_ptr<LazyDocument>& doc,
+  size_t container);
+template<class H>
+static typename H::Result _readValue(Parser *p, H *h);
+template<class B>
+class LazyBuilder;
+template<class B>
+static bool _descends(const LazyBuilder<B>*);
+template<class B>
+static Value _readLeaf(Parser *p, LazyBuilder<B> *h);
+static std::string *_keptString(Parser *p);
+
+
+// Lends a buffer kept by a Decoder to a local variable during the lifetime of
+// the Borrow object, so that the memory of the buffer is reused by the next
+// call to the Decoder. Does nothing if kept is nullptr.
+template<class T>
+class Borrow {
+  T *kept;
+  T& local;
 
+public:
+  Borrow(T *kept, T& local)
+    : kept(kept),
+    local(local)
+  {
+    if (kept) {
+      local.swap(*kept);
+    }
+  }
 
-static inline void _setComment(Value& val, void (Value::*fp)(const std::string&),
-  Parser *p, const CommentInfo& ci)
-{
-  if (ci.hasComment) {
-    (val.*fp)(std::string(p->data + ci.cmStart, p->data + ci.cmEnd));
+  ~Borrow() {
+    if (kept) {
+      local.swap(*kept);
+    }
   }
-}
+};
 
 
-static inline void _setComment(Value& val, void (Value::*fp)(const std::string&),
-  Parser *p, const CommentInfo& ciA, const CommentInfo& ciB)
-{
-  if (ciA.hasComment && ciB.hasComment) {
-    (val.*fp)(std::string(p->data + ciA.cmStart, p->data + ciA.cmEnd) +
-      std::string(p->data + ciB.cmStart, p->data + ciB.cmEnd));
-  } else if (!ciA.hasComment && !ciB.hasComment) {
-    (val.*fp)("");
-  } else {
-    _setComment(val, fp, p, ciA);
-    _setComment(val, fp, p, ciB);
+// Makes this thread allocate Value nodes from the given arena (or from the
+// heap if nullptr) during the lifetime of the ArenaUse object.
+class ArenaUse {
+  Arena *prev;
+
+public:
+  ArenaUse(Arena *arena)
+    : prev(useArena(arena))
+  {
   }
-}
+
+  ~ArenaUse() {
+    useArena(prev);
+  }
+};
+
+
+// All Value nodes created by this thread during the lifetime of an ArenaScope
+// object are allocated from the same arena. The arena is sealed when the scope
+// ends, but stays alive for as long as any of the nodes are alive.
+class ArenaScope {
+  std::shared_ptr<Arena> arena;
+  ArenaUse use;
+
+public:
+  ArenaScope(size_t sizeHint)
+    : arena(createArena(sizeHint)),
+    use(arena.get())
+  {
+  }
+
+  ~ArenaScope() {
+    sealArena(arena.get());
+  }
+};
+
+
+// The comments of a Value, in the same order as Value::Comments::Slot.
+enum CommentSlot {
+  CS_BEFORE,
+  CS_KEY,
+  CS_INSIDE,
+  CS_AFTER
+};
+
+
+// A comment that has been copied to a CommentBuffer.
+class SavedComment {
+public:
+  bool hasComment = false;
+  size_t pos = 0, size = 0;
+};
+
+
+// Collects the text of all comments in a document. The Values only store
+// ranges of the text, so that no string is created for a comment until the
+// comment is read.
+class CommentBuffer {
+public:
+  std::shared_ptr<std::string> text;
+
+  SavedComment save(Parser *p, const CommentInfo& ci) {
+    SavedComment sc;
+    sc.hasComment = ci.hasComment;
+    if (ci.hasComment && ci.cmEnd > ci.cmStart) {
+      if (!text) {
+        text = std::make_shared<std::string>();
+      }
+      sc.pos = text->size();
+      sc.size = ci.cmEnd - ci.cmStart;
+      text->append(reinterpret_cast<const char*>(p->data) + ci.cmStart, sc.size);
+    }
+    return sc;
+  }
+
+  // Sets the comment in the given slot, or appends to it if append is true.
+  void set(Value& val, int slot, const SavedComment& sc, bool append = false) {
+    if (sc.hasComment) {
+      setCommentRange(val, slot, text, sc.pos, sc.size, append);
+    }
+  }
+
+  // Sets the comment to scA followed by scB. Removes the comment if neither
+  // scA nor scB has a comment, unless append is true.
+  void set(Value& val, int slot, const SavedComment& scA,
+    const SavedComment& scB, bool append = false)
+  {
+    if (!scA.hasComment && !scB.hasComment) {
+      if (!append) {
+        setCommentRange(val, slot, text, 0, 0, false);
+      }
+    } else {
+      set(val, slot, scA, append);
+      set(val, slot, scB, append || scA.hasComment);
+    }
+  }
+
+  void set(Value& val, int slot, Parser *p, const CommentInfo& ci,
+    bool append = false)
+  {
+    if (ci.hasComment) {
+      set(val, slot, save(p, ci), append);
+    }
+  }
+
+  void set(Value& val, int slot, Parser *p, const CommentInfo& ciA,
+    const CommentInfo& ciB, bool append = false)
+  {
+    auto scA = save(p, ciA);
+    set(val, slot, scA, save(p, ciB), append);
+  }
+};
 
 
 static bool _next(Parser *p) {
@@ -64,11 +285,251 @@ static bool _next(Parser *p) {
 
   ++p->indexNext;
   p->ch = 0;
+  p->atEnd = true;
 
   return false;
 }
 
 
+// Sets of bytes that end a run of bytes that the decoder can skip over, or
+// copy as they are, without looking at each byte separately.
+enum ScanStop : unsigned short {
+  // 0 or anything but whitespace.
+  SS_NOT_WHITE = 0x01,
+  // 0, \n or anything but whitespace.
+  SS_NOT_WHITE_IN_LINE = 0x02,
+  // 0 or \n, the end of a line comment.
+  SS_LINE_END = 0x04,
+  // 0 or *, the possible end of a block comment.
+  SS_STAR = 0x08,
+  // ", \\, \r or \n in a string in double quotes.
+  SS_DQ_STRING = 0x10,
+  // ', \\, \r or \n in a string in single quotes.
+  SS_SQ_STRING = 0x20,
+  // 0, ', \r or \n in a multiline string.
+  SS_ML_STRING = 0x40,
+  // 0, whitespace or one of :{}[], in a quoteless key.
+  SS_KEY = 0x80,
+  // 0, \r, \n or one of ,]}#/ in a quoteless value.
+  SS_VALUE = 0x100,
+};
+
+
+static constexpr unsigned short _scanClass(int c) {
+  return static_cast<unsigned short>(
+    ((c == 0 || c > ' ') ? SS_NOT_WHITE : 0) |
+    ((c == 0 || c > ' ' || c == '\n') ? SS_NOT_WHITE_IN_LINE : 0) |
+    ((c == 0 || c == '\n') ? SS_LINE_END : 0) |
+    ((c == 0 || c == '*') ? SS_STAR : 0) |
+    ((c == '"' || c == '\\' || c == '\r' || c == '\n') ? SS_DQ_STRING : 0) |
+    ((c == '\'' || c == '\\' || c == '\r' || c == '\n') ? SS_SQ_STRING : 0) |
+    ((c == 0 || c == '\'' || c == '\r' || c == '\n') ? SS_ML_STRING : 0) |
+    ((c <= ' ' || c == ':' || c == '{' || c == '}' || c == '[' || c == ']' ||
+      c == ',') ? SS_KEY : 0) |
+    ((c == 0 || c == '\r' || c == '\n' || c == ',' || c == ']' || c == '}' ||
+      c == '#' || c == '/') ? SS_VALUE : 0));
+}
+
+
+#define HJSON_SC4(_I) _scanClass(_I), _scanClass(_I + 1), _scanClass(_I + 2), \
+  _scanClass(_I + 3)
+#define HJSON_SC16(_I) HJSON_SC4(_I), HJSON_SC4(_I + 4), HJSON_SC4(_I + 8), \
+  HJSON_SC4(_I + 12)
+#define HJSON_SC64(_I) HJSON_SC16(_I), HJSON_SC16(_I + 16), HJSON_SC16(_I + 32), \
+  HJSON_SC16(_I + 48)
+
+static const unsigned short _scanClasses[256] = {
+  HJSON_SC64(0), HJSON_SC64(64), HJSON_SC64(128), HJSON_SC64(192)
+};
+
+#undef HJSON_SC64
+#undef HJSON_SC16
+#undef HJSON_SC4
+
+
+#if HJSON_SIMD_WIDTH
+static inline int _countTrailingZeros(std::uint64_t x) {
+# if defined(_MSC_VER) && defined(_M_X64)
+  unsigned long index;
+  _BitScanForward64(&index, x);
+  return static_cast<int>(index);
+# elif defined(_MSC_VER)
+  unsigned long index;
+  if (_BitScanForward(&index, static_cast<unsigned long>(x))) {
+    return static_cast<int>(index);
+  }
+  _BitScanForward(&index, static_cast<unsigned long>(x >> 32));
+  return static_cast<int>(index) + 32;
+# else
+  return __builtin_ctzll(x);
+# endif
+}
+
+
+// A few operations on a vector of HJSON_SIMD_WIDTH bytes. A comparison gives
+// 0xff in the bytes where it is true. _simdMask() gives a non-zero value if
+// the comparison was true for any byte, and _simdFirst() gives the index of
+// the first such byte.
+# if HJSON_SIMD_AVX2
+typedef __m256i SimdVec;
+
+static inline SimdVec _simdLoad(const unsigned char *p) {
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+}
+
+static inline SimdVec _simdEq(SimdVec v, unsigned char c) {
+  return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(static_cast<char>(c)));
+}
+
+static inline SimdVec _simdGe(SimdVec v, unsigned char c) {
+  return _mm256_cmpeq_epi8(_mm256_max_epu8(v, _mm256_set1_epi8(static_cast<char>(c))), v);
+}
+
+static inline SimdVec _simdLe(SimdVec v, unsigned char c) {
+  return _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(static_cast<char>(c))), v);
+}
+
+static inline SimdVec _simdOr(SimdVec a, SimdVec b) {
+  return _mm256_or_si256(a, b);
+}
+
+static inline std::uint64_t _simdMask(SimdVec v) {
+  return static_cast<std::uint32_t>(_mm256_movemask_epi8(v));
+}
+
+static inline size_t _simdFirst(std::uint64_t mask) {
+  return _countTrailingZeros(mask);
+}
+# elif HJSON_SIMD_SSE2
+typedef __m128i SimdVec;
+
+static inline SimdVec _simdLoad(const unsigned char *p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+static inline SimdVec _simdEq(SimdVec v, unsigned char c) {
+  return _mm_cmpeq_epi8(v, _mm_set1_epi8(static_cast<char>(c)));
+}
+
+static inline SimdVec _simdGe(SimdVec v, unsigned char c) {
+  return _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8(static_cast<char>(c))), v);
+}
+
+static inline SimdVec _simdLe(SimdVec v, unsigned char c) {
+  return _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(static_cast<char>(c))), v);
+}
+
+static inline SimdVec _simdOr(SimdVec a, SimdVec b) {
+  return _mm_or_si128(a, b);
+}
+
+static inline std::uint64_t _simdMask(SimdVec v) {
+  return static_cast<std::uint32_t>(_mm_movemask_epi8(v));
+}
+
+static inline size_t _simdFirst(std::uint64_t mask) {
+  return _countTrailingZeros(mask);
+}
+# elif HJSON_SIMD_NEON
+typedef uint8x16_t SimdVec;
+
+static inline SimdVec _simdLoad(const unsigned char *p) {
+  return vld1q_u8(p);
+}
+
+static inline SimdVec _simdEq(SimdVec v, unsigned char c) {
+  return vceqq_u8(v, vdupq_n_u8(c));
+}
+
+static inline SimdVec _simdGe(SimdVec v, unsigned char c) {
+  return vcgeq_u8(v, vdupq_n_u8(c));
+}
+
+static inline SimdVec _simdLe(SimdVec v, unsigned char c) {
+  return vcleq_u8(v, vdupq_n_u8(c));
+}
+
+static inline SimdVec _simdOr(SimdVec a, SimdVec b) {
+  return vorrq_u8(a, b);
+}
+
+// NEON has no movemask, this gives 4 bits per byte instead.
+static inline std::uint64_t _simdMask(SimdVec v) {
+  return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(v), 4)), 0);
+}
+
+static inline size_t _simdFirst(std::uint64_t mask) {
+  return _countTrailingZeros(mask) >> 2;
+}
+# endif
+
+
+template<unsigned S>
+static inline SimdVec _simdStops(SimdVec v) {
+  switch (S) {
+  case SS_NOT_WHITE:
+    return _simdOr(_simdEq(v, 0), _simdGe(v, ' ' + 1));
+  case SS_NOT_WHITE_IN_LINE:
+    return _simdOr(_simdOr(_simdEq(v, 0), _simdGe(v, ' ' + 1)), _simdEq(v, '\n'));
+  case SS_LINE_END:
+    return _simdOr(_simdEq(v, 0), _simdEq(v, '\n'));
+  case SS_STAR:
+    return _simdOr(_simdEq(v, 0), _simdEq(v, '*'));
+  case SS_DQ_STRING:
+    return _simdOr(_simdOr(_simdEq(v, '"'), _simdEq(v, '\\')),
+      _simdOr(_simdEq(v, '\r'), _simdEq(v, '\n')));
+  case SS_SQ_STRING:
+    return _simdOr(_simdOr(_simdEq(v, '\''), _simdEq(v, '\\')),
+      _simdOr(_simdEq(v, '\r'), _simdEq(v, '\n')));
+  case SS_ML_STRING:
+    return _simdOr(_simdOr(_simdEq(v, 0), _simdEq(v, '\'')),
+      _simdOr(_simdEq(v, '\r'), _simdEq(v, '\n')));
+  case SS_KEY:
+    return _simdOr(_simdOr(_simdOr(_simdLe(v, ' '), _simdEq(v, ':')),
+      _simdOr(_simdEq(v, '{'), _simdEq(v, '}'))),
+      _simdOr(_simdOr(_simdEq(v, '['), _simdEq(v, ']')), _simdEq(v, ',')));
+  default:
+    return _simdOr(_simdOr(_simdOr(_simdEq(v, 0), _simdEq(v, '\r')),
+      _simdOr(_simdEq(v, '\n'), _simdEq(v, ','))),
+      _simdOr(_simdOr(_simdEq(v, ']'), _simdEq(v, '}')),
+      _simdOr(_simdEq(v, '#'), _simdEq(v, '/'))));
+  }
+}
+#endif
+
+
+// Returns the index of the first byte in the range [pos, end) that is in the
+// set S, or end if there is no such byte.
+template<unsigned S>
+static inline size_t _scan(const unsigned char *data, size_t pos, size_t end) {
+#if HJSON_SIMD_WIDTH
+  while (end - pos >= HJSON_SIMD_WIDTH) {
+    if (auto mask = _simdMask(_simdStops<S>(_simdLoad(data + pos)))) {
+      return pos + _simdFirst(mask);
+    }
+    pos += HJSON_SIMD_WIDTH;
+  }
+#endif
+
+  while (pos < end && !(_scanClasses[data[pos]] & S)) {
+    ++pos;
+  }
+
+  return pos;
+}
+
+
+// Moves the parser forward to the first byte in the set S, starting with the
+// current char. Gives the same result as calling _next() until p->ch is in S.
+template<unsigned S>
+static inline void _skipTo(Parser *p) {
+  if (p->indexNext && p->indexNext <= p->dataSize && !(_scanClasses[p->ch] & S)) {
+    p->indexNext = _scan<S>(p->data, p->indexNext, p->dataSize);
+    _next(p);
+  }
+}
+
+
 static bool _prev(Parser *p) {
   // get the previous character.
   if (p->indexNext > 1) {
@@ -101,29 +562,47 @@ static std::string _errAt(Parser *p, const std::string& message) {
       col++;
     }
 
+    size_t lineCol = col;
+    std::string sample;
+    if (i == 0 && p->cutLineLen) {
+      lineCol += p->cutLineLen + 1;
+      sample = *p->cutLineHead;
+    }
+
     for (; i > 0; i--) {
       if (p->data[i] == '\n') {
         line++;
       }
     }
 
-    size_t samEnd = std::min((size_t)20, p->dataSize - (decoderIndex - col));
+    if (sample.empty()) {
+      size_t samEnd = std::min((size_t)20, p->dataSize - (decoderIndex - col));
+      sample.assign((char*)p->data + decoderIndex - col, samEnd);
+    }
 
-    return message + " at line " + std::to_string(line) + "," +
-      std::to_string(col) + " >>> " + std::string((char*)p->data + decoderIndex - col, samEnd);
+    return message + " at line " + std::to_string(line + p->linesBefore) + "," +
+      std::to_string(lineCol) + " >>> " + sample;
   } else {
     return message;
   }
 }
 
 
-static unsigned char _peek(Parser *p, int offs) {
-  int pos = p->indexNext + offs;
+static unsigned char _peek(Parser *p, std::ptrdiff_t offs) {
+  if (offs < 0 && static_cast<size_t>(-offs) > p->indexNext) {
+    // Only the length of the part of the current line that is outside of the
+    // window is known, not its content.
+    return static_cast<size_t>(-offs) - p->indexNext <= p->cutLineLen ? ' ' : 0;
+  }
+
+  size_t pos = p->indexNext + offs;
 
-  if (pos >= 0 && pos < p->dataSize) {
+  if (pos < p->dataSize) {
     return p->data[pos];
   }
 
+  p->atEnd = true;
+
   return 0;
 }
 
@@ -152,18 +631,18 @@ static unsigned char _escapee(unsigned char c) {
 }
 
 
-// Parse a multiline string value.
-static std::string _readMLString(Parser *p) {
-  // Store the string in a new vector, because the length of it might be
-  // different than the length in the input data.
-  std::vector<char> res;
+// Parse a multiline string value into res.
+static void _readMLString(Parser *p, std::string &res) {
+  // Store the string in a buffer, because the length of it might be different
+  // than the length in the input data.
+  res.clear();
   int triple = 0;
 
   // we are at ''' +1 - get indent
-  int indent = 0;
+  size_t indent = 0;
 
   for (;;) {
-    auto c = _peek(p, -indent - 5);
+    auto c = _peek(p, -static_cast<std::ptrdiff_t>(indent) - 5);
     if (c == 0 || c == '\n') {
       break;
     }
@@ -196,11 +675,10 @@ static std::string _readMLString(Parser *p) {
       triple++;
       _next(p);
       if (triple == 3) {
-        auto sres = res.data();
         if (lastLf) {
-          return std::string(sres, res.size() - 1); // remove last EOL
+          res.pop_back(); // remove last EOL
         }
-        return std::string(sres, res.size());
+        return;
       }
       continue;
     } else {
@@ -215,18 +693,22 @@ static std::string _readMLString(Parser *p) {
       lastLf = true;
       _next(p);
       skipIndent();
+    } else if (p->ch == '\r') {
+      _next(p);
     } else {
-      if (p->ch != '\r') {
-        res.push_back(p->ch);
-        lastLf = false;
-      }
+      // Copy everything up to the next char that needs to be looked at.
+      size_t runStart = p->indexNext - 1;
+      p->indexNext = _scan<SS_ML_STRING>(p->data, p->indexNext, p->dataSize);
+      res.append(reinterpret_cast<const char*>(p->data) + runStart,
+        p->indexNext - runStart);
+      lastLf = false;
       _next(p);
     }
   }
 }
 
 
-static void _toUtf8(std::vector<char> &res, uint32_t uIn) {
+static void _toUtf8(std::string &res, uint32_t uIn) {
   if (uIn < 0x80) {
     res.push_back(uIn);
   } else if (uIn < 0x800) {
@@ -250,24 +732,50 @@ static void _toUtf8(std::vector<char> &res, uint32_t uIn) {
 // Parse a string value.
 // callers make sure that (ch === '"' || ch === "'")
 // When parsing for string values, we must look for " and \ characters.
-static std::string _readString(Parser *p, bool allowML) {
-  // Store the string in a new vector, because the length of it might be
-  // different than the length in the input data.
-  std::vector<char> res;
+// The returned view points into the input data if the string did not contain
+// any escape sequences, otherwise into buf.
+static StringView _readString(Parser *p, bool allowML, std::string &buf) {
+  size_t start = p->indexNext;
+  bool escaped = false;
 
   char exitCh = p->ch;
   while (_next(p)) {
+    if (!(_scanClasses[p->ch] & (exitCh == '"' ? SS_DQ_STRING : SS_SQ_STRING))) {
+      // Skip to the next char that needs to be looked at.
+      size_t runStart = p->indexNext - 1;
+      p->indexNext = exitCh == '"' ?
+        _scan<SS_DQ_STRING>(p->data, p->indexNext, p->dataSize) :
+        _scan<SS_SQ_STRING>(p->data, p->indexNext, p->dataSize);
+      if (escaped) {
+        buf.append(reinterpret_cast<const char*>(p->data) + runStart,
+          p->indexNext - runStart);
+      }
+      if (!_next(p)) {
+        break;
+      }
+    }
     if (p->ch == exitCh) {
+      size_t end = p->indexNext - 1;
       _next(p);
-      if (allowML && exitCh == '\'' && p->ch == '\'' && res.size() == 0) {
+      if (allowML && exitCh == '\'' && p->ch == '\'' && end == start) {
         // ''' indicates a multiline string
         _next(p);
-        return _readMLString(p);
-      } else {
-        return std::string(res.data(), res.size());
+        _readMLString(p, buf);
+        return StringView{ buf.data(), buf.size() };
+      } else if (escaped) {
+        return StringView{ buf.data(), buf.size() };
       }
+      return StringView{ reinterpret_cast<const char*>(p->data) + start,
+        end - start };
     }
     if (p->ch == '\\') {
+      if (!escaped) {
+        // The length of the string will differ from the length in the input
+        // data, so from here on the string is stored in buf.
+        escaped = true;
+        buf.assign(reinterpret_cast<const char*>(p->data) + start,
+          p->indexNext - 1 - start);
+      }
       unsigned char ech;
       _next(p);
       if (p->ch == 'u') {
@@ -286,16 +794,16 @@ static std::string _readString(Parser *p, bool allowML) {
           }
           uffff = uffff * 16 + hex;
         }
-        _toUtf8(res, uffff);
+        _toUtf8(buf, uffff);
       } else if ((ech = _escapee(p->ch))) {
-        res.push_back(ech);
+        buf.push_back(ech);
       } else {
         throw syntax_error(_errAt(p, std::string("Bad escape \\") + (char)p->ch));
       }
     } else if (p->ch == '\n' || p->ch == '\r') {
       throw syntax_error(_errAt(p, "Bad string containing newline"));
-    } else {
-      res.push_back(p->ch);
+    } else if (escaped) {
+      buf.push_back(p->ch);
     }
   }
 
@@ -305,30 +813,31 @@ static std::string _readString(Parser *p, bool allowML) {
 
 // quotes for keys are optional in Hjson
 // unless they include {}[],: or whitespace.
-static std::string _readKeyname(Parser *p) {
+static StringView _readKeyname(Parser *p, std::string &buf) {
   if (p->ch == '"' || p->ch == '\'') {
-    return _readString(p, false);
+    return _readString(p, false, buf);
   }
 
   // keyStart is the index for the first char of the key.
   size_t keyStart = p->indexNext - 1;
   // keyEnd is the index for the first char after the key (i.e. not included in the key).
   size_t keyEnd = keyStart;
-  int firstSpace = -1;
+  size_t firstSpace = std::string::npos;
   for (;;) {
     if (p->ch == ':') {
       if (keyEnd <= keyStart) {
         throw syntax_error(_errAt(p, "Found ':' but no key name (for an empty key name use quotes)"));
-      } else if (firstSpace >= 0 && firstSpace != keyEnd) {
+      } else if (firstSpace != std::string::npos && firstSpace != keyEnd) {
         p->indexNext = firstSpace + 1;
         throw syntax_error(_errAt(p, "Found whitespace in your key name (use quotes to include)"));
       }
-      return std::string(reinterpret_cast<const char*>(p->data) + keyStart, keyEnd - keyStart);
+      return StringView{ reinterpret_cast<const char*>(p->data) + keyStart,
+        keyEnd - keyStart };
     } else if (p->ch <= ' ') {
       if (p->ch == 0) {
         throw syntax_error(_errAt(p, "Found EOF while looking for a key name (check your syntax)"));
       }
-      if (firstSpace < 0) {
+      if (firstSpace == std::string::npos) {
         firstSpace = p->indexNext - 1;
       }
     } else {
@@ -336,6 +845,8 @@ static std::string _readKeyname(Parser *p) {
         throw syntax_error(_errAt(p, std::string("Found '") + (char)p->ch + std::string(
           "' where a key name was expected (check your syntax or use quotes if the key name includes {}[],: or whitespace)")));
       }
+      // Skip to the first char that can not be a part of the key name.
+      p->indexNext = _scan<SS_KEY>(p->data, p->indexNext, p->dataSize);
       keyEnd = p->indexNext;
     }
     _next(p);
@@ -343,6 +854,42 @@ static std::string _readKeyname(Parser *p) {
 }
 
 
+// Finds the end of a string value in quotes without decoding it, for
+// DecoderOptions::lazyValidate. The escape sequences are not checked, but the
+// escaped chars are skipped so that the end is the same as for _readString().
+// callers make sure that (ch === '"' || ch === "'") and that it is not the
+// start of a multiline string.
+static void _skipString(Parser *p) {
+  char exitCh = p->ch;
+  while (_next(p)) {
+    if (!(_scanClasses[p->ch] & (exitCh == '"' ? SS_DQ_STRING : SS_SQ_STRING))) {
+      p->indexNext = exitCh == '"' ?
+        _scan<SS_DQ_STRING>(p->data, p->indexNext, p->dataSize) :
+        _scan<SS_SQ_STRING>(p->data, p->indexNext, p->dataSize);
+      if (!_next(p)) {
+        break;
+      }
+    }
+    if (p->ch == exitCh) {
+      _next(p);
+      return;
+    }
+    if (p->ch == '\\') {
+      if (!_next(p)) {
+        break;
+      }
+      if (p->ch == '\n' || p->ch == '\r') {
+        throw syntax_error(_errAt(p, std::string("Bad escape \\") + (char)p->ch));
+      }
+    } else if (p->ch == '\n' || p->ch == '\r') {
+      throw syntax_error(_errAt(p, "Bad string containing newline"));
+    }
+  }
+
+  throw syntax_error(_errAt(p, "Bad string"));
+}
+
+
 static CommentInfo _white(Parser *p) {
   CommentInfo ci = {
     false,
@@ -352,24 +899,24 @@ static CommentInfo _white(Parser *p) {
 
   while (p->ch > 0) {
     // Skip whitespace.
-    while (p->ch > 0 && p->ch <= ' ') {
-      _next(p);
-    }
+    _skipTo<SS_NOT_WHITE>(p);
     // Hjson allows comments
     if (p->ch == '#' || (p->ch == '/' && _peek(p, 0) == '/')) {
       if (p->opt.comments) {
         ci.hasComment = true;
       }
-      while (p->ch > 0 && p->ch != '\n') {
-        _next(p);
-      }
+      _skipTo<SS_LINE_END>(p);
     } else if (p->ch == '/' && _peek(p, 0) == '*') {
       if (p->opt.comments) {
         ci.hasComment = true;
       }
       _next(p);
       _next(p);
-      while (p->ch > 0 && !(p->ch == '*' && _peek(p, 0) == '/')) {
+      for (;;) {
+        _skipTo<SS_STAR>(p);
+        if (p->ch == 0 || _peek(p, 0) == '/') {
+          break;
+        }
         _next(p);
       }
       if (p->ch > 0) {
@@ -400,24 +947,24 @@ static CommentInfo _getCommentAfter(Parser *p) {
 
   while (p->ch > 0) {
     // Skip whitespace, but only until EOL.
-    while (p->ch > 0 && p->ch <= ' ' && p->ch != '\n') {
-      _next(p);
-    }
+    _skipTo<SS_NOT_WHITE_IN_LINE>(p);
     // Hjson allows comments
     if (p->ch == '#' || (p->ch == '/' && _peek(p, 0) == '/')) {
       if (p->opt.comments) {
         ci.hasComment = true;
       }
-      while (p->ch > 0 && p->ch != '\n') {
-        _next(p);
-      }
+      _skipTo<SS_LINE_END>(p);
     } else if (p->ch == '/' && _peek(p, 0) == '*') {
       if (p->opt.comments) {
         ci.hasComment = true;
       }
       _next(p);
       _next(p);
-      while (p->ch > 0 && !(p->ch == '*' && _peek(p, 0) == '/')) {
+      for (;;) {
+        _skipTo<SS_STAR>(p);
+        if (p->ch == 0 || _peek(p, 0) == '/') {
+          break;
+        }
         _next(p);
       }
       if (p->ch > 0) {
@@ -436,375 +983,3786 @@ static CommentInfo _getCommentAfter(Parser *p) {
 }
 
 
-// Hjson strings can be quoteless
-// returns string, true, false, or null.
-static Value _readTfnns2(Parser *p, size_t &valEnd) {
-  if (_isPunctuatorChar(p->ch)) {
-    throw syntax_error(_errAt(p, std::string("Found a punctuator character '") +
-      (char)p->ch + std::string("' when expecting a quoteless string (check your syntax)")));
-  }
-  size_t valStart = p->indexNext - 1;
+// The phases of the decoding that StatsBuilder measures the time of.
+// SP_GRAMMAR is the time not spent in any of the other phases.
+enum StatsPhase {
+  SP_GRAMMAR,
+  SP_WHITE,
+  SP_STRING,
+  SP_NUMBER,
+  SP_TREE,
+  SP_COUNT
+};
 
-  if (std::isspace(p->ch)) {
-    ++valStart;
-  } else {
-    // valEnd is the first char after the value.
-    valEnd = p->indexNext;
+
+// Each handler has a Phase type. The grammar functions create a Phase object
+// for the duration of each phase, so that StatsBuilder can measure the time.
+// The other handlers use NoPhase, which does nothing.
+class NoPhase {
+public:
+  template<class H>
+  NoPhase(H*, StatsPhase) {
   }
+};
 
-  for (;;) {
-    _next(p);
-    bool isEol = (p->ch == '\r' || p->ch == '\n' || p->ch == 0);
-    if (isEol ||
-      p->ch == ',' || p->ch == '}' || p->ch == ']' ||
-      p->ch == '#' ||
-      (p->ch == '/' && (_peek(p, 0) == '/' || _peek(p, 0) == '*')))
-    {
-      const char *pVal = reinterpret_cast<const char*>(p->data) + valStart;
-      size_t valLen = valEnd - valStart;
 
-      switch (*pVal)
-      {
-      case 'f':
-        if (valLen == 5 && !std::strncmp(pVal, "false", 5)) {
-          return false;
-        }
-        break;
-      case 'n':
-        if (valLen == 4 && !std::strncmp(pVal, "null", 4)) {
-          return Value(Type::Null);
-        }
-        break;
-      case 't':
-        if (valLen == 4 && !std::strncmp(pVal, "true", 4)) {
-          return true;
-        }
-        break;
-      default:
-        if (*pVal == '-' || (*pVal >= '0' && *pVal <= '9')) {
-          Value number;
-          if (tryParseNumber(&number, pVal, valLen, false)) {
-            return number;
-          }
-        }
-      }
-      if (isEol) {
-        return std::string(pVal, valLen);
-      }
-    }
-    if (std::isspace(p->ch)) {
-      if (valEnd <= valStart) {
-        ++valStart;
-      }
-    } else {
-      // valEnd is the first char after the value.
-      valEnd = p->indexNext;
-    }
-  }
+// Wrappers that also tell the handler about the comments that were found.
+template<class H>
+static CommentInfo _white(Parser *p, H *h) {
+  typename H::Phase phase(h, SP_WHITE);
+  auto ci = _white(p);
+  h->comment(p, ci);
+  return ci;
 }
 
 
-static Value _readTfnns(Parser *p) {
-  size_t valEnd = 0;
-  auto ret = _readTfnns2(p, valEnd);
-  // Make sure that we include whitespace after the value in the after-comment.
-  p->indexNext = valEnd;
-  _next(p);
-  return ret;
+template<class H>
+static CommentInfo _getCommentAfter(Parser *p, H *h) {
+  typename H::Phase phase(h, SP_WHITE);
+  auto ci = _getCommentAfter(p);
+  h->comment(p, ci);
+  return ci;
 }
 
 
-// Parse an array value.
-// assuming ch == '['
-static Value _readArray(Parser *p) {
-  Value array(Hjson::Type::Vector);
+// The largest number of elements that TreeBuilder reserves for a Map from the
+// size of the previous Map at the same depth.
+static const size_t _mapSizeHintMax = 64;
+
+
+// The grammar functions below are templates on the handler that receives what
+// was found in the input, so that the handler calls can be inlined. Each
+// handler has a Result type, used for the values returned by the grammar
+// functions.
+//
+// TreeBuilder creates the Value tree returned by Unmarshal().
+class TreeBuilder {
+  // The size of the last Map at each depth of Maps. Documents often contain
+  // arrays of records that all have the same keys, so the next Map at the same
+  // depth is reserved with that size instead of growing one key at a time.
+  // Only up to _mapSizeHintMax elements are reserved, and not the hash index,
+  // so that a small Map after a large one does not keep a large allocation.
+  std::vector<size_t> mapSizes;
+  size_t mapDepth = 0;
+
+public:
+  typedef Value Result;
+  typedef NoPhase Phase;
+
+  Value object_begin() {
+    Value object(Type::Map);
+    if (mapDepth < mapSizes.size() && mapSizes[mapDepth] > 1) {
+      reserveMapElements(object, std::min(mapSizes[mapDepth], _mapSizeHintMax));
+    }
+    ++mapDepth;
+    return object;
+  }
+
+  void object_end(Value& object) {
+    --mapDepth;
+    if (mapDepth >= mapSizes.size()) {
+      mapSizes.resize(mapDepth + 1);
+    }
+    mapSizes[mapDepth] = object.size();
+  }
+
+  // Lets a Decoder keep the sizes between documents.
+  std::vector<size_t>& map_sizes() {
+    return mapSizes;
+  }
+
+  Value array_begin() {
+    return Value(Type::Vector);
+  }
+
+  void array_end(Value&) {
+  }
+
+  void key(const StringView&) {
+  }
+
+  bool duplicate_key(Value& object, const StringView& key) {
+    return object.contains(key.str());
+  }
+
+  void object_insert(Value& object, const StringView& key, Value& elem) {
+    object.insert_or_assign(key.str(), std::move(elem));
+  }
+
+  void array_push(Value& array, const Value& elem) {
+    array.push_back(elem);
+  }
+
+  Value boolean(bool b) {
+    return b;
+  }
+
+  Value null() {
+    return Value(Type::Null);
+  }
+
+  Value int64(std::int64_t i) {
+    return i;
+  }
+
+  Value float64(double d) {
+    return d;
+  }
+
+  Value string(const StringView& s) {
+    return s.str();
+  }
+
+  void comment(Parser*, const CommentInfo&) {
+  }
+
+  // The comment functions are only used if DecoderOptions::comments is true,
+  // then CommentTreeBuilder is used instead of TreeBuilder.
+  void comment_inside(Value&, Parser*, const CommentInfo&) {
+  }
+
+  void comment_value(Value&, Parser*, const CommentInfo&, const CommentInfo&) {
+  }
+
+  void comment_key(Value&, Parser*, const CommentInfo&) {
+  }
+
+  void comment_before(Value&, Parser*, const CommentInfo&, const CommentInfo&) {
+  }
+
+  void comment_after_last(Value&, Parser*, const CommentInfo&,
+    const CommentInfo&)
+  {
+  }
+
+  void comment_braceless_end(Value&, Parser*, const CommentInfo&,
+    const CommentInfo&)
+  {
+  }
+
+  void comment_braceless_root(Value&, Parser*, CommentInfo&) {
+  }
+
+  void comment_root(Value&, Parser*, const CommentInfo&, const CommentInfo&) {
+  }
+
+  // Called by the threads of ParallelBuilder for the builders they used.
+  void merge_worker(const TreeBuilder&) {
+  }
+
+  // Called when the whole tree has been built.
+  void document_end(Parser*) {
+  }
+};
+
+
+// CommentTreeBuilder also stores the comments in the Value tree.
+class CommentTreeBuilder : public TreeBuilder {
+  CommentBuffer cb;
+
+public:
+  void comment_inside(Value& val, Parser *p, const CommentInfo& ci) {
+    cb.set(val, CS_INSIDE, p, ci);
+  }
+
+  void comment_value(Value& val, Parser *p, const CommentInfo& ciBefore,
+    const CommentInfo& ciAfter)
+  {
+    cb.set(val, CS_BEFORE, p, ciBefore);
+    cb.set(val, CS_AFTER, p, ciAfter);
+  }
+
+  void comment_key(Value& val, Parser *p, const CommentInfo& ciKey) {
+    cb.set(val, CS_KEY, p, ciKey);
+    moveComment(val, CS_KEY, CS_BEFORE);
+  }
+
+  void comment_before(Value& val, Parser *p, const CommentInfo& ciBefore,
+    const CommentInfo& ciExtra)
+  {
+    cb.set(val, CS_BEFORE, p, ciBefore, ciExtra);
+  }
+
+  void comment_after_last(Value& val, Parser *p, const CommentInfo& ciAfter,
+    const CommentInfo& ciExtra)
+  {
+    cb.set(val, CS_AFTER, p, ciAfter, ciExtra, true);
+  }
+
+  void comment_braceless_end(Value& object, Parser *p,
+    const CommentInfo& ciBefore, const CommentInfo& ciExtra)
+  {
+    if (object.empty()) {
+      cb.set(object, CS_INSIDE, p, ciBefore);
+    } else {
+      cb.set(object[static_cast<int>(object.size() - 1)], CS_AFTER, p,
+        ciBefore, ciExtra);
+    }
+  }
+
+  void comment_braceless_root(Value& object, Parser *p, CommentInfo& ciBefore) {
+    if (object.size() > 0) {
+      cb.set(object[0], CS_BEFORE, p, ciBefore);
+      ciBefore = CommentInfo();
+    }
+  }
+
+  void comment_root(Value& val, Parser *p, const CommentInfo& ciBefore,
+    const CommentInfo& ciExtra)
+  {
+    cb.set(val, CS_BEFORE, p, ciBefore);
+    cb.set(val, CS_AFTER, p, ciExtra, true);
+  }
+};
+
+
+// NullHandler only validates the input.
+class NullHandler {
+  // The keys found so far in each open object, only used if
+  // DecoderOptions::duplicateKeyException is true.
+  std::vector<std::set<std::string>> keys;
+
+public:
+  class Result {
+  };
+
+  typedef NoPhase Phase;
+
+  Result object_begin() {
+    keys.emplace_back();
+    return Result();
+  }
+
+  void object_end(Result&) {
+    keys.pop_back();
+  }
+
+  Result array_begin() {
+    return Result();
+  }
+
+  void array_end(Result&) {
+  }
+
+  void key(const StringView&) {
+  }
+
+  bool duplicate_key(Result&, const StringView& key) {
+    return !keys.back().insert(key.str()).second;
+  }
+
+  void object_insert(Result&, const StringView&, Result&) {
+  }
+
+  void array_push(Result&, const Result&) {
+  }
+
+  Result boolean(bool) {
+    return Result();
+  }
+
+  Result null() {
+    return Result();
+  }
+
+  Result int64(std::int64_t) {
+    return Result();
+  }
+
+  Result float64(double) {
+    return Result();
+  }
+
+  Result string(const StringView&) {
+    return Result();
+  }
+
+  void comment(Parser*, const CommentInfo&) {
+  }
+
+  void comment_inside(Result&, Parser*, const CommentInfo&) {
+  }
+
+  void comment_value(Result&, Parser*, const CommentInfo&, const CommentInfo&) {
+  }
+
+  void comment_key(Result&, Parser*, const CommentInfo&) {
+  }
+
+  void comment_before(Result&, Parser*, const CommentInfo&, const CommentInfo&) {
+  }
+
+  void comment_after_last(Result&, Parser*, const CommentInfo&,
+    const CommentInfo&)
+  {
+  }
+
+  void comment_braceless_end(Result&, Parser*, const CommentInfo&,
+    const CommentInfo&)
+  {
+  }
+
+  void comment_braceless_root(Result&, Parser*, CommentInfo&) {
+  }
+
+  void comment_root(Result&, Parser*, const CommentInfo&, const CommentInfo&) {
+  }
+};
+
+
+// EventHandler passes everything on to a user supplied DecoderHandler.
+class EventHandler : public NullHandler {
+  DecoderHandler &dh;
+
+public:
+  EventHandler(DecoderHandler &dh)
+    : dh(dh)
+  {
+  }
+
+  Result object_begin() {
+    dh.on_object_begin();
+    return NullHandler::object_begin();
+  }
+
+  void object_end(Result& object) {
+    NullHandler::object_end(object);
+    dh.on_object_end();
+  }
+
+  Result array_begin() {
+    dh.on_array_begin();
+    return Result();
+  }
+
+  void array_end(Result&) {
+    dh.on_array_end();
+  }
+
+  void key(const StringView& key) {
+    dh.on_key(key.data, key.size);
+  }
+
+  Result boolean(bool b) {
+    dh.on_bool(b);
+    return Result();
+  }
+
+  Result null() {
+    dh.on_null();
+    return Result();
+  }
+
+  Result int64(std::int64_t i) {
+    dh.on_int64(i);
+    return Result();
+  }
+
+  Result float64(double d) {
+    dh.on_double(d);
+    return Result();
+  }
+
+  Result string(const StringView& s) {
+    dh.on_string(s.data, s.size);
+    return Result();
+  }
+
+  void comment(Parser *p, const CommentInfo& ci) {
+    if (ci.hasComment && ci.cmEnd > ci.cmStart) {
+      dh.on_comment(reinterpret_cast<const char*>(p->data) + ci.cmStart,
+        ci.cmEnd - ci.cmStart);
+    }
+  }
+};
+
+
+// BindHandler stores the values straight into C++ objects, see Binding.
+class BindHandler : public NullHandler {
+  class Frame {
+  public:
+    BindTarget container;
+    bool isArray;
+    // Where the value for the last key is stored.
+    BindTarget child;
+  };
+
+  BindTarget root;
+  std::vector<Frame> frames;
+  // The last key, for error messages.
+  StringView lastKey;
+  // The number of open arrays and objects that are skipped because they are
+  // not bound.
+  size_t skipDepth;
+
+  // Returns where the next value is stored.
+  BindTarget next() {
+    if (frames.empty()) {
+      auto ret = root;
+      root.ops = nullptr;
+      return ret;
+    }
+
+    auto& frame = frames.back();
+    if (frame.isArray) {
+      return frame.container.ops->element(frame.container.obj);
+    }
+
+    return frame.child;
+  }
+
+  [[noreturn]] void fail(std::string msg) {
+    if (!frames.empty() && !frames.back().isArray) {
+      msg += " for the key '" + lastKey.str() + "'";
+    }
+    throw type_mismatch(msg);
+  }
+
+  [[noreturn]] void mismatch(const BindTarget& target, const char *found) {
+    fail(std::string("Found ") + found + " where " + target.ops->name +
+      " was expected");
+  }
+
+  void begin(bool isArray) {
+    if (skipDepth) {
+      ++skipDepth;
+      return;
+    }
+
+    auto target = next();
+    if (!target.ops) {
+      skipDepth = 1;
+      return;
+    }
+    if (isArray ? !target.ops->element : !target.ops->member) {
+      mismatch(target, isArray ? "an array" : "an object");
+    }
+    if (target.ops->clear) {
+      target.ops->clear(target.obj);
+    }
+    frames.push_back(Frame{ target, isArray, BindTarget{ nullptr, nullptr } });
+  }
+
+  void end() {
+    if (skipDepth) {
+      --skipDepth;
+    } else {
+      frames.pop_back();
+    }
+  }
+
+public:
+  BindHandler(const BindTarget& target)
+    : root(target),
+    skipDepth(0)
+  {
+  }
+
+  Result object_begin() {
+    begin(false);
+    return NullHandler::object_begin();
+  }
+
+  void object_end(Result& object) {
+    NullHandler::object_end(object);
+    end();
+  }
+
+  Result array_begin() {
+    begin(true);
+    return Result();
+  }
+
+  void array_end(Result&) {
+    end();
+  }
+
+  void key(const StringView& key) {
+    if (!skipDepth) {
+      auto& frame = frames.back();
+      frame.child = frame.container.ops->member(frame.container.obj, key.data,
+        key.size);
+      lastKey = key;
+    }
+  }
+
+  Result boolean(bool b) {
+    auto target = (skipDepth ? BindTarget{ nullptr, nullptr } : next());
+    if (target.ops) {
+      if (!target.ops->boolean) {
+        mismatch(target, "a bool");
+      }
+      target.ops->boolean(target.obj, b);
+    }
+    return Result();
+  }
+
+  Result null() {
+    if (!skipDepth) {
+      next();
+    }
+    return Result();
+  }
+
+  Result int64(std::int64_t i) {
+    auto target = (skipDepth ? BindTarget{ nullptr, nullptr } : next());
+    if (target.ops) {
+      if (!target.ops->int64) {
+        mismatch(target, "a number");
+      }
+      if (!target.ops->int64(target.obj, i)) {
+        fail("Found a number that is out of range");
+      }
+    }
+    return Result();
+  }
+
+  Result float64(double d) {
+    auto target = (skipDepth ? BindTarget{ nullptr, nullptr } : next());
+    if (target.ops) {
+      if (!target.ops->float64) {
+        mismatch(target, "a number");
+      }
+      if (!target.ops->float64(target.obj, d)) {
+        fail("Found a number that is out of range");
+      }
+    }
+    return Result();
+  }
+
+  Result string(const StringView& s) {
+    auto target = (skipDepth ? BindTarget{ nullptr, nullptr } : next());
+    if (target.ops) {
+      if (!target.ops->string) {
+        mismatch(target, "a string");
+      }
+      target.ops->string(target.obj, s.data, s.size);
+    }
+    return Result();
+  }
+};
+
+
+// The input of a lazily decoded document (see DecoderOptions::lazy), and the
+// positions of all Vectors and Maps in it, in the order of their opening
+// brackets.
+class LazyDocument {
+public:
+  class Container {
+  public:
+    // The positions of the opening and closing brackets.
+    size_t begin, end;
+    // The number of Vectors and Maps inside this one, at any depth.
+    size_t descendants;
+    bool empty;
+  };
+
+  std::string data;
+  DecoderOptions opt;
+  std::vector<Container> containers;
+};
+
+
+// IndexHandler validates the input like NullHandler, and records the positions
+// of all Vectors and Maps in a LazyDocument.
+class IndexHandler : public NullHandler {
+  Parser *p;
+  LazyDocument *doc;
+  // The positions in doc->containers of the open Vectors and Maps.
+  std::vector<size_t> open;
+
+  void begin() {
+    // assuming ch == '{' or ch == '['
+    open.push_back(doc->containers.size());
+    doc->containers.push_back(LazyDocument::Container{
+      p->indexNext - 1, 0, 0, false });
+  }
+
+  void end() {
+    // Called after the closing bracket has been skipped.
+    auto& c = doc->containers[open.back()];
+    c.end = p->indexNext - 2;
+    c.descendants = doc->containers.size() - open.back() - 1;
+    open.pop_back();
+  }
+
+public:
+  // If false, string values in quotes are not decoded and duplicate keys are
+  // not looked for, see DecoderOptions::lazyValidate.
+  bool validate;
+
+  IndexHandler(Parser *_p, LazyDocument *_doc)
+    : p(_p),
+    doc(_doc),
+    validate(_doc->opt.lazyValidate)
+  {
+  }
+
+  Result object_begin() {
+    begin();
+    return NullHandler::object_begin();
+  }
+
+  void object_end(Result& object) {
+    end();
+    NullHandler::object_end(object);
+  }
+
+  Result array_begin() {
+    begin();
+    return Result();
+  }
+
+  void array_end(Result&) {
+    end();
+  }
+
+  bool duplicate_key(Result& object, const StringView& key) {
+    return validate && NullHandler::duplicate_key(object, key);
+  }
+
+  // Only called for empty Vectors and Maps, which are never lazy since they
+  // can have a comment inside.
+  void comment_inside(Result&, Parser*, const CommentInfo&) {
+    doc->containers[open.back()].empty = true;
+  }
+};
+
+
+// Updates valStart and valEnd for the chars in the range [pos, end) the same
+// way that _readTfnns2() does for a single char.
+static void _spanValue(const unsigned char *data, size_t pos, size_t end,
+  size_t &valStart, size_t &valEnd)
+{
+  if (valEnd <= valStart) {
+    for (; pos < end && std::isspace(data[pos]); ++pos) {
+      ++valStart;
+    }
+  }
+  while (end > pos && std::isspace(data[end - 1])) {
+    --end;
+  }
+  if (end > pos) {
+    valEnd = end;
+  }
+}
+
+
+// Hjson strings can be quoteless
+// returns string, true, false, or null.
+template<class H>
+static typename H::Result _readTfnns2(Parser *p, H *h, size_t &valEnd) {
+  if (p->ch == 0) {
+    // At the end of the data, show the position of its last char.
+    p->indexNext = std::min(p->indexNext, p->dataSize);
+    throw syntax_error(_errAt(p, "Found EOF while looking for a value (check your syntax)"));
+  } else if (_isPunctuatorChar(p->ch)) {
+    throw syntax_error(_errAt(p, std::string("Found a punctuator character '") +
+      (char)p->ch + std::string("' when expecting a quoteless string (check your syntax)")));
+  }
+  size_t valStart = p->indexNext - 1;
+
+  if (std::isspace(p->ch)) {
+    ++valStart;
+  } else {
+    // valEnd is the first char after the value.
+    valEnd = p->indexNext;
+  }
+
+  for (;;) {
+    _next(p);
+    bool isEol = (p->ch == '\r' || p->ch == '\n' || p->ch == 0);
+    if (isEol ||
+      p->ch == ',' || p->ch == '}' || p->ch == ']' ||
+      p->ch == '#' ||
+      (p->ch == '/' && (_peek(p, 0) == '/' || _peek(p, 0) == '*')))
+    {
+      const char *pVal = reinterpret_cast<const char*>(p->data) + valStart;
+      size_t valLen = valEnd - valStart;
+
+      switch (*pVal)
+      {
+      case 'f':
+        if (valLen == 5 && !std::strncmp(pVal, "false", 5)) {
+          return h->boolean(false);
+        }
+        break;
+      case 'n':
+        if (valLen == 4 && !std::strncmp(pVal, "null", 4)) {
+          return h->null();
+        }
+        break;
+      case 't':
+        if (valLen == 4 && !std::strncmp(pVal, "true", 4)) {
+          return h->boolean(true);
+        }
+        break;
+      default:
+        if (*pVal == '-' || (*pVal >= '0' && *pVal <= '9')) {
+          std::int64_t i;
+          double d;
+          bool isInt;
+          bool isNumber;
+          {
+            typename H::Phase phase(h, SP_NUMBER);
+            isNumber = tryParseNumber(&i, &d, &isInt, pVal, valLen, false);
+          }
+          if (isNumber) {
+            return isInt ? h->int64(i) : h->float64(d);
+          }
+        }
+      }
+      if (isEol) {
+        return h->string(StringView{ pVal, valLen });
+      }
+    }
+    if (std::isspace(p->ch)) {
+      if (valEnd <= valStart) {
+        ++valStart;
+      }
+    } else {
+      // valEnd is the first char after the value.
+      valEnd = p->indexNext;
+    }
+    if (p->indexNext < p->dataSize && !(_scanClasses[p->data[p->indexNext]] & SS_VALUE)) {
+      // None of the following chars until the next stop can end the value.
+      size_t runEnd = _scan<SS_VALUE>(p->data, p->indexNext, p->dataSize);
+      _spanValue(p->data, p->indexNext, runEnd, valStart, valEnd);
+      p->indexNext = runEnd;
+    }
+  }
+}
+
+
+template<class H>
+static typename H::Result _readTfnns(Parser *p, H *h) {
+  typename H::Phase phase(h, SP_STRING);
+  size_t valEnd = 0;
+  auto ret = _readTfnns2(p, h, valEnd);
+  // Make sure that we include whitespace after the value in the after-comment.
+  p->indexNext = valEnd;
+  _next(p);
+  return ret;
+}
+
+
+// Parse a string, number or word (i.e. anything but an object or an array).
+template<class H>
+static typename H::Result _readLeaf(Parser *p, H *h) {
+  if (p->ch == '"' || p->ch == '\'') {
+    std::string buf;
+    Borrow<std::string> borrow(_keptString(p), buf);
+    StringView str;
+    {
+      typename H::Phase phase(h, SP_STRING);
+      str = _readString(p, true, buf);
+    }
+    return h->string(str);
+  }
+
+  return _readTfnns(p, h);
+}
+
+
+static NullHandler::Result _readLeaf(Parser *p, IndexHandler *h) {
+  if (!h->validate && (p->ch == '"' || (p->ch == '\'' &&
+    !(_peek(p, 0) == '\'' && _peek(p, 1) == '\''))))
+  {
+    _skipString(p);
+    return NullHandler::Result();
+  }
+
+  return _readLeaf<IndexHandler>(p, h);
+}
+
+
+// A Vector or Map that is being read by _readContainer(), together with the
+// state of the element that is being read inside it.
+template<class R>
+class ReadFrame {
+public:
+  R container;
+  bool isObject;
+  bool withoutBraces;
+  // The comments before and after the comma in front of the current element.
+  CommentInfo ciBefore, ciExtra;
+  // The comments before the value and after the key of the current element,
+  // kept while the value is a Vector or Map that is being read.
+  CommentInfo ciValue, ciKey;
+  // The key of the current element. keyBuf is not referenced by pointer,
+  // because it moves when the stack grows.
+  const char *keyData;
+  size_t keySize;
+  bool keyInBuf;
+  std::string keyBuf;
+
+  StringView key() const {
+    return StringView{ keyInBuf ? keyBuf.data() : keyData, keySize };
+  }
+};
+
+
+// The buffers that a Decoder keeps between calls.
+class DecodeScratch {
+public:
+  std::string str;
+  std::vector<ReadFrame<Value>> frames;
+  std::vector<size_t> mapSizes;
+};
+
+
+static std::string *_keptString(Parser *p) {
+  return p->scratch ? &p->scratch->str : nullptr;
+}
+
+
+// The stack of _readContainer() kept by a Decoder, or nullptr.
+template<class R>
+static std::vector<ReadFrame<R>> *_keptFrames(Parser*, const R*) {
+  return nullptr;
+}
+
+
+static std::vector<ReadFrame<Value>> *_keptFrames(Parser *p, const Value*) {
+  return p->scratch ? &p->scratch->frames : nullptr;
+}
+
+
+// False for a handler that does not decode the elements of nested Vectors and
+// Maps itself, but lets _readLeaf() handle them.
+template<class H>
+static bool _descends(const H*) {
+  return true;
+}
+
+
+// Adds elem to the container on top of the stack, after reading the comments
+// and the comma that follow it. Returns true if that was the last element of
+// the container, in which case p has moved past the closing bracket.
+template<class H, class R>
+static bool _readElementEnd(Parser *p, H *h, ReadFrame<R>& f, R& elem) {
+  if (f.isObject) {
+    h->comment_key(elem, p, f.ciKey);
+  }
+  h->comment_before(elem, p, f.ciBefore, f.ciExtra);
+  auto ciAfter = _white(p, h);
+  // in Hjson the comma is optional and trailing commas are allowed
+  if (p->ch == ',') {
+    _next(p);
+    // It is unlikely that someone writes a comment after the value but
+    // before the comma, so we include any such comment in "comment_after".
+    f.ciExtra = _white(p, h);
+  } else {
+    f.ciExtra = {};
+  }
+  if (p->ch == (f.isObject ? '}' : ']') && !f.withoutBraces) {
+    h->comment_after_last(elem, p, ciAfter, f.ciExtra);
+    if (f.isObject) {
+      // duplicate keys overwrite the previous value
+      h->object_insert(f.container, f.key(), elem);
+    } else {
+      h->array_push(f.container, elem);
+    }
+    _next(p);
+    return true;
+  }
+  if (f.isObject) {
+    h->object_insert(f.container, f.key(), elem);
+  } else {
+    h->array_push(f.container, elem);
+  }
+  f.ciBefore = ciAfter;
+
+  return false;
+}
+
+
+// Parse an object or an array, including all Vectors and Maps nested in it.
+// Instead of recursing into _readValue() for each nested Vector or Map, the
+// open containers are kept in an explicit stack, so that the depth of the
+// input is only limited by DecoderOptions::maxDepth.
+// assuming ch == '{' or ch == '[', unless withoutBraces is true
+template<class H>
+static typename H::Result _readContainer(Parser *p, H *h, bool isObject,
+  bool withoutBraces)
+{
+  typedef typename H::Result Result;
+  enum class Step {
+    Open,
+    Element,
+    Close
+  };
+
+  std::vector<ReadFrame<Result>> stack;
+  Borrow<std::vector<ReadFrame<Result>>> borrow(
+    _keptFrames(p, static_cast<const Result*>(nullptr)), stack);
+  // Left over if a previous call threw an exception.
+  stack.clear();
+  Step step = Step::Open;
+
+  for (;;) {
+    switch (step) {
+    case Step::Open:
+      {
+        if (p->opt.maxDepth > 0 &&
+          p->depth + stack.size() >= static_cast<size_t>(p->opt.maxDepth))
+        {
+          throw depth_error(_errAt(p, "Exceeded the maximum depth of " +
+            std::to_string(p->opt.maxDepth) + " nested arrays and objects"));
+        }
+        stack.emplace_back();
+        auto& f = stack.back();
+        f.isObject = isObject;
+        f.withoutBraces = withoutBraces;
+        if (isObject) {
+          f.container = h->object_begin();
+        } else {
+          f.container = h->array_begin();
+        }
+        if (!withoutBraces) {
+          // Skip '{' or '['.
+          _next(p);
+        }
+        f.ciBefore = _white(p, h);
+        if (p->ch == (isObject ? '}' : ']') && !withoutBraces) {
+          h->comment_inside(f.container, p, f.ciBefore);
+          _next(p);
+          step = Step::Close; // empty object or array
+        } else {
+          f.ciExtra = {};
+          step = Step::Element;
+        }
+      }
+      break;
+
+    case Step::Element:
+      {
+        auto& f = stack.back();
+        if (p->ch <= 0) {
+          if (f.withoutBraces) {
+            h->comment_braceless_end(f.container, p, f.ciBefore, f.ciExtra);
+            step = Step::Close;
+            break;
+          }
+          if (f.isObject) {
+            throw syntax_error(_errAt(p, "End of input while parsing an object (did you forget a closing '}'?)"));
+          }
+          throw syntax_error(_errAt(p, "End of input while parsing an array (did you forget a closing ']'?)"));
+        }
+        if (f.isObject) {
+          StringView key;
+          {
+            typename H::Phase phase(h, SP_STRING);
+            key = _readKeyname(p, f.keyBuf);
+          }
+          f.keyInBuf = (key.data == f.keyBuf.data());
+          f.keyData = key.data;
+          f.keySize = key.size;
+          h->key(key);
+          if (p->opt.duplicateKeyException && h->duplicate_key(f.container, key)) {
+            throw syntax_error(_errAt(p, "Found duplicate of key '" +
+              std::string(key.data, key.size) + "'"));
+          }
+          f.ciKey = _white(p, h);
+          if (p->ch != ':') {
+            throw syntax_error(_errAt(p, std::string(
+              "Expected ':' instead of '") + (char)(p->ch) + "'"));
+          }
+          _next(p);
+        }
+        // The first part of _readValue().
+        f.ciValue = _white(p, h);
+        if ((p->ch == '{' || p->ch == '[') && _descends(h)) {
+          isObject = (p->ch == '{');
+          withoutBraces = false;
+          step = Step::Open;
+          break;
+        }
+        auto elem = _readLeaf(p, h);
+        auto ciAfter = _getCommentAfter(p, h);
+        h->comment_value(elem, p, f.ciValue, ciAfter);
+        step = _readElementEnd(p, h, f, elem) ? Step::Close : Step::Element;
+      }
+      break;
+
+    case Step::Close:
+      {
+        auto& f = stack.back();
+        if (f.isObject) {
+          h->object_end(f.container);
+        } else {
+          h->array_end(f.container);
+        }
+        Result elem(std::move(f.container));
+        stack.pop_back();
+        if (stack.empty()) {
+          return elem;
+        }
+        // The last part of _readValue().
+        auto& parent = stack.back();
+        auto ciAfter = _getCommentAfter(p, h);
+        h->comment_value(elem, p, parent.ciValue, ciAfter);
+        step = _readElementEnd(p, h, parent, elem) ? Step::Close :
+          Step::Element;
+      }
+      break;
+    }
+  }
+}
+
+
+// Parse an array value.
+// assuming ch == '['
+template<class H>
+static typename H::Result _readArray(Parser *p, H *h) {
+  return _readContainer(p, h, false, false);
+}
+
+
+// Parse an object value.
+template<class H>
+static typename H::Result _readObject(Parser *p, H *h, bool withoutBraces) {
+  return _readContainer(p, h, true, withoutBraces);
+}
+
+
+// Parse a Hjson value. It could be an object, an array, a string, a number or a word.
+template<class H>
+static typename H::Result _readValue(Parser *p, H *h) {
+  typename H::Result ret;
+
+  auto ciBefore = _white(p, h);
+
+  if ((p->ch == '{' || p->ch == '[') && _descends(h)) {
+    ret = _readContainer(p, h, p->ch == '{', false);
+  } else {
+    ret = _readLeaf(p, h);
+  }
+
+  auto ciAfter = _getCommentAfter(p, h);
+
+  h->comment_value(ret, p, ciBefore, ciAfter);
+
+  return ret;
+}
+
+
+// LazyBuilder builds one level of a lazily decoded document: the Vectors and
+// Maps inside the Vector or Map being decoded are only created as lazy Values,
+// without decoding their elements.
+template<class B>
+class LazyBuilder : public B {
+public:
+  std::shared_ptr<LazyDocument> doc;
+  // The position in doc->containers of the next Vector or Map.
+  size_t next;
+
+  Value object_begin() {
+    ++next;
+    return B::object_begin();
+  }
+
+  Value array_begin() {
+    ++next;
+    return B::array_begin();
+  }
+
+  // Skips the Vector or Map. Empty ones are decoded right away.
+  // assuming ch == '{' or ch == '['
+  Value skip_container(Parser *p) {
+    auto& c = doc->containers[next];
+
+    if (c.empty) {
+      ++next;
+      if (p->ch == '{') {
+        return _readObject(p, static_cast<B*>(this), false);
+      }
+      return _readArray(p, static_cast<B*>(this));
+    }
+
+    auto ret = createLazy(p->ch == '{' ? Type::Map : Type::Vector, doc, next);
+    next += c.descendants + 1;
+    p->indexNext = c.end + 1;
+    _next(p);
+
+    return ret;
+  }
+};
+
+// The elements of nested Vectors and Maps are not decoded by LazyBuilder, see
+// _readLeaf().
+template<class B>
+static bool _descends(const LazyBuilder<B>*) {
+  return false;
+}
+
+
+// Same as _readLeaf(), but Vectors and Maps are skipped.
+template<class B>
+static Value _readLeaf(Parser *p, LazyBuilder<B> *h) {
+  if (p->ch == '{' || p->ch == '[') {
+    return h->skip_container(p);
+  }
+
+  return _readLeaf(p, static_cast<B*>(h));
+}
+
+
+template<class H>
+static bool _hasTrailing(Parser *p, H *h, CommentInfo *ci) {
+  *ci = _white(p, h);
+  return p->ch > 0;
+}
+
+
+// Documents smaller than this are always decoded by a single thread, and the
+// elements of a root container are handed to the threads in chunks of at
+// least this size.
+static const size_t _parallelChunkSize = 1 << 16;
+
+
+// ParallelBuilder creates the same tree as B, but decodes the elements of a
+// root Vector or Map concurrently. A fast scan of the structure of the input
+// first finds where elements of the root start, and each thread then decodes
+// the elements from one of these positions to the next. If the input is
+// invalid (or the scan was wrong), the whole document is decoded again by a
+// single thread, so that the syntax error is reported exactly the same way.
+template<class B>
+class ParallelBuilder : public B {
+public:
+  int threads;
+};
+
+
+// StatsBuilder creates the same tree as B, and collects the statistics for
+// DecoderOptions::stats. Only used when stats are requested, so that the other
+// builders are not slowed down by the counting and timing. The time of each
+// phase is only measured if Timed is true.
+template<class B, bool Timed>
+class StatsBuilder : public B {
+  typedef std::chrono::steady_clock Clock;
+
+  DecoderStats stats;
+  DecoderStats *prevStats;
+  int depth;
+  StatsPhase current;
+  Clock::time_point start, since;
+  Clock::duration times[SP_COUNT];
+
+  void enter(StatsPhase phase) {
+    if (!Timed) {
+      return;
+    }
+    auto now = Clock::now();
+    times[current] += now - since;
+    since = now;
+    current = phase;
+  }
+
+  static double _seconds(Clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+  }
+
+  void node(Type type) {
+    ++stats.nodes[static_cast<int>(type)];
+  }
+
+public:
+  typedef typename B::Result Result;
+
+  // Makes the StatsBuilder measure the time of a phase, until the previous
+  // phase is restored when the Phase object is destroyed.
+  class Phase {
+    StatsBuilder *h;
+    StatsPhase prev;
+
+  public:
+    Phase(StatsBuilder *_h, StatsPhase phase)
+      : h(_h),
+      prev(_h->current)
+    {
+      h->enter(phase);
+    }
+
+    ~Phase() {
+      h->enter(prev);
+    }
+  };
+
+  StatsBuilder()
+    : prevStats(countAllocations(&stats)),
+    depth(0),
+    current(SP_GRAMMAR),
+    start(Clock::now()),
+    since(start)
+  {
+    for (auto& t : times) {
+      t = Clock::duration::zero();
+    }
+  }
+
+  ~StatsBuilder() {
+    countAllocations(prevStats);
+  }
+
+  Result object_begin() {
+    Phase phase(this, SP_TREE);
+    node(Type::Map);
+    stats.maxDepth = std::max(stats.maxDepth, ++depth);
+    return B::object_begin();
+  }
+
+  void object_end(Result& object) {
+    Phase phase(this, SP_TREE);
+    --depth;
+    B::object_end(object);
+  }
+
+  Result array_begin() {
+    Phase phase(this, SP_TREE);
+    node(Type::Vector);
+    stats.maxDepth = std::max(stats.maxDepth, ++depth);
+    return B::array_begin();
+  }
+
+  void array_end(Result& array) {
+    Phase phase(this, SP_TREE);
+    --depth;
+    B::array_end(array);
+  }
+
+  bool duplicate_key(Result& object, const StringView& key) {
+    Phase phase(this, SP_TREE);
+    return B::duplicate_key(object, key);
+  }
+
+  void object_insert(Result& object, const StringView& key, Result& elem) {
+    Phase phase(this, SP_TREE);
+    B::object_insert(object, key, elem);
+  }
+
+  void array_push(Result& array, const Result& elem) {
+    Phase phase(this, SP_TREE);
+    B::array_push(array, elem);
+  }
+
+  Result boolean(bool b) {
+    Phase phase(this, SP_TREE);
+    node(Type::Bool);
+    return B::boolean(b);
+  }
+
+  Result null() {
+    Phase phase(this, SP_TREE);
+    node(Type::Null);
+    return B::null();
+  }
+
+  Result int64(std::int64_t i) {
+    Phase phase(this, SP_TREE);
+    node(Type::Int64);
+    return B::int64(i);
+  }
+
+  Result float64(double d) {
+    Phase phase(this, SP_TREE);
+    node(Type::Double);
+    return B::float64(d);
+  }
+
+  Result string(const StringView& s) {
+    Phase phase(this, SP_TREE);
+    node(Type::String);
+    return B::string(s);
+  }
+
+  void comment_inside(Result& val, Parser *p, const CommentInfo& ci) {
+    Phase phase(this, SP_TREE);
+    B::comment_inside(val, p, ci);
+  }
+
+  void comment_value(Result& val, Parser *p, const CommentInfo& ciBefore,
+    const CommentInfo& ciAfter)
+  {
+    Phase phase(this, SP_TREE);
+    B::comment_value(val, p, ciBefore, ciAfter);
+  }
+
+  void comment_key(Result& val, Parser *p, const CommentInfo& ciKey) {
+    Phase phase(this, SP_TREE);
+    B::comment_key(val, p, ciKey);
+  }
+
+  void comment_before(Result& val, Parser *p, const CommentInfo& ciBefore,
+    const CommentInfo& ciExtra)
+  {
+    Phase phase(this, SP_TREE);
+    B::comment_before(val, p, ciBefore, ciExtra);
+  }
+
+  void comment_after_last(Result& val, Parser *p, const CommentInfo& ciAfter,
+    const CommentInfo& ciExtra)
+  {
+    Phase phase(this, SP_TREE);
+    B::comment_after_last(val, p, ciAfter, ciExtra);
+  }
+
+  void comment_braceless_end(Result& object, Parser *p,
+    const CommentInfo& ciBefore, const CommentInfo& ciExtra)
+  {
+    Phase phase(this, SP_TREE);
+    B::comment_braceless_end(object, p, ciBefore, ciExtra);
+  }
+
+  void comment_braceless_root(Result& object, Parser *p, CommentInfo& ciBefore) {
+    Phase phase(this, SP_TREE);
+    B::comment_braceless_root(object, p, ciBefore);
+  }
+
+  void comment_root(Result& val, Parser *p, const CommentInfo& ciBefore,
+    const CommentInfo& ciExtra)
+  {
+    Phase phase(this, SP_TREE);
+    B::comment_root(val, p, ciBefore, ciExtra);
+  }
+
+  // The worker decoded elements of the root container, i.e. one level deeper
+  // than this builder is now.
+  void merge_worker(StatsBuilder& worker) {
+    worker.enter(SP_GRAMMAR);
+    for (int a = 0; a < 8; ++a) {
+      stats.nodes[a] += worker.stats.nodes[a];
+    }
+    stats.maxDepth = std::max(stats.maxDepth, depth + worker.stats.maxDepth);
+    stats.allocations += worker.stats.allocations;
+    stats.allocatedBytes += worker.stats.allocatedBytes;
+    for (int a = 0; a < SP_COUNT; ++a) {
+      times[a] += worker.times[a];
+    }
+  }
+
+  void document_end(Parser *p) {
+    enter(SP_GRAMMAR);
+    auto& res = *p->opt.stats;
+    res.bytes += p->dataSize;
+    for (int a = 0; a < 8; ++a) {
+      res.nodes[a] += stats.nodes[a];
+    }
+    res.maxDepth = std::max(res.maxDepth, stats.maxDepth);
+    res.allocations += stats.allocations;
+    res.allocatedBytes += stats.allocatedBytes;
+    res.totalSeconds += _seconds(Clock::now() - start);
+    res.whitespaceSeconds += _seconds(times[SP_WHITE]);
+    res.stringSeconds += _seconds(times[SP_STRING]);
+    res.numberSeconds += _seconds(times[SP_NUMBER]);
+    res.treeSeconds += _seconds(times[SP_TREE]);
+  }
+};
+
+
+// Returns the index of the first byte after the string in quotes that starts
+// at pos, for _scanRootSplits(). Stops at a newline (which makes the string
+// invalid).
+static size_t _scanQuoted(const unsigned char *data, size_t pos, size_t end) {
+  auto exitCh = data[pos++];
+
+  while (pos < end) {
+    pos = exitCh == '"' ? _scan<SS_DQ_STRING>(data, pos, end) :
+      _scan<SS_SQ_STRING>(data, pos, end);
+    if (pos >= end) {
+      break;
+    }
+    auto c = data[pos++];
+    if (c == exitCh) {
+      return pos;
+    } else if (c == '\\') {
+      ++pos;
+    } else {
+      // \r or \n
+      return pos;
+    }
+  }
+
+  return end;
+}
+
+
+// Returns the index of the first byte after the multiline string that starts
+// at pos, for _scanRootSplits().
+static size_t _scanMultiline(const unsigned char *data, size_t pos,
+  size_t end)
+{
+  pos += 3;
+
+  while (pos < end) {
+    auto q = static_cast<const unsigned char*>(
+      std::memchr(data + pos, '\'', end - pos));
+    if (!q) {
+      break;
+    }
+    pos = q - data;
+    if (pos + 2 < end && data[pos + 1] == '\'' && data[pos + 2] == '\'') {
+      return pos + 3;
+    }
+    ++pos;
+  }
+
+  return end;
+}
+
+
+// True if the quoteless value in [pos, end) (with trailing whitespace) looks
+// like true, false, null or a number, i.e. if _readTfnns2() would end it
+// before the end of the line.
+static bool _scanIsLiteral(const unsigned char *data, size_t pos, size_t end) {
+  while (end > pos && data[end - 1] <= ' ') {
+    --end;
+  }
+
+  const char *pVal = reinterpret_cast<const char*>(data) + pos;
+  size_t valLen = end - pos;
+  if ((valLen == 4 && (!std::strncmp(pVal, "true", 4) ||
+    !std::strncmp(pVal, "null", 4))) ||
+    (valLen == 5 && !std::strncmp(pVal, "false", 5)))
+  {
+    return true;
+  }
+
+  if (!valLen || (*pVal != '-' && (*pVal < '0' || *pVal > '9'))) {
+    return false;
+  }
+  for (; pos < end; ++pos) {
+    auto c = data[pos];
+    if ((c < '0' || c > '9') && c != '-' && c != '+' && c != '.' &&
+      c != 'e' && c != 'E')
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+
+// Returns the index of the first byte after the quoteless value that starts
+// at pos, for _scanRootSplits(): the end of the line, or the punctuator or
+// comment after a value that looks like true, false, null or a number.
+static size_t _scanQuoteless(const unsigned char *data, size_t pos,
+  size_t end)
+{
+  size_t start = pos;
+
+  while (++pos < end) {
+    pos = _scan<SS_VALUE>(data, pos, end);
+    if (pos >= end) {
+      break;
+    }
+    auto c = data[pos];
+    if (c == 0 || c == '\r' || c == '\n') {
+      return pos;
+    }
+    if ((c != '/' || (pos + 1 < end && (data[pos + 1] == '/' ||
+      data[pos + 1] == '*'))) && _scanIsLiteral(data, start, pos))
+    {
+      return pos;
+    }
+  }
+
+  return end;
+}
+
+
+// Returns the positions in the input where the threads of ParallelBuilder can
+// start decoding: the first chars of elements of the root Vector or Map, at
+// least minGap bytes apart, starting with the first element at pos. Unlike the
+// decoder, the scan only tells brackets, strings in quotes, multiline strings,
+// comments and quoteless keys and values apart, without validating or
+// decoding anything. The positions are only a guess (e.g. for invalid input),
+// so the threads check that each chunk ends exactly where the next one starts.
+// assuming pos is the first char after the opening bracket (if any) and the
+// whitespace and comments that follow it
+static std::vector<size_t> _scanRootSplits(const unsigned char *data,
+  size_t pos, size_t end, bool isObject, size_t minGap)
+{
+  std::vector<size_t> splits;
+  // True for each open Map, false for each open Vector, the root first.
+  std::vector<bool> open(1, isObject);
+  // True if the next token is a key in the innermost Map.
+  bool wantKey = isObject;
+  size_t nextSplit = pos;
+
+  while (pos < end) {
+    auto c = data[pos];
+
+    if (c <= ' ') {
+      if (c == 0) {
+        break;
+      }
+      pos = _scan<SS_NOT_WHITE>(data, pos, end);
+    } else if (c == '#' || (c == '/' && pos + 1 < end && data[pos + 1] == '/')) {
+      pos = _scan<SS_LINE_END>(data, pos, end);
+    } else if (c == '/' && pos + 1 < end && data[pos + 1] == '*') {
+      for (pos += 2; ; ++pos) {
+        pos = _scan<SS_STAR>(data, pos, end);
+        if (pos >= end || data[pos] == 0) {
+          return splits;
+        } else if (pos + 1 < end && data[pos + 1] == '/') {
+          pos += 2;
+          break;
+        }
+      }
+    } else if (c == ',') {
+      ++pos;
+    } else if (c == '}' || c == ']') {
+      open.pop_back();
+      if (open.empty()) {
+        break;
+      }
+      wantKey = open.back();
+      ++pos;
+    } else if (c == ':' && wantKey) {
+      wantKey = false;
+      ++pos;
+    } else {
+      if (open.size() == 1 && wantKey == isObject && pos >= nextSplit) {
+        splits.push_back(pos);
+        nextSplit = pos + minGap;
+      }
+      if (c == '"' || (c == '\'' && !(pos + 2 < end && data[pos + 1] == '\'' &&
+        data[pos + 2] == '\'')))
+      {
+        pos = _scanQuoted(data, pos, end);
+      } else if (wantKey) {
+        pos = _scan<SS_KEY>(data, pos + 1, end);
+        // The ':' is still to come.
+        continue;
+      } else if (c == '{' || c == '[') {
+        open.push_back(c == '{');
+        wantKey = (c == '{');
+        ++pos;
+        continue;
+      } else if (c == '\'') {
+        pos = _scanMultiline(data, pos, end);
+      } else {
+        pos = _scanQuoteless(data, pos, end);
+      }
+      if (!wantKey) {
+        wantKey = open.back();
+      }
+    }
+  }
+
+  return splits;
+}
+
+
+// The elements of the root Vector or Map from one split position to the next,
+// decoded by one of the threads of ParallelBuilder.
+class RootChunk {
+public:
+  // Only set if the chunk ended exactly at the next split position, or at the
+  // end of the root for the last chunk.
+  bool ok = false;
+  std::vector<std::string> keys;
+  std::vector<Value> values;
+  // The comments after the last element, i.e. before the first element of the
+  // next chunk.
+  CommentInfo ciAfter, ciExtra;
+  // The state of the parser after the last element.
+  size_t indexNext;
+  unsigned char ch;
+  bool atEnd;
+};
+
+
+// Decodes the elements of the root Vector or Map from the split position start
+// to the split position stop, or to the end of the root if stop is 0, in the
+// same way as _readContainer() does. The comments before the first element are
+// left to the caller, since they were read by the previous chunk.
+template<class B>
+static void _readRootChunk(Parser *p, B *h, DecodeScratch *scratch,
+  bool isObject, bool withoutBraces, size_t start, size_t stop,
+  RootChunk *chunk)
+{
+  Parser ep = *p;
+  // The buffers of a Decoder are only used by the calling thread.
+  ep.scratch = scratch;
+  ep.indexNext = start;
+  _next(&ep);
+
+  CommentInfo ciBefore = {}, ciExtra = {};
+  std::string keyBuf;
+
+  for (;;) {
+    if (ep.ch == 0) {
+      if (stop || !withoutBraces) {
+        return;
+      }
+      break;
+    }
+    CommentInfo ciKey;
+    if (isObject) {
+      StringView key;
+      {
+        typename B::Phase phase(h, SP_STRING);
+        key = _readKeyname(&ep, keyBuf);
+      }
+      h->key(key);
+      ciKey = _white(&ep, h);
+      if (ep.ch != ':') {
+        return;
+      }
+      _next(&ep);
+      chunk->keys.push_back(key.str());
+    }
+    auto elem = _readValue(&ep, h);
+    if (isObject) {
+      h->comment_key(elem, &ep, ciKey);
+    }
+    if (!chunk->values.empty()) {
+      h->comment_before(elem, &ep, ciBefore, ciExtra);
+    }
+    ciBefore = _white(&ep, h);
+    // in Hjson the comma is optional and trailing commas are allowed
+    if (ep.ch == ',') {
+      _next(&ep);
+      ciExtra = _white(&ep, h);
+    } else {
+      ciExtra = {};
+    }
+    chunk->values.push_back(std::move(elem));
+    if (ep.ch == (isObject ? '}' : ']') && !withoutBraces) {
+      if (stop) {
+        return;
+      }
+      h->comment_after_last(chunk->values.back(), &ep, ciBefore, ciExtra);
+      break;
+    }
+    if (stop && ep.indexNext - 1 >= stop) {
+      if (ep.indexNext - 1 > stop) {
+        return;
+      }
+      break;
+    }
+  }
+
+  chunk->ciAfter = ciBefore;
+  chunk->ciExtra = ciExtra;
+  chunk->indexNext = ep.indexNext;
+  chunk->ch = ep.ch;
+  chunk->atEnd = ep.atEnd;
+  chunk->ok = true;
+}
+
+
+// True if all chunks were decoded and the result is the same as from a single
+// thread, i.e. the root can be built from them.
+static bool _rootChunksValid(Parser *p, const std::vector<RootChunk>& chunks,
+  bool isObject)
+{
+  for (const auto& chunk : chunks) {
+    if (!chunk.ok) {
+      return false;
+    }
+  }
+
+  if (isObject && p->opt.duplicateKeyException) {
+    // Duplicates within a chunk are not looked for by the threads either.
+    std::unordered_set<std::string> keys;
+    for (const auto& chunk : chunks) {
+      for (const auto& key : chunk.keys) {
+        if (!keys.insert(key).second) {
+          return false;
+        }
+      }
+    }
+  }
+
+  return true;
+}
+
+
+// Counts the root Vector or Map in Parser::depth while its elements are read,
+// since it is not read by _readContainer().
+class RootDepth {
+  Parser *p;
+
+public:
+  RootDepth(Parser *parser)
+    : p(parser)
+  {
+    ++p->depth;
+  }
+
+  ~RootDepth() {
+    --p->depth;
+  }
+};
+
+
+// Decodes the root Vector or Map with the elements split between up to
+// h->threads threads, see ParallelBuilder. Returns false if the input must be
+// decoded by a single thread instead, because it is invalid, or because the
+// scan did not find where the elements start. The caller then has to restore
+// the position of p. Nothing but the time spent is added to the stats of h.
+template<class B>
+static bool _readRootParallel(Parser *p, ParallelBuilder<B> *h, bool isObject,
+  bool withoutBraces, Value *pResult)
+{
+  RootDepth rootDepth(p);
+
+  if (!withoutBraces) {
+    // Skip '{' or '['.
+    _next(p);
+  }
+  auto ciBefore = _white(p, h);
+  if (p->ch == 0 || (p->ch == (isObject ? '}' : ']') && !withoutBraces)) {
+    return false;
+  }
+
+  size_t start = p->indexNext - 1;
+  size_t chunkBytes = std::max(_parallelChunkSize,
+    (p->dataSize - start) / (size_t(h->threads) * 4));
+  auto splits = _scanRootSplits(p->data, start, p->dataSize, isObject,
+    chunkBytes);
+  if (splits.size() < 2 || splits[0] != start) {
+    return false;
+  }
+
+  size_t chunkCount = splits.size();
+  std::vector<RootChunk> chunks(chunkCount);
+  std::atomic<size_t> nextChunk(0);
+  // The threads only add their stats etc. to h when the calling thread has
+  // found that the chunks are valid, so that nothing is counted twice if the
+  // input is decoded again by a single thread.
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t threadCount = 1, finished = 0;
+  int decision = 0;
+  std::exception_ptr error;
+  Value ret;
+
+  auto work = [&](bool caller) {
+    std::unique_ptr<ArenaScope> scope;
+    if (p->opt.arena) {
+      scope.reset(new ArenaScope(chunkBytes * 2));
+    }
+    B builder;
+    // Keeps the stack of _readContainer() etc. between the elements.
+    DecodeScratch scratch;
+    for (size_t chunk; (chunk = nextChunk++) < chunkCount;) {
+      try {
+        _readRootChunk(p, &builder, &scratch, isObject, withoutBraces,
+          splits[chunk], chunk + 1 < chunkCount ? splits[chunk + 1] : 0,
+          &chunks[chunk]);
+      } catch (...) {
+        // Found again when decoding on a single thread, unless the chunk did
+        // not start where an element starts.
+        chunks[chunk].ok = false;
+      }
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    ++finished;
+    if (caller) {
+      cv.wait(lock, [&]() { return finished == threadCount; });
+      decision = -1;
+      if (_rootChunksValid(p, chunks, isObject)) {
+        try {
+          ret = isObject ? h->object_begin() : h->array_begin();
+          decision = 1;
+        } catch (...) {
+          error = std::current_exception();
+        }
+      }
+      cv.notify_all();
+    } else {
+      cv.notify_all();
+      cv.wait(lock, [&]() { return decision != 0; });
+    }
+    if (decision > 0) {
+      h->merge_worker(builder);
+    }
+  };
+
+  std::vector<std::thread> workers;
+  try {
+    for (size_t a = 1; a < std::min(size_t(h->threads), chunkCount); ++a) {
+      workers.emplace_back(work, false);
+    }
+  } catch (const std::system_error&) {
+    // Use the threads that could be started.
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    threadCount += workers.size();
+  }
+  work(true);
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+  if (decision < 0) {
+    return false;
+  }
+
+  size_t count = 0;
+  for (const auto& chunk : chunks) {
+    count += chunk.values.size();
+  }
+  ret.reserve(count);
+
+  for (size_t a = 0; a < chunkCount; ++a) {
+    auto& chunk = chunks[a];
+    if (a) {
+      h->comment_before(chunk.values[0], p, chunks[a - 1].ciAfter,
+        chunks[a - 1].ciExtra);
+    } else {
+      h->comment_before(chunk.values[0], p, ciBefore, CommentInfo());
+    }
+    for (size_t b = 0; b < chunk.values.size(); ++b) {
+      if (isObject) {
+        auto& key = chunk.keys[b];
+        h->object_insert(ret, StringView{ key.data(), key.size() },
+          chunk.values[b]);
+      } else {
+        h->array_push(ret, chunk.values[b]);
+      }
+    }
+  }
+
+  auto& last = chunks.back();
+  p->indexNext = last.indexNext;
+  p->ch = last.ch;
+  p->atEnd = last.atEnd;
+  if (withoutBraces) {
+    h->comment_braceless_end(ret, p, last.ciAfter, last.ciExtra);
+  } else {
+    _next(p);
+  }
+  if (isObject) {
+    h->object_end(ret);
+  } else {
+    h->array_end(ret);
+  }
+
+  *pResult = std::move(ret);
+  return true;
+}
+
+
+// Same as _readContainer() for the root Vector or Map, but the elements are
+// decoded on several threads if the input is large enough. Decodes the input
+// again on a single thread if that fails, so that the result and any syntax
+// error are exactly the same as when using a single thread.
+template<class B>
+static Value _readRootContainer(Parser *p, ParallelBuilder<B> *h,
+  bool isObject, bool withoutBraces)
+{
+  if (h->threads >= 2 && p->dataSize >= _parallelChunkSize * 2) {
+    auto indexNext = p->indexNext;
+    auto ch = p->ch;
+    auto atEnd = p->atEnd;
+    Value ret;
+    if (_readRootParallel(p, h, isObject, withoutBraces, &ret)) {
+      return ret;
+    }
+    p->indexNext = indexNext;
+    p->ch = ch;
+    p->atEnd = atEnd;
+  }
+
+  return _readContainer(p, static_cast<B*>(h), isObject, withoutBraces);
+}
+
+
+template<class H>
+static typename H::Result _readRootObject(Parser *p, H *h, bool withoutBraces) {
+  return _readObject(p, h, withoutBraces);
+}
+
+
+template<class H>
+static typename H::Result _readRootArray(Parser *p, H *h) {
+  return _readArray(p, h);
+}
+
+
+template<class B>
+static Value _readRootObject(Parser *p, ParallelBuilder<B> *h,
+  bool withoutBraces)
+{
+  return _readRootContainer(p, h, true, withoutBraces);
+}
+
+
+// assuming ch == '['
+template<class B>
+static Value _readRootArray(Parser *p, ParallelBuilder<B> *h) {
+  return _readRootContainer(p, h, false, false);
+}
+
+
+// Braces for the root object are optional
+template<class H>
+static typename H::Result _rootValue(Parser *p, H *h) {
+  typename H::Result ret;
+  CommentInfo ciExtra;
+
+  auto ciBefore = _white(p, h);
+
+  switch (p->ch) {
+  case '{':
+    ret = _readRootObject(p, h, false);
+    if (_hasTrailing(p, h, &ciExtra)) {
+      throw syntax_error(_errAt(p, "Syntax error, found trailing characters"));
+    }
+    break;
+  case '[':
+    ret = _readRootArray(p, h);
+    if (_hasTrailing(p, h, &ciExtra)) {
+      throw syntax_error(_errAt(p, "Syntax error, found trailing characters"));
+    }
+    break;
+  default:
+    {
+      // Assume we have a root object without braces, unless the whole input
+      // is a single JSON value (true/false/null/num/""). Find out which it is
+      // before any events are sent to the real handler.
+      auto indexNext = p->indexNext;
+      auto ch = p->ch;
+      NullHandler nh;
+      bool singleOk = false, singleThrew = false;
+      std::exception_ptr singleError;
+
+      if (p->ch > 0) {
+        try {
+          _readValue(p, &nh);
+          singleOk = !_hasTrailing(p, &nh, &ciExtra);
+          if (!singleOk) {
+            singleError = std::make_exception_ptr(syntax_error(_errAt(p,
+              "Syntax error, found trailing characters")));
+          }
+        } catch (...) {
+          singleThrew = true;
+          singleError = std::current_exception();
+        }
+        p->indexNext = indexNext;
+        p->ch = ch;
+      }
+
+      if (singleOk) {
+        // A braceless root object still has precedence.
+        try {
+          _readObject(p, &nh, true);
+          singleOk = _hasTrailing(p, &nh, &ciExtra);
+        } catch (const depth_error&) {
+          throw;
+        } catch (const syntax_error&) {
+        }
+        p->indexNext = indexNext;
+        p->ch = ch;
+      }
+
+      if (singleOk) {
+        ret = _readValue(p, h);
+        _hasTrailing(p, h, &ciExtra);
+        break;
+      }
+
+      try {
+        ret = _readRootObject(p, h, true);
+      } catch (const depth_error&) {
+        throw;
+      } catch (const syntax_error&) {
+        if (singleThrew) {
+          std::rethrow_exception(singleError);
+        }
+        throw;
+      }
+      if (_hasTrailing(p, h, &ciExtra)) {
+        std::rethrow_exception(singleError);
+      }
+      // if there were no braces, the first comment belongs to the first child
+      // of the root object, not to the root object itself.
+      h->comment_braceless_root(ret, p, ciBefore);
+    }
+    break;
+  }
+
+  h->comment_root(ret, p, ciBefore, ciExtra);
+
+  return ret;
+}
+
+
+// Reads the comments after a document that starts with a bracket. Like for
+// the trailing comments of _rootValue(), but only until the end of the line
+// unless no other document follows.
+static CommentInfo _documentEnd(Parser *p) {
+  auto indexNext = p->indexNext;
+  auto ch = p->ch;
+
+  auto ci = _white(p);
+  if (p->ch > 0) {
+    p->indexNext = indexNext;
+    p->ch = ch;
+    ci = _getCommentAfter(p);
+    // The same as what _white() would have found in the same range.
+    if (p->opt.whitespaceAsComments && ci.cmEnd == ci.cmStart) {
+      ci.hasComment = false;
+    }
+  }
+
+  return ci;
+}
+
+
+// Finds the end of a document that does not start with a bracket: the end of
+// the line before the first empty line (containing only whitespace) that is
+// not inside a multiline string, or the end of the data if only whitespace
+// and comments follow. Sets p->atEnd if the end of the data was reached.
+// assuming ch is the first char of the document
+static size_t _bracelessEnd(Parser *p) {
+  const char *data = reinterpret_cast<const char*>(p->data);
+  size_t pos = p->indexNext - 1;
+  bool inMLString = false;
+
+  for (;;) {
+    auto lf = static_cast<const char*>(
+      std::memchr(data + pos, '\n', p->dataSize - pos));
+    size_t eol = lf ? lf - data : p->dataSize;
+    for (size_t a = pos; a + 2 < eol; ++a) {
+      if (data[a] == '\'' && data[a + 1] == '\'' && data[a + 2] == '\'') {
+        inMLString = !inMLString;
+        a += 2;
+      }
+    }
+    if (eol == p->dataSize) {
+      p->atEnd = true;
+      return eol;
+    }
+
+    pos = eol + 1;
+    size_t a = pos;
+    while (a < p->dataSize && (data[a] == ' ' || data[a] == '\t' ||
+      data[a] == '\r'))
+    {
+      ++a;
+    }
+    if (!inMLString && (a == p->dataSize || data[a] == '\n')) {
+      Parser sp = *p;
+      sp.indexNext = eol;
+      _next(&sp);
+      _white(&sp);
+      if (sp.ch > 0) {
+        return eol;
+      }
+      p->atEnd = true;
+      return p->dataSize;
+    }
+  }
+}
+
+
+// Reads the next document of a sequence, where each document starts at the end
+// of the previous one, into *pResult. A document that starts with a bracket
+// ends at the matching bracket, any other document at the next empty line.
+// The result is the same as from _rootValue() for the part of the input from
+// the end of the previous document to the end of this document, including the
+// comments after it on the same line. Returns false if only whitespace and
+// comments are left.
+template<class H>
+static bool _readDocument(Parser *p, H *h, typename H::Result *pResult) {
+  auto indexNext = p->indexNext;
+  auto ch = p->ch;
 
-  // Skip '['.
-  _next(p);
   auto ciBefore = _white(p);
+  if (p->ch == 0) {
+    return false;
+  }
+
+  if (p->ch == '{' || p->ch == '[') {
+    h->comment(p, ciBefore);
+    auto ret = _readContainer(p, h, p->ch == '{', false);
+    auto ciExtra = _documentEnd(p);
+    h->comment(p, ciExtra);
+    h->comment_root(ret, p, ciBefore, ciExtra);
+    *pResult = std::move(ret);
+    return true;
+  }
+
+  // Let _rootValue() tell a root object without braces from a single value,
+  // as if the document was all of the input.
+  size_t end = _bracelessEnd(p);
+  size_t dataSize = p->dataSize;
+  p->dataSize = end;
+  p->indexNext = indexNext;
+  p->ch = ch;
+  try {
+    *pResult = _rootValue(p, h);
+  } catch (...) {
+    p->dataSize = dataSize;
+    throw;
+  }
+  p->dataSize = dataSize;
+  p->indexNext = end;
+  _next(p);
+
+  return true;
+}
+
+
+// Unmarshal parses the Hjson-encoded data and returns a tree of Values.
+//
+// Unmarshal uses the inverse of the encodings that Marshal uses.
+//
+template<class H>
+static Value _buildTree(Parser *p, H *h) {
+  if (p->opt.arena) {
+    ArenaScope scope(p->dataSize);
+    return _rootValue(p, h);
+  }
+
+  return _rootValue(p, h);
+}
+
+
+// Builds the tree with B, or with ParallelBuilder<B> if more than one thread
+// may be used.
+template<class B>
+static Value _decode(Parser *p, int threads) {
+  std::vector<size_t> *keptSizes = p->scratch ? &p->scratch->mapSizes :
+    nullptr;
+
+  if (threads > 1) {
+    ParallelBuilder<B> builder;
+    builder.threads = threads;
+    Borrow<std::vector<size_t>> borrow(keptSizes, builder.map_sizes());
+    auto ret = _buildTree(p, &builder);
+    builder.document_end(p);
+    return ret;
+  }
+
+  B builder;
+  Borrow<std::vector<size_t>> borrow(keptSizes, builder.map_sizes());
+  auto ret = _buildTree(p, &builder);
+  builder.document_end(p);
+  return ret;
+}
+
+
+// Decodes the root of a lazily decoded document.
+template<class B>
+static Value _decodeLazyRoot(Parser *p, const std::shared_ptr<LazyDocument>& doc) {
+  LazyBuilder<B> builder;
+  builder.doc = doc;
+  builder.next = 0;
+
+  return _buildTree(p, &builder);
+}
+
+
+// Decodes the elements of a Vector or Map in a lazily decoded document.
+template<class B>
+static Value _decodeLazy(Parser *p, const std::shared_ptr<LazyDocument>& doc,
+  size_t container)
+{
+  LazyBuilder<B> builder;
+  builder.doc = doc;
+  builder.next = container;
+
+  std::unique_ptr<ArenaScope> scope;
+  if (p->opt.arena) {
+    auto& c = doc->containers[container];
+    scope.reset(new ArenaScope(c.end + 1 - c.begin));
+  }
+
+  if (p->ch == '{') {
+    return _readObject(p, &builder, false);
+  }
+
+  return _readArray(p, &builder);
+}
+
+
+Value decodeLazy(const std::shared_ptr<LazyDocument>& doc, size_t container) {
+  Parser parser = {
+    (const unsigned char*) doc->data.data(),
+    doc->data.size(),
+    doc->containers[container].begin,
+    ' ',
+    doc->opt,
+    false,
+    0,
+    0,
+    nullptr,
+    0,
+    nullptr
+  };
+
+  _next(&parser);
+
+  if (parser.opt.comments) {
+    return _decodeLazy<CommentTreeBuilder>(&parser, doc, container);
+  }
+
+  return _decodeLazy<TreeBuilder>(&parser, doc, container);
+}
+
+
+// Validates and indexes the input in a first pass, then decodes the root.
+static Value _unmarshalLazy(const char *data, size_t dataSize,
+  const DecoderOptions& options)
+{
+  auto doc = std::make_shared<LazyDocument>();
+  doc->data.assign(data, dataSize);
+  doc->opt = options;
+
+  Parser parser = {
+    (const unsigned char*) doc->data.data(),
+    doc->data.size(),
+    0,
+    ' ',
+    doc->opt,
+    false,
+    0,
+    0,
+    nullptr,
+    0,
+    nullptr
+  };
+
+  _resetAt(&parser);
+
+  IndexHandler ih(&parser, doc.get());
+  _rootValue(&parser, &ih);
+
+  _resetAt(&parser);
+
+  if (parser.opt.comments) {
+    return _decodeLazyRoot<CommentTreeBuilder>(&parser, doc);
+  }
+
+  return _decodeLazyRoot<TreeBuilder>(&parser, doc);
+}
+
+
+static Value _unmarshal(const char *data, size_t dataSize,
+  const DecoderOptions& options, DecodeScratch *scratch)
+{
+  Parser parser = {
+    (const unsigned char*) data,
+    dataSize,
+    0,
+    ' ',
+    options,
+    false,
+    0,
+    0,
+    nullptr,
+    0,
+    scratch
+  };
+
+  if (parser.opt.whitespaceAsComments) {
+    parser.opt.comments = true;
+  }
+
+  if (parser.opt.lazy) {
+    return _unmarshalLazy(data, dataSize, parser.opt);
+  }
+
+  _resetAt(&parser);
+
+  int threads = parser.opt.threads;
+  if (threads < 1) {
+    threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  }
+
+  if (parser.opt.stats && parser.opt.statsPhaseTimes) {
+    if (parser.opt.comments) {
+      return _decode<StatsBuilder<CommentTreeBuilder, true> >(&parser, threads);
+    }
+
+    return _decode<StatsBuilder<TreeBuilder, true> >(&parser, threads);
+  }
+
+  if (parser.opt.stats) {
+    if (parser.opt.comments) {
+      return _decode<StatsBuilder<CommentTreeBuilder, false> >(&parser, threads);
+    }
+
+    return _decode<StatsBuilder<TreeBuilder, false> >(&parser, threads);
+  }
+
+  if (parser.opt.comments) {
+    return _decode<CommentTreeBuilder>(&parser, threads);
+  }
+
+  return _decode<TreeBuilder>(&parser, threads);
+}
+
+
+Value Unmarshal(const char *data, size_t dataSize, const DecoderOptions& options) {
+  return _unmarshal(data, dataSize, options, nullptr);
+}
+
+
+Value Unmarshal(const char *data, const DecoderOptions& options) {
+  if (!data) {
+    return Value();
+  }
+
+  return Unmarshal(data, std::strlen(data), options);
+}
+
+
+Value Unmarshal(const std::string &data, const DecoderOptions& options) {
+  return Unmarshal(data.c_str(), data.size(), options);
+}
+
+
+class Decoder::Impl {
+public:
+  DecoderOptions opt;
+  DecodeScratch scratch;
+};
+
+
+Decoder::Decoder(const DecoderOptions& options)
+  : prv(new Impl())
+{
+  prv->opt = options;
+}
+
+
+Decoder::~Decoder() {
+}
+
+
+Value Decoder::unmarshal(const char *data, size_t dataSize) {
+  try {
+    return _unmarshal(data, dataSize, prv->opt, &prv->scratch);
+  } catch (...) {
+    // Release the Values of the containers that were open at the error.
+    prv->scratch.frames.clear();
+    throw;
+  }
+}
+
+
+Value Decoder::unmarshal(const char *data) {
+  if (!data) {
+    return Value();
+  }
+
+  return unmarshal(data, std::strlen(data));
+}
+
+
+Value Decoder::unmarshal(const std::string &data) {
+  return unmarshal(data.c_str(), data.size());
+}
+
+
+DecoderHandler::~DecoderHandler() {
+}
+
+
+void DecoderHandler::on_object_begin() {
+}
+
+
+void DecoderHandler::on_object_end() {
+}
+
+
+void DecoderHandler::on_array_begin() {
+}
+
+
+void DecoderHandler::on_array_end() {
+}
+
+
+void DecoderHandler::on_key(const char*, size_t) {
+}
+
+
+void DecoderHandler::on_string(const char*, size_t) {
+}
+
+
+void DecoderHandler::on_int64(std::int64_t) {
+}
+
+
+void DecoderHandler::on_double(double) {
+}
+
+
+void DecoderHandler::on_bool(bool) {
+}
+
+
+void DecoderHandler::on_null() {
+}
+
+
+void DecoderHandler::on_comment(const char*, size_t) {
+}
+
+
+void Unmarshal(const char *data, size_t dataSize, DecoderHandler& handler,
+  const DecoderOptions& options)
+{
+  Parser parser = {
+    (const unsigned char*) data,
+    dataSize,
+    0,
+    ' ',
+    options,
+    false,
+    0,
+    0,
+    nullptr,
+    0,
+    nullptr
+  };
 
-  if (p->ch == ']') {
-    _setComment(array, &Value::set_comment_inside, p, ciBefore);
-    _next(p);
-    return array; // empty array
+  if (parser.opt.whitespaceAsComments) {
+    parser.opt.comments = true;
+  }
+
+  _resetAt(&parser);
+
+  EventHandler eh(handler);
+  _rootValue(&parser, &eh);
+}
+
+
+void Unmarshal(const std::string &data, DecoderHandler& handler,
+  const DecoderOptions& options)
+{
+  Unmarshal(data.c_str(), data.size(), handler, options);
+}
+
+
+void UnmarshalTarget(const char *data, size_t dataSize,
+  const BindTarget& target, const DecoderOptions& options)
+{
+  Parser parser = {
+    (const unsigned char*) data,
+    dataSize,
+    0,
+    ' ',
+    options,
+    false,
+    0,
+    0,
+    nullptr,
+    0,
+    nullptr
+  };
+
+  // The comments are not stored anywhere.
+  parser.opt.comments = false;
+  parser.opt.whitespaceAsComments = false;
+
+  _resetAt(&parser);
+
+  BindHandler bh(target);
+  _rootValue(&parser, &bh);
+}
+
+
+std::uint64_t bindHash(const char *str, size_t strSize) {
+  std::uint64_t hash = 14695981039346656037ULL;
+
+  for (size_t a = 0; a < strSize; ++a) {
+    hash = (hash ^ static_cast<unsigned char>(str[a])) * 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+
+// The index is an open addressing hash table with linear probing, with at
+// least twice as many slots as there are fields. Each slot contains the
+// position of a field plus one, or zero if the slot is empty.
+BindFields::BindFields(const BindField *_fields, size_t _count)
+  : fields(_fields),
+  count(_count)
+{
+  size_t size = 4;
+  while (size < count * 2) {
+    size *= 2;
+  }
+  index.resize(size);
+
+  for (size_t a = 0; a < count; ++a) {
+    size_t slot = fields[a].hash & (size - 1);
+    while (index[slot]) {
+      slot = (slot + 1) & (size - 1);
+    }
+    index[slot] = static_cast<unsigned short>(a + 1);
+  }
+}
+
+
+const BindField *BindFields::find(const char *key, size_t keySize) const {
+  auto hash = bindHash(key, keySize);
+  size_t mask = index.size() - 1;
+
+  for (size_t slot = hash & mask; index[slot]; slot = (slot + 1) & mask) {
+    auto& field = fields[index[slot] - 1];
+    if (field.hash == hash && field.nameSize == keySize &&
+      !std::memcmp(field.name, key, keySize))
+    {
+      return &field;
+    }
+  }
+
+  return nullptr;
+}
+
+
+// A read-only view of the entire contents of a file. The file is memory mapped
+// if possible, so that it can be parsed straight from the mapped pages.
+// Otherwise the file is read into memory with a single bulk read.
+class FileView {
+public:
+  const char *data;
+  size_t size;
+
+  FileView(const std::string &path);
+  ~FileView();
+
+private:
+  std::string buf;
+  void *map;
+#if defined(_WIN32)
+  HANDLE hFile, hMapping;
+#endif
+
+  FileView(const FileView&) = delete;
+  FileView& operator=(const FileView&) = delete;
+
+  void readAll(const std::string &path);
+};
+
+
+#if defined(_WIN32)
+
+FileView::FileView(const std::string &path)
+  : data(nullptr),
+  size(0),
+  map(nullptr),
+  hFile(INVALID_HANDLE_VALUE),
+  hMapping(nullptr)
+{
+  hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+    OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+  if (hFile == INVALID_HANDLE_VALUE) {
+    throw file_error("Could not open file '" + path + "' for reading");
+  }
+
+  LARGE_INTEGER fileSize;
+  if (GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart > 0 &&
+    static_cast<unsigned long long>(fileSize.QuadPart) <= SIZE_MAX)
+  {
+    hMapping = CreateFileMappingA(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (hMapping) {
+      map = MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (map) {
+      data = static_cast<const char*>(map);
+      size = static_cast<size_t>(fileSize.QuadPart);
+      return;
+    }
+  }
+
+  readAll(path);
+}
+
+
+FileView::~FileView() {
+  if (map) {
+    UnmapViewOfFile(map);
+  }
+  if (hMapping) {
+    CloseHandle(hMapping);
+  }
+  if (hFile != INVALID_HANDLE_VALUE) {
+    CloseHandle(hFile);
+  }
+}
+
+#else
+
+FileView::FileView(const std::string &path)
+  : data(nullptr),
+  size(0),
+  map(nullptr)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw file_error("Could not open file '" + path + "' for reading");
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+    static_cast<unsigned long long>(st.st_size) <= SIZE_MAX)
+  {
+    void *p = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+      MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+#if defined(MADV_SEQUENTIAL)
+      madvise(p, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+#endif
+      map = p;
+      data = static_cast<const char*>(p);
+      size = static_cast<size_t>(st.st_size);
+    }
+  }
+
+  // The mapping stays valid after the file descriptor has been closed.
+  close(fd);
+
+  if (!map) {
+    readAll(path);
+  }
+}
+
+
+FileView::~FileView() {
+  if (map) {
+    munmap(map, size);
+  }
+}
+
+#endif
+
+
+void FileView::readAll(const std::string &path) {
+  std::ifstream infile(path, std::ifstream::ate | std::ifstream::binary);
+  if (!infile.is_open()) {
+    throw file_error("Could not open file '" + path + "' for reading");
+  }
+  std::streamoff len = infile.tellg();
+  if (len > 0) {
+    buf.resize(static_cast<size_t>(len));
+    infile.seekg(0, std::ios::beg);
+    infile.read(&buf[0], buf.size());
+    buf.resize(static_cast<size_t>(infile.gcount()));
+  }
+  data = buf.data();
+  size = buf.size();
+}
+
+
+// The size of the contents of the file without trailing null chars and
+// without the last line break.
+static size_t _fileDataSize(const FileView& file) {
+  size_t len = file.size;
+
+  while (len > 0 && file.data[len - 1] == '\0') {
+    --len;
+  }
+
+  if (len > 0 && file.data[len - 1] == '\n') {
+    --len;
+  }
+  if (len > 0 && file.data[len - 1] == '\r') {
+    --len;
+  }
+
+  return len;
+}
+
+
+Value UnmarshalFromFile(const std::string &path, const DecoderOptions& options) {
+  FileView file(path);
+
+  return Unmarshal(file.data, _fileDataSize(file), options);
+}
+
+
+// Streams are read in blocks of at least this size.
+static const size_t _documentBlockSize = 1 << 16;
+
+
+// The state of a DocumentReader. Input from a stream is read into buf, from
+// which the input before the current document is discarded (except for the
+// current line, like in IncrementalDecoder) when that is cheaper than what has
+// already been read. A document that reaches beyond the input read so far is
+// read again after the next block has been appended, and each block is at
+// least as large as the part of the document read so far, so the time spent
+// on reading again stays proportional to the size of the document.
+class DocumentReader::Impl {
+public:
+  DecoderOptions opt;
+  std::unique_ptr<FileView> file;
+  // The stream, or null if the whole input is in memory.
+  std::streambuf *sb;
+  std::string buf;
+  bool started;
+  bool eof;
+  // Set when the last document has been read, or after an exception.
+  bool done;
+  std::string cutLineHead;
+  DecodeScratch scratch;
+  Parser p;
+
+  Impl(const DecoderOptions& options, std::streambuf *sb)
+    : opt(options),
+    sb(sb),
+    started(false),
+    eof(false),
+    done(false)
+  {
+    if (opt.whitespaceAsComments) {
+      opt.comments = true;
+    }
+    p = Parser{ nullptr, 0, 0, ' ', opt, false, 0, 0, &cutLineHead, 0,
+      &scratch };
+  }
+
+  void setData(const char *data, size_t dataSize) {
+    p.data = reinterpret_cast<const unsigned char*>(data);
+    p.dataSize = dataSize;
+  }
+
+  // Appends the next block from the stream to buf.
+  void fill() {
+    size_t size = buf.size();
+    size_t start = p.indexNext ? p.indexNext - 1 : 0;
+    size_t want = std::max(_documentBlockSize, size - std::min(start, size));
+    buf.resize(size + want);
+    std::streamsize got = sb->sgetn(&buf[size], static_cast<std::streamsize>(want));
+    if (got <= 0) {
+      got = 0;
+      eof = true;
+    }
+    buf.resize(size + static_cast<size_t>(got));
+    setData(buf.data(), buf.size());
+  }
+
+  // Discards the input before the current document, except for the current
+  // line unless it is very long.
+  void compact() {
+    size_t cur = p.indexNext - 1;
+    if (cur > buf.size() || cur < 4096 || cur < buf.size() - cur) {
+      return;
+    }
+
+    size_t keep = cur;
+    size_t lineLimit = cur > 1024 ? cur - 1024 : 0;
+    for (size_t i = cur; i > lineLimit; --i) {
+      if (buf[i - 1] == '\n') {
+        keep = i - 1;
+        break;
+      }
+    }
+
+    if (keep == cur) {
+      auto pos = buf.rfind('\n', cur - 1);
+      if (pos == std::string::npos) {
+        p.cutLineLen += cur;
+      } else {
+        p.cutLineLen = cur - pos - 1;
+        cutLineHead = buf.substr(pos, 20);
+      }
+    } else {
+      p.cutLineLen = 0;
+    }
+
+    p.linesBefore += std::count(buf.begin() + 1, buf.begin() + keep + 1, '\n');
+    buf.erase(0, keep);
+    p.indexNext -= keep;
+    setData(buf.data(), buf.size());
+  }
+
+  // Returns false if there cannot be any more documents.
+  bool begin() {
+    if (done) {
+      return false;
+    }
+
+    if (sb) {
+      if (!started) {
+        fill();
+        _resetAt(&p);
+      } else {
+        compact();
+      }
+    } else if (!started) {
+      _resetAt(&p);
+    }
+    started = true;
+
+    return true;
+  }
+
+  // Runs f, which reads a document from the current position. Returns false
+  // if f needed input that has not been read from the stream yet, in which
+  // case the position has been restored and more input has been read.
+  template<class F>
+  bool attempt(F f) {
+    auto indexNext = p.indexNext;
+    p.atEnd = false;
+
+    try {
+      f();
+      if (!sb || eof || !p.atEnd) {
+        return true;
+      }
+    } catch (const syntax_error&) {
+      // Make sure that the error message is the same as for the whole
+      // input, which also shows the input following the error position.
+      if (!sb || eof || !(p.atEnd || p.indexNext + 20 > p.dataSize)) {
+        throw;
+      }
+    }
+
+    p.indexNext = indexNext - 1;
+    fill();
+    _next(&p);
+
+    return false;
+  }
+
+  template<class B>
+  bool next(Value& doc) {
+    for (;;) {
+      B builder;
+      Borrow<std::vector<size_t>> borrow(&scratch.mapSizes,
+        builder.map_sizes());
+      std::unique_ptr<ArenaScope> scope;
+      if (opt.arena) {
+        scope.reset(new ArenaScope(0));
+      }
+      Value ret;
+      bool found = false;
+
+      if (attempt([&]() { found = _readDocument(&p, &builder, &ret); })) {
+        if (!found) {
+          done = true;
+          return false;
+        }
+        builder.document_end(&p);
+        doc.assign_with_comments(std::move(ret));
+        return true;
+      }
+    }
+  }
+
+  bool next(Value& doc) {
+    if (!begin()) {
+      return false;
+    }
+
+    if (opt.comments) {
+      return next<CommentTreeBuilder>(doc);
+    }
+
+    return next<TreeBuilder>(doc);
+  }
+
+  bool next(DecoderHandler& handler) {
+    if (!begin()) {
+      return false;
+    }
+
+    if (sb) {
+      // The handler must not receive the events of a document twice, so
+      // first make sure that all of it has been read from the stream.
+      auto indexNext = p.indexNext;
+      bool found = false;
+      while (!attempt([&]() {
+        NullHandler nh;
+        NullHandler::Result ret;
+        found = _readDocument(&p, &nh, &ret);
+      })) {
+      }
+      if (!found) {
+        done = true;
+        return false;
+      }
+      p.indexNext = indexNext - 1;
+      _next(&p);
+    }
+
+    EventHandler eh(handler);
+    NullHandler::Result ret;
+    if (!_readDocument(&p, &eh, &ret)) {
+      done = true;
+      return false;
+    }
+
+    return true;
+  }
+};
+
+
+DocumentReader::DocumentReader(const char *data, size_t dataSize,
+  const DecoderOptions& options)
+  : prv(new Impl(options, nullptr))
+{
+  prv->setData(data, dataSize);
+}
+
+
+DocumentReader::DocumentReader(std::istream& in, const DecoderOptions& options)
+  : prv(new Impl(options, in.rdbuf()))
+{
+  if (!prv->sb) {
+    prv->setData(nullptr, 0);
+  }
+}
+
+
+DocumentReader::DocumentReader(DocumentReader&&) = default;
+
+
+DocumentReader& DocumentReader::operator=(DocumentReader&&) = default;
+
+
+DocumentReader::~DocumentReader() {
+}
+
+
+DocumentReader DocumentReader::fromFile(const std::string& path,
+  const DecoderOptions& options)
+{
+  DocumentReader reader(nullptr, 0, options);
+  reader.prv->file.reset(new FileView(path));
+  reader.prv->setData(reader.prv->file->data,
+    _fileDataSize(*reader.prv->file));
+
+  return reader;
+}
+
+
+bool DocumentReader::next(Value& doc) {
+  try {
+    return prv->next(doc);
+  } catch (...) {
+    prv->done = true;
+    throw;
+  }
+}
+
+
+bool DocumentReader::next(DecoderHandler& handler) {
+  try {
+    return prv->next(handler);
+  } catch (...) {
+    prv->done = true;
+    throw;
+  }
+}
+
+
+// The position of a document found by the pre-scan of UnmarshalDocuments().
+class DocumentStart {
+public:
+  size_t indexNext;
+  unsigned char ch;
+};
+
+
+// Finds all documents in a first pass, then decodes them concurrently in
+// chunks, like the elements of a root container in _readRootElements().
+template<class B>
+static std::vector<Value> _readDocuments(Parser *p, int threads) {
+  std::vector<DocumentStart> starts;
+  {
+    NullHandler nh;
+    NullHandler::Result ret;
+    for (;;) {
+      DocumentStart start = { p->indexNext, p->ch };
+      if (!_readDocument(p, &nh, &ret)) {
+        break;
+      }
+      starts.push_back(start);
+    }
+  }
+
+  auto docEnd = [&](size_t a) {
+    return a + 1 < starts.size() ? starts[a + 1].indexNext - 1 : p->dataSize;
+  };
+
+  // Divide the documents into chunks, by size in the input.
+  std::vector<size_t> chunkStart(1, 0);
+  size_t chunkBytes = std::max(_parallelChunkSize,
+    p->dataSize / (size_t(threads) * 4));
+  for (size_t a = 1; a < starts.size(); ++a) {
+    if (starts[a].indexNext - starts[chunkStart.back()].indexNext >= chunkBytes) {
+      chunkStart.push_back(a);
+    }
+  }
+  chunkStart.push_back(starts.size());
+  size_t chunkCount = chunkStart.size() - 1;
+
+  std::vector<Value> res(starts.size());
+  std::vector<std::exception_ptr> errors(chunkCount);
+  std::atomic<size_t> nextChunk(0);
+
+  auto work = [&]() {
+    std::vector<size_t> mapSizes;
+    for (size_t chunk; (chunk = nextChunk++) < chunkCount;) {
+      try {
+        std::unique_ptr<ArenaScope> scope;
+        if (p->opt.arena) {
+          scope.reset(new ArenaScope(chunkBytes * 2));
+        }
+        for (size_t a = chunkStart[chunk]; a < chunkStart[chunk + 1]; ++a) {
+          Parser ep = *p;
+          ep.dataSize = docEnd(a);
+          ep.indexNext = starts[a].indexNext;
+          ep.ch = starts[a].ch;
+          B builder;
+          Borrow<std::vector<size_t>> borrow(&mapSizes, builder.map_sizes());
+          Value val;
+          _readDocument(&ep, &builder, &val);
+          builder.document_end(&ep);
+          res[a].assign_with_comments(std::move(val));
+        }
+      } catch (...) {
+        errors[chunk] = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  try {
+    for (size_t a = 1; a < std::min(size_t(threads), chunkCount); ++a) {
+      workers.emplace_back(work);
+    }
+  } catch (const std::system_error&) {
+    // Use the threads that could be started.
+  }
+  work();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  for (auto& error : errors) {
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  return res;
+}
+
+
+std::vector<Value> UnmarshalDocuments(const char *data, size_t dataSize,
+  const DecoderOptions& options)
+{
+  int threads = options.threads;
+  if (threads < 1) {
+    threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
   }
 
-  CommentInfo ciExtra = {};
+  std::vector<Value> res;
 
-  while (p->ch > 0) {
-    auto elem = _readValue(p);
-    _setComment(elem, &Value::set_comment_before, p, ciBefore, ciExtra);
-    auto ciAfter = _white(p);
-    // in Hjson the comma is optional and trailing commas are allowed
-    if (p->ch == ',') {
-      _next(p);
-      // It is unlikely that someone writes a comment after the value but
-      // before the comma, so we include any such comment in "comment_after".
-      ciExtra = _white(p);
-    } else {
-      ciExtra = {};
-    }
-    if (p->ch == ']') {
-      auto existingAfter = elem.get_comment_after();
-      _setComment(elem, &Value::set_comment_after, p, ciAfter, ciExtra);
-      if (!existingAfter.empty()) {
-        elem.set_comment_after(existingAfter + elem.get_comment_after());
+  if (threads < 2 || dataSize < _parallelChunkSize * 2) {
+    DocumentReader reader(data, dataSize, options);
+    for (;;) {
+      Value doc;
+      if (!reader.next(doc)) {
+        break;
       }
-      array.push_back(elem);
-      _next(p);
-      return array;
+      res.push_back(doc);
     }
-    array.push_back(elem);
-    ciBefore = ciAfter;
+    return res;
+  }
+
+  Parser parser = {
+    (const unsigned char*) data,
+    dataSize,
+    0,
+    ' ',
+    options,
+    false,
+    0,
+    0,
+    nullptr,
+    0,
+    nullptr
+  };
+
+  if (parser.opt.whitespaceAsComments) {
+    parser.opt.comments = true;
+  }
+
+  _resetAt(&parser);
+
+  if (parser.opt.comments) {
+    return _readDocuments<CommentTreeBuilder>(&parser, threads);
   }
 
-  throw syntax_error(_errAt(p, "End of input while parsing an array (did you forget a closing ']'?)"));
+  return _readDocuments<TreeBuilder>(&parser, threads);
 }
 
 
-// Parse an object value.
-static Value _readObject(Parser *p, bool withoutBraces) {
-  Value object(Hjson::Type::Map);
+std::vector<Value> UnmarshalDocuments(const std::string& data,
+  const DecoderOptions& options)
+{
+  return UnmarshalDocuments(data.c_str(), data.size(), options);
+}
 
-  if (!withoutBraces) {
-    // assuming ch == '{'
-    _next(p);
+
+// The incremental decoder runs the same grammar as _rootValue(), _readObject(),
+// _readArray() and _readValue(), but keeps the stack of open containers in
+// `frames` instead of on the call stack. The parsing is divided into small
+// steps, where a leaf value (string, number, word) is parsed in a single step.
+// A step is only committed if it did not need to look beyond the end of the
+// input fed so far, otherwise it is run again when more input is available.
+class IncrementalDecoder::Impl {
+public:
+  enum class Stage {
+    Begin,
+    Member,
+    Value,
+    AfterValue
+  };
+
+  class Frame {
+  public:
+    Value container;
+    bool withoutBraces;
+    // False for the root container.
+    bool isValue;
+    Stage stage;
+    SavedComment ciBefore, ciExtra, ciKey, ciValue;
+    std::string key;
+    Value elem;
+  };
+
+  enum class State {
+    Root,
+    Frames,
+    Trailing,
+    SingleValue,
+    Done
+  };
+
+  DecoderOptions opt;
+  std::shared_ptr<Arena> arena;
+  // The part of the input that is still needed.
+  std::string buf;
+  Parser p;
+  State state;
+  std::vector<Frame> frames;
+  SavedComment rootBefore, rootExtra;
+  CommentBuffer cb;
+  Value result;
+  bool braceless;
+  // True for as long as a root without braces could turn out to be a single
+  // value (like in _rootValue()), in which case all input must be kept.
+  bool singlePossible;
+  size_t singleCheckAt;
+  // Once the root is known not to be a single value: the error that
+  // _rootValue() would have had for it, or null if it had none.
+  std::exception_ptr singleError;
+  // True if singleError is from reading the single value, false if it is
+  // for trailing characters after the single value.
+  bool singleThrew;
+  std::string errMsg;
+  std::string cutLineHead;
+  // Don't run a step that needed more input again until there is this much.
+  size_t retryAt;
+  bool finishing;
+
+  Impl(const DecoderOptions& options)
+    : opt(options)
+  {
+    if (opt.whitespaceAsComments) {
+      opt.comments = true;
+    }
+    reset();
   }
 
-  auto ciBefore = _white(p);
+  void reset() {
+    arena.reset();
+    buf.clear();
+    buf.shrink_to_fit();
+    p = Parser{ nullptr, 0, 0, ' ', opt, false, 0, 0, &cutLineHead, 0,
+      nullptr };
+    state = State::Root;
+    frames.clear();
+    rootBefore = SavedComment();
+    rootExtra = SavedComment();
+    cb = CommentBuffer();
+    result = Value();
+    braceless = false;
+    singlePossible = false;
+    singleCheckAt = 0;
+    singleError = nullptr;
+    singleThrew = false;
+    errMsg.clear();
+    cutLineHead.clear();
+    retryAt = 0;
+    finishing = false;
+  }
 
-  if (p->ch == '}' && !withoutBraces) {
-    _setComment(object, &Value::set_comment_inside, p, ciBefore);
-    _next(p);
-    return object; // empty object
+  bool needMore() {
+    return p.atEnd && !finishing;
+  }
+
+  // Throws if a nested Vector or Map at the current position would exceed
+  // DecoderOptions::maxDepth, like _readContainer().
+  void checkDepth() {
+    if (opt.maxDepth > 0 && frames.size() >= static_cast<size_t>(opt.maxDepth)) {
+      throw depth_error(_errAt(&p, "Exceeded the maximum depth of " +
+        std::to_string(opt.maxDepth) + " nested arrays and objects"));
+    }
   }
 
-  CommentInfo ciExtra = {};
+  void pushFrame(Type type, bool withoutBraces, bool isValue,
+    const SavedComment& ciValue)
+  {
+    Frame f;
+    f.container = Value(type);
+    f.withoutBraces = withoutBraces;
+    f.isValue = isValue;
+    f.stage = Stage::Begin;
+    f.ciValue = ciValue;
+    frames.push_back(std::move(f));
+  }
 
-  while (p->ch > 0) {
-    auto key = _readKeyname(p);
-    if (p->opt.duplicateKeyException && object[key].defined()) {
-      throw syntax_error(_errAt(p, "Found duplicate of key '" + key + "'"));
+  // Pops the finished container on top of the stack. If the container is a
+  // value in another container, ciAfter is its comment as read by the last
+  // part of _readValue().
+  void closeFrame(const CommentInfo *ciAfter) {
+    Frame f = std::move(frames.back());
+    frames.pop_back();
+
+    if (f.isValue) {
+      cb.set(f.container, CS_BEFORE, f.ciValue);
+      cb.set(f.container, CS_AFTER, &p, *ciAfter);
+      frames.back().elem.assign_with_comments(std::move(f.container));
+      frames.back().stage = Stage::AfterValue;
+    } else {
+      result = std::move(f.container);
+      state = State::Trailing;
     }
-    auto ciKey = _white(p);
-    if (p->ch != ':') {
-      throw syntax_error(_errAt(p, std::string(
-        "Expected ':' instead of '") + (char)(p->ch) + "'"));
+  }
+
+  bool stepRoot() {
+    _resetAt(&p);
+    auto ci = _white(&p);
+    if (needMore()) {
+      return false;
     }
-    _next(p);
-    // duplicate keys overwrite the previous value
-    auto elem = _readValue(p);
-    _setComment(elem, &Value::set_comment_key, p, ciKey);
-    if (!elem.get_comment_before().empty()) {
-      elem.set_comment_key(elem.get_comment_key() +
-        elem.get_comment_before());
-      elem.set_comment_before("");
-    }
-    _setComment(elem, &Value::set_comment_before, p, ciBefore, ciExtra);
-    auto ciAfter = _white(p);
-    // in Hjson the comma is optional and trailing commas are allowed
-    if (p->ch == ',') {
-      _next(p);
-      // It is unlikely that someone writes a comment after the value but
-      // before the comma, so we include any such comment in "comment_after".
-      ciExtra = _white(p);
-    } else {
-      ciExtra = {};
+
+    rootBefore = cb.save(&p, ci);
+    state = State::Frames;
+
+    switch (p.ch) {
+    case '{':
+      pushFrame(Type::Map, false, false, SavedComment());
+      break;
+    case '[':
+      pushFrame(Type::Vector, false, false, SavedComment());
+      break;
+    default:
+      // Assume we have a root object without braces.
+      braceless = true;
+      singlePossible = true;
+      pushFrame(Type::Map, true, false, SavedComment());
+      break;
     }
-    if (p->ch == '}' && !withoutBraces) {
-      auto existingAfter = elem.get_comment_after();
-      _setComment(elem, &Value::set_comment_after, p, ciAfter, ciExtra);
-      if (!existingAfter.empty()) {
-        elem.set_comment_after(existingAfter + elem.get_comment_after());
+
+    return true;
+  }
+
+  bool stepValue() {
+    auto ci = _white(&p);
+
+    if (p.ch == '{' || p.ch == '[') {
+      if (needMore()) {
+        return false;
       }
-      object[key].assign_with_comments(std::move(elem));
-      _next(p);
-      return object;
+      checkDepth();
+      frames.back().stage = Stage::AfterValue;
+      pushFrame(p.ch == '{' ? Type::Map : Type::Vector, false, true,
+        cb.save(&p, ci));
+      return true;
     }
-    object[key].assign_with_comments(std::move(elem));
-    ciBefore = ciAfter;
-  }
 
-  if (withoutBraces) {
-    if (object.empty()) {
-      _setComment(object, &Value::set_comment_inside, p, ciBefore);
-    } else {
-      _setComment(object[static_cast<int>(object.size() - 1)],
-        &Value::set_comment_after, p, ciBefore, ciExtra);
+    TreeBuilder builder;
+    auto ret = _readLeaf(&p, &builder);
+    auto ciAfter = _getCommentAfter(&p);
+    if (needMore()) {
+      return false;
     }
 
-    return object;
+    cb.set(ret, CS_BEFORE, &p, ci);
+    cb.set(ret, CS_AFTER, &p, ciAfter);
+    frames.back().elem.assign_with_comments(std::move(ret));
+    frames.back().stage = Stage::AfterValue;
+
+    return true;
   }
-  throw syntax_error(_errAt(p, "End of input while parsing an object (did you forget a closing '}'?)"));
-}
 
+  bool stepObject() {
+    Frame& f = frames.back();
 
-// Parse a Hjson value. It could be an object, an array, a string, a number or a word.
-static Value _readValue(Parser *p) {
-  Hjson::Value ret;
+    switch (f.stage) {
+    case Stage::Begin:
+      {
+        if (!f.withoutBraces) {
+          // Skip '{'.
+          _next(&p);
+        }
+        auto ci = _white(&p);
+        if (p.ch == '}' && !f.withoutBraces) {
+          _next(&p);
+          CommentInfo ciAfter = {};
+          if (f.isValue) {
+            ciAfter = _getCommentAfter(&p);
+          }
+          if (needMore()) {
+            return false;
+          }
+          cb.set(f.container, CS_INSIDE, &p, ci);
+          closeFrame(&ciAfter);
+          return true;
+        }
+        if (needMore()) {
+          return false;
+        }
+        f.ciBefore = cb.save(&p, ci);
+        f.ciExtra = SavedComment();
+        f.stage = Stage::Member;
+      }
+      return true;
 
-  auto ciBefore = _white(p);
+    case Stage::Member:
+      {
+        if (p.ch == 0) {
+          if (!f.withoutBraces) {
+            throw syntax_error(_errAt(&p, "End of input while parsing an object (did you forget a closing '}'?)"));
+          }
+          if (f.container.empty()) {
+            cb.set(f.container, CS_INSIDE, f.ciBefore);
+          } else {
+            cb.set(f.container[static_cast<int>(f.container.size() - 1)],
+              CS_AFTER, f.ciBefore, f.ciExtra);
+          }
+          closeFrame(nullptr);
+          return true;
+        }
+        std::string keyBuf;
+        auto key = _readKeyname(&p, keyBuf).str();
+        if (p.opt.duplicateKeyException && f.container.contains(key)) {
+          throw syntax_error(_errAt(&p, "Found duplicate of key '" + key + "'"));
+        }
+        auto ciKey = _white(&p);
+        if (p.ch != ':') {
+          throw syntax_error(_errAt(&p, std::string(
+            "Expected ':' instead of '") + (char)(p.ch) + "'"));
+        }
+        _next(&p);
+        if (needMore()) {
+          return false;
+        }
+        f.key = std::move(key);
+        f.ciKey = cb.save(&p, ciKey);
+        f.stage = Stage::Value;
+      }
+      return true;
 
-  switch (p->ch) {
-  case '{':
-    ret = _readObject(p, false);
-    break;
-  case '[':
-    ret = _readArray(p);
-    break;
-  case '"':
-  case '\'':
-    ret = _readString(p, true);
-    break;
-  default:
-    ret = _readTfnns(p);
-    break;
-  }
+    case Stage::Value:
+      return stepValue();
 
-  auto ciAfter = _getCommentAfter(p);
+    case Stage::AfterValue:
+      {
+        Value elem = f.elem;
+        cb.set(elem, CS_KEY, f.ciKey);
+        moveComment(elem, CS_KEY, CS_BEFORE);
+        cb.set(elem, CS_BEFORE, f.ciBefore, f.ciExtra);
+        auto ciAfter = _white(&p);
+        CommentInfo ciExtra = {};
+        // in Hjson the comma is optional and trailing commas are allowed
+        if (p.ch == ',') {
+          _next(&p);
+          ciExtra = _white(&p);
+        }
+        bool closing = (p.ch == '}' && !f.withoutBraces);
+        CommentInfo ciValAfter = {};
+        if (closing) {
+          cb.set(elem, CS_AFTER, &p, ciAfter, ciExtra, true);
+          _next(&p);
+          if (f.isValue) {
+            ciValAfter = _getCommentAfter(&p);
+          }
+        }
+        if (needMore()) {
+          return false;
+        }
+        f.container.insert_or_assign(std::move(f.key), std::move(elem));
+        f.elem = Value();
+        if (closing) {
+          closeFrame(&ciValAfter);
+        } else {
+          f.ciBefore = cb.save(&p, ciAfter);
+          f.ciExtra = cb.save(&p, ciExtra);
+          f.stage = Stage::Member;
+        }
+      }
+      return true;
+    }
 
-  _setComment(ret, &Value::set_comment_before, p, ciBefore);
-  _setComment(ret, &Value::set_comment_after, p, ciAfter);
+    return false;
+  }
 
-  return ret;
-}
+  bool stepArray() {
+    Frame& f = frames.back();
 
+    switch (f.stage) {
+    case Stage::Begin:
+      {
+        // Skip '['.
+        _next(&p);
+        auto ci = _white(&p);
+        if (p.ch == ']') {
+          _next(&p);
+          CommentInfo ciAfter = {};
+          if (f.isValue) {
+            ciAfter = _getCommentAfter(&p);
+          }
+          if (needMore()) {
+            return false;
+          }
+          cb.set(f.container, CS_INSIDE, &p, ci);
+          closeFrame(&ciAfter);
+          return true;
+        }
+        if (needMore()) {
+          return false;
+        }
+        f.ciBefore = cb.save(&p, ci);
+        f.ciExtra = SavedComment();
+        f.stage = Stage::Member;
+      }
+      return true;
 
-static Value _hasTrailing(Parser *p, CommentInfo *ci) {
-  *ci = _white(p);
-  return p->ch > 0;
-}
+    case Stage::Member:
+      if (p.ch == 0) {
+        throw syntax_error(_errAt(&p, "End of input while parsing an array (did you forget a closing ']'?)"));
+      }
+      return stepValue();
 
+    case Stage::Value:
+      return stepValue();
 
-// Braces for the root object are optional
-static Value _rootValue(Parser *p) {
-  Value ret;
-  std::string errMsg;
-  CommentInfo ciExtra;
+    case Stage::AfterValue:
+      {
+        Value elem = f.elem;
+        cb.set(elem, CS_BEFORE, f.ciBefore, f.ciExtra);
+        auto ciAfter = _white(&p);
+        CommentInfo ciExtra = {};
+        // in Hjson the comma is optional and trailing commas are allowed
+        if (p.ch == ',') {
+          _next(&p);
+          ciExtra = _white(&p);
+        }
+        bool closing = (p.ch == ']');
+        CommentInfo ciValAfter = {};
+        if (closing) {
+          cb.set(elem, CS_AFTER, &p, ciAfter, ciExtra, true);
+          _next(&p);
+          if (f.isValue) {
+            ciValAfter = _getCommentAfter(&p);
+          }
+        }
+        if (needMore()) {
+          return false;
+        }
+        f.container.push_back(elem);
+        f.elem = Value();
+        if (closing) {
+          closeFrame(&ciValAfter);
+        } else {
+          f.ciBefore = cb.save(&p, ciAfter);
+          f.ciExtra = cb.save(&p, ciExtra);
+          f.stage = Stage::Member;
+        }
+      }
+      return true;
+    }
 
-  auto ciBefore = _white(p);
+    return false;
+  }
 
-  switch (p->ch) {
-  case '{':
-    ret = _readObject(p, false);
-    if (_hasTrailing(p, &ciExtra)) {
-      throw syntax_error(_errAt(p, "Syntax error, found trailing characters"));
+  bool stepTrailing() {
+    auto ci = _white(&p);
+    if (needMore()) {
+      return false;
     }
-    break;
-  case '[':
-    ret = _readArray(p);
-    if (_hasTrailing(p, &ciExtra)) {
-      throw syntax_error(_errAt(p, "Syntax error, found trailing characters"));
+    if (p.ch > 0) {
+      if (braceless && singleError) {
+        // Like in _rootValue().
+        std::rethrow_exception(singleError);
+      }
+      throw syntax_error(_errAt(&p, "Syntax error, found trailing characters"));
     }
-    break;
+    rootExtra = cb.save(&p, ci);
+    state = State::Done;
+    return true;
   }
 
-  if (!ret.defined()) {
-    // assume we have a root object without braces
-    try {
-      ret = _readObject(p, true);
-      if (_hasTrailing(p, &ciExtra)) {
-        // Syntax error, or maybe a single JSON value.
-        ret = Value();
-      } else if (ret.size() > 0) {
-        // if there were no braces, the first comment belongs to the first child
-        // of the root object, not to the root object itself.
-        _setComment(ret[0], &Value::set_comment_before, p, ciBefore);
-        ciBefore = CommentInfo();
+  bool step() {
+    switch (state) {
+    case State::Root:
+      return stepRoot();
+    case State::Frames:
+      if (frames.back().container.type() == Type::Map) {
+        return stepObject();
       }
-    } catch(const syntax_error& e) {
-      errMsg = std::string(e.what());
+      return stepArray();
+    case State::Trailing:
+      return stepTrailing();
+    default:
+      return false;
     }
   }
 
-  if (!ret.defined()) {
-    // test if we are dealing with a single JSON value instead (true/false/null/num/"")
-    _resetAt(p);
-    ret = _readValue(p);
-    if (_hasTrailing(p, &ciExtra)) {
-      // Syntax error.
-      ret = Value();
+  // Discards the input before the current position, except for the current
+  // line (needed for the indentation of multiline strings and for error
+  // messages) unless it is very long.
+  void compact() {
+    if (finishing || singlePossible || state == State::Root) {
+      return;
     }
-  }
 
-  if (ret.defined()) {
-    _setComment(ret, &Value::set_comment_before, p, ciBefore);
-    auto existingAfter = ret.get_comment_after();
-    _setComment(ret, &Value::set_comment_after, p, ciExtra);
-    if (!existingAfter.empty()) {
-      ret.set_comment_after(existingAfter + ret.get_comment_after());
+    size_t cur = p.indexNext - 1;
+    // Only move the rest of the buffer when that is cheaper than what has
+    // already been parsed.
+    if (cur < 4096 || cur < buf.size() - cur) {
+      return;
     }
-    return ret;
+
+    size_t keep = cur;
+    size_t lineLimit = cur > 1024 ? cur - 1024 : 0;
+    for (size_t i = cur; i > lineLimit; --i) {
+      if (buf[i - 1] == '\n') {
+        keep = i - 1;
+        break;
+      }
+    }
+
+    if (keep == cur) {
+      auto pos = buf.rfind('\n', cur - 1);
+      if (pos == std::string::npos) {
+        p.cutLineLen += cur;
+      } else {
+        p.cutLineLen = cur - pos - 1;
+        cutLineHead = buf.substr(pos, 20);
+      }
+    } else {
+      p.cutLineLen = 0;
+    }
+
+    p.linesBefore += std::count(buf.begin() + 1, buf.begin() + keep + 1, '\n');
+    buf.erase(0, keep);
+    p.indexNext -= keep;
   }
 
-  if (!errMsg.empty()) {
-    throw syntax_error(errMsg);
+  // Returns false if it is certain that the root is not a single value. In
+  // that case also sets singleError and singleThrew, unless more input could
+  // still change the error message.
+  bool checkSingle() {
+    Parser sp = { reinterpret_cast<const unsigned char*>(buf.data()),
+      buf.size(), 0, ' ', opt, false, 0, 0, nullptr, 0, nullptr };
+    // The error message shows up to 20 chars from the start of the line.
+    auto isFinal = [&] {
+      return !sp.atEnd && sp.indexNext + 20 <= sp.dataSize;
+    };
+
+    try {
+      _resetAt(&sp);
+      NullHandler nh;
+      _readValue(&sp, &nh);
+      CommentInfo ci;
+      if (!_hasTrailing(&sp, &nh, &ci)) {
+        return true;
+      }
+      if (!isFinal()) {
+        return true;
+      }
+      singleError = std::make_exception_ptr(syntax_error(_errAt(&sp,
+        "Syntax error, found trailing characters")));
+      singleThrew = false;
+    } catch (const syntax_error&) {
+      if (!isFinal()) {
+        return true;
+      }
+      singleError = std::current_exception();
+      singleThrew = true;
+    }
+
+    return false;
   }
 
-  throw syntax_error(_errAt(p, "Syntax error, found trailing characters"));
-}
+  void run() {
+    while (state != State::SingleValue && state != State::Done) {
+      if (!finishing && buf.size() < retryAt) {
+        break;
+      }
 
+      p.data = reinterpret_cast<const unsigned char*>(buf.data());
+      p.dataSize = buf.size();
+      p.atEnd = false;
+      auto indexNext = p.indexNext;
+      auto ch = p.ch;
+      bool done;
+
+      try {
+        done = step();
+      } catch (const syntax_error& e) {
+        // Make sure that the error message is the same as from Unmarshal(),
+        // which also shows the input following the error position.
+        if (!finishing && (p.atEnd || p.indexNext + 20 > p.dataSize)) {
+          done = false;
+        } else if (singlePossible && !dynamic_cast<const depth_error*>(&e)) {
+          errMsg = e.what();
+          state = State::SingleValue;
+          break;
+        } else if (braceless && singleThrew &&
+          !dynamic_cast<const depth_error*>(&e))
+        {
+          // Like in _rootValue(), the error of the single value has
+          // precedence.
+          std::rethrow_exception(singleError);
+        } else {
+          throw;
+        }
+      }
 
-// Unmarshal parses the Hjson-encoded data and returns a tree of Values.
-//
-// Unmarshal uses the inverse of the encodings that Marshal uses.
-//
-Value Unmarshal(const char *data, size_t dataSize, const DecoderOptions& options) {
-  Parser parser = {
-    (const unsigned char*) data,
-    dataSize,
-    0,
-    ' ',
-    options
-  };
+      if (!done) {
+        p.indexNext = indexNext;
+        p.ch = ch;
+        size_t stepStart = indexNext ? indexNext - 1 : 0;
+        retryAt = buf.size() + std::max(static_cast<size_t>(1),
+          buf.size() - stepStart);
+        break;
+      }
 
-  if (parser.opt.whitespaceAsComments) {
-    parser.opt.comments = true;
+      retryAt = 0;
+      compact();
+    }
+
+    if (singlePossible && !finishing && buf.size() >= singleCheckAt) {
+      singlePossible = checkSingle();
+      singleCheckAt = buf.size() * 2;
+      if (!singlePossible && state == State::SingleValue) {
+        if (singleThrew) {
+          std::rethrow_exception(singleError);
+        }
+        throw syntax_error(errMsg);
+      }
+    }
   }
 
-  _resetAt(&parser);
-  return _rootValue(&parser);
-}
+  void feed(const char *data, size_t dataSize) {
+    if (state == State::Done) {
+      // Like Unmarshal(), ignore anything after a null character.
+      return;
+    }
 
+    if (opt.arena && !arena) {
+      arena = createArena(0);
+    }
+    ArenaUse use(arena.get());
 
-Value Unmarshal(const char *data, const DecoderOptions& options) {
-  if (!data) {
-    return Value();
+    buf.append(data, dataSize);
+    run();
   }
 
-  return Unmarshal(data, std::strlen(data), options);
+  Value finish() {
+    ArenaUse use(arena.get());
+
+    finishing = true;
+    run();
+
+    Value ret;
+
+    if (state == State::SingleValue) {
+      Parser sp = { reinterpret_cast<const unsigned char*>(buf.data()),
+        buf.size(), 0, ' ', opt, false, 0, 0, nullptr, 0, nullptr };
+      _resetAt(&sp);
+      if (opt.comments) {
+        CommentTreeBuilder builder;
+        ret = _rootValue(&sp, &builder);
+      } else {
+        TreeBuilder builder;
+        ret = _rootValue(&sp, &builder);
+      }
+    } else {
+      ret = result;
+      if (braceless && ret.size() > 0) {
+        // if there were no braces, the first comment belongs to the first child
+        // of the root object, not to the root object itself.
+        cb.set(ret[0], CS_BEFORE, rootBefore);
+        rootBefore = SavedComment();
+      }
+      cb.set(ret, CS_BEFORE, rootBefore);
+      cb.set(ret, CS_AFTER, rootExtra, true);
+    }
+
+    if (arena) {
+      sealArena(arena.get());
+    }
+
+    return ret;
+  }
+};
+
+
+IncrementalDecoder::IncrementalDecoder(const DecoderOptions& options)
+  : prv(new Impl(options))
+{
 }
 
 
-Value Unmarshal(const std::string &data, const DecoderOptions& options) {
-  return Unmarshal(data.c_str(), data.size(), options);
+IncrementalDecoder::~IncrementalDecoder() {
 }
 
 
-Value UnmarshalFromFile(const std::string &path, const DecoderOptions& options) {
-  std::ifstream infile(path, std::ifstream::ate | std::ifstream::binary);
-  if (!infile.is_open()) {
-    throw file_error("Could not open file '" + path + "' for reading");
+void IncrementalDecoder::feed(const char *data, size_t dataSize) {
+  try {
+    prv->feed(data, dataSize);
+  } catch (...) {
+    prv->reset();
+    throw;
   }
-  std::string inStr;
-  size_t len = infile.tellg();
-  inStr.resize(len);
-  infile.seekg(0, std::ios::beg);
-  infile.read(&inStr[0], inStr.size());
-  infile.close();
+}
 
-  while (len > 0 && inStr.at(len - 1) == '\0') {
-    --len;
-  }
 
-  if (len > 0 && inStr.at(len - 1) == '\n') {
-    --len;
-  }
-  if (len > 0 && inStr.at(len - 1) == '\r') {
-    --len;
-  }
+void IncrementalDecoder::feed(const std::string& data) {
+  feed(data.data(), data.size());
+}
+
 
-  return Unmarshal(inStr.c_str(), len, options);
+Value IncrementalDecoder::finish() {
+  try {
+    auto ret = prv->finish();
+    prv->reset();
+    return ret;
+  } catch (...) {
+    prv->reset();
+    throw;
+  }
 }
 
 
@@ -815,9 +4773,19 @@ StreamDecoder::StreamDecoder(Value& _v, const DecoderOptions& _o)
 
 
 std::istream &operator >>(std::istream& in, StreamDecoder& sd) {
-  std::string inStr{ std::istreambuf_iterator<char>(in),
-    std::istreambuf_iterator<char>() };
-  sd.v.assign_with_comments(Unmarshal(inStr, sd.o));
+  // Read straight from the stream buffer in large blocks, and parse each block
+  // as soon as it has been read. Like the istreambuf_iterator that was used
+  // before, this leaves the stream state untouched.
+  std::streambuf *sb = in.rdbuf();
+  IncrementalDecoder decoder(sd.o);
+  if (sb) {
+    std::vector<char> block(65536);
+    std::streamsize got;
+    while ((got = sb->sgetn(block.data(), block.size())) > 0) {
+      decoder.feed(block.data(), static_cast<size_t>(got));
+    }
+  }
+  sd.v.assign_with_comments(decoder.finish());
 
   return in;
 }
@@ -1,29 +1,239 @@
 #include "hjson.h"
-#include <sstream>
-#include <regex>
-#include <iomanip>
 #include <iostream>
 #include <fstream>
 #include <cmath>
 #include <cctype>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
 
 
 namespace Hjson {
 
 
-struct Encoder {
-  EncoderOptions opt;
+// The encoder output is collected in a contiguous buffer, that is handed over
+// as the result of Marshal() or (if os is set) flushed to a stream in large
+// chunks.
+class OutputBuffer {
+public:
+  std::string buf;
   std::ostream *os;
-  std::locale loc;
+  // The number of bytes flushed to os so far.
+  size_t flushed;
+  // If timeWrites is true, the time spent writing to os is added to
+  // writeSeconds.
+  bool timeWrites;
+  double writeSeconds;
+
+  explicit OutputBuffer(std::ostream *_os = nullptr)
+    : os(_os),
+    flushed(0),
+    timeWrites(false),
+    writeSeconds(0)
+  {
+  }
+
+  void write(const char *data, size_t size) {
+    buf.append(data, size);
+    if (os && buf.size() >= _flushSize) {
+      flush();
+    }
+  }
+
+  OutputBuffer& operator<<(const std::string& str) {
+    write(str.data(), str.size());
+    return *this;
+  }
+
+  OutputBuffer& operator<<(const StringRef& str) {
+    write(str.data(), str.size());
+    return *this;
+  }
+
+  OutputBuffer& operator<<(const char *sz) {
+    write(sz, std::strlen(sz));
+    return *this;
+  }
+
+  OutputBuffer& operator<<(char ch) {
+    buf.push_back(ch);
+    return *this;
+  }
+
+  void flush() {
+    if (os && !buf.empty()) {
+      if (timeWrites) {
+        auto start = std::chrono::steady_clock::now();
+        os->write(buf.data(), buf.size());
+        writeSeconds += std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start).count();
+      } else {
+        os->write(buf.data(), buf.size());
+      }
+      flushed += buf.size();
+      buf.clear();
+    }
+  }
+
+private:
+  static const size_t _flushSize = 1 << 16;
+};
+
+
+struct StrFrame;
+
+
+struct EncoderState {
+  EncoderOptions opt;
+  OutputBuffer *out;
   int indent;
-  std::regex needsEscape, needsQuotes, needsEscapeML, startsWithKeyword,
-    needsEscapeName, lineBreak;
+  // eol followed by indentBy repeated for as many levels as have been needed
+  // so far.
+  std::string indentCache;
+  int indentCacheLevels;
+  // The number of threads that may be used for encoding the elements of a
+  // large container. Always 1 in the encoders used by those threads.
+  int threads;
+  // Where the statistics are collected, or null. Each thread that encodes
+  // elements of a large container has its own.
+  EncoderStats *stats;
+  // The stack of _str() kept by an Encoder between calls, or null.
+  std::vector<StrFrame> *frames;
+  // True if the last value written was a quoteless string, that must not be
+  // followed by a comment on the same line.
+  bool afterQuoteless;
+};
+
+
+// Adds the time from its construction to its destruction to
+// e->stats->quoteSeconds, if e->stats is set and
+// EncoderOptions::statsPhaseTimes is true.
+class QuoteTimer {
+  EncoderStats *stats;
+  std::chrono::steady_clock::time_point start;
+
+public:
+  explicit QuoteTimer(const EncoderState *e)
+    : stats(e->opt.statsPhaseTimes ? e->stats : nullptr)
+  {
+    if (stats) {
+      start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~QuoteTimer() {
+    if (stats) {
+      stats->quoteSeconds += std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    }
+  }
+};
+
+
+static void _addStats(EncoderStats *to, const EncoderStats& from) {
+  to->bytes += from.bytes;
+  for (int a = 0; a < 8; ++a) {
+    to->nodes[a] += from.nodes[a];
+  }
+  to->totalSeconds += from.totalSeconds;
+  to->quoteSeconds += from.quoteSeconds;
+  to->writeSeconds += from.writeSeconds;
+}
+
+
+// Containers with fewer elements than this are always encoded on the current
+// thread.
+static const size_t _parallelMinElements = 1024;
+// The number of chunks per thread that may be encoded ahead of the chunk that
+// is currently being written to the output.
+static const size_t _parallelWindow = 2;
+
+
+// A defined element in a container that is encoded in parallel. For elements
+// in a Map, entry is set. For elements in a Vector, index is the position of
+// the element in the Vector.
+struct ElemRef {
+  int index;
+  const Value::MapEntry *entry;
+};
+
+
+// Flags for the byte classes that affect how a string must be written.
+enum CharClass : unsigned char {
+  // Must be escaped inside a quoted string: \\, \" and 0x00-0x1f.
+  CC_ESCAPE = 0x01,
+  // Prevents a quoteless string: 0x00-0x1f.
+  CC_CONTROL = 0x02,
+  // Prevents a multiline string: 0x00-0x1f except \t, \n and \r.
+  CC_CONTROL_ML = 0x04,
+  // Whitespace as defined by \s in ECMAScript regex (for bytes < 0x80).
+  CC_SPACE = 0x08,
+  // Not allowed at the start of a quoteless string, nor anywhere in a
+  // quoteless key: ,{}[]:#"'
+  CC_PUNCT = 0x10,
+  // First byte of a UTF-8 sequence that might be a part of the common range
+  // of code points that must always be escaped (see _commonRangeLen()).
+  CC_LEAD = 0x20,
+};
+
+
+static constexpr unsigned char _charClass(int c) {
+  return static_cast<unsigned char>(
+    ((c < 0x20 || c == '\\' || c == '"') ? CC_ESCAPE : 0) |
+    (c < 0x20 ? CC_CONTROL : 0) |
+    ((c < 0x20 && c != '\t' && c != '\n' && c != '\r') ? CC_CONTROL_ML : 0) |
+    ((c == ' ' || (c >= '\t' && c <= '\r')) ? CC_SPACE : 0) |
+    ((c == ',' || c == '{' || c == '}' || c == '[' || c == ']' || c == ':' ||
+      c == '#' || c == '"' || c == '\'') ? CC_PUNCT : 0) |
+    ((c == 0xc2 || c == 0xd8 || c == 0xdc || c == 0xe1 || c == 0xe2 ||
+      c == 0xef) ? CC_LEAD : 0));
+}
+
+
+#define HJSON_CC4(_I) _charClass(_I), _charClass(_I + 1), _charClass(_I + 2), \
+  _charClass(_I + 3)
+#define HJSON_CC16(_I) HJSON_CC4(_I), HJSON_CC4(_I + 4), HJSON_CC4(_I + 8), \
+  HJSON_CC4(_I + 12)
+#define HJSON_CC64(_I) HJSON_CC16(_I), HJSON_CC16(_I + 16), HJSON_CC16(_I + 32), \
+  HJSON_CC16(_I + 48)
+
+// Constant initialized, so it is safe to use from static initializers too.
+static const unsigned char _charClasses[256] = {
+  HJSON_CC64(0), HJSON_CC64(64), HJSON_CC64(128), HJSON_CC64(192)
+};
+
+#undef HJSON_CC64
+#undef HJSON_CC16
+#undef HJSON_CC4
+
+
+// The decisions about quotation and escaping for a string, made in a single
+// pass over the string.
+struct StringTraits {
+  // The string cannot be placed inside double quotes without escapes.
+  bool needsEscape;
+  // The string cannot be written as a quoteless string.
+  bool needsQuotes;
+  // The string cannot be written as a multiline string.
+  bool needsEscapeML;
+  // The string contains \r or \n.
+  bool hasLineBreak;
 };
 
 
 bool startsWithNumber(const char *text, size_t textSize);
-static void _objElem(Encoder *e, const std::string& key, const Value& value, bool *pIsFirst,
-  bool isRootObject, const std::string& commentAfterPrevObj);
+static void _objElemBegin(EncoderState *e, const std::string& key, const Value& value, bool *pIsFirst,
+  bool isRootObject, StringRef commentAfterPrevObj);
+static void _vecElemBegin(EncoderState *e, const Value& value, bool *pIsFirst,
+  StringRef commentAfterPrevObj);
+static void _parallelElems(EncoderState *e, const Value& value, bool isRootObject,
+  StringRef *pCommentAfter);
 
 
 // table of character substitutions
@@ -50,12 +260,13 @@ static const char *_meta(char c) {
 }
 
 
-static void _writeIndent(Encoder *e, int indent) {
-  *e->os << e->opt.eol;
-
-  for (int i = 0; i < indent; i++) {
-    *e->os << e->opt.indentBy;
+static void _writeIndent(EncoderState *e, int indent) {
+  for (; e->indentCacheLevels < indent; ++e->indentCacheLevels) {
+    e->indentCache += e->opt.indentBy;
   }
+
+  e->out->write(e->indentCache.data(), e->opt.eol.size() +
+    std::max(indent, 0) * e->opt.indentBy.size());
 }
 
 
@@ -103,82 +314,291 @@ static int _fromUtf8(const unsigned char **ppC, size_t *pnS) {
 }
 
 
-static void _quoteReplace(Encoder *e, const std::string& text) {
-  size_t uIndexStart = 0;
+// Returns the length of the UTF-8 sequence starting at pC if it encodes a code
+// point that must always be escaped, otherwise returns 0. The sequences are:
+// \xc2\xad, \xd8[\x80-\x84], \xdc\x8f, \xe1\x9e[\xb4\xb5], \xe2\x80[\x8c\x8f],
+// \xe2\x80[\xa8-\xaf], \xe2\x81[\xa0-\xaf], \xef\xbb\xbf, \xef\xbf[\xb0-\xbf]
+static inline size_t _commonRangeLen(const unsigned char *pC, size_t nS) {
+  if (nS < 2) {
+    return 0;
+  }
+
+  switch (pC[0]) {
+  case 0xc2:
+    return (pC[1] == 0xad ? 2 : 0);
+  case 0xd8:
+    return (pC[1] >= 0x80 && pC[1] <= 0x84 ? 2 : 0);
+  case 0xdc:
+    return (pC[1] == 0x8f ? 2 : 0);
+  default:
+    break;
+  }
+
+  if (nS < 3) {
+    return 0;
+  }
+
+  switch (pC[0]) {
+  case 0xe1:
+    return (pC[1] == 0x9e && (pC[2] == 0xb4 || pC[2] == 0xb5) ? 3 : 0);
+  case 0xe2:
+    if (pC[1] == 0x80) {
+      return (pC[2] == 0x8c || pC[2] == 0x8f || (pC[2] >= 0xa8 && pC[2] <= 0xaf) ? 3 : 0);
+    }
+    return (pC[1] == 0x81 && pC[2] >= 0xa0 && pC[2] <= 0xaf ? 3 : 0);
+  case 0xef:
+    return ((pC[1] == 0xbb && pC[2] == 0xbf) || (pC[1] == 0xbf && pC[2] >= 0xb0) ? 3 : 0);
+  default:
+    break;
+  }
+
+  return 0;
+}
+
+
+// Returns the length of the sequence at index i that must be escaped inside a
+// quoted string, or 0 if the char at index i can be written as it is.
+static inline size_t _escapeLen(const std::string& text, size_t i) {
+  auto pC = reinterpret_cast<const unsigned char*>(text.data()) + i;
+  auto cc = _charClasses[*pC];
+
+  if (cc & CC_ESCAPE) {
+    return 1;
+  } else if (cc & CC_LEAD) {
+    return _commonRangeLen(pC, text.size() - i);
+  }
+
+  return 0;
+}
+
+
+static StringTraits _classify(const std::string& text) {
+  StringTraits st = { false, false, false, false };
+
+  if (text.empty()) {
+    return st;
+  }
+
+  auto pC = reinterpret_cast<const unsigned char*>(text.data());
+  size_t nS = text.size();
+  bool onlySpace = true;
+  int quoteCount = 0;
+
+  // Equivalent to the regex ^\s|^"|^'|^#|^/\*|^//|^\{|^\}|^\[|^\]|^:|^,|\s$
+  st.needsQuotes = ((_charClasses[pC[0]] & (CC_SPACE | CC_PUNCT)) ||
+    (pC[0] == '/' && nS > 1 && (pC[1] == '*' || pC[1] == '/')) ||
+    (_charClasses[pC[nS - 1]] & CC_SPACE));
+
+  for (size_t i = 0; i < nS; ++i) {
+    auto cc = _charClasses[pC[i]];
+
+    if (!(cc & CC_SPACE)) {
+      onlySpace = false;
+    }
+
+    if (pC[i] == '\'') {
+      if (++quoteCount == 3) {
+        st.needsEscapeML = true;
+      }
+    } else {
+      quoteCount = 0;
+    }
+
+    if (cc & (CC_ESCAPE | CC_LEAD)) {
+      if (cc & CC_ESCAPE) {
+        st.needsEscape = true;
+        if (cc & CC_CONTROL) {
+          st.needsQuotes = true;
+          if (cc & CC_CONTROL_ML) {
+            st.needsEscapeML = true;
+          } else if (pC[i] == '\n') {
+            st.hasLineBreak = true;
+          } else if (pC[i] == '\r') {
+            // The decoder drops every \r in a multiline string.
+            st.needsEscapeML = true;
+          }
+        }
+      } else if (size_t len = _commonRangeLen(pC + i, nS - i)) {
+        st.needsEscape = st.needsQuotes = st.needsEscapeML = true;
+        i += len - 1;
+        onlySpace = false;
+        quoteCount = 0;
+      }
+    }
+  }
 
-  for (std::sregex_iterator it = std::sregex_iterator(text.begin(), text.end(),
-    e->needsEscape); it != std::sregex_iterator(); ++it)
+  // The decoder skips the whitespace in front of the text of a multiline
+  // string, and a quote at the end of a single line would make a run of four
+  // quotes.
+  if (onlySpace || (!st.hasLineBreak && ((_charClasses[pC[0]] & CC_SPACE) ||
+    pC[nS - 1] == '\'')))
   {
-    std::smatch match = *it;
-    const char *szReplacement = _meta(match.str()[0]);
+    st.needsEscapeML = true;
+  }
+
+  return st;
+}
+
+
+// Equivalent to the regex ^(true|false|null)\s*((,|\]|\}|#|//|/\*).*)?$
+// i.e. starts with a keyword and optionally is followed by a comment.
+static bool _startsWithKeyword(const std::string& text) {
+  size_t i;
+
+  if (!text.compare(0, 4, "true") || !text.compare(0, 4, "null")) {
+    i = 4;
+  } else if (!text.compare(0, 5, "false")) {
+    i = 5;
+  } else {
+    return false;
+  }
+
+  while (i < text.size() && (_charClasses[static_cast<unsigned char>(text[i])] & CC_SPACE)) {
+    ++i;
+  }
+
+  if (i == text.size()) {
+    return true;
+  }
+
+  switch (text[i]) {
+  case ',':
+  case ']':
+  case '}':
+  case '#':
+    break;
+  case '/':
+    if (i + 1 < text.size() && (text[i + 1] == '/' || text[i + 1] == '*')) {
+      break;
+    }
+    return false;
+  default:
+    return false;
+  }
+
+  // The regex "." does not match line terminators.
+  return text.find_first_of("\r\n", i) == std::string::npos;
+}
 
-    if (size_t(match.position()) > uIndexStart) {
+
+// Equivalent to the regex [,\{\[\}\]\s:#"'\x00-\x1f]|//|/\*
+static bool _needsEscapeName(const std::string& name) {
+  auto pC = reinterpret_cast<const unsigned char*>(name.data());
+  size_t nS = name.size();
+
+  for (size_t i = 0; i < nS; ++i) {
+    if ((_charClasses[pC[i]] & (CC_SPACE | CC_PUNCT | CC_CONTROL)) ||
+      (pC[i] == '/' && i + 1 < nS && (pC[i + 1] == '/' || pC[i + 1] == '*')))
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+static bool _needsEscape(const std::string& text) {
+  for (size_t i = 0; i < text.size(); ++i) {
+    if (_escapeLen(text, i)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+static void _quoteReplace(EncoderState *e, const std::string& text) {
+  size_t uIndexStart = 0;
+
+  for (size_t i = 0; i < text.size(); ++i) {
+    size_t len = _escapeLen(text, i);
+    if (!len) {
+      continue;
+    }
+
+    const char *szReplacement = _meta(text[i]);
+
+    if (i > uIndexStart) {
       // Append non-matching text.
-      *e->os << text.substr(uIndexStart, match.position() - uIndexStart);
+      e->out->write(text.data() + uIndexStart, i - uIndexStart);
     }
 
     if (szReplacement) {
-      *e->os << szReplacement;
+      *e->out << szReplacement;
     } else {
-      const char *pC = text.data() + match.position();
-      size_t nS = match.length();
+      static const char hexDigits[] = "0123456789abcdef";
+      const char *pC = text.data() + i;
+      size_t nS = len;
 
-      *e->os << std::hex << std::setfill('0');
       while (nS) {
         int nRet = _fromUtf8((const unsigned char**) &pC, &nS);
         if (nRet < 0) {
           // Not UTF8. Just dump it.
-          *e->os << std::string(pC, nS);
+          e->out->write(pC, nS);
           break;
         }
-        *e->os << "\\u" << std::setw(4) << nRet;
+        // At least 4 hex digits.
+        char buf[8];
+        int nDigits = 4;
+        while (nDigits < 6 && (nRet >> (4 * nDigits))) {
+          ++nDigits;
+        }
+        for (int a = nDigits - 1; a >= 0; --a, nRet >>= 4) {
+          buf[a] = hexDigits[nRet & 0xf];
+        }
+        *e->out << "\\u";
+        e->out->write(buf, nDigits);
       }
     }
 
-    uIndexStart = match.position() + match.length();
+    i += len - 1;
+    uIndexStart = i + 1;
   }
 
   if (uIndexStart < text.length()) {
     // Append remaining text.
-    *e->os << text.substr(uIndexStart, text.length() - uIndexStart);
+    e->out->write(text.data() + uIndexStart, text.length() - uIndexStart);
   }
 }
 
 
 // wrap the string into the ''' (multiline) format
-static void _mlString(Encoder *e, const std::string& value, const char *separator) {
-  size_t uIndexStart = 0;
-  std::sregex_iterator it = std::sregex_iterator(value.begin(), value.end(),
-    e->lineBreak);
-
-  if (it == std::sregex_iterator()) {
+static void _mlString(EncoderState *e, const std::string& value, const char *separator,
+  bool hasLineBreak)
+{
+  if (!hasLineBreak) {
     // The string contains only a single line. We still use the multiline
     // format as it avoids escaping the \ character (e.g. when used in a
     // regex).
-    *e->os << separator << "'''";
-    *e->os << value;
+    *e->out << separator << "'''";
+    *e->out << value;
   } else {
+    size_t uIndexStart = 0;
+
     _writeIndent(e, e->indent + 1);
-    *e->os << "'''";
+    *e->out << "'''";
 
-    do {
-      std::smatch match = *it;
+    // The value contains no \r, see _classify().
+    for (size_t pos = value.find('\n'); pos != std::string::npos;
+      pos = value.find('\n', uIndexStart))
+    {
       auto indent = e->indent + 1;
-      if (match.position() == uIndexStart) {
+      if (pos == uIndexStart) {
         indent = 0;
       }
       _writeIndent(e, indent);
-      if (size_t(match.position()) > uIndexStart) {
-        *e->os << value.substr(uIndexStart, match.position() - uIndexStart);
+      if (pos > uIndexStart) {
+        e->out->write(value.data() + uIndexStart, pos - uIndexStart);
       }
-      uIndexStart = match.position() + match.length();
-      ++it;
-    } while (it != std::sregex_iterator());
+      uIndexStart = pos + 1;
+    }
 
     if (uIndexStart < value.length()) {
       // Append remaining text.
       _writeIndent(e, e->indent + 1);
-      *e->os << value.substr(uIndexStart, value.length() - uIndexStart);
+      e->out->write(value.data() + uIndexStart, value.length() - uIndexStart);
     } else {
       // Trailing line feed.
       _writeIndent(e, 0);
@@ -187,23 +607,42 @@ static void _mlString(Encoder *e, const std::string& value, const char *separato
     _writeIndent(e, e->indent + 1);
   }
 
-  *e->os << "'''";
+  *e->out << "'''";
 }
 
 
-// Check if we can insert this string without quotes
+// Check if we can insert this non-empty string without quotes
 // see hjson syntax (must not parse as true, false, null or number)
-static void _quote(Encoder *e, const std::string& value, const char *separator,
+// Also sets *pSt to the traits of value.
+static bool _needsQuotes(EncoderState *e, const std::string& value,
+  bool isRootObject, bool hasCommentAfter, StringTraits *pSt)
+{
+  QuoteTimer timer(e);
+  *pSt = _classify(value);
+
+  return (e->opt.quoteAlways ||
+    pSt->needsQuotes ||
+    startsWithNumber(value.c_str(), value.size()) ||
+    _startsWithKeyword(value) ||
+    // A quoteless root string containing a colon could be decoded as an
+    // object without braces.
+    (isRootObject && value.find(':') != std::string::npos) ||
+    hasCommentAfter);
+}
+
+
+static void _quote(EncoderState *e, const std::string& value, const char *separator,
   bool isRootObject, bool hasCommentAfter)
 {
   if (value.size() == 0) {
-    *e->os << separator << "\"\"";
-  } else if (e->opt.quoteAlways ||
-    std::regex_search(value, e->needsQuotes) ||
-    startsWithNumber(value.c_str(), value.size()) ||
-    std::regex_search(value, e->startsWithKeyword) ||
-    hasCommentAfter)
-  {
+    *e->out << separator << "\"\"";
+    return;
+  }
+
+  StringTraits st;
+  bool needsQuotes = _needsQuotes(e, value, isRootObject, hasCommentAfter, &st);
+
+  if (needsQuotes) {
 
     // If the string contains no control characters, no quote characters, and no
     // backslash characters, then we can safely slap some quotes around it.
@@ -211,44 +650,50 @@ static void _quote(Encoder *e, const std::string& value, const char *separator,
     // format or we must replace the offending characters with safe escape
     // sequences.
 
-    if (!std::regex_search(value, e->needsEscape)) {
-      *e->os << separator << '"' << value << '"';
-    } else if (!e->opt.quoteAlways && !std::regex_search(value,
-      e->needsEscapeML) && !isRootObject)
-    {
-      _mlString(e, value, separator);
+    if (!st.needsEscape) {
+      *e->out << separator << '"' << value << '"';
+    } else if (!e->opt.quoteAlways && !st.needsEscapeML && !isRootObject) {
+      _mlString(e, value, separator, st.hasLineBreak);
     } else {
-      *e->os << separator << '"';
+      *e->out << separator << '"';
       _quoteReplace(e, value);
-      *e->os << '"';
+      *e->out << '"';
     }
   } else {
     // return without quotes
-    *e->os << separator << value;
+    *e->out << separator << value;
+    e->afterQuoteless = true;
   }
 }
 
 
-static void _quoteName(Encoder *e, const std::string& name) {
+static void _quoteName(EncoderState *e, const std::string& name) {
+  bool needsQuotes, needsEscape;
+  {
+    QuoteTimer timer(e);
+    needsQuotes = (e->opt.quoteKeys || _needsEscapeName(name));
+    needsEscape = (needsQuotes && _needsEscape(name));
+  }
+
   if (name.empty()) {
-    *e->os << "\"\"";
-  } else if (e->opt.quoteKeys || std::regex_search(name, e->needsEscapeName)) {
-    *e->os << '"';
-    if (std::regex_search(name, e->needsEscape)) {
+    *e->out << "\"\"";
+  } else if (needsQuotes) {
+    *e->out << '"';
+    if (needsEscape) {
       _quoteReplace(e, name);
     } else {
-      *e->os << name;
+      *e->out << name;
     }
 
-    *e->os << '"';
+    *e->out << '"';
   } else {
     // without quotes
-    *e->os << name;
+    *e->out << name;
   }
 }
 
 
-static void _bracesIndent(Encoder *e, bool isObjElement, const Value& value, const char *separator) {
+static void _bracesIndent(EncoderState *e, bool isObjElement, const Value& value, const char *separator) {
   if (
     isObjElement
     && !e->opt.bracesSameLine
@@ -256,22 +701,22 @@ static void _bracesIndent(Encoder *e, bool isObjElement, const Value& value, con
       !value.empty()
       || (
         e->opt.comments
-        && !value.get_comment_inside().empty()
+        && !value.get_comment_inside_ref().empty()
       )
     )
     && (
       !e->opt.comments
-      || value.get_comment_key().empty()
+      || value.get_comment_key_ref().empty()
     )
   ) {
     _writeIndent(e, e->indent);
   } else {
-    *e->os << separator;
+    *e->out << separator;
   }
 }
 
 
-static bool _quoteForComment(Encoder *e, const std::string& comment) {
+static bool _quoteForComment(EncoderState *e, StringRef comment) {
   if (!e->opt.comments) {
     return false;
   }
@@ -298,7 +743,7 @@ static bool _quoteForComment(Encoder *e, const std::string& comment) {
 // (i.e. the string contains an unterminated line comment).
 // Also returns true for '/* # */' and similar, but that should be uncommon and
 // will only cause an unnecessary line feed after the comment.
-static bool _isInComment(const std::string& comment) {
+static bool _isInComment(StringRef comment) {
   bool endsInsideComment = false;
   char prev = ' ';
 
@@ -323,202 +768,296 @@ static bool _isInComment(const std::string& comment) {
 }
 
 
-// Produce a string from value.
-static void _str(Encoder *e, const Value& value, bool isRootObject, bool isObjElement) {
+static inline bool _hasLineFeed(StringRef comment) {
+  return std::memchr(comment.data(), '\n', comment.size()) != nullptr;
+}
+
+
+// Returns true if the comment starts with a line feed, possibly after some
+// spaces or tabs. Otherwise the comment would continue the line of the
+// previous element, which is not possible after a quoteless string.
+static bool _startsOnNewLine(StringRef comment) {
+  for (char ch : comment) {
+    if (ch == '\n' || ch == '\r') {
+      return true;
+    } else if (ch != ' ' && ch != '\t') {
+      return false;
+    }
+  }
+
+  return false;
+}
+
+
+// Writes value, or if value is a Vector or Map, everything before its first
+// element. Returns true in the latter case, where the elements and the end of
+// the container are then written by _str().
+static bool _strBegin(EncoderState *e, const Value& value, bool isRootObject, bool isObjElement) {
   const char *separator = ((isObjElement && (!e->opt.comments ||
-    value.get_comment_key().empty())) ? " " : "");
+    value.get_comment_key_ref().empty())) ? " " : "");
+
+  if (e->stats) {
+    ++e->stats->nodes[static_cast<int>(value.type())];
+  }
 
   if (e->opt.comments) {
     if (isRootObject) {
-      *e->os << value.get_comment_before();
+      *e->out << value.get_comment_before_ref();
     }
-    *e->os << value.get_comment_key();
+    *e->out << value.get_comment_key_ref();
   }
 
+  e->afterQuoteless = false;
+
   switch (value.type()) {
   case Type::Double:
-    *e->os << separator;
+    *e->out << separator;
 
     if (std::isnan(static_cast<double>(value)) || std::isinf(static_cast<double>(value))) {
-      *e->os << Value(Type::Null).to_string();
+      *e->out << Value(Type::Null).to_string();
     } else if (!e->opt.allowMinusZero && value == 0 && std::signbit(static_cast<double>(value))) {
-      *e->os << Value(0).to_string();
+      *e->out << Value(0).to_string();
     } else {
-      *e->os << value.to_string();
+      *e->out << value.to_string();
     }
     break;
 
   case Type::String:
-    _quote(e, value, separator, isRootObject, _quoteForComment(e, value.get_comment_after()));
+    _quote(e, value.string_ref(), separator, isRootObject,
+      _quoteForComment(e, value.get_comment_after_ref()));
     break;
 
   case Type::Vector:
-    {
+    _bracesIndent(e, isObjElement, value, separator);
+    *e->out << "[";
+
+    e->indent++;
+    return true;
+
+  case Type::Map:
+    if (!e->opt.omitRootBraces || !isRootObject || value.empty()) {
       _bracesIndent(e, isObjElement, value, separator);
-      *e->os << "[";
+      *e->out << "{";
 
       e->indent++;
+    }
+    return true;
 
-      // Join all of the element texts together, separated with newlines
-      bool isFirst = true;
-      std::string commentAfter = value.get_comment_inside();
-      for (int i = 0; size_t(i) < value.size(); ++i) {
-        if (value[i].defined()) {
-          bool shouldIndent = (!e->opt.comments || value[i].get_comment_key().empty());
-
-          if (isFirst) {
-            isFirst = false;
-
-            if (e->opt.comments && !commentAfter.empty()) {
-              *e->os << commentAfter;
-              // This is the first element, so commentAfterPrevObj is the inner comment
-              // of the parent vector. The inner comment probably expects "]" to come
-              // after it and therefore needs one more level of indentation.
-              *e->os << e->opt.indentBy;
-              shouldIndent = false;
-            }
-          } else {
-            if (e->opt.separator) {
-              *e->os << ",";
-            }
-
-            if (e->opt.comments) {
-              *e->os << commentAfter;
-            }
-          }
+  default:
+    *e->out << separator << value.to_string();
+  }
 
-          if (e->opt.comments && !value[i].get_comment_before().empty()) {
-            if (!e->opt.separator &&
-              value[i].get_comment_before().find("\n") == std::string::npos)
-            {
-              _writeIndent(e, e->indent);
-            }
-            *e->os << value[i].get_comment_before();
-          } else if (shouldIndent) {
-            _writeIndent(e, e->indent);
-          }
+  if (e->opt.comments && isRootObject) {
+    *e->out << value.get_comment_after_ref();
+  }
 
-          _str(e, value[i], false, false);
+  return false;
+}
 
-          commentAfter = value[i].get_comment_after();
-        }
-      }
-      if (e->opt.comments && !commentAfter.empty()) {
-        *e->os << commentAfter;
-      }
-      if (!value.empty() && (!e->opt.comments || commentAfter.empty() ||
-        !e->opt.separator && commentAfter.find("\n") == std::string::npos))
-      {
-        _writeIndent(e, e->indent - 1);
-      }
 
-      *e->os << "]";
-      e->indent--;
+// Writes the end of a Vector or Map, after its last element. commentAfter is
+// the comment after the last element, or the inner comment of the container
+// if it has no defined elements.
+static void _strEnd(EncoderState *e, const Value& value, bool isRootObject,
+  StringRef commentAfter)
+{
+  e->afterQuoteless = false;
+
+  if (value.type() == Type::Vector) {
+    if (e->opt.comments && !commentAfter.empty()) {
+      *e->out << commentAfter;
+    }
+    if (!value.empty() && (!e->opt.comments || commentAfter.empty() ||
+      !e->opt.separator && !_hasLineFeed(commentAfter)))
+    {
+      _writeIndent(e, e->indent - 1);
     }
-    break;
 
-  case Type::Map:
+    *e->out << "]";
+    e->indent--;
+  } else {
+    if (e->opt.comments && !commentAfter.empty()) {
+      *e->out << commentAfter;
+    }
+    if (!value.empty() && (!e->opt.omitRootBraces || !isRootObject) &&
+      (!e->opt.comments || commentAfter.empty() ||
+      !e->opt.separator && !_hasLineFeed(commentAfter)))
     {
-      if (!e->opt.omitRootBraces || !isRootObject || value.empty()) {
-        _bracesIndent(e, isObjElement, value, separator);
-        *e->os << "{";
+      _writeIndent(e, e->indent - 1);
+    }
 
-        e->indent++;
+    if (!e->opt.omitRootBraces || !isRootObject || value.empty()) {
+      e->indent--;
+      if (isRootObject && e->opt.comments && !commentAfter.empty() &&
+        _isInComment(commentAfter))
+      {
+        _writeIndent(e, e->indent);
       }
+      *e->out << "}";
+    }
+  }
 
-      // Join all of the member texts together, separated with newlines
-      bool isFirst = true;
-      std::string commentAfter = value.get_comment_inside();
-      if (e->opt.preserveInsertionOrder) {
-        size_t limit = value.size();
-        for (int index = 0; index < limit; index++) {
-          if (value[index].defined()) {
-            _objElem(e, value.key(index), value[index], &isFirst, isRootObject, commentAfter);
-            commentAfter = value[index].get_comment_after();
-          }
-        }
-      } else {
-        for (auto it : value) {
-          if (it.second.defined()) {
-            _objElem(e, it.first, it.second, &isFirst, isRootObject, commentAfter);
-            commentAfter = it.second.get_comment_after();
-          }
-        }
-      }
+  if (e->opt.comments && isRootObject) {
+    *e->out << value.get_comment_after_ref();
+  }
+}
 
-      if (e->opt.comments && !commentAfter.empty()) {
-        *e->os << commentAfter;
-      }
-      if (!value.empty() && (!e->opt.omitRootBraces || !isRootObject) &&
-        (!e->opt.comments || commentAfter.empty() ||
-        !e->opt.separator && commentAfter.find("\n") == std::string::npos))
-      {
-        _writeIndent(e, e->indent - 1);
-      }
 
-      if (!e->opt.omitRootBraces || !isRootObject || value.empty()) {
-        e->indent--;
-        if (isRootObject && e->opt.comments && !commentAfter.empty() &&
-          _isInComment(commentAfter))
-        {
-          _writeIndent(e, e->indent);
+// A Vector or Map that is being written by _str(), and the position of its
+// next element.
+struct StrFrame {
+  const Value *value;
+  bool isMap;
+  bool isRootObject;
+  bool isFirst;
+  // The comment after the previous element, or the inner comment of the
+  // container before the first element.
+  StringRef commentAfter;
+  // The next element of a Vector, and the size of the Vector.
+  size_t index, size;
+  // The next element of a Map, and the end of the Map.
+  Value::const_iterator it, end;
+};
+
+
+// Creates the frame for writing the elements of a Vector or Map. Large
+// containers are written right away by _parallelElems() if more than one
+// thread may be used, in which case the frame has no elements left.
+static StrFrame _strFrame(EncoderState *e, const Value& value, bool isRootObject) {
+  StrFrame f;
+  f.value = &value;
+  f.isMap = (value.type() == Type::Map);
+  f.isRootObject = isRootObject;
+  f.isFirst = true;
+  f.commentAfter = value.get_comment_inside_ref();
+  f.index = 0;
+  f.size = value.size();
+
+  if (e->threads > 1 && f.size >= _parallelMinElements) {
+    _parallelElems(e, value, isRootObject, &f.commentAfter);
+    f.index = f.size;
+  } else if (f.isMap) {
+    if (e->opt.preserveInsertionOrder) {
+      auto range = value.insertion_order();
+      f.it = range.begin();
+      f.end = range.end();
+    } else {
+      f.it = value.begin();
+      f.end = value.end();
+    }
+  }
+
+  return f;
+}
+
+
+// Produce a string from value. Nested Vectors and Maps are written using an
+// explicit stack instead of recursion, so that the depth of the tree does not
+// matter.
+static void _str(EncoderState *e, const Value& value, bool isRootObject, bool isObjElement) {
+  if (!_strBegin(e, value, isRootObject, isObjElement)) {
+    return;
+  }
+
+  std::vector<StrFrame> stack;
+  if (e->frames) {
+    stack.swap(*e->frames);
+    stack.clear();
+  }
+  stack.push_back(_strFrame(e, value, isRootObject));
+
+  // Join all of the element texts together, separated with newlines
+  while (!stack.empty()) {
+    auto& f = stack.back();
+    const Value *elem = nullptr;
+
+    if (!f.isMap) {
+      while (!elem && f.index < f.size) {
+        const Value& v = (*f.value)[static_cast<int>(f.index++)];
+        if (v.defined()) {
+          elem = &v;
+          _vecElemBegin(e, v, &f.isFirst, f.commentAfter);
+        }
+      }
+    } else {
+      while (!elem && f.it != f.end) {
+        const auto& it = *f.it++;
+        if (it.second.defined()) {
+          elem = &it.second;
+          _objElemBegin(e, it.first, it.second, &f.isFirst, f.isRootObject,
+            f.commentAfter);
         }
-        *e->os << "}";
       }
     }
-    break;
 
-  default:
-    *e->os << separator << value.to_string();
+    if (!elem) {
+      _strEnd(e, *f.value, f.isRootObject, f.commentAfter);
+      stack.pop_back();
+      continue;
+    }
+
+    f.commentAfter = elem->get_comment_after_ref();
+    if (_strBegin(e, *elem, false, f.isMap)) {
+      stack.push_back(_strFrame(e, *elem, false));
+    }
   }
 
-  if (e->opt.comments && isRootObject) {
-    *e->os << value.get_comment_after();
+  if (e->frames) {
+    stack.swap(*e->frames);
   }
 }
 
 
-static void _objElem(Encoder *e, const std::string& key, const Value& value, bool *pIsFirst,
-  bool isRootObject, const std::string& commentAfterPrevObj)
+// Writes everything in front of the value of a Map element.
+static void _objElemBegin(EncoderState *e, const std::string& key, const Value& value, bool *pIsFirst,
+  bool isRootObject, StringRef commentAfterPrevObj)
 {
-  bool hasCommentBefore = (e->opt.comments && !value.get_comment_before().empty());
+  StringRef commentBefore = value.get_comment_before_ref();
+  bool hasCommentBefore = (e->opt.comments && !commentBefore.empty());
 
   if (*pIsFirst) {
     *pIsFirst = false;
     bool shouldIndent = ((!e->opt.omitRootBraces || !isRootObject) && !hasCommentBefore);
 
     if (e->opt.comments && !commentAfterPrevObj.empty()) {
-      *e->os << commentAfterPrevObj;
+      *e->out << commentAfterPrevObj;
       // This is the first element, so commentAfterPrevObj is the inner comment
       // of the parent map. The inner comment probably expects "}" to come
       // after it and therefore needs one more level of indentation, unless
       // this is the root object without braces.
       if (shouldIndent) {
-        *e->os << e->opt.indentBy;
+        *e->out << e->opt.indentBy;
       }
     } else if (shouldIndent) {
       _writeIndent(e, e->indent);
     }
   } else {
     if (e->opt.separator) {
-      *e->os << ",";
+      *e->out << ",";
     }
     if (e->opt.comments) {
-      *e->os << commentAfterPrevObj;
+      *e->out << commentAfterPrevObj;
     }
-    if (!hasCommentBefore || !e->opt.separator &&
-      value.get_comment_before().find("\n") == std::string::npos)
+    if (!hasCommentBefore || !e->opt.separator && !(e->afterQuoteless ?
+      _startsOnNewLine(commentBefore) : _hasLineFeed(commentBefore)))
     {
       _writeIndent(e, e->indent);
     }
   }
 
   if (hasCommentBefore) {
-    *e->os << value.get_comment_before();
+    *e->out << commentBefore;
   }
 
   _quoteName(e, key);
-  *e->os << ":";
+  *e->out << ":";
+}
+
+
+static void _objElem(EncoderState *e, const std::string& key, const Value& value, bool *pIsFirst,
+  bool isRootObject, StringRef commentAfterPrevObj)
+{
+  _objElemBegin(e, key, value, pIsFirst, isRootObject, commentAfterPrevObj);
   _str(
     e,
     value,
@@ -528,39 +1067,599 @@ static void _objElem(Encoder *e, const std::string& key, const Value& value, boo
 }
 
 
+// Writes everything in front of a Vector element.
+static void _vecElemBegin(EncoderState *e, const Value& value, bool *pIsFirst,
+  StringRef commentAfterPrevObj)
+{
+  bool shouldIndent = (!e->opt.comments || value.get_comment_key_ref().empty());
+
+  if (*pIsFirst) {
+    *pIsFirst = false;
+
+    if (e->opt.comments && !commentAfterPrevObj.empty()) {
+      *e->out << commentAfterPrevObj;
+      // This is the first element, so commentAfterPrevObj is the inner comment
+      // of the parent vector. The inner comment probably expects "]" to come
+      // after it and therefore needs one more level of indentation.
+      *e->out << e->opt.indentBy;
+      shouldIndent = false;
+    }
+  } else {
+    if (e->opt.separator) {
+      *e->out << ",";
+    }
+
+    if (e->opt.comments) {
+      *e->out << commentAfterPrevObj;
+    }
+  }
+
+  StringRef commentBefore = value.get_comment_before_ref();
+  if (e->opt.comments && !commentBefore.empty()) {
+    if (!e->opt.separator && !(e->afterQuoteless ?
+      _startsOnNewLine(commentBefore) : _hasLineFeed(commentBefore)))
+    {
+      _writeIndent(e, e->indent);
+    }
+    *e->out << commentBefore;
+  } else if (shouldIndent) {
+    _writeIndent(e, e->indent);
+  }
+}
+
+
+static void _vecElem(EncoderState *e, const Value& value, bool *pIsFirst,
+  StringRef commentAfterPrevObj)
+{
+  _vecElemBegin(e, value, pIsFirst, commentAfterPrevObj);
+  _str(e, value, false, false);
+}
+
+
+static inline const Value& _elemValue(const Value& container, const ElemRef& ref) {
+  return (ref.entry ? ref.entry->second : container[ref.index]);
+}
+
+
+// Encodes the elements elems[begin] to elems[end - 1] of the container into
+// the returned string, exactly as they would have been encoded by _str(). The
+// statistics are collected in *stats if e->stats is set.
+static std::string _encodeElems(const EncoderState *e, const Value& container,
+  bool isRootObject, const std::vector<ElemRef>& elems, size_t begin,
+  size_t end, StringRef commentInside, EncoderStats *stats)
+{
+  OutputBuffer out;
+  EncoderState ce = *e;
+  ce.out = &out;
+  ce.threads = 1;
+  ce.stats = (e->stats ? stats : nullptr);
+  ce.frames = nullptr;
+
+  bool isFirst = !begin;
+  StringRef commentAfter = commentInside;
+  ce.afterQuoteless = false;
+  if (begin) {
+    // The element before this chunk is written by another thread, as
+    // _quote() would write it.
+    const auto& prev = _elemValue(container, elems[begin - 1]);
+    commentAfter = prev.get_comment_after_ref();
+    StringTraits st;
+    ce.afterQuoteless = (prev.type() == Type::String &&
+      !prev.string_ref().empty() && !_needsQuotes(&ce, prev.string_ref(),
+      false, _quoteForComment(&ce, commentAfter), &st));
+  }
+
+  for (size_t a = begin; a < end; ++a) {
+    const auto& ref = elems[a];
+    const auto& value = _elemValue(container, ref);
+
+    if (container.type() == Type::Vector) {
+      _vecElem(&ce, value, &isFirst, commentAfter);
+    } else {
+      _objElem(&ce, ref.entry->first, value, &isFirst, isRootObject, commentAfter);
+    }
+
+    commentAfter = value.get_comment_after_ref();
+  }
+
+  return std::move(out.buf);
+}
+
+
+// Encodes the defined elements of a large Vector or Map on up to e->threads
+// threads. The elements are split into chunks that are encoded into separate
+// buffers, and each buffer is written to e->out as soon as all previous chunks
+// have been written. At most _parallelWindow chunks per thread are kept in
+// memory, so that output to a stream still only needs a bounded amount of
+// memory. On return, *pCommentAfter is the comment after the last element, or
+// unchanged (the inner comment of the container) if there are no defined
+// elements.
+static void _parallelElems(EncoderState *e, const Value& value, bool isRootObject,
+  StringRef *pCommentAfter)
+{
+  std::vector<ElemRef> elems;
+  elems.reserve(value.size());
+
+  if (value.type() == Type::Map && e->opt.preserveInsertionOrder) {
+    for (const auto& it : value.insertion_order()) {
+      if (it.second.defined()) {
+        elems.push_back(ElemRef{ 0, &it });
+      }
+    }
+  } else if (value.type() == Type::Map) {
+    for (const auto& it : value) {
+      if (it.second.defined()) {
+        elems.push_back(ElemRef{ 0, &it });
+      }
+    }
+  } else {
+    for (int i = 0; size_t(i) < value.size(); ++i) {
+      if (value[i].defined()) {
+        elems.push_back(ElemRef{ i, nullptr });
+      }
+    }
+  }
+
+  if (elems.empty()) {
+    return;
+  }
+
+  size_t threads = size_t(e->threads);
+  size_t chunkSize = std::min<size_t>(4096,
+    std::max<size_t>(16, elems.size() / (threads * 16)));
+  size_t chunkCount = (elems.size() + chunkSize - 1) / chunkSize;
+  size_t window = threads * _parallelWindow;
+
+  std::vector<std::string> bufs(chunkCount);
+  std::vector<char> done(chunkCount, 0);
+  size_t nextChunk = 0, written = 0;
+  bool failed = false;
+  std::exception_ptr error;
+  std::mutex mutex;
+  std::condition_variable cond;
+  StringRef commentInside = *pCommentAfter;
+
+  // The statistics of each chunk are added to e->stats while the mutex is
+  // locked.
+  auto encodeChunk = [&](size_t chunk, EncoderStats *stats) {
+    size_t begin = chunk * chunkSize;
+    return _encodeElems(e, value, isRootObject, elems, begin,
+      std::min(begin + chunkSize, elems.size()), commentInside, stats);
+  };
+
+  auto fail = [&](std::unique_lock<std::mutex>& lock) {
+    if (!failed) {
+      failed = true;
+      error = std::current_exception();
+    }
+    lock.unlock();
+    cond.notify_all();
+  };
+
+  auto worker = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      cond.wait(lock, [&]() {
+        return failed || nextChunk == chunkCount || nextChunk < written + window;
+      });
+      if (failed || nextChunk == chunkCount) {
+        return;
+      }
+      size_t chunk = nextChunk++;
+      lock.unlock();
+
+      std::string buf;
+      EncoderStats stats;
+      try {
+        buf = encodeChunk(chunk, &stats);
+      } catch (...) {
+        lock.lock();
+        fail(lock);
+        return;
+      }
+
+      lock.lock();
+      if (e->stats) {
+        _addStats(e->stats, stats);
+      }
+      bufs[chunk].swap(buf);
+      done[chunk] = 1;
+      cond.notify_all();
+    }
+  };
+
+  std::vector<std::thread> pool;
+  size_t workerCount = std::min(threads, chunkCount) - 1;
+  for (size_t a = 0; a < workerCount; ++a) {
+    try {
+      pool.emplace_back(worker);
+    } catch (const std::system_error&) {
+      // Could not create more threads, use the ones that were created.
+      break;
+    }
+  }
+
+  // The current thread writes the chunks in order, and encodes chunks too
+  // while the next chunk to write is not ready.
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!failed && written < chunkCount) {
+      if (done[written]) {
+        std::string buf;
+        buf.swap(bufs[written++]);
+        lock.unlock();
+        cond.notify_all();
+        try {
+          e->out->write(buf.data(), buf.size());
+        } catch (...) {
+          lock.lock();
+          fail(lock);
+          break;
+        }
+        lock.lock();
+      } else if (nextChunk < chunkCount && nextChunk < written + window) {
+        size_t chunk = nextChunk++;
+        lock.unlock();
+        std::string buf;
+        EncoderStats stats;
+        try {
+          buf = encodeChunk(chunk, &stats);
+        } catch (...) {
+          lock.lock();
+          fail(lock);
+          break;
+        }
+        lock.lock();
+        if (e->stats) {
+          _addStats(e->stats, stats);
+        }
+        bufs[chunk].swap(buf);
+        done[chunk] = 1;
+      } else {
+        cond.wait(lock);
+      }
+    }
+  }
+
+  for (auto& t : pool) {
+    t.join();
+  }
+
+  if (error) {
+    std::rethrow_exception(error);
+  }
+
+  *pCommentAfter = _elemValue(value, elems.back()).get_comment_after_ref();
+}
+
+
+static void _initEncoder(EncoderState *e, const EncoderOptions& options,
+  OutputBuffer *pOut)
+{
+  e->out = pOut;
+  e->opt = options;
+  e->indent = 0;
+  e->indentCache = e->opt.eol;
+  e->indentCacheLevels = 0;
+  e->threads = e->opt.threads;
+  if (e->threads < 1) {
+    e->threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  }
+  e->stats = nullptr;
+  e->frames = nullptr;
+  e->afterQuoteless = false;
+
+  if (e->opt.separator) {
+    e->opt.quoteAlways = true;
+  }
+}
+
+
+// Writes v to e->out, collecting statistics if the options ask for them.
+static void _marshalState(EncoderState *e, const Value& v) {
+  const auto& options = e->opt;
+  OutputBuffer *pOut = e->out;
+
+  if (!options.stats) {
+    _str(e, v, true, false);
+    return;
+  }
+
+  EncoderStats stats;
+  e->stats = &stats;
+  pOut->timeWrites = true;
+  auto start = std::chrono::steady_clock::now();
+
+  _str(e, v, true, false);
+  pOut->flush();
+
+  stats.bytes = pOut->flushed + pOut->buf.size();
+  stats.totalSeconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+  stats.writeSeconds = pOut->writeSeconds;
+  _addStats(options.stats, stats);
+}
+
+
+static void _marshalBuffer(const Value& v, const EncoderOptions& options,
+  OutputBuffer *pOut)
+{
+  EncoderState e;
+  _initEncoder(&e, options, pOut);
+  _marshalState(&e, v);
+}
+
+
 static void _marshalStream(const Value& v, const EncoderOptions& options,
   std::ostream *pStream)
 {
-  Encoder e;
-  e.os = pStream;
-  e.opt = options;
-  e.indent = 0;
+  OutputBuffer out(pStream);
 
-  if (e.opt.separator) {
-    e.opt.quoteAlways = true;
+  _marshalBuffer(v, options, &out);
+  out.flush();
+}
+
+
+// The encoder state for EventEncoder. The opening of an array or an object is
+// only written when its first element or its end arrives, because the
+// formatting depends on whether it is empty.
+class EventEncoder::Impl {
+public:
+  class Frame {
+  public:
+    bool isMap;
+    bool isRootObject;
+    bool isObjElement;
+    bool isOpen;
+    bool isEmpty;
+    // For maps: if the braces are written (not omitted for the root).
+    bool hasBraces;
+    // For maps: if a key has been written and its value has not.
+    bool hasKey;
+  };
+
+  OutputBuffer out;
+  EncoderState e;
+  std::vector<Frame> frames;
+  bool done;
+  std::string buf;
+
+  Impl(const EncoderOptions& options) {
+    e.out = &out;
+    e.opt = options;
+    e.opt.comments = false;
+    e.indent = 0;
+    e.indentCache = e.opt.eol;
+    e.indentCacheLevels = 0;
+    e.threads = 1;
+    e.stats = nullptr;
+    e.frames = nullptr;
+    e.afterQuoteless = false;
+    if (e.opt.separator) {
+      e.opt.quoteAlways = true;
+    }
+    done = false;
   }
 
-  // Regex should not be UTF8 aware, just treat the chars as values.
-  e.loc = std::locale::classic();
+  // Writes what comes before a value, like _vecElem() for an element of an
+  // array. Returns the frame that the value is for, i.e. how it is written.
+  Frame beginValue() {
+    Frame f = {};
+    if (frames.empty()) {
+      if (done) {
+        throw std::logic_error("EventEncoder: more than one root value");
+      }
+      f.isRootObject = true;
+      return f;
+    }
 
-  std::string commonRange = R"(]|\xc2\xad|\xd8[\x80-\x84]|\xdc\x8f|\xe1\x9e[\xb4\xb5]|\xe2\x80[\x8c\x8f]|\xe2\x80[\xa8-\xaf]|\xe2\x81[\xa0-\xaf]|\xef\xbb\xbf|\xef\xbf[\xb0-\xbf])";
-  // needsEscape tests if the string can be written without escapes
-  e.needsEscape.imbue(e.loc);
-  e.needsEscape.assign(R"([\\\"\x00-\x1f)" + commonRange);
-  // needsQuotes tests if the string can be written as a quoteless string (includes needsEscape but without \\ and \")
-  e.needsQuotes.imbue(e.loc);
-  e.needsQuotes.assign(R"(^\s|^"|^'|^#|^/\*|^//|^\{|^\}|^\[|^\]|^:|^,|\s$|[\x00-\x1f)" + commonRange);
-  // needsEscapeML tests if the string can be written as a multiline string (like needsEscape but without \n, \r, \\, \", \t)
-  e.needsEscapeML.imbue(e.loc);
-  e.needsEscapeML.assign(R"('''|^[\s]+$|[\x00-\x08\x0b\x0c\x0e-\x1f)" + commonRange);
-  // starts with a keyword and optionally is followed by a comment
-  e.startsWithKeyword.imbue(e.loc);
-  e.startsWithKeyword.assign(R"(^(true|false|null)\s*((,|\]|\}|#|//|/\*).*)?$)");
-  e.needsEscapeName.imbue(e.loc);
-  e.needsEscapeName.assign(R"([,\{\[\}\]\s:#"']|//|/\*)");
-  e.lineBreak.assign(R"(\r|\n|\r\n)");
+    auto& parent = frames.back();
+    if (parent.isMap) {
+      if (!parent.hasKey) {
+        throw std::logic_error("EventEncoder: value without key in object");
+      }
+      parent.hasKey = false;
+      f.isObjElement = true;
+      return f;
+    }
+
+    open(parent, false);
+    if (!parent.isEmpty && e.opt.separator) {
+      *e.out << ",";
+    }
+    parent.isEmpty = false;
+    _writeIndent(&e, e.indent);
+    return f;
+  }
 
-  _str(&e, v, true, false);
+  void endValue() {
+    if (frames.empty()) {
+      done = true;
+    }
+  }
+
+  // Same as _bracesIndent() and the opening bracket in _strBegin().
+  void open(Frame& f, bool isEmpty) {
+    if (f.isOpen) {
+      return;
+    }
+    f.isOpen = true;
+    f.hasBraces = (!f.isMap || !e.opt.omitRootBraces || !f.isRootObject ||
+      isEmpty);
+    if (!f.hasBraces) {
+      return;
+    }
+    if (f.isObjElement && !e.opt.bracesSameLine && !isEmpty) {
+      _writeIndent(&e, e.indent);
+    } else if (f.isObjElement) {
+      *e.out << " ";
+    }
+    *e.out << (f.isMap ? "{" : "[");
+    e.indent++;
+  }
+
+  void begin(bool isMap) {
+    auto f = beginValue();
+    f.isMap = isMap;
+    f.isEmpty = true;
+    frames.push_back(f);
+  }
+
+  void end(bool isMap) {
+    if (frames.empty() || frames.back().isMap != isMap ||
+      frames.back().hasKey)
+    {
+      throw std::logic_error(std::string("EventEncoder: unexpected ") +
+        (isMap ? "object_end()" : "array_end()"));
+    }
+
+    auto& f = frames.back();
+    open(f, f.isEmpty);
+    if (!f.isEmpty && f.hasBraces) {
+      _writeIndent(&e, e.indent - 1);
+    }
+    if (f.hasBraces) {
+      e.indent--;
+      *e.out << (isMap ? "}" : "]");
+    }
+    frames.pop_back();
+    endValue();
+  }
+
+  // Same as _objElem() before the value.
+  void key(const std::string& key) {
+    if (frames.empty() || !frames.back().isMap || frames.back().hasKey) {
+      throw std::logic_error("EventEncoder: unexpected key");
+    }
+
+    auto& f = frames.back();
+    open(f, false);
+    if (f.isEmpty) {
+      if (f.hasBraces) {
+        _writeIndent(&e, e.indent);
+      }
+    } else {
+      if (e.opt.separator) {
+        *e.out << ",";
+      }
+      _writeIndent(&e, e.indent);
+    }
+    f.isEmpty = false;
+    f.hasKey = true;
+
+    _quoteName(&e, key);
+    *e.out << ":";
+  }
+
+  // Same as _strBegin() for a scalar value.
+  void scalar(const Value& value) {
+    auto f = beginValue();
+    const char *separator = (f.isObjElement ? " " : "");
+
+    if (value.type() == Type::Double) {
+      double d = value;
+      *e.out << separator;
+      if (std::isnan(d) || std::isinf(d)) {
+        *e.out << Value(Type::Null).to_string();
+      } else if (!e.opt.allowMinusZero && d == 0 && std::signbit(d)) {
+        *e.out << Value(0).to_string();
+      } else {
+        *e.out << value.to_string();
+      }
+    } else {
+      *e.out << separator << value.to_string();
+    }
+
+    endValue();
+  }
+
+  void string(const std::string& str) {
+    auto f = beginValue();
+    _quote(&e, str, (f.isObjElement ? " " : ""), f.isRootObject, false);
+    endValue();
+  }
+};
+
+
+EventEncoder::EventEncoder(const EncoderOptions& options)
+  : prv(new Impl(options))
+{
+}
+
+
+EventEncoder::~EventEncoder() {
+}
+
+
+void EventEncoder::object_begin() {
+  prv->begin(true);
+}
+
+
+void EventEncoder::object_end() {
+  prv->end(true);
+}
+
+
+void EventEncoder::array_begin() {
+  prv->begin(false);
+}
+
+
+void EventEncoder::array_end() {
+  prv->end(false);
+}
+
+
+void EventEncoder::key(const char *key, size_t keySize) {
+  prv->buf.assign(key, keySize);
+  prv->key(prv->buf);
+}
+
+
+void EventEncoder::key(const std::string& key) {
+  prv->key(key);
+}
+
+
+void EventEncoder::string(const char *str, size_t strSize) {
+  prv->buf.assign(str, strSize);
+  prv->string(prv->buf);
+}
+
+
+void EventEncoder::string(const std::string& str) {
+  prv->string(str);
+}
+
+
+void EventEncoder::int64(std::int64_t i) {
+  prv->scalar(Value(i));
+}
+
+
+void EventEncoder::float64(double d) {
+  prv->scalar(Value(d));
+}
+
+
+void EventEncoder::boolean(bool b) {
+  prv->scalar(Value(b));
+}
+
+
+void EventEncoder::null() {
+  prv->scalar(Value(Type::Null));
+}
+
+
+std::string EventEncoder::str() {
+  std::string ret;
+  ret.swap(prv->out.buf);
+  prv->frames.clear();
+  prv->done = false;
+  prv->e.indent = 0;
+  return ret;
 }
 
 
@@ -585,11 +1684,103 @@ static void _marshalStream(const Value& v, const EncoderOptions& options,
 // an infinite recursion.
 //
 std::string Marshal(const Value& v, const EncoderOptions& options) {
-  std::ostringstream oss;
+  OutputBuffer out;
 
-  _marshalStream(v, options, &oss);
+  _marshalBuffer(v, options, &out);
 
-  return oss.str();
+  return std::move(out.buf);
+}
+
+
+// The state of an Encoder, of which the output buffer, the cached indentation
+// and the stack of _str() are kept between calls.
+class Encoder::Impl {
+public:
+  OutputBuffer out;
+  EncoderState e;
+  std::vector<StrFrame> frames;
+
+  Impl(const EncoderOptions& options) {
+    _initEncoder(&e, options, &out);
+    e.frames = &frames;
+  }
+};
+
+
+Encoder::Encoder(const EncoderOptions& options)
+  : prv(new Impl(options))
+{
+}
+
+
+Encoder::~Encoder() {
+}
+
+
+const std::string& Encoder::marshal(const Value& v) {
+  prv->out.buf.clear();
+  prv->out.flushed = 0;
+  prv->out.writeSeconds = 0;
+  prv->e.indent = 0;
+  prv->e.stats = nullptr;
+
+  _marshalState(&prv->e, v);
+
+  return prv->out.buf;
+}
+
+
+// The state of a DocumentWriter, kept for all documents like for an Encoder.
+class DocumentWriter::Impl {
+public:
+  OutputBuffer out;
+  EncoderState e;
+  std::vector<StrFrame> frames;
+
+  Impl(std::ostream *os, const EncoderOptions& options)
+    : out(os)
+  {
+    _initEncoder(&e, options, &out);
+    e.opt.stats = nullptr;
+    e.frames = &frames;
+  }
+};
+
+
+DocumentWriter::DocumentWriter(std::ostream& os, const EncoderOptions& options)
+  : prv(new Impl(&os, options))
+{
+}
+
+
+DocumentWriter::~DocumentWriter() {
+  try {
+    flush();
+  } catch (...) {
+  }
+}
+
+
+void DocumentWriter::write(const Value& doc) {
+  auto& e = prv->e;
+  e.indent = 0;
+
+  _marshalState(&e, doc);
+
+  // DocumentReader ends a document that does not start with a bracket at the
+  // next empty line.
+  prv->out << e.opt.eol;
+  if (doc.type() != Type::Vector && (doc.type() != Type::Map ||
+    e.opt.omitRootBraces))
+  {
+    prv->out << e.opt.eol;
+  }
+}
+
+
+void DocumentWriter::flush() {
+  prv->out.flush();
+  prv->out.os->flush();
 }
 
 
@@ -600,6 +1791,9 @@ void MarshalToFile(const Value& v, const std::string &path, const EncoderOptions
   }
   _marshalStream(v, options, &outputFile);
   outputFile << options.eol;
+  if (options.stats) {
+    options.stats->bytes += options.eol.size();
+  }
   outputFile.close();
 }
 
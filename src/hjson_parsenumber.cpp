@@ -1,5 +1,10 @@
 #include "hjson.h"
 #include <cmath>
+#include <cfloat>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <vector>
 #if HJSON_USE_CHARCONV
 # include <charconv>
 #elif HJSON_USE_STRTOD
@@ -16,58 +21,368 @@ namespace Hjson {
 struct Parser {
   const unsigned char *data;
   size_t dataSize;
-  int indexNext;
+  size_t indexNext;
   unsigned char ch;
 };
 
 
-static bool _parseFloat(double *pNumber, const char *pCh, size_t nCh) {
-#if HJSON_USE_CHARCONV
-  auto res = std::from_chars(pCh, pCh + nCh, *pNumber);
+// A decimal number of the form mantissa * 10^exponent. If a non-zero digit
+// had to be dropped because there were more than 19 significant digits,
+// truncated is true and the number cannot be converted by the built-in code.
+struct DecimalNumber {
+  std::uint64_t mantissa;
+  std::int64_t exponent;
+  int nDigits;
+  bool negative;
+  bool truncated;
+  bool hasFraction;
+  bool valid;
+};
 
-  return res.ptr == pCh + nCh && res.ec != std::errc::result_out_of_range &&
-    !std::isinf(*pNumber) && !std::isnan(*pNumber);
-#elif HJSON_USE_STRTOD
-  char *endptr;
-  errno = 0;
-  *pNumber = std::strtod(pCh, &endptr);
 
-  return !errno && endptr - pCh == nCh && !std::isinf(*pNumber) && !std::isnan(*pNumber);
+static const int _minPowerOfFive = -342;
+static const int _maxPowerOfFive = 342;
+
+
+// The 128 most significant bits of 5^q for each q in the range
+// [_minPowerOfFive, _maxPowerOfFive], as used by the Eisel-Lemire algorithm.
+// For negative q the values are rounded up. Computed once, on first use.
+class PowersOfFive {
+public:
+  std::uint64_t v[2 * (_maxPowerOfFive - _minPowerOfFive + 1)];
+
+  PowersOfFive();
+};
+
+
+static size_t _bitLength(const std::vector<std::uint32_t>& big) {
+  size_t n = big.size();
+  while (n > 0 && !big[n - 1]) {
+    --n;
+  }
+  if (!n) {
+    return 0;
+  }
+  size_t bits = (n - 1) * 32;
+  for (std::uint32_t top = big[n - 1]; top; top >>= 1) {
+    ++bits;
+  }
+  return bits;
+}
+
+
+// Returns the 128 bits of big that start at bit index pos (which can be
+// negative, meaning that the value is shifted left).
+static void _getBits128(std::uint64_t *pOut, const std::vector<std::uint32_t>& big,
+  std::ptrdiff_t pos)
+{
+  pOut[0] = pOut[1] = 0;
+  for (int a = 0; a < 128; ++a) {
+    std::ptrdiff_t bit = pos + a;
+    if (bit >= 0 && static_cast<size_t>(bit / 32) < big.size() &&
+      ((big[bit / 32] >> (bit % 32)) & 1))
+    {
+      pOut[a < 64 ? 1 : 0] |= std::uint64_t(1) << (a % 64);
+    }
+  }
+}
+
+
+static void _multiply(std::vector<std::uint32_t>& big, std::uint32_t factor) {
+  std::uint64_t carry = 0;
+  for (auto& limb : big) {
+    carry += std::uint64_t(limb) * factor;
+    limb = static_cast<std::uint32_t>(carry);
+    carry >>= 32;
+  }
+  if (carry) {
+    big.push_back(static_cast<std::uint32_t>(carry));
+  }
+}
+
+
+static void _divide(std::vector<std::uint32_t>& big, std::uint32_t divisor) {
+  std::uint64_t rest = 0;
+  for (size_t a = big.size(); a-- > 0;) {
+    rest = (rest << 32) | big[a];
+    big[a] = static_cast<std::uint32_t>(rest / divisor);
+    rest %= divisor;
+  }
+}
+
+
+static void _increment(std::vector<std::uint32_t>& big) {
+  for (auto& limb : big) {
+    if (++limb) {
+      return;
+    }
+  }
+  big.push_back(1);
+}
+
+
+PowersOfFive::PowersOfFive() {
+  std::vector<std::uint32_t> big(1, 1);
+
+  for (int q = 0; q <= _maxPowerOfFive; ++q) {
+    // Truncated, with the most significant bit at bit index 127.
+    _getBits128(v + 2 * (q - _minPowerOfFive), big,
+      static_cast<std::ptrdiff_t>(_bitLength(big)) - 128);
+    _multiply(big, 5);
+  }
+
+  for (int q = -1; q >= _minPowerOfFive; --q) {
+    std::vector<std::uint32_t> power(1, 1);
+    for (int a = 0; a < -q; ++a) {
+      _multiply(power, 5);
+    }
+    size_t z = _bitLength(power);
+    size_t b = (q >= -27 ? z + 127 : 2 * z + 128);
+
+    // 2^b / 5^-q + 1, computed by repeated division with powers of five that
+    // fit in 32 bits.
+    big.assign(b / 32 + 1, 0);
+    big[b / 32] = std::uint32_t(1) << (b % 32);
+    for (int n = -q; n > 0; n -= 13) {
+      std::uint32_t divisor = 1;
+      for (int a = 0; a < n && a < 13; ++a) {
+        divisor *= 5;
+      }
+      _divide(big, divisor);
+    }
+    _increment(big);
+
+    _getBits128(v + 2 * (q - _minPowerOfFive), big,
+      static_cast<std::ptrdiff_t>(_bitLength(big)) - 128);
+  }
+}
+
+
+static const std::uint64_t *_powerOfFive(int q) {
+  static const PowersOfFive powers;
+
+  return powers.v + 2 * (q - _minPowerOfFive);
+}
+
+
+// Returns the high 64 bits of a * b and stores the low 64 bits in *pLow.
+static std::uint64_t _multiplyHigh(std::uint64_t a, std::uint64_t b, std::uint64_t *pLow) {
+#if defined(__SIZEOF_INT128__)
+  __extension__ typedef unsigned __int128 uint128;
+  uint128 product = static_cast<uint128>(a) * b;
+  *pLow = static_cast<std::uint64_t>(product);
+  return static_cast<std::uint64_t>(product >> 64);
 #else
-  std::string str(pCh, nCh);
-  std::stringstream ss(str);
+  std::uint64_t aLow = a & 0xffffffff, aHigh = a >> 32;
+  std::uint64_t bLow = b & 0xffffffff, bHigh = b >> 32;
+  std::uint64_t ll = aLow * bLow, lh = aLow * bHigh, hl = aHigh * bLow, hh = aHigh * bHigh;
+  std::uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+  *pLow = (mid << 32) | (ll & 0xffffffff);
+  return hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
 
-  // Make sure we expect dot (not comma) as decimal point.
-  ss.imbue(std::locale::classic());
 
-  ss >> *pNumber;
+static int _countLeadingZeros(std::uint64_t x) {
+#if defined(__GNUC__)
+  return __builtin_clzll(x);
+#else
+  int n = 0;
+  for (int shift = 32; shift; shift >>= 1) {
+    if (!(x >> (64 - shift))) {
+      n += shift;
+      x <<= shift;
+    }
+  }
+  return n;
+#endif
+}
 
-  return ss.eof() && !ss.fail() && !std::isinf(*pNumber) && !std::isnan(*pNumber);
+
+static double _fromBits(std::uint64_t bits) {
+  double d;
+  std::memcpy(&d, &bits, sizeof(d));
+  return d;
+}
+
+
+// Computes the double closest to w * 10^q, rounding ties to even. Returns
+// false in the very rare cases where the Eisel-Lemire algorithm cannot decide
+// the rounding, the caller must then use a slower method. The result can be
+// zero, subnormal or infinite.
+static bool _computeDouble(double *pNumber, std::uint64_t w, std::int64_t q, bool negative) {
+  static const double powersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+  const std::uint64_t signBit = negative ? std::uint64_t(1) << 63 : 0;
+
+  if (!w || q < _minPowerOfFive) {
+    *pNumber = _fromBits(signBit);
+    return true;
+  }
+  if (q > 308) {
+    *pNumber = _fromBits(signBit | (std::uint64_t(0x7ff) << 52));
+    return true;
+  }
+
+#if FLT_EVAL_METHOD == 0
+  // Clinger's fast path: both w and 10^|q| are exact doubles, so a single
+  // correctly rounded operation gives the correctly rounded result.
+  if (q >= -22 && q <= 22 && w <= (std::uint64_t(1) << 53)) {
+    double d = static_cast<double>(w);
+    d = (q < 0 ? d / powersOfTen[-q] : d * powersOfTen[q]);
+    *pNumber = (negative ? -d : d);
+    return true;
+  }
 #endif
+
+  int iq = static_cast<int>(q);
+  int lz = _countLeadingZeros(w);
+  w <<= lz;
+
+  const std::uint64_t *pPower = _powerOfFive(iq);
+  std::uint64_t low;
+  std::uint64_t high = _multiplyHigh(w, pPower[0], &low);
+  if ((high & 0x1ff) == 0x1ff) {
+    std::uint64_t low2;
+    std::uint64_t high2 = _multiplyHigh(w, pPower[1], &low2);
+    low += high2;
+    if (high2 > low) {
+      ++high;
+    }
+  }
+  if (low == ~std::uint64_t(0) && (q < -27 || q > 55)) {
+    return false;
+  }
+
+  int upperBit = static_cast<int>(high >> 63);
+  std::uint64_t mantissa = high >> (upperBit + 9);
+  int power2 = ((217706 * iq) >> 16) + 63 + upperBit - lz + 1023;
+
+  if (power2 <= 0) {
+    // Subnormal or zero.
+    if (-power2 + 1 >= 64) {
+      *pNumber = _fromBits(signBit);
+      return true;
+    }
+    mantissa >>= -power2 + 1;
+    mantissa += (mantissa & 1);
+    mantissa >>= 1;
+    power2 = (mantissa < (std::uint64_t(1) << 52) ? 0 : 1);
+  } else {
+    // Exactly halfway between two doubles, round to even.
+    if (low <= 1 && q >= -4 && q <= 23 && (mantissa & 3) == 1 &&
+      (mantissa << (upperBit + 9)) == high)
+    {
+      mantissa &= ~std::uint64_t(1);
+    }
+    mantissa += (mantissa & 1);
+    mantissa >>= 1;
+    if (mantissa >= (std::uint64_t(2) << 52)) {
+      mantissa = std::uint64_t(1) << 52;
+      ++power2;
+    }
+    if (power2 >= 0x7ff) {
+      power2 = 0x7ff;
+      mantissa = 0;
+    }
+  }
+
+  *pNumber = _fromBits(signBit | (mantissa & ((std::uint64_t(1) << 52) - 1)) |
+    (static_cast<std::uint64_t>(power2) << 52));
+
+  return true;
+}
+
+
+static void _addDigit(DecimalNumber *pDec, unsigned char ch, bool isFraction) {
+  if (pDec->nDigits < 19) {
+    pDec->mantissa = pDec->mantissa * 10 + (ch - '0');
+    if (pDec->mantissa) {
+      ++pDec->nDigits;
+    }
+    if (isFraction) {
+      --pDec->exponent;
+    }
+  } else {
+    if (ch != '0') {
+      pDec->truncated = true;
+    }
+    if (!isFraction) {
+      ++pDec->exponent;
+    }
+  }
+}
+
+
+static void _addExponent(DecimalNumber *pDec, std::int64_t exponent, bool negative) {
+  // Saturate, anything this big is out of range anyway.
+  if (exponent > 100000) {
+    exponent = 100000;
+  }
+  pDec->exponent += (negative ? -exponent : exponent);
 }
 
 
-static bool _parseInt(std::int64_t *pNumber, const char *pCh, size_t nCh) {
+// Stores the number in *pNumber if it is an integer that fits in an int64.
+static bool _toInt(std::int64_t *pNumber, const DecimalNumber& dec) {
+  if (!dec.valid || dec.hasFraction || dec.truncated || dec.exponent) {
+    return false;
+  }
+
+  const std::uint64_t limit = std::uint64_t(1) << 63;
+
+  if (dec.negative) {
+    if (dec.mantissa > limit) {
+      return false;
+    }
+    *pNumber = (dec.mantissa == limit ? INT64_MIN :
+      -static_cast<std::int64_t>(dec.mantissa));
+  } else {
+    if (dec.mantissa >= limit) {
+      return false;
+    }
+    *pNumber = static_cast<std::int64_t>(dec.mantissa);
+  }
+
+  return true;
+}
+
+
+// Stores the number in *pNumber if it can be correctly rounded by the built-in
+// code and is neither infinite nor subnormal, nor a non-zero number rounded
+// to zero. Those cases are left to the configured number parser so that range
+// errors are handled the same way as before.
+static bool _toDouble(double *pNumber, const DecimalNumber& dec) {
+  return dec.valid && !dec.truncated &&
+    _computeDouble(pNumber, dec.mantissa, dec.exponent, dec.negative) &&
+    (!dec.mantissa || std::fabs(*pNumber) >= DBL_MIN) && std::fabs(*pNumber) <= DBL_MAX;
+}
+
+
+static bool _parseFloat(double *pNumber, const char *pCh, size_t nCh) {
 #if HJSON_USE_CHARCONV
   auto res = std::from_chars(pCh, pCh + nCh, *pNumber);
 
-  return res.ptr == pCh + nCh && res.ec != std::errc::result_out_of_range;
+  return res.ptr == pCh + nCh && res.ec != std::errc::result_out_of_range &&
+    !std::isinf(*pNumber) && !std::isnan(*pNumber);
 #elif HJSON_USE_STRTOD
   char *endptr;
   errno = 0;
-  *pNumber = std::strtoll(pCh, &endptr, 0);
+  *pNumber = std::strtod(pCh, &endptr);
 
-  return !errno && endptr - pCh == nCh;
+  return !errno && endptr - pCh == nCh && !std::isinf(*pNumber) && !std::isnan(*pNumber);
 #else
   std::string str(pCh, nCh);
   std::stringstream ss(str);
 
-  // Avoid localization surprises.
+  // Make sure we expect dot (not comma) as decimal point.
   ss.imbue(std::locale::classic());
 
   ss >> *pNumber;
 
-  return ss.eof() && !ss.fail();
+  return ss.eof() && !ss.fail() && !std::isinf(*pNumber) && !std::isnan(*pNumber);
 #endif
 }
 
@@ -89,53 +404,87 @@ static bool _next(Parser *p) {
 }
 
 
-// Parse a number value. The parameter "text" must be zero terminated.
-bool tryParseNumber(Value *pValue, const char *text, size_t textSize, bool stopAtNext) {
-  Parser p = {
-    (const unsigned char*) text,
-    textSize,
-    0,
-    ' '
-  };
-
-  int leadingZeros = 0;
+// Reads digits with an optional sign, decimal point and exponent. Returns the
+// number of leading zeros in the integer part, minus one if the integer part
+// is a single zero. pDec->valid is false if there were no digits in the
+// integer part or in the exponent.
+static std::ptrdiff_t _scanNumber(Parser *p, DecimalNumber *pDec) {
+  std::ptrdiff_t leadingZeros = 0;
   bool testLeading = true;
 
-  _next(&p);
+  *pDec = DecimalNumber();
 
-  if (p.ch == '-') {
-    _next(&p);
+  _next(p);
+
+  if (p->ch == '-') {
+    pDec->negative = true;
+    _next(p);
   }
 
-  while (p.ch >= '0' && p.ch <= '9') {
+  pDec->valid = (p->ch >= '0' && p->ch <= '9');
+
+  while (p->ch >= '0' && p->ch <= '9') {
     if (testLeading) {
-      if (p.ch == '0') {
+      if (p->ch == '0') {
         leadingZeros++;
       } else {
         testLeading = false;
       }
     }
-    _next(&p);
+    _addDigit(pDec, p->ch, false);
+    _next(p);
   }
 
   if (testLeading) {
     leadingZeros--;
   } // single 0 is allowed
 
-  if (p.ch == '.') {
-    while (_next(&p) && p.ch >= '0' && p.ch <= '9') {
+  if (p->ch == '.') {
+    pDec->hasFraction = true;
+    while (_next(p) && p->ch >= '0' && p->ch <= '9') {
+      _addDigit(pDec, p->ch, true);
     }
   }
-  if (p.ch == 'e' || p.ch == 'E') {
-    _next(&p);
-    if (p.ch == '-' || p.ch == '+') {
-      _next(&p);
+  if (p->ch == 'e' || p->ch == 'E') {
+    pDec->hasFraction = true;
+    _next(p);
+    bool negative = (p->ch == '-');
+    if (p->ch == '-' || p->ch == '+') {
+      _next(p);
     }
-    while (p.ch >= '0' && p.ch <= '9') {
-      _next(&p);
+    if (p->ch < '0' || p->ch > '9') {
+      pDec->valid = false;
+    }
+    std::int64_t exponent = 0;
+    while (p->ch >= '0' && p->ch <= '9') {
+      if (exponent <= 100000) {
+        exponent = exponent * 10 + (p->ch - '0');
+      }
+      _next(p);
     }
+    _addExponent(pDec, exponent, negative);
   }
 
+  return leadingZeros;
+}
+
+
+// Parse a number value. The parameter "text" must be zero terminated. If the
+// number is an integer that fits in an int64 it is stored in *pInt and *pIsInt
+// is set to true, otherwise it is stored in *pDouble.
+bool tryParseNumber(std::int64_t *pInt, double *pDouble, bool *pIsInt,
+  const char *text, size_t textSize, bool stopAtNext)
+{
+  Parser p = {
+    (const unsigned char*) text,
+    textSize,
+    0,
+    ' '
+  };
+
+  DecimalNumber dec;
+  std::ptrdiff_t leadingZeros = _scanNumber(&p, &dec);
+
   auto end = p.indexNext;
 
   // skip white/to (newline)
@@ -158,25 +507,311 @@ bool tryParseNumber(Value *pValue, const char *text, size_t textSize, bool stopA
     return false;
   }
 
+  // The built-in conversions handle everything except more than 19
+  // significant digits and numbers that are out of range.
+  if (_toInt(pInt, dec)) {
+    *pIsInt = true;
+    return true;
+  } else if (_toDouble(pDouble, dec) || _parseFloat(pDouble, (char*) p.data, end - 1)) {
+    *pIsInt = false;
+    return true;
+  }
+
+  return false;
+}
+
+
+bool tryParseNumber(Value *pValue, const char *text, size_t textSize, bool stopAtNext) {
   std::int64_t i;
-  if (_parseInt(&i, (char*) p.data, end - 1)) {
+  double d;
+  bool isInt;
+
+  if (!tryParseNumber(&i, &d, &isInt, text, textSize, stopAtNext)) {
+    return false;
+  }
+
+  if (isInt) {
     *pValue = Value(i);
-    return true;
   } else {
-    double d;
-    if (_parseFloat(&d, (char*) p.data, end - 1)) {
-      *pValue = Value(d);
-      return true;
-    }
+    *pValue = Value(d);
   }
 
-  return false;
+  return true;
 }
 
 
 bool startsWithNumber(const char *text, size_t textSize) {
-  Value number;
-  return tryParseNumber(&number, text, textSize, true);
+  std::int64_t i;
+  double d;
+  bool isInt;
+  return tryParseNumber(&i, &d, &isInt, text, textSize, true);
+}
+
+
+// Converts the whole string to an int64 if it only contains decimal digits
+// (without leading zeros) and an optional minus sign. Returns false for
+// anything else, the caller must then use the configured number parser.
+bool fastParseInt(std::int64_t *pNumber, const char *text, size_t textSize) {
+  Parser p = {
+    (const unsigned char*) text,
+    textSize,
+    0,
+    ' '
+  };
+
+  DecimalNumber dec;
+  std::ptrdiff_t leadingZeros = _scanNumber(&p, &dec);
+
+  return p.indexNext == textSize + 1 && !leadingZeros && _toInt(pNumber, dec);
+}
+
+
+// Converts the whole string to a double if it is a plain decimal number that
+// can be converted without the configured number parser.
+bool fastParseDouble(double *pNumber, const char *text, size_t textSize) {
+  Parser p = {
+    (const unsigned char*) text,
+    textSize,
+    0,
+    ' '
+  };
+
+  DecimalNumber dec;
+  _scanNumber(&p, &dec);
+
+  return p.indexNext == textSize + 1 && _toDouble(pNumber, dec);
+}
+
+
+struct UInt128 {
+  std::uint64_t high;
+  std::uint64_t low;
+};
+
+
+static UInt128 _add(UInt128 a, UInt128 b) {
+  UInt128 ret = {a.high + b.high, a.low + b.low};
+  if (ret.low < a.low) {
+    ++ret.high;
+  }
+  return ret;
+}
+
+
+static UInt128 _subtract(UInt128 a, UInt128 b) {
+  UInt128 ret = {a.high - b.high, a.low - b.low};
+  if (a.low < b.low) {
+    --ret.high;
+  }
+  return ret;
+}
+
+
+// Returns the 128 bits of the 192 bit number (p2, p1, p0) that start at bit
+// index shift.
+static UInt128 _shiftRight(std::uint64_t p2, std::uint64_t p1, std::uint64_t p0, int shift) {
+  while (shift >= 64) {
+    p0 = p1;
+    p1 = p2;
+    p2 = 0;
+    shift -= 64;
+  }
+  if (shift) {
+    p0 = (p0 >> shift) | (p1 << (64 - shift));
+    p1 = (p1 >> shift) | (p2 << (64 - shift));
+  }
+  UInt128 ret = {p1, p0};
+  return ret;
+}
+
+
+// Writes the shortest string that is parsed back into exactly the value d,
+// choosing between fixed and scientific notation in the same way as
+// std::to_chars(). If several strings of that length would be parsed back into
+// d the one closest to d is used. buf must have room for at least 32 chars.
+// Returns the number of chars written, or 0 if d is infinite or NaN.
+size_t formatDouble(char *buf, double d) {
+  std::uint64_t bits;
+  std::memcpy(&bits, &d, sizeof(bits));
+
+  char *pCh = buf;
+  if (bits >> 63) {
+    *pCh++ = '-';
+  }
+
+  const std::uint64_t fractionMask = (std::uint64_t(1) << 52) - 1;
+  int biased = static_cast<int>((bits >> 52) & 0x7ff);
+  std::uint64_t fraction = bits & fractionMask;
+
+  if (biased == 0x7ff) {
+    return 0;
+  }
+  if (!biased && !fraction) {
+    *pCh++ = '0';
+    return pCh - buf;
+  }
+
+  // |d| = m * 2^e
+  std::uint64_t m = (biased ? fraction | (std::uint64_t(1) << 52) : fraction);
+  int e = (biased ? biased - 1075 : -1074);
+  double absD = _fromBits(bits & ~(std::uint64_t(1) << 63));
+
+  // The first guess for k can be one too big.
+  int log2 = e + 63 - _countLeadingZeros(m);
+  int k = 16 - ((log2 * 78913) >> 18);
+  UInt128 x, halfUlp;
+
+  for (;;) {
+    // x = |d| * 10^k in fixed point with 64 fraction bits, should be in the
+    // range [10^16, 10^17).
+    const std::uint64_t *pPower = _powerOfFive(k);
+    int shift = 63 - e - ((217706 * k) >> 16);
+    std::uint64_t p0, p1, p2;
+    std::uint64_t carry = _multiplyHigh(m, pPower[1], &p0);
+    p2 = _multiplyHigh(m, pPower[0], &p1);
+    p1 += carry;
+    if (p1 < carry) {
+      ++p2;
+    }
+    x = _shiftRight(p2, p1, p0, shift);
+    halfUlp = _shiftRight(0, pPower[0], pPower[1], shift + 1);
+
+    if (x.high < 100000000000000000ULL) {
+      break;
+    }
+    --k;
+  }
+
+  // Every decimal number in the range (lower, upper) is parsed back into d,
+  // the range is widened a little bit to leave room for rounding errors since
+  // each candidate is verified anyway.
+  UInt128 lowerGap = halfUlp;
+  if (!fraction && biased > 1) {
+    lowerGap.low = (lowerGap.low >> 1) | (lowerGap.high << 63);
+    lowerGap.high >>= 1;
+  }
+  const UInt128 margin = {0, std::uint64_t(1) << 32};
+  UInt128 lower = _subtract(_subtract(x, lowerGap), margin);
+  UInt128 upper = _add(_add(x, halfUlp), margin);
+  std::uint64_t lowerInt = lower.high + (lower.low ? 1 : 0);
+  std::uint64_t upperInt = upper.high;
+
+  // Find the biggest power of ten that has a multiple in the range.
+  std::uint64_t p = 1;
+  int pExp = 0;
+  while (pExp < 17 && upperInt / (p * 10) * (p * 10) >= lowerInt) {
+    p *= 10;
+    ++pExp;
+  }
+
+  std::uint64_t digits = 0;
+  for (;;) {
+    std::uint64_t cMin = (lowerInt + p - 1) / p;
+    std::uint64_t cMax = upperInt / p;
+    // x / p rounded to nearest, ties to even.
+    std::uint64_t c = x.high / p;
+    UInt128 rest = {x.high % p, x.low};
+    UInt128 half = {p / 2, (p == 1 ? std::uint64_t(1) << 63 : 0)};
+    if (rest.high > half.high || (rest.high == half.high &&
+      (rest.low > half.low || (rest.low == half.low && (c & 1)))))
+    {
+      ++c;
+    }
+    c = std::min(std::max(c, cMin), cMax);
+    std::uint64_t candidates[3] = {c, c + 1, c - 1};
+    if (x.high < c * p) {
+      std::swap(candidates[1], candidates[2]);
+    }
+
+    for (auto candidate : candidates) {
+      double r;
+      if (candidate >= cMin && candidate <= cMax &&
+        _computeDouble(&r, candidate, pExp - k, false) && r == absD)
+      {
+        digits = candidate;
+        break;
+      }
+    }
+
+    if (digits) {
+      break;
+    }
+    if (!pExp) {
+      // Should not happen, the closest 17 digit number is always correct.
+      digits = c;
+      break;
+    }
+    p /= 10;
+    --pExp;
+  }
+
+  while (digits % 10 == 0) {
+    digits /= 10;
+    ++pExp;
+  }
+
+  char digitBuf[20];
+  int nDigits = 0;
+  for (; digits; digits /= 10) {
+    digitBuf[nDigits++] = static_cast<char>('0' + digits % 10);
+  }
+  std::reverse(digitBuf, digitBuf + nDigits);
+
+  // The exponent of the first digit in scientific notation.
+  int exp10 = pExp - k + nDigits - 1;
+  int absExp = (exp10 < 0 ? -exp10 : exp10);
+  int sciLen = nDigits + (nDigits > 1 ? 1 : 0) + 2 + (absExp >= 100 ? 3 : 2);
+  int fixedLen = (exp10 < 0 ? nDigits + 1 - exp10 :
+    (nDigits > exp10 + 1 ? nDigits + 1 : exp10 + 1));
+
+  if (fixedLen <= sciLen) {
+    if (exp10 < 0) {
+      *pCh++ = '0';
+      *pCh++ = '.';
+      for (int a = -1; a > exp10; --a) {
+        *pCh++ = '0';
+      }
+      std::memcpy(pCh, digitBuf, nDigits);
+      pCh += nDigits;
+    } else if (nDigits <= exp10 + 1 && e > 0) {
+      // Like std::to_chars(), write the exact value of big integers instead of
+      // padding the shortest digits with zeros. m * 2^e has exp10 + 1 digits.
+      UInt128 value = {m >> (64 - e), m << e};
+      for (int a = exp10; a >= 0; --a) {
+        std::uint64_t rest = value.high % 10;
+        value.high /= 10;
+        std::uint64_t part = (rest << 32) | (value.low >> 32);
+        std::uint64_t q1 = part / 10;
+        part = ((part % 10) << 32) | (value.low & 0xffffffff);
+        value.low = (q1 << 32) | (part / 10);
+        pCh[a] = static_cast<char>('0' + part % 10);
+      }
+      pCh += exp10 + 1;
+    } else {
+      for (int a = 0; a < nDigits || a <= exp10; ++a) {
+        if (a == exp10 + 1) {
+          *pCh++ = '.';
+        }
+        *pCh++ = (a < nDigits ? digitBuf[a] : '0');
+      }
+    }
+  } else {
+    *pCh++ = digitBuf[0];
+    if (nDigits > 1) {
+      *pCh++ = '.';
+      std::memcpy(pCh, digitBuf + 1, nDigits - 1);
+      pCh += nDigits - 1;
+    }
+    *pCh++ = 'e';
+    *pCh++ = (exp10 < 0 ? '-' : '+');
+    if (absExp >= 100) {
+      *pCh++ = static_cast<char>('0' + absExp / 100);
+    }
+    *pCh++ = static_cast<char>('0' + absExp / 10 % 10);
+    *pCh++ = static_cast<char>('0' + absExp % 10);
+  }
+
+  return pCh - buf;
 }
 
 
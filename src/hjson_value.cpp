@@ -2,14 +2,18 @@
 #include <vector>
 #include <assert.h>
 #include <cstring>
+#include <cstdint>
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <ostream>
 #if HJSON_USE_CHARCONV
 # include <charconv>
 # include <array>
 #elif HJSON_USE_STRTOD
 # include <cstdlib>
 # include <cerrno>
-# include <cstdio>
 #else
 # include <sstream>
 #endif
@@ -18,93 +22,783 @@
 namespace Hjson {
 
 
-typedef std::vector<std::string> KeyVec;
-typedef std::vector<Value> ValueVec;
-typedef std::map<std::string, Value> ValueMap;
+bool fastParseInt(std::int64_t *pNumber, const char *text, size_t textSize);
+bool fastParseDouble(double *pNumber, const char *text, size_t textSize);
+#if !HJSON_USE_CHARCONV
+size_t formatDouble(char *buf, double d);
+#endif
+Value decodeLazy(const std::shared_ptr<LazyDocument>& doc, size_t container);
+
+
+// Monotonic memory arena. When DecoderOptions::arena is true, the nodes,
+// comment blocks and vectors of the Value tree created by Unmarshal() are
+// allocated from an arena (but not the buffers of long strings and keys).
+// Freeing memory in the arena is a no-op, instead all memory is released at
+// once when the last object allocated in the arena is destroyed.
+class Arena : public std::enable_shared_from_this<Arena> {
+public:
+  // No more allocations will be made from the arena when it is sealed, any
+  // later allocations (e.g. a vector growing) are made on the heap instead.
+  bool sealed;
+
+  Arena(size_t sizeHint);
+  ~Arena();
+  void *allocate(size_t size, size_t alignment);
+  bool contains(const void *p) const;
+
+private:
+  struct Block {
+    char *data;
+    size_t size;
+  };
+
+  std::vector<Block> blocks;
+  char *cur, *end;
+  size_t nextBlockSize;
+};
+
+
+// The arena used for all new nodes created by the current thread, or null if
+// the heap should be used.
+static thread_local Arena *_threadArena = nullptr;
+
 
+// The statistics that the heap allocations made for Value trees by the
+// current thread are counted in, or null if they should not be counted.
+static thread_local DecoderStats *_threadStats = nullptr;
 
+
+// Only strings with a larger capacity than this have a separate heap buffer.
+static const size_t _shortStringCapacity = std::string().capacity();
+
+
+static void *_heapAllocate(size_t size) {
+  if (_threadStats) {
+    ++_threadStats->allocations;
+    _threadStats->allocatedBytes += size;
+  }
+
+  return ::operator new(size);
+}
+
+
+// Counts the heap buffer of the string, if it has one.
+static void _countString(const std::string& str) {
+  if (_threadStats && str.capacity() > _shortStringCapacity) {
+    ++_threadStats->allocations;
+    _threadStats->allocatedBytes += str.capacity() + 1;
+  }
+}
+
+
+// Like std::allocator, but counts the allocations.
+template<class T>
+class HeapAllocator {
+public:
+  typedef T value_type;
+
+  HeapAllocator() {
+  }
+
+  template<class U>
+  HeapAllocator(const HeapAllocator<U>&) {
+  }
+
+  T *allocate(size_t n) {
+    return static_cast<T*>(_heapAllocate(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t) {
+    ::operator delete(p);
+  }
+
+  template<class U>
+  bool operator==(const HeapAllocator<U>&) const {
+    return true;
+  }
+
+  template<class U>
+  bool operator!=(const HeapAllocator<U>&) const {
+    return false;
+  }
+};
+
+
+// Allocates from the arena if the arena is set and not sealed, otherwise from
+// the heap.
+template<class T>
+class ArenaAllocator {
+public:
+  typedef T value_type;
+
+  std::shared_ptr<Arena> arena;
+
+  ArenaAllocator(Arena *_arena)
+    : arena(_arena ? _arena->shared_from_this() : nullptr)
+  {
+  }
+
+  template<class U>
+  ArenaAllocator(const ArenaAllocator<U>& other)
+    : arena(other.arena)
+  {
+  }
+
+  T *allocate(size_t n) {
+    if (arena && !arena->sealed) {
+      return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    return static_cast<T*>(_heapAllocate(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_t) {
+    if (!arena || !arena->contains(p)) {
+      ::operator delete(p);
+    }
+  }
+
+  template<class U>
+  bool operator==(const ArenaAllocator<U>& other) const {
+    return arena == other.arena;
+  }
+
+  template<class U>
+  bool operator!=(const ArenaAllocator<U>& other) const {
+    return arena != other.arena;
+  }
+};
+
+
+typedef std::vector<Value, ArenaAllocator<Value> > ValueVec;
+
+
+// Maps with more elements than this get a hash index, smaller maps are
+// searched linearly.
+static const size_t _mapIndexThreshold = 8;
+
+
+// Serializes the building of sorted views, so that concurrent iterations over
+// the same const Value are safe.
+static std::mutex _sortedViewMutex;
+
+
+typedef std::vector<Value::MapEntry*, ArenaAllocator<Value::MapEntry*> >
+  MapEntryVec;
+
+
+// The elements of a Map in insertion order. Each element is allocated on its
+// own so that references to it stay valid when other elements are added or
+// removed. The sorted view used by Value::begin() and Value::end() is only
+// built when needed.
 class ValueVecMap {
 public:
-  KeyVec v;
-  ValueMap m;
+  typedef Value::MapEntry MapEntry;
+
+  MapEntryVec v;
+
+  ValueVecMap(Arena *arena);
+  ~ValueVecMap();
+  // Returns the insertion index of the key, or std::string::npos.
+  size_t find(const std::string& key) const;
+  // Like find(key), but with the hash of key already computed.
+  size_t find(const std::string& key, size_t hash) const;
+  // Does nothing if the key already exists.
+  void insert(const std::string& key, Value&& val);
+  // Returns the insertion index of the key, and true if the key and val were
+  // moved into a new element. Otherwise they are left untouched.
+  std::pair<size_t, bool> try_emplace(std::string&& key, Value&& val);
+  void reserve(size_t size);
+  void erase(size_t pos);
+  void move(size_t from, size_t to);
+  void clear();
+  void clone_from(const ValueVecMap& other);
+  const MapEntryVec& sortedView();
+
+private:
+  ArenaAllocator<MapEntry> alloc;
+  // The hash of the key of each element in v, only kept while there is an
+  // index. Small maps, like the records in a large array, then need neither
+  // the memory nor the time to hash their keys.
+  std::vector<size_t, ArenaAllocator<size_t> > hashes;
+  // Open addressing with linear probing. Each slot contains the insertion
+  // index plus one, or zero if the slot is empty.
+  std::vector<size_t, ArenaAllocator<size_t> > index;
+  MapEntryVec sorted;
+  std::atomic<bool> sortedValid;
+
+  size_t findInIndex(const std::string& key, size_t hash) const;
+  void addToIndex(size_t pos);
+  void rebuildIndex();
+  void resizeIndex(size_t size);
+};
+
+
+ValueVecMap::ValueVecMap(Arena *arena)
+  : v(ArenaAllocator<Value::MapEntry*>(arena)),
+  alloc(arena),
+  hashes(ArenaAllocator<size_t>(arena)),
+  index(ArenaAllocator<size_t>(arena)),
+  sorted(ArenaAllocator<Value::MapEntry*>(arena)),
+  sortedValid(false)
+{
+}
+
+
+ValueVecMap::~ValueVecMap() {
+  clear();
+}
+
+
+size_t ValueVecMap::find(const std::string& key) const {
+  // The hash is only used if there is an index.
+  return find(key, index.empty() ? 0 : std::hash<std::string>()(key));
+}
+
+
+size_t ValueVecMap::find(const std::string& key, size_t hash) const {
+  if (index.empty()) {
+    for (size_t pos = 0; pos < v.size(); ++pos) {
+      if (v[pos]->first == key) {
+        return pos;
+      }
+    }
+    return std::string::npos;
+  }
+
+  return findInIndex(key, hash);
+}
+
+
+size_t ValueVecMap::findInIndex(const std::string& key, size_t hash) const {
+  size_t mask = index.size() - 1;
+  for (size_t slot = hash & mask; index[slot]; slot = (slot + 1) & mask) {
+    size_t pos = index[slot] - 1;
+    if (hashes[pos] == hash && v[pos]->first == key) {
+      return pos;
+    }
+  }
+
+  return std::string::npos;
+}
+
+
+void ValueVecMap::insert(const std::string& key, Value&& val) {
+  try_emplace(std::string(key), std::move(val));
+}
+
+
+std::pair<size_t, bool> ValueVecMap::try_emplace(std::string&& key,
+  Value&& val)
+{
+  size_t hash = index.empty() ? 0 : std::hash<std::string>()(key);
+  size_t pos = find(key, hash);
+  if (pos != std::string::npos) {
+    return std::make_pair(pos, false);
+  }
+
+  auto elem = alloc.allocate(1);
+  try {
+    new(elem) MapEntry(std::move(key), std::move(val));
+  } catch (...) {
+    alloc.deallocate(elem, 1);
+    throw;
+  }
+  _countString(elem->first);
+  try {
+    if (!index.empty()) {
+      hashes.push_back(hash);
+    }
+    v.push_back(elem);
+  } catch (...) {
+    if (hashes.size() > v.size()) {
+      hashes.pop_back();
+    }
+    elem->~MapEntry();
+    alloc.deallocate(elem, 1);
+    throw;
+  }
+  sortedValid = false;
+
+  // Keep the load factor at most 1/2.
+  if (v.size() > _mapIndexThreshold && v.size() * 2 > index.size()) {
+    rebuildIndex();
+  } else if (!index.empty()) {
+    addToIndex(v.size() - 1);
+  }
+
+  return std::make_pair(v.size() - 1, true);
+}
+
+
+void ValueVecMap::reserve(size_t size) {
+  v.reserve(size);
+  if (size > _mapIndexThreshold && size * 2 > index.size()) {
+    hashes.reserve(size);
+    resizeIndex(size);
+  }
+}
+
+
+void ValueVecMap::erase(size_t pos) {
+  auto elem = v[pos];
+  v.erase(v.begin() + pos);
+  if (!index.empty()) {
+    hashes.erase(hashes.begin() + pos);
+  }
+  elem->~MapEntry();
+  alloc.deallocate(elem, 1);
+  sortedValid = false;
+  rebuildIndex();
+}
+
+
+void ValueVecMap::move(size_t from, size_t to) {
+  if (to < from) {
+    std::rotate(v.begin() + to, v.begin() + from, v.begin() + from + 1);
+    if (!index.empty()) {
+      std::rotate(hashes.begin() + to, hashes.begin() + from,
+        hashes.begin() + from + 1);
+    }
+  } else {
+    std::rotate(v.begin() + from, v.begin() + from + 1, v.begin() + to);
+    if (!index.empty()) {
+      std::rotate(hashes.begin() + from, hashes.begin() + from + 1,
+        hashes.begin() + to);
+    }
+  }
+  rebuildIndex();
+}
+
+
+void ValueVecMap::clear() {
+  for (auto elem : v) {
+    elem->~MapEntry();
+    alloc.deallocate(elem, 1);
+  }
+  v.clear();
+  hashes.clear();
+  index.clear();
+  sortedValid = false;
+}
+
+
+// Returns a copy of val, except that a Vector or Map is replaced by a new
+// empty one with the same comments. Used for cloning without recursion.
+static Value _cloneShell(const Value& val) {
+  if (val.type() != Type::Vector && val.type() != Type::Map) {
+    return val;
+  }
+
+  Value ret(val.type());
+  ret.set_comments(val);
+  return ret;
+}
+
+
+// Makes this empty map a copy of other, where the Vectors and Maps among the
+// values are replaced by empty ones (filled in by Value::clone()). The hashes
+// and the index are copied from other instead of being computed again.
+void ValueVecMap::clone_from(const ValueVecMap& other) {
+  v.reserve(other.v.size());
+  for (auto src : other.v) {
+    auto elem = alloc.allocate(1);
+    try {
+      new(elem) MapEntry(src->first, _cloneShell(src->second));
+    } catch (...) {
+      alloc.deallocate(elem, 1);
+      throw;
+    }
+    v.push_back(elem);
+  }
+  hashes.assign(other.hashes.begin(), other.hashes.end());
+  index.assign(other.index.begin(), other.index.end());
+  sortedValid = false;
+}
+
+
+const MapEntryVec& ValueVecMap::sortedView() {
+  if (!sortedValid.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(_sortedViewMutex);
+    if (!sortedValid.load(std::memory_order_relaxed)) {
+      sorted.assign(v.begin(), v.end());
+      std::sort(sorted.begin(), sorted.end(),
+        [](const Value::MapEntry *a, const Value::MapEntry *b) {
+          return a->first < b->first;
+        });
+      sortedValid.store(true, std::memory_order_release);
+    }
+  }
+
+  return sorted;
+}
+
+
+void ValueVecMap::addToIndex(size_t pos) {
+  size_t mask = index.size() - 1;
+  size_t slot = hashes[pos] & mask;
+  while (index[slot]) {
+    slot = (slot + 1) & mask;
+  }
+  index[slot] = pos + 1;
+}
+
+
+void ValueVecMap::rebuildIndex() {
+  index.clear();
+  if (v.size() > _mapIndexThreshold) {
+    resizeIndex(v.size());
+  } else {
+    hashes.clear();
+  }
+}
+
+
+// Makes the index large enough for the given number of elements.
+void ValueVecMap::resizeIndex(size_t size) {
+  // The hashes are missing if the map did not have an index before.
+  if (hashes.size() != v.size()) {
+    hashes.clear();
+    hashes.reserve(std::max(size, v.size()));
+    for (auto elem : v) {
+      hashes.push_back(std::hash<std::string>()(elem->first));
+    }
+  }
+
+  size_t indexSize = 16;
+  while (indexSize < size * 4) {
+    indexSize *= 2;
+  }
+  index.assign(indexSize, 0);
+  for (size_t pos = 0; pos < v.size(); ++pos) {
+    addToIndex(pos);
+  }
+}
+
+
+// Serializes the decoding of lazy Vectors and Maps, so that concurrent reads
+// of the same const Value are safe.
+static std::mutex _lazyMutex;
+
+
+// A Vector or Map of a lazily decoded document (see DecoderOptions::lazy)
+// whose elements have not been decoded yet.
+class LazyRef {
+public:
+  std::shared_ptr<LazyDocument> doc;
+  // The position of the Vector or Map among all Vectors and Maps in doc.
+  size_t container;
 };
 
 
 class Value::ValueImpl {
 public:
   Type type;
+  // True while lz is used instead of v or m.
+  std::atomic<bool> lazy;
   union {
-    bool b;
-    double d;
-    std::int64_t i;
     std::string *s;
     ValueVec *v;
     ValueVecMap *m;
+    LazyRef *lz;
   };
+  // The arena that s, v or m was allocated from, or null for the heap.
+  Arena *arena;
+  // Changed whenever pointers to the elements of v or m might have become
+  // invalid, i.e. when elements are removed or v is reallocated. Used by
+  // CachedPath to check that a cached lookup is still valid.
+  size_t version;
 
-  ValueImpl();
-  ValueImpl(bool);
-  ValueImpl(double);
-  explicit ValueImpl(std::int64_t);
   ValueImpl(const std::string&);
   ValueImpl(Type);
+  ValueImpl(Type, const std::shared_ptr<LazyDocument>&, size_t);
   ~ValueImpl();
+
+  // v and m must only be accessed through vec() and map(), which first decode
+  // the elements if they have not been decoded yet.
+  ValueVec *vec() {
+    if (lazy.load(std::memory_order_acquire)) {
+      expand();
+    }
+    return v;
+  }
+
+  ValueVecMap *map() {
+    if (lazy.load(std::memory_order_acquire)) {
+      expand();
+    }
+    return m;
+  }
+
+  void expand();
+  void releaseChildren();
+
+  // While the outermost Vector or Map is being destroyed by this thread, the
+  // Vectors and Maps inside it that are not referenced by any other Value are
+  // moved here, and destroyed one at a time by that outermost destructor.
+  // Otherwise the destruction of a deep tree would recurse once per level.
+  static thread_local std::vector<std::shared_ptr<ValueImpl> > *releasing;
+
+  template<class... Args>
+  static std::shared_ptr<ValueImpl> make(Args&&... args) {
+    if (_threadArena) {
+      return std::allocate_shared<ValueImpl>(ArenaAllocator<ValueImpl>(
+        _threadArena), std::forward<Args>(args)...);
+    }
+
+    return std::allocate_shared<ValueImpl>(HeapAllocator<ValueImpl>(),
+      std::forward<Args>(args)...);
+  }
 };
 
 
+// The text of the comments is stored in source, which the decoder shares
+// between all Values in the same document. A comment is only copied out of
+// source when it is read. Copies of a Value share the same Comments object
+// until the comments of one of them are changed.
 class Value::Comments {
 public:
-  std::string m_commentBefore, m_commentKey, m_commentInside, m_commentAfter;
+  // In the same order as CommentSlot in hjson_decode.cpp.
+  enum Slot {
+    Before,
+    Key,
+    Inside,
+    After,
+    SlotCount
+  };
+
+  class Range {
+  public:
+    size_t pos, size;
+  };
+
+  std::shared_ptr<std::string> source;
+  Range ranges[SlotCount];
+
+  Comments()
+    : ranges()
+  {
+  }
+
+  std::string get(int slot) const {
+    auto& r = ranges[slot];
+    return r.size ? source->substr(r.pos, r.size) : std::string();
+  }
+
+  StringRef ref(int slot) const {
+    auto& r = ranges[slot];
+    return r.size ? StringRef(source->data() + r.pos, r.size) : StringRef();
+  }
+
+  // Copies the text of all comments into a new source, with str as the
+  // comment in the given slot. The text is not added to the old source, that
+  // might be shared with other Values.
+  void set(int slot, const std::string& str) {
+    auto newSource = std::make_shared<std::string>();
+    for (int a = 0; a < SlotCount; ++a) {
+      size_t pos = newSource->size();
+      if (a == slot) {
+        newSource->append(str);
+      } else if (ranges[a].size) {
+        newSource->append(*source, ranges[a].pos, ranges[a].size);
+      }
+      ranges[a] = Range{ pos, newSource->size() - pos };
+    }
+    source = std::move(newSource);
+  }
+
+  // Makes the comment in the given slot the range [pos, pos + size) of src,
+  // or appends that range to the comment if append is true.
+  void set_range(int slot, const std::shared_ptr<std::string>& src, size_t pos,
+    size_t size, bool append)
+  {
+    if (!size) {
+      if (!append) {
+        ranges[slot] = Range{ 0, 0 };
+      }
+      return;
+    }
+
+    if (source != src) {
+      // All comments must use the same source.
+      for (auto& r : ranges) {
+        if (r.size) {
+          size_t newPos = src->size();
+          src->append(*source, r.pos, r.size);
+          r.pos = newPos;
+        }
+      }
+      source = src;
+    }
+
+    auto& r = ranges[slot];
+    if (!append || !r.size) {
+      r = Range{ pos, size };
+    } else if (r.pos + r.size == pos) {
+      r.size += size;
+    } else {
+      size_t newPos = source->size();
+      source->append(*source, r.pos, r.size);
+      source->append(*source, pos, size);
+      r = Range{ newPos, r.size + size };
+    }
+  }
+
+  template<class... Args>
+  static std::shared_ptr<Comments> make(Args&&... args) {
+    if (_threadArena) {
+      return std::allocate_shared<Comments>(ArenaAllocator<Comments>(
+        _threadArena), std::forward<Args>(args)...);
+    }
+
+    return std::allocate_shared<Comments>(HeapAllocator<Comments>(),
+      std::forward<Args>(args)...);
+  }
+
+  // Returns the Comments object of a Value that is about to change its
+  // comments, after creating it if cm is null or copying it if cm is shared
+  // with another Value.
+  static Comments& unique(std::shared_ptr<Comments>& cm) {
+    if (!cm) {
+      cm = make();
+    } else if (cm.use_count() > 1) {
+      cm = make(*cm);
+    }
+
+    return *cm;
+  }
 };
 
 
-Value::ValueImpl::ValueImpl()
-  : type(Type::Undefined)
+Arena::Arena(size_t sizeHint)
+  : sealed(false),
+  cur(0),
+  end(0),
+  nextBlockSize(std::max(static_cast<size_t>(0x10000), sizeHint))
 {
 }
 
 
-Value::ValueImpl::ValueImpl(bool input)
-  : type(Type::Bool),
-  b(input)
-{
+Arena::~Arena() {
+  for (auto& block : blocks) {
+    ::operator delete(block.data);
+  }
 }
 
 
-Value::ValueImpl::ValueImpl(double input)
-  : type(Type::Double),
-  d(input)
-{
+void *Arena::allocate(size_t size, size_t alignment) {
+  auto p = (reinterpret_cast<std::uintptr_t>(cur) + alignment - 1) &
+    ~static_cast<std::uintptr_t>(alignment - 1);
+
+  if (!cur || p + size > reinterpret_cast<std::uintptr_t>(end)) {
+    // Grow geometrically, so that the number of blocks stays small.
+    size_t blockSize = std::max(nextBlockSize, size + alignment);
+    Block block = { static_cast<char*>(_heapAllocate(blockSize)), blockSize };
+    blocks.push_back(block);
+    nextBlockSize = blockSize * 2;
+    cur = block.data;
+    end = block.data + blockSize;
+    p = (reinterpret_cast<std::uintptr_t>(cur) + alignment - 1) &
+      ~static_cast<std::uintptr_t>(alignment - 1);
+  }
+
+  cur = reinterpret_cast<char*>(p + size);
+
+  return reinterpret_cast<void*>(p);
 }
 
 
-Value::ValueImpl::ValueImpl(std::int64_t input)
-  : type(Type::Int64),
-  i(input)
-{
+bool Arena::contains(const void *p) const {
+  auto pC = static_cast<const char*>(p);
+
+  for (auto& block : blocks) {
+    if (pC >= block.data && pC < block.data + block.size) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+// Used by the decoder. Creates a new arena, but does not start using it.
+std::shared_ptr<Arena> createArena(size_t sizeHint) {
+  return std::make_shared<Arena>(sizeHint);
+}
+
+
+// Used by the decoder. All new Value nodes created by the calling thread will
+// be allocated from the input arena (or from the heap if the input is null).
+// Returns the previously used arena.
+Arena *useArena(Arena *arena) {
+  Arena *prev = _threadArena;
+  _threadArena = arena;
+  return prev;
+}
+
+
+// Used by the decoder.
+void sealArena(Arena *arena) {
+  arena->sealed = true;
+}
+
+
+// Used by the decoder. The heap allocations for Value trees made by the
+// calling thread are counted in *stats (or not counted if the input is null).
+// Returns the previously used stats.
+DecoderStats *countAllocations(DecoderStats *stats) {
+  DecoderStats *prev = _threadStats;
+  _threadStats = stats;
+  return prev;
+}
+
+
+template<class T, class... Args>
+static T *_create(Arena *arena, Args&&... args) {
+  void *p = (arena ? arena->allocate(sizeof(T), alignof(T)) :
+    _heapAllocate(sizeof(T)));
+
+  return new(p) T(std::forward<Args>(args)...);
+}
+
+
+template<class T>
+static void _destroy(Arena *arena, T *p) {
+  p->~T();
+  // Objects allocated in the arena are freed together with the arena.
+  if (!arena) {
+    ::operator delete(p);
+  }
 }
 
 
 Value::ValueImpl::ValueImpl(const std::string &input)
   : type(Type::String),
-  s(new std::string(input))
+  lazy(false),
+  arena(_threadArena),
+  version(0)
 {
+  s = _create<std::string>(arena, input);
+  _countString(*s);
 }
 
 
 Value::ValueImpl::ValueImpl(Type _type)
-  : type(_type)
+  : type(_type),
+  lazy(false),
+  arena(_threadArena),
+  version(0)
 {
   switch (_type)
   {
   case Type::String:
-    s = new std::string();
+    s = _create<std::string>(arena);
     break;
   case Type::Vector:
-    v = new ValueVec();
+    v = _create<ValueVec>(arena, ArenaAllocator<Value>(arena));
     break;
   case Type::Map:
-    m = new ValueVecMap();
+    m = _create<ValueVecMap>(arena, arena);
     break;
   default:
     break;
@@ -112,21 +806,118 @@ Value::ValueImpl::ValueImpl(Type _type)
 }
 
 
+Value::ValueImpl::ValueImpl(Type _type,
+  const std::shared_ptr<LazyDocument>& doc, size_t container)
+  : type(_type),
+  lazy(true),
+  arena(nullptr),
+  version(0)
+{
+  lz = new LazyRef{ doc, container };
+}
+
+
+thread_local std::vector<std::shared_ptr<Value::ValueImpl> >
+  *Value::ValueImpl::releasing = nullptr;
+
+
 Value::ValueImpl::~ValueImpl() {
-  switch (type)
-  {
-  case Type::String:
-    delete s;
-    break;
-  case Type::Vector:
-    delete v;
-    break;
-  case Type::Map:
-    delete m;
-    break;
-  default:
-    break;
+  if (lazy.load(std::memory_order_relaxed)) {
+    delete lz;
+    return;
+  }
+
+  if (type != Type::Vector && type != Type::Map) {
+    if (type == Type::String) {
+      _destroy(arena, s);
+    }
+    return;
+  }
+
+  std::vector<std::shared_ptr<ValueImpl> > pending;
+  bool outermost = !releasing;
+  if (outermost) {
+    releasing = &pending;
+  }
+
+  releaseChildren();
+  if (type == Type::Vector) {
+    _destroy(arena, v);
+  } else {
+    _destroy(arena, m);
+  }
+
+  if (outermost) {
+    while (!pending.empty()) {
+      auto child = std::move(pending.back());
+      pending.pop_back();
+      // Adds the children of child to pending.
+      child.reset();
+    }
+    releasing = nullptr;
+  }
+}
+
+
+// Moves the elements that are Vectors or Maps only referenced by this Value
+// to *releasing. If there is no memory for that, the element is destroyed
+// together with this Value instead.
+void Value::ValueImpl::releaseChildren() {
+  auto release = [](Value& elem) {
+    if (elem.prv && elem.prv.use_count() == 1 &&
+      (elem.prv->type == Type::Vector || elem.prv->type == Type::Map))
+    {
+      try {
+        releasing->push_back(std::move(elem.prv));
+      } catch (const std::bad_alloc&) {
+      }
+    }
+  };
+
+  if (type == Type::Vector) {
+    for (auto& elem : *v) {
+      release(elem);
+    }
+  } else {
+    for (auto entry : m->v) {
+      release(entry->second);
+    }
+  }
+}
+
+
+// Decodes the elements. If they contain a syntax error (possible if
+// DecoderOptions::lazyValidate was false) the exception is thrown and the
+// elements stay undecoded, so that the exception is thrown again on the next
+// access.
+void Value::ValueImpl::expand() {
+  std::lock_guard<std::mutex> lock(_lazyMutex);
+  if (!lazy.load(std::memory_order_relaxed)) {
+    return;
+  }
+
+  auto val = decodeLazy(lz->doc, lz->container);
+  auto& src = *val.prv;
+  assert(src.type == type);
+
+  delete lz;
+  if (type == Type::Vector) {
+    v = src.v;
+  } else {
+    m = src.m;
   }
+  arena = src.arena;
+  // The decoded elements now belong to this ValueImpl.
+  src.type = Type::Undefined;
+
+  lazy.store(false, std::memory_order_release);
+}
+
+
+Value createLazy(Type type, const std::shared_ptr<LazyDocument>& doc,
+  size_t container)
+{
+  return Value(Value::ValueImpl::make(type, doc, container), nullptr);
 }
 
 
@@ -136,127 +927,164 @@ Value::ValueImpl::~ValueImpl() {
 // be passed by reference, to avoid surprises when doing bracket assignment
 // on a Value that has been passed around but is still of type Undefined.
 Value::Value()
-  : prv(std::make_shared<ValueImpl>(Type::Undefined))
+  : prv(ValueImpl::make(Type::Undefined)),
+  scalarType(Type::Undefined)
 {
 }
 
 
 Value::Value(bool input)
-  : prv(std::make_shared<ValueImpl>(input))
+  : scalarType(Type::Bool)
 {
+  scalar.b = input;
 }
 
 
 Value::Value(float input)
-  : prv(std::make_shared<ValueImpl>(static_cast<double>(input)))
+  : scalarType(Type::Double)
 {
+  scalar.d = input;
 }
 
 
 Value::Value(double input)
-  : prv(std::make_shared<ValueImpl>(input))
+  : scalarType(Type::Double)
 {
+  scalar.d = input;
 }
 
 
 Value::Value(long double input)
-  : prv(std::make_shared<ValueImpl>(static_cast<double>(input)))
+  : scalarType(Type::Double)
 {
+  scalar.d = input;
 }
 
 
 Value::Value(char input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : scalarType(Type::Int64)
 {
+  scalar.i = input;
 }
 
 
 Value::Value(unsigned char input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : scalarType(Type::Int64)
 {
+  scalar.i = input;
 }
 
 
 Value::Value(short input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : scalarType(Type::Int64)
 {
+  scalar.i = input;
 }
 
 
 Value::Value(unsigned short input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : scalarType(Type::Int64)
 {
+  scalar.i = input;
 }
 
 
 Value::Value(int input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : scalarType(Type::Int64)
 {
+  scalar.i = input;
 }
 
 
 Value::Value(unsigned int input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : scalarType(Type::Int64)
 {
+  scalar.i = input;
 }
 
 
 Value::Value(long input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : scalarType(Type::Int64)
 {
+  scalar.i = input;
 }
 
 
 Value::Value(unsigned long input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : scalarType(Type::Int64)
 {
+  scalar.i = input;
 }
 
 
 Value::Value(long long input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : scalarType(Type::Int64)
 {
+  scalar.i = input;
 }
 
 
 Value::Value(unsigned long long input)
-  : prv(std::make_shared<ValueImpl>(static_cast<std::int64_t>(input)))
+  : scalarType(Type::Int64)
 {
+  scalar.i = input;
 }
 
 
 Value::Value(const char *input)
-  : prv(std::make_shared<ValueImpl>(std::string(input)))
+  : prv(ValueImpl::make(std::string(input))),
+  scalarType(Type::Undefined)
 {
 }
 
 
 Value::Value(const std::string& input)
-  : prv(std::make_shared<ValueImpl>(input))
+  : prv(ValueImpl::make(input)),
+  scalarType(Type::Undefined)
 {
 }
 
 
 Value::Value(Type _type)
-  : prv(std::make_shared<ValueImpl>(_type))
+  : scalarType(_type)
 {
+  switch (_type)
+  {
+  case Type::Null:
+    break;
+  case Type::Bool:
+    scalar.b = false;
+    break;
+  case Type::Double:
+    scalar.d = 0;
+    break;
+  case Type::Int64:
+    scalar.i = 0;
+    break;
+  default:
+    prv = ValueImpl::make(_type);
+    break;
+  }
 }
 
 
+// The comments are shared, but are copied before they are changed in either
+// Value (see Comments::unique()). This way a change in the other Value does
+// not affect the comments in this Value.
 Value::Value(const Value& other)
-  : prv(other.prv)
+  : prv(other.prv),
+  cm(other.cm),
+  scalarType(other.scalarType),
+  scalar(other.scalar)
 {
-  if (other.cm) {
-    // Clone the comments instead of sharing the reference. This way a change
-    // in the other Value does not affect the comments in this Value.
-    cm.reset(new Comments(*other.cm));
-  }
 }
 
 
 Value::Value(Value&& other)
   : prv(other.prv),
-    cm(other.cm)
+    cm(other.cm),
+    scalarType(other.scalarType),
+    scalar(other.scalar)
 {
 }
 
@@ -271,11 +1099,19 @@ Value::Value(MapProxy&& other)
 
 Value::Value(std::shared_ptr<ValueImpl> _prv, std::shared_ptr<Comments> _cm)
   : prv(_prv),
-    cm(_cm)
+    cm(_cm),
+    scalarType(Type::Undefined)
 {
 }
 
 
+void Value::share_data(const Value& other) {
+  prv = other.prv;
+  scalarType = other.scalarType;
+  scalar = other.scalar;
+}
+
+
 Value::~Value() {
 }
 
@@ -287,7 +1123,7 @@ Value& Value::operator=(const Value& other) {
     this->set_comments(other);
   }
 
-  this->prv = other.prv;
+  share_data(other);
 
   return *this;
 }
@@ -300,21 +1136,24 @@ Value& Value::operator=(Value&& other) {
     this->cm = other.cm;
   }
 
-  this->prv = other.prv;
+  share_data(other);
 
   return *this;
 }
 
 
 const Value& Value::at(const std::string& name) const {
-  switch (prv->type)
+  switch (type())
   {
   case Type::Undefined:
     throw index_out_of_bounds("Key not found.");
   case Type::Map:
-    try {
-      return prv->m->m.at(name);
-    } catch(const std::out_of_range&) {}
+    {
+      auto pos = prv->map()->find(name);
+      if (pos != std::string::npos) {
+        return prv->map()->v[pos]->second;
+      }
+    }
     throw index_out_of_bounds("Key not found.");
   default:
     throw type_mismatch("Must be of type Map for that operation.");
@@ -323,14 +1162,17 @@ const Value& Value::at(const std::string& name) const {
 
 
 Value& Value::at(const std::string& name) {
-  switch (prv->type)
+  switch (type())
   {
   case Type::Undefined:
     throw index_out_of_bounds("Key not found.");
   case Type::Map:
-    try {
-      return prv->m->m.at(name);
-    } catch(const std::out_of_range&) {}
+    {
+      auto pos = prv->map()->find(name);
+      if (pos != std::string::npos) {
+        return prv->map()->v[pos]->second;
+      }
+    }
     throw index_out_of_bounds("Key not found.");
   default:
     throw type_mismatch("Must be of type Map for that operation.");
@@ -348,15 +1190,36 @@ Value& Value::at(const char *name) {
 }
 
 
+const Value *Value::find(const std::string& name) const {
+  switch (type())
+  {
+  case Type::Undefined:
+    return nullptr;
+  case Type::Map:
+    {
+      auto pos = prv->map()->find(name);
+      return (pos == std::string::npos ? nullptr : &prv->map()->v[pos]->second);
+    }
+  default:
+    throw type_mismatch("Must be of type Undefined or Map for that operation.");
+  }
+}
+
+
+Value *Value::find(const std::string& name) {
+  return const_cast<Value*>(static_cast<const Value&>(*this).find(name));
+}
+
+
 const Value Value::operator[](const std::string& name) const {
-  if (prv->type == Type::Undefined) {
+  if (type() == Type::Undefined) {
     return Value();
-  } else if (prv->type == Type::Map) {
-    auto it = prv->m->m.find(name);
-    if (it == prv->m->m.end()) {
+  } else if (type() == Type::Map) {
+    auto pos = prv->map()->find(name);
+    if (pos == std::string::npos) {
       return Value();
     }
-    return it->second;
+    return prv->map()->v[pos]->second;
   }
 
   throw type_mismatch("Must be of type Undefined or Map for that operation.");
@@ -364,19 +1227,19 @@ const Value Value::operator[](const std::string& name) const {
 
 
 MapProxy Value::operator[](const std::string& name) {
-  if (prv->type == Type::Undefined) {
+  if (type() == Type::Undefined) {
     prv->~ValueImpl();
     // Recreate the private object using the same memory block.
     new(&(*prv)) ValueImpl(Type::Map);
-  } else if (prv->type != Type::Map) {
+  } else if (type() != Type::Map) {
     throw type_mismatch("Must be of type Undefined or Map for that operation.");
   }
 
-  auto it = prv->m->m.find(name);
-  if (it == prv->m->m.end()) {
+  auto pos = prv->map()->find(name);
+  if (pos == std::string::npos) {
     return MapProxy(prv, name, 0);
   }
-  return MapProxy(prv, name, &it->second);
+  return MapProxy(prv, name, &prv->map()->v[pos]->second);
 }
 
 
@@ -401,7 +1264,7 @@ MapProxy Value::operator[](char *input) {
 
 
 const Value& Value::operator[](int index) const {
-  switch (prv->type)
+  switch (type())
   {
   case Type::Undefined:
     throw index_out_of_bounds("Index out of bounds.");
@@ -411,16 +1274,12 @@ const Value& Value::operator[](int index) const {
       throw index_out_of_bounds("Index out of bounds.");
     }
 
-    switch (prv->type)
+    switch (type())
     {
     case Type::Vector:
-      return prv->v[0][index];
+      return prv->vec()[0][index];
     case Type::Map:
-      {
-        auto it = prv->m->m.find(prv->m->v[index]);
-        assert(it != prv->m->m.end());
-        return it->second;
-      }
+      return prv->map()->v[index]->second;
     default:
       break;
     }
@@ -431,7 +1290,7 @@ const Value& Value::operator[](int index) const {
 
 
 Value& Value::operator[](int index) {
-  switch (prv->type)
+  switch (type())
   {
   case Type::Undefined:
     throw index_out_of_bounds("Index out of bounds.");
@@ -441,16 +1300,12 @@ Value& Value::operator[](int index) {
       throw index_out_of_bounds("Index out of bounds.");
     }
 
-    switch (prv->type)
+    switch (type())
     {
     case Type::Vector:
-      return prv->v[0][index];
+      return prv->vec()[0][index];
     case Type::Map:
-      {
-        auto it = prv->m->m.find(prv->m->v[index]);
-        assert(it != prv->m->m.end());
-        return it->second;
-      }
+      return prv->map()->v[index]->second;
     default:
       break;
     }
@@ -543,21 +1398,21 @@ std::string operator+(const Value& a, const std::string &b) {
 
 
 Value operator+(const Value& a, const Value& b) {
-  if (a.prv->type == Type::Double && b.prv->type == Type::Int64) {
-    return a.prv->d + b.prv->i;
-  } else if (a.prv->type == Type::Int64 && b.prv->type == Type::Double) {
-    return a.prv->i + b.prv->d;
+  if (a.type() == Type::Double && b.type() == Type::Int64) {
+    return a.scalar.d + b.scalar.i;
+  } else if (a.type() == Type::Int64 && b.type() == Type::Double) {
+    return a.scalar.i + b.scalar.d;
   }
 
-  if (a.prv->type != b.prv->type) {
+  if (a.type() != b.type()) {
     throw type_mismatch("The values must be of the same type for this operation.");
   }
 
-  switch (a.prv->type) {
+  switch (a.type()) {
   case Type::Double:
-    return a.prv->d + b.prv->d;
+    return a.scalar.d + b.scalar.d;
   case Type::Int64:
-    return a.prv->i + b.prv->i;
+    return a.scalar.i + b.scalar.i;
   case Type::String:
     return *a.prv->s + *b.prv->s;
   default:
@@ -569,21 +1424,21 @@ Value operator+(const Value& a, const Value& b) {
 
 
 bool operator<(const Value& a, const Value& b) {
-  if (a.prv->type == Type::Double && b.prv->type == Type::Int64) {
-    return a.prv->d < b.prv->i;
-  } else if (a.prv->type == Type::Int64 && b.prv->type == Type::Double) {
-    return a.prv->i < b.prv->d;
+  if (a.type() == Type::Double && b.type() == Type::Int64) {
+    return a.scalar.d < b.scalar.i;
+  } else if (a.type() == Type::Int64 && b.type() == Type::Double) {
+    return a.scalar.i < b.scalar.d;
   }
 
-  if (a.prv->type != b.prv->type) {
+  if (a.type() != b.type()) {
     throw type_mismatch("The values must be of the same type for this operation.");
   }
 
-  switch (a.prv->type) {
+  switch (a.type()) {
   case Type::Double:
-    return a.prv->d < b.prv->d;
+    return a.scalar.d < b.scalar.d;
   case Type::Int64:
-    return a.prv->i < b.prv->i;
+    return a.scalar.i < b.scalar.i;
   case Type::String:
     return *a.prv->s < *b.prv->s;
   default:
@@ -595,21 +1450,21 @@ bool operator<(const Value& a, const Value& b) {
 
 
 bool operator>(const Value& a, const Value& b) {
-  if (a.prv->type == Type::Double && b.prv->type == Type::Int64) {
-    return a.prv->d > b.prv->i;
-  } else if (a.prv->type == Type::Int64 && b.prv->type == Type::Double) {
-    return a.prv->i > b.prv->d;
+  if (a.type() == Type::Double && b.type() == Type::Int64) {
+    return a.scalar.d > b.scalar.i;
+  } else if (a.type() == Type::Int64 && b.type() == Type::Double) {
+    return a.scalar.i > b.scalar.d;
   }
 
-  if (a.prv->type != b.prv->type) {
+  if (a.type() != b.type()) {
     throw type_mismatch("The values must be of the same type for this operation.");
   }
 
-  switch (a.prv->type) {
+  switch (a.type()) {
   case Type::Double:
-    return a.prv->d > b.prv->d;
+    return a.scalar.d > b.scalar.d;
   case Type::Int64:
-    return a.prv->i > b.prv->i;
+    return a.scalar.i > b.scalar.i;
   case Type::String:
     return *a.prv->s > *b.prv->s;
   default:
@@ -621,21 +1476,21 @@ bool operator>(const Value& a, const Value& b) {
 
 
 bool operator<=(const Value& a, const Value& b) {
-  if (a.prv->type == Type::Double && b.prv->type == Type::Int64) {
-    return a.prv->d <= b.prv->i;
-  } else if (a.prv->type == Type::Int64 && b.prv->type == Type::Double) {
-    return a.prv->i <= b.prv->d;
+  if (a.type() == Type::Double && b.type() == Type::Int64) {
+    return a.scalar.d <= b.scalar.i;
+  } else if (a.type() == Type::Int64 && b.type() == Type::Double) {
+    return a.scalar.i <= b.scalar.d;
   }
 
-  if (a.prv->type != b.prv->type) {
+  if (a.type() != b.type()) {
     throw type_mismatch("The values must be of the same type for this operation.");
   }
 
-  switch (a.prv->type) {
+  switch (a.type()) {
   case Type::Double:
-    return a.prv->d <= b.prv->d;
+    return a.scalar.d <= b.scalar.d;
   case Type::Int64:
-    return a.prv->i <= b.prv->i;
+    return a.scalar.i <= b.scalar.i;
   case Type::String:
     return *a.prv->s <= *b.prv->s;
   default:
@@ -647,21 +1502,21 @@ bool operator<=(const Value& a, const Value& b) {
 
 
 bool operator>=(const Value& a, const Value& b) {
-  if (a.prv->type == Type::Double && b.prv->type == Type::Int64) {
-    return a.prv->d >= b.prv->i;
-  } else if (a.prv->type == Type::Int64 && b.prv->type == Type::Double) {
-    return a.prv->i >= b.prv->d;
+  if (a.type() == Type::Double && b.type() == Type::Int64) {
+    return a.scalar.d >= b.scalar.i;
+  } else if (a.type() == Type::Int64 && b.type() == Type::Double) {
+    return a.scalar.i >= b.scalar.d;
   }
 
-  if (a.prv->type != b.prv->type) {
+  if (a.type() != b.type()) {
     throw type_mismatch("The values must be of the same type for this operation.");
   }
 
-  switch (a.prv->type) {
+  switch (a.type()) {
   case Type::Double:
-    return a.prv->d >= b.prv->d;
+    return a.scalar.d >= b.scalar.d;
   case Type::Int64:
-    return a.prv->i >= b.prv->i;
+    return a.scalar.i >= b.scalar.i;
   case Type::String:
     return *a.prv->s >= *b.prv->s;
   default:
@@ -673,32 +1528,31 @@ bool operator>=(const Value& a, const Value& b) {
 
 
 bool operator==(const Value& a, const Value& b) {
-  if (a.prv->type == Type::Double && b.prv->type == Type::Int64) {
-    return a.prv->d == b.prv->i;
-  } else if (a.prv->type == Type::Int64 && b.prv->type == Type::Double) {
-    return a.prv->i == b.prv->d;
+  if (a.type() == Type::Double && b.type() == Type::Int64) {
+    return a.scalar.d == b.scalar.i;
+  } else if (a.type() == Type::Int64 && b.type() == Type::Double) {
+    return a.scalar.i == b.scalar.d;
   }
 
-  if (a.prv->type != b.prv->type) {
+  if (a.type() != b.type()) {
     return false;
   }
 
-  switch (a.prv->type) {
+  switch (a.type()) {
   case Type::Undefined:
   case Type::Null:
     return true;
   case Type::Bool:
-    return a.prv->b == b.prv->b;
+    return a.scalar.b == b.scalar.b;
   case Type::Double:
-    return a.prv->d == b.prv->d;
+    return a.scalar.d == b.scalar.d;
   case Type::String:
     return *a.prv->s == *b.prv->s;
   case Type::Vector:
-    return a.prv->v == b.prv->v;
   case Type::Map:
-    return a.prv->m == b.prv->m;
+    return a.prv == b.prv;
   case Type::Int64:
-    return a.prv->i == b.prv->i;
+    return a.scalar.i == b.scalar.i;
   }
 
   assert(!"Unknown type");
@@ -713,21 +1567,21 @@ bool operator!=(const Value& a, const Value& b) {
 
 
 Value operator-(const Value& a, const Value& b) {
-  if (a.prv->type == Type::Double && b.prv->type == Type::Int64) {
-    return a.prv->d - b.prv->i;
-  } else if (a.prv->type == Type::Int64 && b.prv->type == Type::Double) {
-    return a.prv->i - b.prv->d;
+  if (a.type() == Type::Double && b.type() == Type::Int64) {
+    return a.scalar.d - b.scalar.i;
+  } else if (a.type() == Type::Int64 && b.type() == Type::Double) {
+    return a.scalar.i - b.scalar.d;
   }
 
-  if (a.prv->type != b.prv->type) {
+  if (a.type() != b.type()) {
     throw type_mismatch("The values must be of the same type for this operation.");
   }
 
-  switch (a.prv->type) {
+  switch (a.type()) {
   case Type::Double:
-    return a.prv->d - b.prv->d;
+    return a.scalar.d - b.scalar.d;
   case Type::Int64:
-    return a.prv->i - b.prv->i;
+    return a.scalar.i - b.scalar.i;
   default:
     break;
   }
@@ -737,21 +1591,21 @@ Value operator-(const Value& a, const Value& b) {
 
 
 Value operator*(const Value& a, const Value& b) {
-  if (a.prv->type == Type::Double && b.prv->type == Type::Int64) {
-    return a.prv->d * b.prv->i;
-  } else if (a.prv->type == Type::Int64 && b.prv->type == Type::Double) {
-    return a.prv->i * b.prv->d;
+  if (a.type() == Type::Double && b.type() == Type::Int64) {
+    return a.scalar.d * b.scalar.i;
+  } else if (a.type() == Type::Int64 && b.type() == Type::Double) {
+    return a.scalar.i * b.scalar.d;
   }
 
-  if (a.prv->type != b.prv->type) {
+  if (a.type() != b.type()) {
     throw type_mismatch("The values must be of the same type for this operation.");
   }
 
-  switch (a.prv->type) {
+  switch (a.type()) {
   case Type::Double:
-    return a.prv->d * b.prv->d;
+    return a.scalar.d * b.scalar.d;
   case Type::Int64:
-    return a.prv->i * b.prv->i;
+    return a.scalar.i * b.scalar.i;
   default:
     break;
   }
@@ -761,21 +1615,21 @@ Value operator*(const Value& a, const Value& b) {
 
 
 Value operator/(const Value& a, const Value& b) {
-  if (a.prv->type == Type::Double && b.prv->type == Type::Int64) {
-    return a.prv->d / b.prv->i;
-  } else if (a.prv->type == Type::Int64 && b.prv->type == Type::Double) {
-    return a.prv->i / b.prv->d;
+  if (a.type() == Type::Double && b.type() == Type::Int64) {
+    return a.scalar.d / b.scalar.i;
+  } else if (a.type() == Type::Int64 && b.type() == Type::Double) {
+    return a.scalar.i / b.scalar.d;
   }
 
-  if (a.prv->type != b.prv->type) {
+  if (a.type() != b.type()) {
     throw type_mismatch("The values must be of the same type for this operation.");
   }
 
-  switch (a.prv->type) {
+  switch (a.type()) {
   case Type::Double:
-    return a.prv->d / b.prv->d;
+    return a.scalar.d / b.scalar.d;
   case Type::Int64:
-    return a.prv->i / b.prv->i;
+    return a.scalar.i / b.scalar.i;
   default:
     break;
   }
@@ -785,11 +1639,11 @@ Value operator/(const Value& a, const Value& b) {
 
 
 Value operator%(const Value& a, const Value& b) {
-  if (a.prv->type != b.prv->type || a.prv->type != Type::Int64) {
+  if (a.type() != b.type() || a.type() != Type::Int64) {
     throw type_mismatch("The values must be of the Int64 type for this operation.");
   }
 
-  return a.prv->i % b.prv->i;
+  return a.scalar.i % b.scalar.i;
 }
 
 
@@ -829,7 +1683,7 @@ Value& Value::operator+=(const char *b) {
 
 
 Value& Value::operator+=(const std::string& b) {
-  if (prv->type != Type::String) {
+  if (type() != Type::String) {
     throw type_mismatch("The value must be of type String for this operation.");
   }
 
@@ -840,21 +1694,21 @@ Value& Value::operator+=(const std::string& b) {
 
 
 Value& Value::operator+=(const Value& b) {
-  if (prv->type == Type::Double && b.prv->type == Type::Int64) {
-    prv->d += b.prv->i;
-  } else if (prv->type == Type::Int64 && b.prv->type == Type::Double) {
-    prv->i += static_cast<int64_t>(b.prv->d);
+  if (type() == Type::Double && b.type() == Type::Int64) {
+    scalar.d += b.scalar.i;
+  } else if (type() == Type::Int64 && b.type() == Type::Double) {
+    scalar.i += static_cast<int64_t>(b.scalar.d);
   } else {
-    if (prv->type != b.prv->type) {
+    if (type() != b.type()) {
       throw type_mismatch("The values must be of the same type for this operation.");
     }
 
-    switch (prv->type) {
+    switch (type()) {
     case Type::Double:
-      prv->d += b.prv->d;
+      scalar.d += b.scalar.d;
       break;
     case Type::Int64:
-      prv->i += b.prv->i;
+      scalar.i += b.scalar.i;
       break;
     case Type::String:
       *prv->s += *b.prv->s;
@@ -877,21 +1731,21 @@ Value& Value::operator-=(const Value& b) {
 
 
 Value& Value::operator*=(const Value& b) {
-  if (prv->type == Type::Double && b.prv->type == Type::Int64) {
-    prv->d *= b.prv->i;
-  } else if (prv->type == Type::Int64 && b.prv->type == Type::Double) {
-    prv->i = static_cast<int64_t>(prv->i * b.prv->d);
+  if (type() == Type::Double && b.type() == Type::Int64) {
+    scalar.d *= b.scalar.i;
+  } else if (type() == Type::Int64 && b.type() == Type::Double) {
+    scalar.i = static_cast<int64_t>(scalar.i * b.scalar.d);
   } else {
-    if (prv->type != b.prv->type) {
+    if (type() != b.type()) {
       throw type_mismatch("The values must be of the same type for this operation.");
     }
 
-    switch (prv->type) {
+    switch (type()) {
     case Type::Double:
-      prv->d *= b.prv->d;
+      scalar.d *= b.scalar.d;
       break;
     case Type::Int64:
-      prv->i *= b.prv->i;
+      scalar.i *= b.scalar.i;
       break;
     default:
       throw type_mismatch("The values must be of type Double or Int64 for this operation.");
@@ -904,21 +1758,21 @@ Value& Value::operator*=(const Value& b) {
 
 
 Value& Value::operator/=(const Value& b) {
-  if (prv->type == Type::Double && b.prv->type == Type::Int64) {
-    prv->d /= b.prv->i;
-  } else if (prv->type == Type::Int64 && b.prv->type == Type::Double) {
-    prv->i = static_cast<int64_t>(prv->i / b.prv->d);
+  if (type() == Type::Double && b.type() == Type::Int64) {
+    scalar.d /= b.scalar.i;
+  } else if (type() == Type::Int64 && b.type() == Type::Double) {
+    scalar.i = static_cast<int64_t>(scalar.i / b.scalar.d);
   } else {
-    if (prv->type != b.prv->type) {
+    if (type() != b.type()) {
       throw type_mismatch("The values must be of the same type for this operation.");
     }
 
-    switch (prv->type) {
+    switch (type()) {
     case Type::Double:
-      prv->d /= b.prv->d;
+      scalar.d /= b.scalar.d;
       break;
     case Type::Int64:
-      prv->i /= b.prv->i;
+      scalar.i /= b.scalar.i;
       break;
     default:
       throw type_mismatch("The values must be of type Double or Int64 for this operation.");
@@ -931,22 +1785,22 @@ Value& Value::operator/=(const Value& b) {
 
 
 Value& Value::operator%=(const Value& b) {
-  if (prv->type != b.prv->type || prv->type != Type::Int64) {
+  if (type() != b.type() || type() != Type::Int64) {
     throw type_mismatch("The values must be of the Int64 type for this operation.");
   }
 
-  prv->i %= b.prv->i;
+  scalar.i %= b.scalar.i;
 
   return *this;
 }
 
 
 Value Value::operator+() const {
-  switch (prv->type) {
+  switch (type()) {
   case Type::Double:
-    return prv->d;
+    return scalar.d;
   case Type::Int64:
-    return prv->i;
+    return scalar.i;
   default:
     throw type_mismatch("The value must be of type Double or Int64 for this operation.");
     break;
@@ -957,11 +1811,11 @@ Value Value::operator+() const {
 
 
 Value Value::operator-() const {
-  switch (prv->type) {
+  switch (type()) {
   case Type::Double:
-    return -prv->d;
+    return -scalar.d;
   case Type::Int64:
-    return -prv->i;
+    return -scalar.i;
   default:
     throw type_mismatch("The value must be of type Double or Int64 for this operation.");
     break;
@@ -972,12 +1826,12 @@ Value Value::operator-() const {
 
 
 Value& Value::operator++() {
-  switch (prv->type) {
+  switch (type()) {
   case Type::Double:
-    prv->d++;
+    scalar.d++;
     break;
   case Type::Int64:
-    prv->i++;
+    scalar.i++;
     break;
   default:
     throw type_mismatch("The values must be of type Double or Int64 for this operation.");
@@ -989,12 +1843,12 @@ Value& Value::operator++() {
 
 
 Value& Value::operator--() {
-  switch (prv->type) {
+  switch (type()) {
   case Type::Double:
-    prv->d--;
+    scalar.d--;
     break;
   case Type::Int64:
-    prv->i--;
+    scalar.i--;
     break;
   default:
     throw type_mismatch("The values must be of type Double or Int64 for this operation.");
@@ -1008,14 +1862,14 @@ Value& Value::operator--() {
 Value Value::operator++(int) {
   Value ret;
 
-  switch (prv->type) {
+  switch (type()) {
   case Type::Double:
-    ret = prv->d;
-    prv->d++;
+    ret = scalar.d;
+    scalar.d++;
     break;
   case Type::Int64:
-    ret = prv->i;
-    prv->i++;
+    ret = scalar.i;
+    scalar.i++;
     break;
   default:
     throw type_mismatch("The values must be of type Double or Int64 for this operation.");
@@ -1029,14 +1883,14 @@ Value Value::operator++(int) {
 Value Value::operator--(int) {
   Value ret;
 
-  switch (prv->type) {
+  switch (type()) {
   case Type::Double:
-    ret = prv->d;
-    prv->d--;
+    ret = scalar.d;
+    scalar.d--;
     break;
   case Type::Int64:
-    ret = prv->i;
-    prv->i--;
+    ret = scalar.i;
+    scalar.i--;
     break;
   default:
     throw type_mismatch("The values must be of type Double or Int64 for this operation.");
@@ -1048,14 +1902,14 @@ Value Value::operator--(int) {
 
 
 Value::operator bool() const {
-  switch (prv->type)
+  switch (type())
   {
   case Type::Double:
-    return !!prv->d;
+    return !!scalar.d;
   case Type::Int64:
-    return !!prv->i;
+    return !!scalar.i;
   case Type::Bool:
-    return prv->b;
+    return scalar.b;
   default:
     break;
   }
@@ -1070,12 +1924,12 @@ Value::operator float() const {
 
 
 Value::operator double() const {
-  switch (prv->type)
+  switch (type())
   {
   case Type::Double:
-    return prv->d;
+    return scalar.d;
   case Type::Int64:
-    return static_cast<double>(prv->i);
+    return static_cast<double>(scalar.i);
   default:
     break;
   }
@@ -1108,12 +1962,12 @@ HJSON_CONV_INT_IMPL(unsigned long long)
 
 
 Value::operator long long() const {
-  switch (prv->type)
+  switch (type())
   {
   case Type::Double:
-    return static_cast<long long>(prv->d);
+    return static_cast<long long>(scalar.d);
   case Type::Int64:
-    return prv->i;
+    return scalar.i;
   default:
     break;
   }
@@ -1125,7 +1979,7 @@ Value::operator long long() const {
 
 
 Value::operator const char*() const {
-  if (prv->type != Type::String) {
+  if (type() != Type::String) {
     throw type_mismatch("Must be of type String for that operation.");
   }
 
@@ -1134,7 +1988,7 @@ Value::operator const char*() const {
 
 
 Value::operator std::string() const {
-  if (prv->type != Type::String) {
+  if (type() != Type::String) {
     throw type_mismatch("Must be of type String for that operation.");
   }
 
@@ -1143,41 +1997,47 @@ Value::operator std::string() const {
 
 
 bool Value::defined() const {
-  return prv->type != Type::Undefined;
+  return type() != Type::Undefined;
 }
 
 
 bool Value::empty() const {
-  return (prv->type == Type::Undefined ||
-    prv->type == Type::Null ||
-    (prv->type == Type::String && prv->s->empty()) ||
-    (prv->type == Type::Vector && prv->v->empty()) ||
-    (prv->type == Type::Map && prv->m->m.empty()));
+  // The decoder never makes empty Vectors or Maps lazy, so there is no need to
+  // decode the elements here.
+  if (prv && prv->lazy.load(std::memory_order_acquire)) {
+    return false;
+  }
+
+  return (type() == Type::Undefined ||
+    type() == Type::Null ||
+    (type() == Type::String && prv->s->empty()) ||
+    (type() == Type::Vector && prv->vec()->empty()) ||
+    (type() == Type::Map && prv->map()->v.empty()));
 }
 
 
 Type Value::type() const {
-  return prv->type;
+  return prv ? prv->type : scalarType;
 }
 
 
 bool Value::is_container() const {
-  return prv->type == Type::Vector || prv->type == Type::Map;
+  return type() == Type::Vector || type() == Type::Map;
 }
 
 
 bool Value::is_numeric() const {
-  return prv->type == Type::Double || prv->type == Type::Int64;
+  return type() == Type::Double || type() == Type::Int64;
 }
 
 
 size_t Value::size() const {
-  switch (prv->type)
+  switch (type())
   {
   case Type::Vector:
-    return prv->v->size();
+    return prv->vec()->size();
   case Type::Map:
-    return prv->m->m.size();
+    return prv->map()->v.size();
   default:
     break;
   }
@@ -1186,92 +2046,291 @@ size_t Value::size() const {
 }
 
 
+void Value::reserve(size_t newSize) {
+  switch (type())
+  {
+  case Type::Vector:
+    if (newSize > prv->vec()->capacity()) {
+      ++prv->version;
+    }
+    prv->vec()->reserve(newSize);
+    break;
+  case Type::Map:
+    prv->map()->reserve(newSize);
+    break;
+  default:
+    break;
+  }
+}
+
+
+// Lends a stack that is kept per thread between calls, so that repeated
+// traversals do not allocate once the stack has grown deep enough. Stacks that
+// have grown larger than _keptStackLimit are released instead of kept.
+template<class T>
+class KeptStack {
+public:
+  std::vector<T> v;
+
+  explicit KeptStack(std::vector<T>& _kept)
+    : kept(_kept)
+  {
+    // Swapped out, so that a nested traversal on the same thread gets its own
+    // stack instead of overwriting this one.
+    v.swap(kept);
+  }
+
+  ~KeptStack() {
+    v.clear();
+    if (v.capacity() <= _keptStackLimit && v.capacity() > kept.capacity()) {
+      v.swap(kept);
+    }
+  }
+
+private:
+  static const size_t _keptStackLimit = 4096;
+
+  std::vector<T>& kept;
+};
+
+
+// A pair of Vectors or Maps being compared by deep_equal(), and the position
+// of the next pair of elements to compare.
+class EqualFrame {
+public:
+  const Value *a, *b;
+  size_t pos;
+  // True while the keys of the Maps a and b have been found in the same order.
+  bool inOrder;
+};
+
+
+// A Vector or Map being hashed by hash(), the position of its next element
+// and the hash of the elements before that position.
+class HashFrame {
+public:
+  const Value *val;
+  size_t pos;
+  std::uint64_t acc;
+};
+
+
+static thread_local std::vector<EqualFrame> _equalStack;
+static thread_local std::vector<HashFrame> _hashStack;
+
+
+// The Vectors and Maps are compared using an explicit stack with one frame per
+// nested level instead of recursion, so that the depth of the trees does not
+// matter. Containers that share the same ValueImpl are equal without being
+// traversed, and the elements of Maps are looked up by key in the index of the
+// other Map, so that no keys are copied or sorted.
 bool Value::deep_equal(const Value& other) const {
   if (*this == other) {
     return true;
   }
-
-  if (this->type() != other.type() || this->size() != other.size()) {
+  if (!is_container() || type() != other.type() || size() != other.size()) {
     return false;
   }
 
-  switch (prv->type)
-  {
-  case Type::Vector:
-    {
-      auto itA = this->prv->v->begin();
-      auto endA = this->prv->v->end();
-      auto itB = other.prv->v->begin();
-      while (itA != endA) {
-        if (!itA->deep_equal(*itB)) {
-          return false;
-        }
-        ++itA;
-        ++itB;
+  KeptStack<EqualFrame> stack(_equalStack);
+  stack.v.push_back(EqualFrame{this, &other, 0, true});
+
+  while (!stack.v.empty()) {
+    EqualFrame& f = stack.v.back();
+    const Value *a, *b;
+
+    if (f.a->type() == Type::Vector) {
+      auto& vecA = *f.a->prv->vec();
+      if (f.pos == vecA.size()) {
+        stack.v.pop_back();
+        continue;
+      }
+      a = &vecA[f.pos];
+      b = &(*f.b->prv->vec())[f.pos];
+    } else {
+      auto& mapA = *f.a->prv->map();
+      if (f.pos == mapA.v.size()) {
+        stack.v.pop_back();
+        continue;
       }
+      auto& mapB = *f.b->prv->map();
+      const MapEntry *entryA = mapA.v[f.pos];
+      // Maps that have been created from the same text have their keys in the
+      // same order, so each key is first compared with the key at the same
+      // position in the other Map.
+      f.inOrder = f.inOrder && entryA->first == mapB.v[f.pos]->first;
+      size_t posB = f.inOrder ? f.pos : mapB.find(entryA->first);
+      if (posB == std::string::npos) {
+        return false;
+      }
+      a = &entryA->second;
+      b = &mapB.v[posB]->second;
     }
-    return true;
+    ++f.pos;
 
-  case Type::Map:
+    if (*a == *b) {
+      continue;
+    }
+    if (!a->is_container() || a->type() != b->type() || a->size() != b->size())
     {
-      auto itA = this->begin(), endA = this->end(), itB = other.begin();
-      while (itA != endA) {
-        if (!itA->second.deep_equal(itB->second)) {
-          return false;
-        }
-        ++itA;
-        ++itB;
-      }
+      return false;
     }
-    return true;
+    // f is invalid after this.
+    stack.v.push_back(EqualFrame{a, b, 0, true});
+  }
 
-  default:
-    break;
+  return true;
+}
+
+
+static std::uint64_t _hashMix(std::uint64_t hash, std::uint64_t val) {
+  // The finalizer of splitmix64, so that every bit of the input affects every
+  // bit of the result.
+  std::uint64_t x = hash ^ (val + 0x9e3779b97f4a7c15ULL + (hash << 6) +
+    (hash >> 2));
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+
+static std::uint64_t _hashDouble(double d) {
+  // 0.0 and -0.0 are equal, so they must have the same hash.
+  if (d == 0) {
+    d = 0;
   }
+  std::uint64_t bits;
+  std::memcpy(&bits, &d, sizeof(bits));
+  return _hashMix(static_cast<std::uint64_t>(Type::Double), bits);
+}
 
-  return false;
+
+static std::uint64_t _hashKey(const std::string& key) {
+  return _hashMix(static_cast<std::uint64_t>(Type::String),
+    std::hash<std::string>()(key));
 }
 
 
-Value Value::clone() const {
-  switch (prv->type) {
-  case Type::Vector:
-    {
-      Value ret;
-      for (int index = 0; index < int(size()); ++index) {
-        ret.push_back(operator[](index).clone());
-      }
-      ret.set_comments(*this);
-      return ret;
+// Uses an explicit stack with one frame per nested level instead of recursion,
+// like deep_equal().
+size_t Value::hash() const {
+  auto scalarHash = [](const Value& val) -> std::uint64_t {
+    switch (val.type()) {
+    case Type::Bool:
+      return _hashMix(static_cast<std::uint64_t>(Type::Bool), val.scalar.b);
+    // An Int64 is equal to a Double with the same value, so both are hashed
+    // as Double.
+    case Type::Int64:
+      return _hashDouble(static_cast<double>(val.scalar.i));
+    case Type::Double:
+      return _hashDouble(val.scalar.d);
+    case Type::String:
+      return _hashKey(*val.prv->s);
+    default:
+      return _hashMix(static_cast<std::uint64_t>(val.type()), 0);
     }
+  };
 
-  case Type::Map:
-    {
-      Value ret;
-      for (int index = 0; index < size(); ++index) {
-        ret[key(index)] = operator[](index).clone();
+  if (!is_container()) {
+    return static_cast<size_t>(scalarHash(*this));
+  }
+
+  KeptStack<HashFrame> stack(_hashStack);
+  stack.v.push_back(HashFrame{this, 0, 0});
+
+  for (;;) {
+    HashFrame& f = stack.v.back();
+    const Value *child;
+    std::uint64_t hash;
+
+    if (f.pos < f.val->size()) {
+      child = (f.val->type() == Type::Vector ? &(*f.val->prv->vec())[f.pos] :
+        &f.val->prv->map()->v[f.pos]->second);
+      ++f.pos;
+      if (child->is_container()) {
+        // f is invalid after this.
+        stack.v.push_back(HashFrame{child, 0, 0});
+        continue;
+      }
+      hash = scalarHash(*child);
+    } else {
+      hash = _hashMix(_hashMix(static_cast<std::uint64_t>(f.val->type()),
+        f.val->size()), f.acc);
+      stack.v.pop_back();
+      if (stack.v.empty()) {
+        return static_cast<size_t>(hash);
       }
-      ret.set_comments(*this);
-      return ret;
     }
 
-  default:
-    break;
+    HashFrame& parent = stack.v.back();
+    if (parent.val->type() == Type::Vector) {
+      parent.acc = _hashMix(parent.acc, hash);
+    } else {
+      // The order of the keys in a Map does not matter for deep_equal(), so
+      // the hashes of the entries are combined by addition.
+      parent.acc += _hashMix(_hashKey(
+        parent.val->prv->map()->v[parent.pos - 1]->first), hash);
+    }
   }
+}
 
-  return *this;
+
+Value Value::clone() const {
+  if (type() != Type::Vector && type() != Type::Map) {
+    return *this;
+  }
+
+  Value ret = _cloneShell(*this);
+  // The Vectors and Maps that have been created by _cloneShell() but whose
+  // elements have not been cloned yet, and their originals.
+  std::vector<std::pair<const Value*, Value*> > stack(1,
+    std::make_pair(this, &ret));
+
+  while (!stack.empty()) {
+    const Value& from = *stack.back().first;
+    Value& to = *stack.back().second;
+    stack.pop_back();
+    size_t base = stack.size();
+
+    if (from.type() == Type::Vector) {
+      auto& src = *from.prv->vec();
+      auto& vec = *to.prv->vec();
+      vec.reserve(src.size());
+      for (const auto& elem : src) {
+        vec.push_back(_cloneShell(elem));
+        if (elem.is_container()) {
+          stack.push_back(std::make_pair(&elem, &vec.back()));
+        }
+      }
+    } else {
+      auto& src = *from.prv->map();
+      auto& map = *to.prv->map();
+      map.clone_from(src);
+      for (size_t a = 0; a < src.v.size(); ++a) {
+        if (src.v[a]->second.is_container()) {
+          stack.push_back(std::make_pair(&src.v[a]->second, &map.v[a]->second));
+        }
+      }
+    }
+    // So that the elements are cloned in order, which is faster to clone
+    // and to use afterwards.
+    std::reverse(stack.begin() + base, stack.end());
+  }
+
+  return ret;
 }
 
 
 void Value::clear() {
-  switch (prv->type) {
+  switch (type()) {
   case Type::Vector:
-    prv->v->clear();
+    ++prv->version;
+    prv->vec()->clear();
     break;
 
   case Type::Map:
-    prv->m->m.clear();
-    prv->m->v.clear();
+    ++prv->version;
+    prv->map()->clear();
     break;
 
   default:
@@ -1281,7 +2340,7 @@ void Value::clear() {
 
 
 void Value::erase(int index) {
-  switch (prv->type)
+  switch (type())
   {
   case Type::Undefined:
   case Type::Vector:
@@ -1290,17 +2349,18 @@ void Value::erase(int index) {
       throw index_out_of_bounds("Index out of bounds.");
     }
 
-    switch (prv->type)
+    ++prv->version;
+
+    switch (type())
     {
     case Type::Vector:
       {
-        prv->v->erase(prv->v->begin() + index);
+        prv->vec()->erase(prv->vec()->begin() + index);
       }
       break;
     case Type::Map:
       {
-        prv->m->m.erase(prv->m->v[index]);
-        prv->m->v.erase(prv->m->v.begin() + index);
+        prv->map()->erase(index);
       }
       break;
     default:
@@ -1315,20 +2375,23 @@ void Value::erase(int index) {
 
 
 void Value::push_back(const Value& other) {
-  if (prv->type == Type::Undefined) {
+  if (type() == Type::Undefined) {
     prv->~ValueImpl();
     // Recreate the private object using the same memory block.
     new(&(*prv)) ValueImpl(Type::Vector);
-  } else if (prv->type != Type::Vector) {
+  } else if (type() != Type::Vector) {
     throw type_mismatch("Must be of type Undefined or Vector for that operation.");
   }
 
-  prv->v->push_back(other);
+  if (prv->vec()->size() == prv->vec()->capacity()) {
+    ++prv->version;
+  }
+  prv->vec()->push_back(other);
 }
 
 
 void Value::move(int from, int to) {
-  switch (prv->type)
+  switch (type())
   {
   case Type::Undefined:
   case Type::Vector:
@@ -1341,30 +2404,23 @@ void Value::move(int from, int to) {
       return;
     }
 
-    switch (prv->type)
+    ++prv->version;
+
+    switch (type())
     {
     case Type::Vector:
       {
-        auto it = prv->v->begin();
+        auto it = prv->vec()->begin();
 
-        prv->v->insert(it + to, it[from]);
+        prv->vec()->insert(it + to, it[from]);
         if (to < from) {
           ++from;
         }
-        prv->v->erase(prv->v->begin() + from);
+        prv->vec()->erase(prv->vec()->begin() + from);
       }
       break;
     case Type::Map:
-      {
-        auto vec = &prv->m->v;
-        auto it = vec->begin();
-
-        vec->insert(it + to, it[from]);
-        if (to < from) {
-          ++from;
-        }
-        vec->erase(vec->begin() + from);
-      }
+      prv->map()->move(from, to);
       break;
     default:
       break;
@@ -1378,84 +2434,151 @@ void Value::move(int from, int to) {
 
 
 std::string Value::key(int index) const {
-  switch (prv->type)
+  switch (type())
+  {
+  case Type::Undefined:
+  case Type::Map:
+    if (index < 0 || index >= size()) {
+      throw index_out_of_bounds("Index out of bounds.");
+    }
+    return prv->map()->v[index]->first;
+  default:
+    throw type_mismatch("Must be of type Map for that operation.");
+  }
+}
+
+
+const std::string& Value::key_ref(int index) const {
+  switch (type())
   {
   case Type::Undefined:
   case Type::Map:
     if (index < 0 || index >= size()) {
       throw index_out_of_bounds("Index out of bounds.");
     }
-    return prv->m->v[index];
+    return prv->map()->v[index]->first;
   default:
     throw type_mismatch("Must be of type Map for that operation.");
   }
 }
 
 
-ValueMap::iterator Value::begin() {
-  if (prv->type != Type::Map) {
-    // Some C++ compilers might not allow comparing this to another
-    // default-constructed iterator.
-    return ValueMap::iterator();
+bool Value::contains(const std::string& key) const {
+  return type() == Type::Map && prv->map()->find(key) != std::string::npos;
+}
+
+
+bool Value::try_emplace(std::string key, Value val) {
+  if (type() == Type::Undefined) {
+    prv->~ValueImpl();
+    // Recreate the private object using the same memory block.
+    new(&(*prv)) ValueImpl(Type::Map);
+  } else if (type() != Type::Map) {
+    throw type_mismatch("Must be of type Undefined or Map for that operation.");
+  }
+
+  return prv->map()->try_emplace(std::move(key), std::move(val)).second;
+}
+
+
+Value& Value::insert_or_assign(std::string key, Value val) {
+  if (type() == Type::Undefined) {
+    prv->~ValueImpl();
+    // Recreate the private object using the same memory block.
+    new(&(*prv)) ValueImpl(Type::Map);
+  } else if (type() != Type::Map) {
+    throw type_mismatch("Must be of type Undefined or Map for that operation.");
+  }
+
+  auto res = prv->map()->try_emplace(std::move(key), std::move(val));
+  auto& elem = prv->map()->v[res.first]->second;
+  if (!res.second) {
+    elem.assign_with_comments(std::move(val));
+  }
+
+  return elem;
+}
+
+
+Value::iterator Value::begin() {
+  if (type() != Type::Map) {
+    return iterator();
+  }
+
+  return iterator(prv->map()->sortedView().data());
+}
+
+
+Value::iterator Value::end() {
+  if (type() != Type::Map) {
+    return iterator();
+  }
+
+  auto& sorted = prv->map()->sortedView();
+
+  return iterator(sorted.data() + sorted.size());
+}
+
+
+Value::const_iterator Value::begin() const {
+  if (type() != Type::Map) {
+    return const_iterator();
   }
 
-  return prv->m->m.begin();
+  return const_iterator(prv->map()->sortedView().data());
 }
 
 
-ValueMap::iterator Value::end() {
-  if (prv->type != Type::Map) {
-    // Some C++ compilers might not allow comparing this to another
-    // default-constructed iterator.
-    return ValueMap::iterator();
+Value::const_iterator Value::end() const {
+  if (type() != Type::Map) {
+    return const_iterator();
   }
 
-  return prv->m->m.end();
+  auto& sorted = prv->map()->sortedView();
+
+  return const_iterator(sorted.data() + sorted.size());
 }
 
 
-ValueMap::const_iterator Value::begin() const {
-  if (prv->type != Type::Map) {
-    // Some C++ compilers might not allow comparing this to another
-    // default-constructed iterator.
-    return ValueMap::const_iterator();
+Value::MapRange<Value::iterator> Value::insertion_order() {
+  if (type() != Type::Map) {
+    return MapRange<iterator>(iterator(), iterator());
   }
 
-  return prv->m->m.begin();
+  auto& v = prv->map()->v;
+
+  return MapRange<iterator>(iterator(v.data()), iterator(v.data() + v.size()));
 }
 
 
-ValueMap::const_iterator Value::end() const {
-  if (prv->type != Type::Map) {
-    // Some C++ compilers might not allow comparing this to another
-    // default-constructed iterator.
-    return ValueMap::const_iterator();
+Value::MapRange<Value::const_iterator> Value::insertion_order() const {
+  if (type() != Type::Map) {
+    return MapRange<const_iterator>(const_iterator(), const_iterator());
   }
 
-  return prv->m->m.end();
+  auto& v = prv->map()->v;
+
+  return MapRange<const_iterator>(const_iterator(v.data()),
+    const_iterator(v.data() + v.size()));
 }
 
 
 size_t Value::erase(const std::string &key) {
-  if (prv->type == Type::Undefined) {
+  if (type() == Type::Undefined) {
     return 0;
-  } else if (prv->type != Type::Map) {
+  } else if (type() != Type::Map) {
     throw type_mismatch("Must be of type Map for that operation.");
   }
 
-  size_t ret = prv->m->m.erase(key);
-
-  if (ret > 0) {
-    auto v = &prv->m->v;
-    auto it = std::find(v->begin(), v->end(), key);
-    if (it == v->end()) {
-      assert(!"Value found in map but not in vector");
-    } else {
-      v->erase(it);
-    }
+  auto pos = prv->map()->find(key);
+  if (pos == std::string::npos) {
+    return 0;
   }
 
-  return ret;
+  ++prv->version;
+  prv->map()->erase(pos);
+
+  return 1;
 }
 
 
@@ -1465,20 +2588,24 @@ size_t Value::erase(const char *key) {
 
 
 double Value::to_double() const {
-  switch (prv->type) {
+  switch (type()) {
   case Type::Undefined:
   case Type::Null:
     return 0.0;
   case Type::Bool:
-    return (prv->b ? 1.0 : 0.0);
+    return (scalar.b ? 1.0 : 0.0);
   case Type::Double:
-    return prv->d;
+    return scalar.d;
   case Type::Int64:
-    return static_cast<double>(prv->i);
+    return static_cast<double>(scalar.i);
   case Type::String:
     {
       double ret;
 
+      if (fastParseDouble(&ret, prv->s->c_str(), prv->s->size())) {
+        return ret;
+      }
+
 #if HJSON_USE_CHARCONV
       const char *pCh = prv->s->c_str();
       const char *pEnd = pCh + prv->s->size();
@@ -1518,20 +2645,24 @@ double Value::to_double() const {
 
 
 std::int64_t Value::to_int64() const {
-  switch (prv->type) {
+  switch (type()) {
   case Type::Undefined:
   case Type::Null:
     return 0;
   case Type::Bool:
-    return (prv->b ? 1 : 0);
+    return (scalar.b ? 1 : 0);
   case Type::Double:
-    return static_cast<std::int64_t>(prv->d);
+    return static_cast<std::int64_t>(scalar.d);
   case Type::Int64:
-    return prv->i;
+    return scalar.i;
   case Type::String:
     {
       std::int64_t ret;
 
+      if (fastParseInt(&ret, prv->s->c_str(), prv->s->size())) {
+        return ret;
+      }
+
 #if HJSON_USE_CHARCONV
       const char *pCh = prv->s->c_str();
       const char *pEnd = pCh + prv->s->size();
@@ -1572,97 +2703,59 @@ std::int64_t Value::to_int64() const {
 
 
 std::string Value::to_string() const {
-  switch (prv->type) {
+  switch (type()) {
   case Type::Undefined:
     return "";
   case Type::Null:
     return "null";
   case Type::Bool:
-    return (prv->b ? "true" : "false");
+    return (scalar.b ? "true" : "false");
   case Type::Double:
     {
+      char buf[32];
 #if HJSON_USE_CHARCONV
-      std::array<char, 32> buf;
-
-      auto res = std::to_chars(buf.data(), buf.data() + buf.size(), prv->d);
+      auto res = std::to_chars(buf, buf + sizeof(buf) - 2, scalar.d);
 
-      if (res.ptr - buf.data() >= buf.size() || res.ec != std::errc()) {
+      if (res.ec != std::errc()) {
         return "";
       }
 
-      // to_chars() does not set a zero termination, which is needed by strchr().
-      *res.ptr = '\0';
-
-      // Always output a decimal point.
-      if (strchr(buf.data(), '.') == nullptr) {
-        if (res.ptr - buf.data() >= buf.size() - 1) {
-          return "";
-        }
-        *(res.ptr++) = '.';
-        *(res.ptr++) = '0';
-      }
-
-      return std::string(buf.data(), res.ptr);
-#elif HJSON_USE_STRTOD
-      char buf[32];
-      int nChars = snprintf(buf, sizeof(buf), "%.15g", prv->d);
+      size_t nChars = res.ptr - buf;
+#else
+      // Locale independent, and the shortest string that is parsed back into
+      // the same double.
+      size_t nChars = formatDouble(buf, scalar.d);
 
-      if (nChars < 0 || nChars >= static_cast<int>(sizeof(buf))) {
+      if (!nChars) {
         return "";
       }
+#endif
 
-      // Always output a decimal point.
-      if (strchr(buf, '.') == nullptr) {
-        if (nChars >= static_cast<int>(sizeof(buf)) - 1) {
-          return "";
-        }
+      // Always output a decimal point or an exponent, so that the string is
+      // parsed back into a double.
+      if (!std::memchr(buf, '.', nChars) && !std::memchr(buf, 'e', nChars)) {
         buf[nChars++] = '.';
         buf[nChars++] = '0';
       }
 
       return std::string(buf, nChars);
-#else
-      std::ostringstream oss;
-
-      // Make sure we use dot (not comma) as decimal point.
-      oss.imbue(std::locale::classic());
-      oss.precision(15);
-
-      oss << prv->d;
-
-      // Always output a decimal point. Done like this to avoid printing more
-      // decimals than needed, which would be the result of using
-      // std::ios::showpoint.
-      if (oss.str().find_first_of('.', 0) == std::string::npos) {
-        oss << ".0";
-      }
-
-      return oss.str();
-#endif
     }
   case Type::Int64:
     {
 #if HJSON_USE_CHARCONV
       std::array<char, 32> buf;
 
-      auto res = std::to_chars(buf.data(), buf.data() + buf.size(), prv->i);
+      auto res = std::to_chars(buf.data(), buf.data() + buf.size(), scalar.i);
 
       if (res.ec != std::errc()) {
         return "";
       }
 
       return std::string(buf.data(), res.ptr);
-#elif HJSON_USE_STRTOD
-      return std::to_string(prv->i);
 #else
-      std::ostringstream oss;
-
-      // Avoid localization surprises.
-      oss.imbue(std::locale::classic());
-
-      oss << prv->i;
-
-      return oss.str();
+      // std::to_string() does not use any locale dependent formatting for
+      // integers.
+      return std::to_string(scalar.i);
 #endif
     }
   case Type::String:
@@ -1671,107 +2764,172 @@ std::string Value::to_string() const {
     break;
   }
 
-  throw type_mismatch("Illegal type for this operation.");
+  throw type_mismatch("Illegal type for this operation.");
+}
+
+
+const std::string& Value::string_ref() const {
+  if (type() != Type::String) {
+    throw type_mismatch("Must be of type String for that operation.");
+  }
+
+  return *prv->s;
+}
+
+
+std::ostream& operator <<(std::ostream& out, const StringRef& str) {
+  return out.write(str.data(), str.size());
 }
 
 
 void Value::set_comment_before(const std::string& str) {
-  if (!cm) {
-    if (str.empty()) {
-      return;
-    }
-    cm.reset(new Comments());
+  if (!cm && str.empty()) {
+    return;
   }
 
-  cm->m_commentBefore = str;
+  Comments::unique(cm).set(Comments::Before, str);
 }
 
 
 std::string Value::get_comment_before() const {
   if (cm) {
-    return cm->m_commentBefore;
+    return cm->get(Comments::Before);
   }
 
   return "";
 }
 
 
+StringRef Value::get_comment_before_ref() const {
+  if (cm) {
+    return cm->ref(Comments::Before);
+  }
+
+  return StringRef();
+}
+
+
 void Value::set_comment_key(const std::string& str) {
-  if (!cm) {
-    if (str.empty()) {
-      return;
-    }
-    cm.reset(new Comments());
+  if (!cm && str.empty()) {
+    return;
   }
 
-  cm->m_commentKey = str;
+  Comments::unique(cm).set(Comments::Key, str);
 }
 
 
 std::string Value::get_comment_key() const {
   if (cm) {
-    return cm->m_commentKey;
+    return cm->get(Comments::Key);
   }
 
   return "";
 }
 
 
+StringRef Value::get_comment_key_ref() const {
+  if (cm) {
+    return cm->ref(Comments::Key);
+  }
+
+  return StringRef();
+}
+
+
 void Value::set_comment_inside(const std::string& str) {
-  if (!cm) {
-    if (str.empty()) {
-      return;
-    }
-    cm.reset(new Comments());
+  if (!cm && str.empty()) {
+    return;
   }
 
-  cm->m_commentInside = str;
+  Comments::unique(cm).set(Comments::Inside, str);
 }
 
 
 std::string Value::get_comment_inside() const {
   if (cm) {
-    return cm->m_commentInside;
+    return cm->get(Comments::Inside);
   }
 
   return "";
 }
 
 
+StringRef Value::get_comment_inside_ref() const {
+  if (cm) {
+    return cm->ref(Comments::Inside);
+  }
+
+  return StringRef();
+}
+
+
 void Value::set_comment_after(const std::string& str) {
-  if (!cm) {
-    if (str.empty()) {
-      return;
-    }
-    cm.reset(new Comments());
+  if (!cm && str.empty()) {
+    return;
   }
 
-  cm->m_commentAfter = str;
+  Comments::unique(cm).set(Comments::After, str);
 }
 
 
 std::string Value::get_comment_after() const {
   if (cm) {
-    return cm->m_commentAfter;
+    return cm->get(Comments::After);
   }
 
   return "";
 }
 
 
-void Value::set_comments(const Value& other) {
-  if (other.cm) {
-    if (!cm) {
-      cm.reset(new Comments());
-    }
+StringRef Value::get_comment_after_ref() const {
+  if (cm) {
+    return cm->ref(Comments::After);
+  }
 
-    *cm = *other.cm;
-  } else {
-    clear_comments();
+  return StringRef();
+}
+
+
+void setCommentRange(Value& val, int slot,
+  const std::shared_ptr<std::string>& source, size_t pos, size_t size,
+  bool append)
+{
+  if (!val.cm && !size) {
+    return;
+  }
+
+  Value::Comments::unique(val.cm).set_range(slot, source, pos, size, append);
+}
+
+
+// Like Value::reserve(), but only for the elements and not for the hash index
+// of a Map, which would take several times as much memory if the guess of the
+// final size is too large.
+void reserveMapElements(Value& val, size_t size) {
+  if (val.type() == Type::Map) {
+    val.prv->map()->v.reserve(size);
+  }
+}
+
+
+// Appends the comment in fromSlot to the comment in toSlot, and removes the
+// comment in fromSlot.
+void moveComment(Value& val, int toSlot, int fromSlot) {
+  if (val.cm && val.cm->ranges[fromSlot].size) {
+    auto& cm = Value::Comments::unique(val.cm);
+    auto r = cm.ranges[fromSlot];
+    cm.ranges[fromSlot] = Value::Comments::Range{ 0, 0 };
+    cm.set_range(toSlot, cm.source, r.pos, r.size, true);
   }
 }
 
 
+void Value::set_comments(const Value& other) {
+  // Shared until the comments of either Value are changed.
+  cm = other.cm;
+}
+
+
 void Value::clear_comments() {
   cm.reset();
 }
@@ -1799,13 +2957,16 @@ Value& Value::assign_with_comments(Value&& other) {
 
 MapProxy::MapProxy(std::shared_ptr<ValueImpl> _parent, const std::string &_key,
   Value *_pTarget)
-  : Value(_pTarget ? _pTarget->prv : std::make_shared<ValueImpl>(Type::Undefined),
+  : Value(_pTarget ? nullptr : ValueImpl::make(Type::Undefined),
       _pTarget ? _pTarget->cm : 0),
     parentPrv(_parent),
     key(_key),
     pTarget(_pTarget),
     wasAssigned(false)
 {
+  if (_pTarget) {
+    share_data(*_pTarget);
+  }
 }
 
 
@@ -1819,20 +2980,19 @@ MapProxy::~MapProxy() {
   if (wasAssigned || !empty()) {
     if (pTarget) {
       // Can have changed due to assignment.
-      pTarget->prv = this->prv;
+      pTarget->share_data(*this);
       // In case cm was 0 but now has been created by a call to set_comment_x.
       pTarget->cm = this->cm;
     } else {
-      // If the key is new we must add it to the order vector also.
-      parentPrv->m->v.push_back(key);
-
       // We waited until now because we don't want to insert a Value object of
       // type Undefined into the parent map, unless such an object was explicitly
       // assigned (e.g. `val["key"] = Hjson::Value()`).
       // Without this requirement, checking for the existence of an element
       // would create an Undefined element for that key if it didn't already exist
       // (e.g. `if (val["key"] == 1) {` would create an element for "key").
-      parentPrv->m->m.emplace(key, Value(this->prv, this->cm));
+      Value val(nullptr, this->cm);
+      val.share_data(*this);
+      parentPrv->map()->insert(key, std::move(val));
     }
   }
 }
@@ -1882,32 +3042,546 @@ MapProxy& MapProxy::assign_with_comments(Value&& other) {
 }
 
 
-Value Merge(const Value& base, const Value& ext) {
-  Value merged;
+class Path::Segment {
+public:
+  std::string key;
+  size_t hash;
+  // The key as index in a Vector, or std::string::npos if the key is not a
+  // decimal number without leading zeros.
+  size_t index;
+
+  explicit Segment(std::string&& _key)
+    : key(std::move(_key)),
+    hash(std::hash<std::string>()(key)),
+    index(std::string::npos)
+  {
+    if (key.empty() || key.size() > 18 || (key[0] == '0' && key.size() > 1)) {
+      return;
+    }
+
+    size_t i = 0;
+    for (char c : key) {
+      if (c < '0' || c > '9') {
+        return;
+      }
+      i = i * 10 + (c - '0');
+    }
+    index = i;
+  }
+};
+
+
+Path::Path(const std::string& pointer) {
+  auto segs = std::make_shared<std::vector<Segment> >();
+
+  if (!pointer.empty()) {
+    if (pointer[0] != '/') {
+      throw syntax_error("A JSON pointer must start with '/': " + pointer);
+    }
+
+    std::string key;
+    for (size_t i = 1; ; ++i) {
+      if (i == pointer.size() || pointer[i] == '/') {
+        segs->emplace_back(std::move(key));
+        key.clear();
+        if (i == pointer.size()) {
+          break;
+        }
+      } else if (pointer[i] == '~') {
+        if (i + 1 < pointer.size() && (pointer[i + 1] == '0' ||
+          pointer[i + 1] == '1'))
+        {
+          key += (pointer[++i] == '0' ? '~' : '/');
+        } else {
+          throw syntax_error("Invalid escape sequence in JSON pointer: " +
+            pointer);
+        }
+      } else {
+        key += pointer[i];
+      }
+    }
+  }
+
+  segments = segs;
+}
+
+
+Path::Path(const std::vector<std::string>& keys) {
+  auto segs = std::make_shared<std::vector<Segment> >();
+
+  segs->reserve(keys.size());
+  for (const auto& key : keys) {
+    segs->emplace_back(std::string(key));
+  }
+
+  segments = segs;
+}
+
+
+const Value *Path::child(const Value& container, const Segment& seg) {
+  switch (container.type()) {
+  case Type::Vector:
+    {
+      auto& vec = *container.prv->vec();
+      return (seg.index < vec.size() ? &vec[seg.index] : nullptr);
+    }
+  case Type::Map:
+    {
+      auto& map = *container.prv->map();
+      auto pos = map.find(seg.key, seg.hash);
+      return (pos == std::string::npos ? nullptr : &map.v[pos]->second);
+    }
+  default:
+    return nullptr;
+  }
+}
+
+
+const Value *Path::find(const Value& root) const {
+  const Value *cur = &root;
+
+  for (const auto& seg : *segments) {
+    if (!(cur = child(*cur, seg))) {
+      return nullptr;
+    }
+  }
+
+  return cur;
+}
+
+
+Value *Path::find(Value& root) const {
+  return const_cast<Value*>(find(static_cast<const Value&>(root)));
+}
+
+
+const Value& Path::at(const Value& root) const {
+  auto ret = find(root);
+  if (!ret) {
+    throw index_out_of_bounds("Path not found.");
+  }
+
+  return *ret;
+}
+
+
+Value& Path::at(Value& root) const {
+  return const_cast<Value&>(at(static_cast<const Value&>(root)));
+}
+
+
+class CachedPath::Cache {
+public:
+  // A container on the path, with its version when the lookup was made and
+  // the element in the container that is on the path. Keeping the container
+  // alive makes sure that its address cannot be reused by another container.
+  class Step {
+  public:
+    std::shared_ptr<const void> container;
+    size_t version;
+    const Value *child;
+  };
+
+  std::vector<Step> steps;
+  bool valid = false;
+};
+
+
+CachedPath::CachedPath(const Path& _path)
+  : path(_path),
+  cache(new Cache())
+{
+}
+
+
+CachedPath::CachedPath(const CachedPath& other)
+  : path(other.path),
+  cache(new Cache())
+{
+}
 
+
+CachedPath::~CachedPath() {
+}
+
+
+CachedPath& CachedPath::operator=(const CachedPath& other) {
+  path = other.path;
+  cache->steps.clear();
+  cache->valid = false;
+
+  return *this;
+}
+
+
+const Value *CachedPath::lookup(const Value& root) {
+  auto& steps = cache->steps;
+
+  if (cache->valid) {
+    const Value *cur = &root;
+    for (const auto& step : steps) {
+      if (cur->prv.get() != step.container.get() ||
+        cur->prv->version != step.version)
+      {
+        cur = nullptr;
+        break;
+      }
+      cur = step.child;
+    }
+    if (cur) {
+      return cur;
+    }
+  }
+
+  cache->valid = false;
+  steps.clear();
+
+  const Value *cur = &root;
+  for (const auto& seg : *path.segments) {
+    auto next = Path::child(*cur, seg);
+    if (!next) {
+      steps.clear();
+      return nullptr;
+    }
+    steps.push_back(Cache::Step{ cur->prv, cur->prv->version, next });
+    cur = next;
+  }
+  cache->valid = true;
+
+  return cur;
+}
+
+
+const Value *CachedPath::find(const Value& root) {
+  return lookup(root);
+}
+
+
+Value *CachedPath::find(Value& root) {
+  return const_cast<Value*>(lookup(root));
+}
+
+
+const Value& CachedPath::at(const Value& root) {
+  auto ret = lookup(root);
+  if (!ret) {
+    throw index_out_of_bounds("Path not found.");
+  }
+
+  return *ret;
+}
+
+
+Value& CachedPath::at(Value& root) {
+  return const_cast<Value&>(at(static_cast<const Value&>(root)));
+}
+
+
+// A Map in the result of Merge() that is a merge of two Maps, but that has not
+// been filled in yet.
+struct MergeFrame {
+  const Value *base;
+  const Value *ext;
+  Value *merged;
+};
+
+
+Value Merge(const Value& base, const Value& ext) {
   if (!ext.defined()) {
-    merged = base.clone();
-  } else if (base.type() == Type::Map && ext.type() == Type::Map) {
-    for (int index = 0; index < ext.size(); ++index) {
-      if (base[ext.key(index)].defined()) {
-        merged[ext.key(index)] = Merge(base[ext.key(index)], ext[index]);
+    return base.clone();
+  } else if (base.type() != Type::Map || ext.type() != Type::Map) {
+    return ext.clone();
+  }
+
+  Value ret(Type::Map);
+  // Nested Maps are merged using an explicit stack instead of recursion.
+  std::vector<MergeFrame> stack(1, MergeFrame{ &base, &ext, &ret });
+
+  while (!stack.empty()) {
+    auto cur = stack.back();
+    stack.pop_back();
+    Value& merged = *cur.merged;
+    const Value& constMerged = merged;
+    merged.reserve(cur.ext->size() + cur.base->size());
+
+    for (const auto& it : cur.ext->insertion_order()) {
+      auto pBase = cur.base->find(it.first);
+      if (!pBase || !pBase->defined()) {
+        merged.try_emplace(it.first, it.second.clone());
+      } else if (!it.second.defined()) {
+        merged.try_emplace(it.first, pBase->clone());
+      } else if (pBase->type() != Type::Map || it.second.type() != Type::Map) {
+        merged.try_emplace(it.first, it.second.clone());
       } else {
-        merged[ext.key(index)] = ext[index].clone();
+        // The key is new in merged, so this is the same as try_emplace().
+        auto& child = merged.insert_or_assign(it.first, Value(Type::Map));
+        stack.push_back(MergeFrame{ pBase, &it.second, &child });
+      }
+    }
+
+    for (const auto& it : cur.base->insertion_order()) {
+      auto pMerged = constMerged.find(it.first);
+      if (!pMerged) {
+        merged.try_emplace(it.first, it.second.clone());
+      } else if (!pMerged->defined()) {
+        merged.insert_or_assign(it.first, it.second.clone());
       }
     }
 
-    for (int index = 0; index < base.size(); ++index) {
-      if (!merged[base.key(index)].defined()) {
-        merged[base.key(index)] = base[index].clone();
+    merged.set_comments(*cur.ext);
+  }
+
+  return ret;
+}
+
+
+std::string Difference::Change::pointer() const {
+  std::string ret;
+
+  for (const auto& key : path) {
+    ret += '/';
+    for (char c : key) {
+      if (c == '~') {
+        ret += "~0";
+      } else if (c == '/') {
+        ret += "~1";
+      } else {
+        ret += c;
       }
     }
+  }
+
+  return ret;
+}
+
+
+// A pair of Vectors or Maps of the same type in the trees given to Diff(),
+// whose elements have not been compared yet.
+struct DiffFrame {
+  const Value *from;
+  const Value *to;
+  std::vector<std::string> path;
+};
+
+
+static void _addChange(Difference& diff, Difference::Op op,
+  const std::vector<std::string>& path, const std::string& key,
+  const Value& val)
+{
+  diff.changes.emplace_back();
+  auto& change = diff.changes.back();
+  change.op = op;
+  change.path.reserve(path.size() + 1);
+  change.path = path;
+  change.path.push_back(key);
+  change.value = val;
+}
+
+
+// Adds a change that replaces the element "from" with "to" if they are not
+// equal, unless both are Vectors or Maps: then their elements are compared
+// later instead.
+static void _diffElement(Difference& diff, std::vector<DiffFrame>& stack,
+  const Value& from, const Value& to, const std::vector<std::string>& path,
+  const std::string& key)
+{
+  if (from == to) {
+    return;
+  }
 
-    merged.set_comments(ext);
+  if (from.is_container() && from.type() == to.type()) {
+    stack.push_back(DiffFrame{ &from, &to, path });
+    stack.back().path.push_back(key);
   } else {
-    merged = ext.clone();
+    _addChange(diff, Difference::Op::Replace, path, key, to);
   }
+}
+
+
+static void _diffVector(Difference& diff, std::vector<DiffFrame>& stack,
+  const DiffFrame& cur)
+{
+  const Value& from = *cur.from;
+  const Value& to = *cur.to;
+  size_t fromSize = from.size(), toSize = to.size();
+
+  size_t head = 0;
+  while (head < fromSize && head < toSize &&
+    from[int(head)].deep_equal(to[int(head)]))
+  {
+    ++head;
+  }
+  size_t tail = 0;
+  while (tail < fromSize - head && tail < toSize - head &&
+    from[int(fromSize - 1 - tail)].deep_equal(to[int(toSize - 1 - tail)]))
+  {
+    ++tail;
+  }
+
+  // The elements between head and tail are compared pairwise, and then the
+  // surplus elements are removed or added. The indexes of the pairs are the
+  // same before and after the removals and additions, so the changes inside
+  // the pairs (that are added later from the stack) still find them.
+  size_t fromEnd = fromSize - tail, toEnd = toSize - tail;
+  size_t pairEnd = std::min(fromEnd, toEnd);
+  for (size_t i = head; i < pairEnd; ++i) {
+    _diffElement(diff, stack, from[int(i)], to[int(i)], cur.path,
+      std::to_string(i));
+  }
+  // From the back, so that the indexes of the remaining elements are
+  // unchanged.
+  for (size_t i = fromEnd; i > pairEnd; --i) {
+    _addChange(diff, Difference::Op::Remove, cur.path, std::to_string(i - 1),
+      Value());
+  }
+  for (size_t i = pairEnd; i < toEnd; ++i) {
+    _addChange(diff, Difference::Op::Add, cur.path, std::to_string(i),
+      to[int(i)]);
+  }
+}
+
+
+static void _diffMap(Difference& diff, std::vector<DiffFrame>& stack,
+  const DiffFrame& cur)
+{
+  const Value& from = *cur.from;
+  const Value& to = *cur.to;
+  // The keys in the insertion order that the patched Map will have after the
+  // removals and additions.
+  std::vector<const std::string*> order;
+  order.reserve(to.size());
+
+  for (const auto& it : from.insertion_order()) {
+    auto pTo = to.find(it.first);
+    if (pTo) {
+      order.push_back(&it.first);
+      _diffElement(diff, stack, it.second, *pTo, cur.path, it.first);
+    } else {
+      _addChange(diff, Difference::Op::Remove, cur.path, it.first, Value());
+    }
+  }
+
+  for (const auto& it : to.insertion_order()) {
+    if (!from.find(it.first)) {
+      order.push_back(&it.first);
+      _addChange(diff, Difference::Op::Add, cur.path, it.first, it.second);
+    }
+  }
+
+  size_t pos = 0;
+  for (const auto& it : to.insertion_order()) {
+    if (*order[pos] != it.first) {
+      size_t pos2 = pos + 1;
+      while (*order[pos2] != it.first) {
+        ++pos2;
+      }
+      diff.changes.emplace_back();
+      auto& change = diff.changes.back();
+      change.op = Difference::Op::Move;
+      change.path = cur.path;
+      change.from = int(pos2);
+      change.to = int(pos);
+      std::rotate(order.begin() + pos, order.begin() + pos2,
+        order.begin() + pos2 + 1);
+    }
+    ++pos;
+  }
+}
+
+
+Difference Diff(const Value& from, const Value& to) {
+  Difference diff;
+
+  if (from == to) {
+    return diff;
+  }
+  if (!from.is_container() || from.type() != to.type()) {
+    diff.changes.emplace_back();
+    diff.changes.back().value = to;
+    return diff;
+  }
+
+  // Nested containers are compared using an explicit stack instead of
+  // recursion.
+  std::vector<DiffFrame> stack(1, DiffFrame{ &from, &to,
+    std::vector<std::string>() });
+
+  while (!stack.empty()) {
+    auto cur = std::move(stack.back());
+    stack.pop_back();
+
+    if (cur.from->type() == Type::Vector) {
+      _diffVector(diff, stack, cur);
+    } else {
+      _diffMap(diff, stack, cur);
+    }
+  }
+
+  return diff;
+}
+
+
+static size_t _patchIndex(const std::string& key) {
+  size_t index = 0;
+
+  if (key.empty() || key.size() > 18) {
+    throw index_out_of_bounds("Path not found.");
+  }
+  for (char c : key) {
+    if (c < '0' || c > '9') {
+      throw index_out_of_bounds("Path not found.");
+    }
+    index = index * 10 + (c - '0');
+  }
+
+  return index;
+}
+
+
+void Patch(Value& root, const Difference& diff) {
+  for (const auto& change : diff.changes) {
+    if (change.op == Difference::Op::Replace) {
+      Path(change.path).at(root).assign_with_comments(change.value.clone());
+      continue;
+    } else if (change.op == Difference::Op::Move) {
+      Path(change.path).at(root).move(change.from, change.to);
+      continue;
+    } else if (change.path.empty()) {
+      throw index_out_of_bounds("Path not found.");
+    }
 
-  return merged;
+    Value& parent = Path(std::vector<std::string>(change.path.begin(),
+      change.path.end() - 1)).at(root);
+    const std::string& key = change.path.back();
+
+    if (parent.type() == Type::Vector) {
+      size_t index = _patchIndex(key);
+      if (change.op == Difference::Op::Remove) {
+        if (index >= parent.size()) {
+          throw index_out_of_bounds("Path not found.");
+        }
+        parent.erase(int(index));
+      } else {
+        if (index > parent.size()) {
+          throw index_out_of_bounds("Path not found.");
+        }
+        parent.push_back(change.value.clone());
+        if (index + 1 < parent.size()) {
+          parent.move(int(parent.size() - 1), int(index));
+        }
+      }
+    } else if (parent.type() == Type::Map) {
+      if (change.op == Difference::Op::Remove) {
+        if (!parent.erase(key)) {
+          throw index_out_of_bounds("Path not found.");
+        }
+      } else {
+        parent[key].assign_with_comments(change.value.clone());
+      }
+    } else {
+      throw index_out_of_bounds("Path not found.");
+    }
+  }
 }
 
 
@@ -1,6 +1,7 @@
 #include <hjson.h>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <cstring>
 #include <vector>
 #include <algorithm>
@@ -37,19 +38,11 @@ static std::string _readStream(std::ifstream *pInfile) {
 }
 
 
-static std::string _readFile(std::string pathBeginning, std::string extra,
-  std::string pathEnd, bool *pUsedExtra)
-{
+static std::string _readFile(std::string path) {
   // The output from Hjson::Marshal() always uses Unix EOL, but git might have
   // converted files to Windows EOL on Windows, therefore we open the file in
   // text mode instead of binary mode.
-  std::ifstream infile(pathBeginning + extra + pathEnd, std::ifstream::ate);
-  if (!infile.is_open()) {
-    infile.open(pathBeginning + pathEnd, std::ifstream::ate);
-    *pUsedExtra = false;
-  } else {
-    *pUsedExtra = true;
-  }
+  std::ifstream infile(path, std::ifstream::ate);
   if (!infile.is_open()) {
     return "";
   }
@@ -143,6 +136,91 @@ static bool _evaluate(std::string name, std::string expected, Hjson::Value root,
 }
 
 
+// Checks that a DecoderHandler, an IncrementalDecoder fed in chunks of
+// different sizes and operator>> give the same result or error as Unmarshal()
+// for data, which is the content of the test file name or an input of its own.
+static void _examineOtherDecoders(const std::string& name, const std::string& data) {
+  for (int optIndex = 0; optIndex < 3; ++optIndex) {
+    Hjson::DecoderOptions decOpt;
+    decOpt.comments = (optIndex != 1);
+    decOpt.whitespaceAsComments = (optIndex == 2);
+
+    Hjson::Value root;
+    std::string errMsg;
+    try {
+      root = Hjson::Unmarshal(data, decOpt);
+    } catch (const Hjson::syntax_error& e) {
+      errMsg = e.what();
+    }
+
+    Hjson::EncoderOptions encOpt;
+    encOpt.comments = decOpt.comments;
+    auto expected = errMsg.empty() ? Hjson::Marshal(root, encOpt) : "";
+
+    {
+      Hjson::DecoderHandler handler;
+      std::string errMsg2;
+      try {
+        Hjson::Unmarshal(data, handler, decOpt);
+      } catch (const Hjson::syntax_error& e) {
+        errMsg2 = e.what();
+      }
+      if (errMsg2 != errMsg) {
+        std::cout << "DecoderHandler differs from Unmarshal for " << name << "\n";
+        assert(false);
+      }
+    }
+
+    for (size_t chunkSize : {1, 2, 3, 7, 64, 100000}) {
+      Hjson::IncrementalDecoder decoder(decOpt);
+      Hjson::Value root2;
+      std::string errMsg2;
+      try {
+        for (size_t pos = 0; pos < data.size(); pos += chunkSize) {
+          decoder.feed(data.data() + pos, std::min(chunkSize, data.size() - pos));
+        }
+        root2 = decoder.finish();
+      } catch (const Hjson::syntax_error& e) {
+        errMsg2 = e.what();
+      }
+
+      if (errMsg2 != errMsg || !root2.deep_equal(root) ||
+        (errMsg.empty() && Hjson::Marshal(root2, encOpt) != expected))
+      {
+        std::cout << "IncrementalDecoder differs from Unmarshal for " <<
+          name << " with chunk size " << chunkSize << "\n";
+        assert(false);
+      }
+    }
+
+    {
+      std::istringstream in(data);
+      Hjson::Value root2;
+      std::string errMsg2;
+      try {
+        in >> Hjson::StreamDecoder(root2, decOpt);
+      } catch (const Hjson::syntax_error& e) {
+        errMsg2 = e.what();
+      }
+      if (errMsg2 != errMsg || !root2.deep_equal(root)) {
+        std::cout << "operator>> differs from Unmarshal for " << name << "\n";
+        assert(false);
+      }
+    }
+  }
+}
+
+
+static void _examineOtherDecoders(std::string name) {
+  std::ifstream infile("assets/" + name + "_test.hjson", std::ifstream::ate | std::ifstream::binary);
+  if (!infile.is_open()) {
+    infile.open("assets/" + name + "_test.json", std::ifstream::ate | std::ifstream::binary);
+  }
+
+  _examineOtherDecoders(name, _readStream(&infile));
+}
+
+
 static void _examine(std::string filename) {
   size_t pos = filename.find("_test.");
   if (pos == std::string::npos) {
@@ -154,6 +232,8 @@ static void _examine(std::string filename) {
 
   bool shouldFail = !name.compare(0, 4, "fail");
 
+  _examineOtherDecoders(name);
+
   Hjson::Value root;
   try {
     root = _getTestContent(name);
@@ -170,21 +250,23 @@ static void _examine(std::string filename) {
     }
   }
 
-  std::string extra = "";
-#if HJSON_USE_CHARCONV
-  extra = "charconv/";
-#endif
+  {
+    Hjson::DecoderOptions decOpt;
+    decOpt.arena = true;
+    auto arenaRoot = _getTestContent(name, decOpt);
+    assert(arenaRoot.deep_equal(root));
+    assert(Hjson::Marshal(arenaRoot) == Hjson::Marshal(root));
+  }
 
   Hjson::EncoderOptions opt;
   opt.bracesSameLine = true;
 
-  bool bUsedExtra = false;
-  auto rhjson = _readFile("assets/comments2/", extra, name + "_result.hjson", &bUsedExtra);
+  auto rhjson = _readFile("assets/comments2/" + name + "_result.hjson");
   auto actualHjson = Hjson::Marshal(root, opt);
 
 #if WRITE_FACIT
-  std::ofstream outputFile = std::ofstream("assets/comments2/" +
-    (bUsedExtra ? extra + '/' : "") + name + "_result.hjson", std::ofstream::binary);
+  std::ofstream outputFile = std::ofstream("assets/comments2/" + name +
+    "_result.hjson", std::ofstream::binary);
   outputFile << actualHjson << '\n';
   outputFile.close();
 #endif
@@ -193,12 +275,11 @@ static void _examine(std::string filename) {
 
   opt.bracesSameLine = false;
 
-  rhjson = _readFile("assets/comments/", extra, name + "_result.hjson", &bUsedExtra);
+  rhjson = _readFile("assets/comments/" + name + "_result.hjson");
   actualHjson = Hjson::Marshal(root, opt);
 
 #if WRITE_FACIT
-  outputFile = std::ofstream("assets/comments/" + (bUsedExtra ? extra + '/' : "") +
-    name + "_result.hjson", std::ofstream::binary);
+  outputFile = std::ofstream("assets/comments/" + name + "_result.hjson", std::ofstream::binary);
   outputFile << actualHjson << '\n';
   outputFile.close();
 #endif
@@ -207,24 +288,22 @@ static void _examine(std::string filename) {
 
   opt.comments = false;
 
-  rhjson = _readFile("assets/", extra, name + "_result.hjson", &bUsedExtra);
+  rhjson = _readFile("assets/" + name + "_result.hjson");
   actualHjson = Hjson::Marshal(root, opt);
 
 #if WRITE_FACIT
-  outputFile = std::ofstream("assets/" + (bUsedExtra ? extra + '/' : "") +
-    name + "_result.hjson", std::ofstream::binary);
+  outputFile = std::ofstream("assets/" + name + "_result.hjson", std::ofstream::binary);
   outputFile << actualHjson << '\n';
   outputFile.close();
 #endif
 
   assert(_evaluate(name, rhjson, root, actualHjson));
 
-  auto rjson = _readFile("assets/", extra, name + "_result.json", &bUsedExtra);
+  auto rjson = _readFile("assets/" + name + "_result.json");
   auto actualJson = Hjson::MarshalJson(root);
 
 #if WRITE_FACIT
-  outputFile = std::ofstream("assets/" + (bUsedExtra ? extra + '/' : "") +
-    name + "_result.json", std::ofstream::binary);
+  outputFile = std::ofstream("assets/" + name + "_result.json", std::ofstream::binary);
   outputFile << actualJson << '\n';
   outputFile.close();
 #endif
@@ -233,12 +312,11 @@ static void _examine(std::string filename) {
 
   opt.preserveInsertionOrder = false;
 
-  rhjson = _readFile("assets/sorted/", extra, name + "_result.hjson", &bUsedExtra);
+  rhjson = _readFile("assets/sorted/" + name + "_result.hjson");
   actualHjson = Hjson::Marshal(root, opt);
 
 #if WRITE_FACIT
-  outputFile = std::ofstream("assets/sorted/" + (bUsedExtra ? extra + '/' : "") +
-    name + "_result.hjson", std::ofstream::binary);
+  outputFile = std::ofstream("assets/sorted/" + name + "_result.hjson", std::ofstream::binary);
   outputFile << actualHjson << '\n';
   outputFile.close();
 #endif
@@ -251,12 +329,11 @@ static void _examine(std::string filename) {
   opt.separator = true;
   opt.comments = false;
 
-  rjson = _readFile("assets/sorted/", extra, name + "_result.json", &bUsedExtra);
+  rjson = _readFile("assets/sorted/" + name + "_result.json");
   actualJson = Hjson::Marshal(root, opt);
 
 #if WRITE_FACIT
-  outputFile = std::ofstream("assets/sorted/" + (bUsedExtra ? extra + '/' : "") +
-    name + "_result.json", std::ofstream::binary);
+  outputFile = std::ofstream("assets/sorted/" + name + "_result.json", std::ofstream::binary);
   outputFile << actualJson << '\n';
   outputFile.close();
 #endif
@@ -273,12 +350,11 @@ static void _examine(std::string filename) {
   }
 
   opt = Hjson::EncoderOptions();
-  rhjson = _readFile("assets/comments3/", extra, name + "_result.hjson", &bUsedExtra);
+  rhjson = _readFile("assets/comments3/" + name + "_result.hjson");
   actualHjson = Hjson::Marshal(root, opt);
 
 #if WRITE_FACIT
-  outputFile = std::ofstream("assets/comments3/" + (bUsedExtra ? extra + '/' : "") +
-    name + "_result.hjson", std::ofstream::binary);
+  outputFile = std::ofstream("assets/comments3/" + name + "_result.hjson", std::ofstream::binary);
   outputFile << actualHjson << '\n';
   outputFile.close();
 #endif
@@ -294,4 +370,13 @@ void test_marshal() {
   while (std::getline(infile, line)) {
     _examine(line);
   }
+
+  // Invalid input where a root object without braces and a single value would
+  // fail differently.
+  std::vector<std::string> invalid = { "}", ":a", ",", "a: 1\n}", "1 }",
+    "\"a\" 1", std::string(30, ' ') + "]" + std::string(30, 'x'), "{a:",
+    "[1,\n{b:#" };
+  for (const auto& data : invalid) {
+    _examineOtherDecoders(data, data);
+  }
 }
@@ -2,7 +2,16 @@
 #include <cmath>
 #include <cstring>
 #include <sstream>
+#include <fstream>
 #include <cstdio>
+#include <limits>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <iterator>
+#include <type_traits>
 #include "hjson_test.h"
 
 
@@ -11,6 +20,57 @@ static std::string _test_string_param(std::string param) {
 }
 
 
+// Writes all events to a string, and remembers the last string pointer.
+class _RecordingHandler : public Hjson::DecoderHandler {
+public:
+  std::string log;
+  const char *lastStr = nullptr;
+
+  void on_object_begin() override { log += "{ "; }
+  void on_object_end() override { log += "} "; }
+  void on_array_begin() override { log += "[ "; }
+  void on_array_end() override { log += "] "; }
+  void on_key(const char *key, size_t keySize) override {
+    log += "k:" + std::string(key, keySize) + " ";
+  }
+  void on_string(const char *str, size_t strSize) override {
+    log += "s:" + std::string(str, strSize) + " ";
+    lastStr = str;
+  }
+  void on_int64(std::int64_t i) override { log += "i:" + std::to_string(i) + " "; }
+  void on_double(double d) override { log += "d:" + std::to_string(d) + " "; }
+  void on_bool(bool b) override { log += b ? "true " : "false "; }
+  void on_null() override { log += "null "; }
+  void on_comment(const char *comment, size_t commentSize) override {
+    log += "c:" + std::string(comment, commentSize) + " ";
+  }
+};
+
+
+struct _BoundInner {
+  int a = 1;
+  std::vector<double> d;
+};
+HJSON_BIND(_BoundInner, HJSON_FIELD(a), HJSON_FIELD(d))
+
+
+struct _BoundConfig {
+  std::string name;
+  int port = 80;
+  bool on = false;
+  unsigned char small = 0;
+  long long big = 0;
+  float ratio = 0;
+  std::vector<_BoundInner> inners;
+  std::map<std::string, std::string> env;
+  _BoundInner one;
+  std::vector<std::vector<int>> matrix;
+};
+HJSON_BIND(_BoundConfig, HJSON_FIELD(name), HJSON_FIELD(port), HJSON_FIELD(on),
+  HJSON_FIELD(small), HJSON_FIELD(big), HJSON_FIELD(ratio), HJSON_FIELD(inners),
+  HJSON_FIELD_NAMED(env, "environment"), HJSON_FIELD(one), HJSON_FIELD(matrix))
+
+
 void test_value() {
   {
     Hjson::Value valVec(Hjson::Type::Vector);
@@ -346,6 +406,47 @@ void test_value() {
     assert(val1.to_double() == val3.to_double());
   }
 
+  {
+    // Doubles are written as the shortest string that is parsed back into
+    // exactly the same value, with the same output for all number parsers.
+    assert(Hjson::Value(0.1).to_string() == "0.1");
+    assert(Hjson::Value(0.1 + 0.2).to_string() == "0.30000000000000004");
+    assert(Hjson::Value(123456.0).to_string() == "123456.0");
+    assert(Hjson::Value(-1.5e-7).to_string() == "-1.5e-07");
+    assert(Hjson::Value(1e22).to_string() == "1e+22");
+    assert(Hjson::Value(5e-324).to_string() == "5e-324");
+    assert(Hjson::Value(1.7976931348623157e308).to_string() == "1.7976931348623157e+308");
+    for (double d : {0.1, 1.0 / 3, -2.5, 1e22, 1e-7, 9.223372036854776e+58,
+      2.2250738585072014e-308, 1.7976931348623157e308})
+    {
+      auto val = Hjson::Unmarshal(Hjson::Marshal(Hjson::Value(d)));
+      assert(val.type() == Hjson::Type::Double);
+      assert(val.to_double() == d);
+    }
+
+    auto root = Hjson::Unmarshal("[\n9223372036854775807\n-9223372036854775808\n"
+      "9223372036854775808\n0.30000000000000004\n-0\n1e\n2.5E+3\n"
+      "12345678901234567890123\n]");
+    assert(root[0].type() == Hjson::Type::Int64);
+    assert(root[0] == 9223372036854775807);
+    assert(root[1].type() == Hjson::Type::Int64);
+    assert(root[1].to_int64() == INT64_MIN);
+    assert(root[2].type() == Hjson::Type::Double);
+    assert(root[2] == 9223372036854775808.0);
+    assert(root[3] == 0.1 + 0.2);
+    assert(root[4].type() == Hjson::Type::Int64);
+    assert(root[4] == 0);
+    assert(root[5].type() == Hjson::Type::String);
+    assert(root[6] == 2500.0);
+    assert(root[7] == 12345678901234567890123.0);
+
+    assert(Hjson::Value("2.5e3").to_double() == 2500.0);
+    assert(Hjson::Value("-42").to_int64() == -42);
+    assert(Hjson::Value("42.9").to_int64() == 42);
+    assert(Hjson::Value("1e").to_double() == 0.0);
+    assert(Hjson::Value("-").to_int64() == 0);
+  }
+
   {
     Hjson::Value val1 = 3;
     val1 += 1;
@@ -496,7 +597,7 @@ void test_value() {
     assert(it == val.end());
 
     const Hjson::Value valConst = val;
-    std::map<std::string, Hjson::Value>::const_iterator itConst = valConst.begin();
+    Hjson::Value::const_iterator itConst = valConst.begin();
     assert(itConst->first == "first");
     assert(itConst->second == "leaf1");
     ++itConst;
@@ -507,6 +608,18 @@ void test_value() {
     assert(itConst->second == "leaf1");
     ++itConst;
     assert(itConst == valConst.end());
+    // What is left of the std::map iterators that were used before.
+    static_assert(std::is_same<Hjson::Value::const_iterator::value_type,
+      const std::pair<const std::string, Hjson::Value>>::value, "");
+    static_assert(std::is_same<Hjson::Value::iterator::reference,
+      std::pair<const std::string, Hjson::Value>&>::value, "");
+    static_assert(std::is_same<std::iterator_traits<
+      Hjson::Value::iterator>::iterator_category,
+      std::bidirectional_iterator_tag>::value, "");
+    Hjson::Value::const_iterator itConst2 = val.begin();
+    assert(itConst2 == val.begin() && std::next(itConst2) != val.end());
+    assert(std::distance(valConst.begin(), valConst.end()) == 3);
+    assert(std::prev(valConst.end())->first == "second");
   }
 
   {
@@ -1185,6 +1298,33 @@ beta: a// cm 2
     std::remove(szTmp);
   }
 
+  {
+    const char *szTmp = "tmpTestFile.hjson";
+    Hjson::Value root1;
+
+    // Large enough to need several blocks when read from a stream.
+    for (int a = 0; a < 1000; ++a) {
+      root1.push_back("element number " + std::to_string(a));
+    }
+
+    Hjson::MarshalToFile(root1, szTmp);
+    auto root2 = Hjson::UnmarshalFromFile(szTmp);
+    assert(root2.deep_equal(root1));
+
+    std::ifstream infile(szTmp, std::ifstream::binary);
+    Hjson::Value root3;
+    infile >> root3;
+    assert(root3.deep_equal(root1));
+    infile.close();
+
+    // An empty file cannot be memory mapped.
+    std::ofstream outfile(szTmp, std::ofstream::binary);
+    outfile.close();
+    root2 = Hjson::UnmarshalFromFile(szTmp);
+    assert(root2.empty());
+    std::remove(szTmp);
+  }
+
   {
     const char *szTmp = "tmpTestFile.hjson";
     Hjson::DecoderOptions decOpt;
@@ -1587,6 +1727,1174 @@ alfa: a
     assert(root2.deep_equal(root));
   }
 
+  {
+    // Output that is bigger than the chunks written to a stream, and with
+    // deeper indentation than what has been used before.
+    Hjson::Value root;
+    for (int a = 0; a < 20; ++a) {
+      Hjson::Value parent;
+      parent["text"] = "some \"text\" with \t escapes\n";
+      if (a) {
+        parent["child"] = root;
+      }
+      root = parent;
+    }
+    for (int a = 0; a < 5000; ++a) {
+      root["vec"].push_back("element number " + std::to_string(a));
+    }
+    Hjson::EncoderOptions encOpt;
+    encOpt.indentBy = "\t";
+    std::ostringstream oss;
+    oss << Hjson::StreamEncoder(root, encOpt);
+    auto str = Hjson::Marshal(root, encOpt);
+    assert(str.size() > 100000);
+    assert(oss.str() == str);
+    assert(str.find("\n" + std::string(20, '\t') + "text:") != std::string::npos);
+    assert(Hjson::Unmarshal(str).deep_equal(root));
+  }
+
+  {
+    // The decoder skips over long runs of ordinary chars in one go, make sure
+    // that a special char is found wherever it is placed within such a run.
+    for (int a = 0; a < 70; ++a) {
+      std::string pad(a, 'x');
+      std::string tail(40, 'y');
+      std::string sp(a, ' ');
+
+      auto root = Hjson::Unmarshal("{\n  \"a" + pad + "\": \"" + pad + "\\\"" +
+        tail + "\\u0041\"\n  b: '" + pad + "\"" + tail + "'\n  \"c\": \"" + pad +
+        "\"\n  k" + pad + ":" + sp + "1\n" + sp + "# " + pad + " comment\n"
+        "  /*" + pad + "*" + tail + "**/ d: " + pad + "y z /x" + sp + "\n  e: 12" +
+        sp + "# c\n  f:\n    '''\n    " + pad + "'y" + pad + "''y\r\n    end\n    '''\n}");
+      assert(root.size() == 7);
+      assert(root["a" + pad] == pad + "\"" + tail + "A");
+      assert(root["b"] == pad + "\"" + tail);
+      assert(root["c"] == pad);
+      assert(root["k" + pad] == 1);
+      assert(root["d"].get_comment_before() == "\n" + sp + "# " + pad +
+        " comment\n  /*" + pad + "*" + tail + "**/ ");
+      assert(root["d"] == pad + "y z /x");
+      assert(root["e"].type() == Hjson::Type::Int64 && root["e"] == 12);
+      assert(root["f"] == pad + "'y" + pad + "''y\nend");
+      assert(Hjson::Unmarshal("[\"" + pad + std::string(1, '\0') + tail + "\"]")[0] ==
+        pad + std::string(1, '\0') + tail);
+
+      try {
+        Hjson::Unmarshal("[\"" + pad + tail);
+        assert(!"Did not throw error for unterminated string");
+      } catch (const Hjson::syntax_error&) {
+      }
+      try {
+        Hjson::Unmarshal("[\"" + pad + "\n" + tail + "\"]");
+        assert(!"Did not throw error for newline in string");
+      } catch (const Hjson::syntax_error& e) {
+        assert(std::string(e.what()).find("at line 2,0") != std::string::npos);
+      }
+      try {
+        Hjson::Unmarshal("{\n/*" + pad + tail);
+        assert(!"Did not throw error for unterminated comment");
+      } catch (const Hjson::syntax_error&) {
+      }
+    }
+  }
+
+  {
+    Hjson::Value root;
+    {
+      std::string str = "// before\n{\n  # key comment\n  \"a\" /* k */ : /* b */ 1 // after a\n"
+        "  b: [ # inside\n  ]\n  c: 3\n}\n// end\n";
+      root = Hjson::Unmarshal(str);
+      // The comments must not refer to the input.
+      str.assign(str.size(), 'x');
+    }
+    assert(root.get_comment_before() == "// before\n");
+    assert(root.get_comment_after() == "\n// end\n");
+    assert(root["a"].get_comment_before() == "\n  # key comment\n  ");
+    assert(root["a"].get_comment_key() == " /* k */  /* b */ ");
+    assert(root["a"].get_comment_after() == " // after a");
+    assert(root["b"].get_comment_inside() == " # inside\n  ");
+    assert(root["c"].get_comment_before() == "");
+
+    // Changing a comment in a copy does not change the original, and the
+    // other comments are kept.
+    Hjson::Value a = root["a"];
+    a.set_comment_key(" ");
+    assert(a.get_comment_key() == " ");
+    assert(a.get_comment_after() == " // after a");
+    assert(root["a"].get_comment_key() == " /* k */  /* b */ ");
+    root["a"].set_comment_after("");
+    assert(root["a"].get_comment_after() == "");
+    assert(root["a"].get_comment_before() == "\n  # key comment\n  ");
+    assert(a.get_comment_after() == " // after a");
+
+    Hjson::Value other = Hjson::Unmarshal("x: 1 # other\n");
+    other["x"].set_comments(root["b"]);
+    assert(other["x"].get_comment_inside() == " # inside\n  ");
+    assert(other["x"].get_comment_after() == "");
+
+    Hjson::DecoderOptions decOpt;
+    decOpt.comments = false;
+    auto noComments = Hjson::Unmarshal("# a\n{\n  a: 1 # b\n  c: [ /* c */ ]\n}\n",
+      decOpt);
+    assert(noComments.get_comment_before() == "");
+    assert(noComments["a"].get_comment_after() == "");
+    assert(noComments["c"].get_comment_inside() == "");
+    assert(Hjson::Marshal(noComments) == "{\n  a: 1\n  c: []\n}");
+  }
+
+  {
+    Hjson::Value map;
+    map.reserve(100);
+    assert(map.type() == Hjson::Type::Undefined);
+    std::string key = "first";
+    Hjson::Value val(1);
+    val.set_comment_after(" # one");
+    assert(map.try_emplace(std::move(key), std::move(val)));
+    assert(map.type() == Hjson::Type::Map);
+    assert(map.contains("first"));
+    assert(!map.contains("second"));
+    assert(map["first"].get_comment_after() == " # one");
+    assert(!map.try_emplace("first", 2));
+    assert(map["first"] == 1);
+    map.reserve(1000);
+    for (int a = 0; a < 1000; ++a) {
+      assert(map.try_emplace("key" + std::to_string(a), a));
+    }
+    assert(map.size() == 1001);
+    assert(map.key(1000) == "key999");
+    assert(map["key999"] == 999);
+    Hjson::Value two(2);
+    two.set_comment_before("# two\n");
+    auto &elem = map.insert_or_assign("first", two);
+    assert(elem == 2);
+    assert(elem.get_comment_before() == "# two\n");
+    assert(elem.get_comment_after() == "");
+    assert(map.key(0) == "first");
+    map.insert_or_assign("last", Hjson::Value("x")) = "y";
+    assert(map.key(1001) == "last");
+    assert(map["last"] == "y");
+    assert(!Hjson::Value(1).contains("first"));
+    try {
+      Hjson::Value(Hjson::Type::Vector).try_emplace("a", 1);
+      assert(!"Did not throw error for try_emplace on a Vector");
+    } catch (const Hjson::type_mismatch&) {
+    }
+
+    Hjson::Value vec;
+    vec.reserve(10);
+    vec = Hjson::Value(Hjson::Type::Vector);
+    vec.reserve(10);
+    vec.push_back(1);
+    assert(vec.size() == 1);
+  }
+
+  {
+    // Decoding with several threads gives the same result as with one thread,
+    // also for comments and syntax errors.
+    std::string arr = "// before\n[ # inside\n", obj = "{\n", braceless = "# first\n";
+    for (int a = 0; arr.size() < 300000; ++a) {
+      auto sA = std::to_string(a);
+      arr += "  {\n    id: " + sA + " # id\n    text: '''\n      ml " + sA +
+        "\n      '''\n  } /* after */,\n  \n  \"" + sA + "\", [1, 2]\n";
+      obj += "  \"key " + sA + "\" /* k */ : /* v */ " + sA + "\n  nested: { a: [" +
+        sA + "] } // after\n";
+      braceless += "k" + sA + ": value " + sA + "\n";
+    }
+    arr += "  last, # extra\n]\n// end\n";
+    obj += "}\n";
+    std::vector<std::string> docs = { arr, obj, braceless };
+
+    for (int useArena = 0; useArena < 2; ++useArena) {
+      for (int ws = 0; ws < 3; ++ws) {
+        Hjson::DecoderOptions decOpt;
+        decOpt.arena = useArena;
+        decOpt.comments = ws > 0;
+        decOpt.whitespaceAsComments = ws > 1;
+        Hjson::DecoderOptions decOptMt = decOpt;
+        decOptMt.threads = 4;
+        for (const auto& doc : docs) {
+          auto root = Hjson::Unmarshal(doc, decOpt);
+          auto rootMt = Hjson::Unmarshal(doc, decOptMt);
+          assert(root.size() > 1000);
+          assert(rootMt.deep_equal(root));
+          assert(Hjson::Marshal(rootMt) == Hjson::Marshal(root));
+        }
+      }
+    }
+
+    Hjson::DecoderOptions decOpt, decOptMt;
+    decOptMt.threads = 4;
+    auto errDocs = docs;
+    errDocs[0].insert(errDocs[0].find("  {\n    id: 2000 "), "  { a b: 1 }\n");
+    errDocs[1].insert(errDocs[1].find("  \"key 2000\""), "  \"key 1\": 1\n");
+    errDocs[2].insert(errDocs[2].find("k3000:"), "k: \"\\q\"\n");
+    errDocs.push_back(arr.substr(0, arr.size() - 9));
+    for (size_t a = 0; a < errDocs.size(); ++a) {
+      decOpt.duplicateKeyException = decOptMt.duplicateKeyException = (a == 1);
+      std::string err, errMt;
+      try {
+        Hjson::Unmarshal(errDocs[a], decOpt);
+      } catch (const Hjson::syntax_error& e) {
+        err = e.what();
+      }
+      try {
+        Hjson::Unmarshal(errDocs[a], decOptMt);
+      } catch (const Hjson::syntax_error& e) {
+        errMt = e.what();
+      }
+      assert(!err.empty());
+      assert(errMt == err);
+    }
+    assert(Hjson::Unmarshal(arr.substr(0, arr.size() - 9) + "]", decOptMt).size() > 1000);
+
+    // "1-2" looks like a number to the scan that splits the input between the
+    // threads, but is the start of a quoteless string, so that the scan finds
+    // elements that do not exist.
+    std::string tricky = "[\n";
+    while (tricky.size() < 300000) {
+      tricky += "  1-2, {\n  x: 1 }, 7\n";
+    }
+    tricky += "]\n";
+    auto trickyRoot = Hjson::Unmarshal(tricky, decOptMt);
+    assert(trickyRoot.deep_equal(Hjson::Unmarshal(tricky)));
+    assert(trickyRoot[0] == "1-2, {" && trickyRoot[1] == "x: 1 }, 7");
+  }
+
+  {
+    // Encoding with several threads gives the same output as with one thread.
+    std::string doc = "# before\n{ # inside\n";
+    for (int a = 0; a < 3000; ++a) {
+      auto sA = std::to_string(a);
+      doc += "  \"k" + sA + "\" /* k */ : /* v */ [ # in\n    " + sA +
+        ", text " + sA + "\n    '''\n    ml\n    '''\n  ] # after\n";
+    }
+    doc += "  last: {} # last\n}\n# end\n";
+    Hjson::DecoderOptions decOpt;
+    decOpt.whitespaceAsComments = true;
+    auto withComments = Hjson::Unmarshal(doc, decOpt);
+
+    Hjson::Value vec(Hjson::Type::Vector);
+    for (int a = 0; a < 5000; ++a) {
+      Hjson::Value map;
+      map["v"] = a;
+      map["s"] = "line\nbreak";
+      if (a % 7 == 0) {
+        map.set_comment_before("# before " + std::to_string(a) + "\n");
+      }
+      // Undefined elements are not written, also at chunk boundaries.
+      vec.push_back(a % 16 == 0 || a > 4990 ? Hjson::Value() : map);
+    }
+    Hjson::Value nested;
+    nested["a"] = 1;
+    nested["vec"] = vec;
+    nested["z"] = Hjson::Value(Hjson::Type::Vector);
+    for (int a = 2000; a > 0; --a) {
+      nested["z"].push_back(a * 0.5);
+    }
+
+    for (const auto& root : { withComments, vec, nested }) {
+      for (int a = 0; a < 16; ++a) {
+        Hjson::EncoderOptions encOpt;
+        encOpt.preserveInsertionOrder = !(a & 1);
+        encOpt.separator = (a & 2);
+        encOpt.omitRootBraces = (a & 4);
+        encOpt.bracesSameLine = (a & 8);
+        Hjson::EncoderOptions encOptMt = encOpt;
+        encOptMt.threads = 4;
+        auto out = Hjson::Marshal(root, encOpt);
+        assert(out.size() > 20000);
+        assert(Hjson::Marshal(root, encOptMt) == out);
+        std::ostringstream oss;
+        oss << Hjson::StreamEncoder(root, encOptMt);
+        assert(oss.str() == out);
+      }
+    }
+    assert(Hjson::Unmarshal(Hjson::Marshal(withComments), decOpt).deep_equal(withComments));
+  }
+
+  {
+    // Unmarshal() and Marshal() for bound structs, without a Value tree.
+    _BoundConfig cfg;
+    cfg.env["old"] = "removed";
+    Hjson::UnmarshalInto(R"(
+      # comment
+      name: server one
+      port: 8080
+      on: true
+      small: 7
+      big: 12345678901
+      ratio: 0.5
+      unknown: { x: [1, { y: 2 }], z: "q" }
+      inners: [{ a: 2, d: [1.5, 2] }, {}, null]
+      environment: {
+        A: "x"
+        "B C": y z
+      }
+      one: { d: [] }
+      matrix: [[1], [], [2, 3]]
+    )", cfg);
+    assert(cfg.name == "server one");
+    assert(cfg.port == 8080);
+    assert(cfg.on);
+    assert(cfg.small == 7);
+    assert(cfg.big == 12345678901LL);
+    assert(cfg.ratio == 0.5f);
+    assert(cfg.inners.size() == 3);
+    assert(cfg.inners[0].a == 2 && cfg.inners[0].d.size() == 2 && cfg.inners[0].d[1] == 2.0);
+    assert(cfg.inners[1].a == 1 && cfg.inners[1].d.empty());
+    assert(cfg.inners[2].a == 1);
+    assert(cfg.env.size() == 2 && cfg.env["A"] == "x" && cfg.env["B C"] == "y z");
+    assert(cfg.one.a == 1);
+    assert(cfg.matrix.size() == 3 && cfg.matrix[2][1] == 3);
+
+    // Missing keys and null keep the old values, numbers are converted.
+    Hjson::UnmarshalInto("{port: 9.7, name: null}", cfg);
+    assert(cfg.port == 9);
+    assert(cfg.name == "server one");
+    assert(cfg.inners.size() == 3);
+
+    // The output is the same as for the corresponding Value tree.
+    auto root = Hjson::Unmarshal(Hjson::Marshal(cfg));
+    assert(root["environment"]["B C"] == "y z");
+    assert(root["inners"][2]["a"] == 1);
+    for (int a = 0; a < 32; ++a) {
+      Hjson::EncoderOptions encOpt;
+      encOpt.separator = (a & 1);
+      encOpt.omitRootBraces = (a & 2);
+      encOpt.bracesSameLine = (a & 4);
+      encOpt.quoteKeys = (a & 8);
+      encOpt.quoteAlways = (a & 16);
+      assert(Hjson::Marshal(cfg, encOpt) == Hjson::Marshal(root, encOpt));
+    }
+    _BoundConfig cfg2;
+    Hjson::UnmarshalInto(Hjson::Marshal(cfg), cfg2);
+    assert(Hjson::Marshal(cfg2) == Hjson::Marshal(cfg));
+
+    std::vector<int> vec;
+    Hjson::UnmarshalInto("[1, 2, 3]", vec);
+    assert(vec.size() == 3 && vec[2] == 3);
+    assert(Hjson::Marshal(vec) == Hjson::Marshal(Hjson::Unmarshal("[1, 2, 3]")));
+    std::map<std::string, _BoundInner> inners;
+    Hjson::UnmarshalInto("x: { a: 5 }\ny: {}", inners);
+    assert(inners.size() == 2 && inners["x"].a == 5);
+    _BoundConfig empty;
+    Hjson::UnmarshalInto("", empty);
+    assert(Hjson::Marshal(std::vector<int>()) == "[]");
+    assert(Hjson::Marshal(std::map<std::string, int>()) == "{}");
+
+    // Scalar targets, also from null-terminated input.
+    int k = 0;
+    Hjson::UnmarshalInto("42", k);
+    assert(k == 42);
+    size_t n = 0;
+    Hjson::UnmarshalInto(std::string("43"), n);
+    assert(n == 43);
+    std::string str;
+    Hjson::UnmarshalInto("abc", str);
+    assert(str == "abc");
+    std::uint64_t u = 0;
+    Hjson::UnmarshalInto("9223372036854775807", u);
+    assert(u == 9223372036854775807ULL);
+    Hjson::UnmarshalInto("1e19", u);
+    assert(u == 10000000000000000000ULL);
+
+    // Mismatching types throw, syntax errors are the same as for Value trees.
+    std::vector<std::string> badDocs = { "port: x", "port: [1]", "on: 1",
+      "inners: { a: 1 }", "one: 2", "matrix: [[1, [2]]]", "7", "port: 3e9",
+      "small: 256", "small: -1", "ratio: 1e39", "big: 1e19" };
+    for (const auto& bad : badDocs) {
+      try {
+        _BoundConfig c;
+        Hjson::UnmarshalInto(bad, c);
+        assert(!"Did not throw error for mismatching type");
+      } catch (const Hjson::type_mismatch&) {}
+    }
+    for (auto big : { "18446744073709551615", "-1", "1.9e19" }) {
+      try {
+        std::uint64_t u2 = 5;
+        Hjson::UnmarshalInto(big, u2);
+        assert(!"Did not throw error for a number out of range");
+      } catch (const Hjson::type_mismatch&) {}
+    }
+    try {
+      _BoundConfig c;
+      Hjson::UnmarshalInto("port: 1\n}", c);
+      assert(!"Did not throw error for invalid input");
+    } catch (const Hjson::syntax_error& e) {
+      std::string err;
+      try {
+        Hjson::Unmarshal("port: 1\n}");
+      } catch (const Hjson::syntax_error& e2) {
+        err = e2.what();
+      }
+      assert(err == e.what());
+    }
+
+    // EventEncoder checks that the calls describe a single value.
+    Hjson::EventEncoder enc;
+    enc.object_begin();
+    enc.key("a");
+    try {
+      enc.key("b");
+      assert(!"Did not throw error for two keys");
+    } catch (const std::logic_error&) {}
+    enc.int64(1);
+    enc.object_end();
+    try {
+      enc.null();
+      assert(!"Did not throw error for two root values");
+    } catch (const std::logic_error&) {}
+    assert(enc.str() == "{\n  a: 1\n}");
+    enc.string(std::string("root string"));
+    assert(enc.str() == "root string");
+  }
+
+  {
+    // Statistics about decoding and encoding.
+    Hjson::DecoderStats stats;
+    Hjson::DecoderOptions decOpt;
+    decOpt.stats = &stats;
+    std::string doc = "a: 1\nb: [true, null, 2.5, \"x\", []]\nc: {\n  d: { e: a long text that is not a short string\n  }\n}\n";
+    auto root = Hjson::Unmarshal(doc, decOpt);
+    assert(stats.bytes == doc.size());
+    assert(stats.nodes[static_cast<int>(Hjson::Type::Undefined)] == 0);
+    assert(stats.nodes[static_cast<int>(Hjson::Type::Null)] == 1);
+    assert(stats.nodes[static_cast<int>(Hjson::Type::Bool)] == 1);
+    assert(stats.nodes[static_cast<int>(Hjson::Type::Double)] == 1);
+    assert(stats.nodes[static_cast<int>(Hjson::Type::Int64)] == 1);
+    assert(stats.nodes[static_cast<int>(Hjson::Type::String)] == 2);
+    assert(stats.nodes[static_cast<int>(Hjson::Type::Vector)] == 2);
+    assert(stats.nodes[static_cast<int>(Hjson::Type::Map)] == 3);
+    assert(stats.maxDepth == 3);
+    assert(stats.allocations > 10);
+    assert(stats.allocatedBytes > stats.allocations * 8);
+    assert(stats.totalSeconds > 0);
+    assert(stats.whitespaceSeconds + stats.stringSeconds + stats.numberSeconds +
+      stats.treeSeconds <= stats.totalSeconds);
+
+    // Later calls add to the same stats, maxDepth is the largest depth.
+    Hjson::Unmarshal("7", decOpt);
+    assert(stats.bytes == doc.size() + 1);
+    assert(stats.nodes[static_cast<int>(Hjson::Type::Int64)] == 2);
+    assert(stats.maxDepth == 3);
+
+    // An exception leaves the stats unchanged.
+    auto before = stats.bytes;
+    try {
+      Hjson::Unmarshal("[1, 2", decOpt);
+      assert(!"Did not throw error for invalid input");
+    } catch (const Hjson::syntax_error&) {}
+    assert(stats.bytes == before);
+
+    // The same counts with several threads, with an arena, and without
+    // measuring the time of each phase.
+    std::string big = "[\n";
+    for (int a = 0; big.size() < 300000; ++a) {
+      big += "  { id: " + std::to_string(a) + ", v: [1.5, \"x\", { d: [null] }] }\n";
+    }
+    big += "]\n";
+    Hjson::DecoderStats bigStats;
+    decOpt.stats = &bigStats;
+    Hjson::Unmarshal(big, decOpt);
+    assert(bigStats.maxDepth == 5);
+    for (int a = 0; a < 4; ++a) {
+      Hjson::DecoderStats other;
+      Hjson::DecoderOptions otherOpt;
+      otherOpt.stats = &other;
+      otherOpt.threads = (a & 1 ? 4 : 1);
+      otherOpt.arena = (a & 2);
+      otherOpt.statsPhaseTimes = (a != 1);
+      Hjson::Unmarshal(big, otherOpt);
+      assert(other.bytes == bigStats.bytes);
+      for (int b = 0; b < 8; ++b) {
+        assert(other.nodes[b] == bigStats.nodes[b]);
+      }
+      assert(other.maxDepth == bigStats.maxDepth);
+      assert(other.allocations > 0);
+      assert(otherOpt.statsPhaseTimes == (other.treeSeconds > 0 &&
+        other.stringSeconds > 0));
+    }
+
+    Hjson::EncoderStats encStats;
+    Hjson::EncoderOptions encOpt;
+    encOpt.stats = &encStats;
+    auto out = Hjson::Marshal(root, encOpt);
+    assert(encStats.bytes == out.size());
+    assert(encStats.nodes[static_cast<int>(Hjson::Type::String)] == 2);
+    assert(encStats.nodes[static_cast<int>(Hjson::Type::Map)] == 3);
+    assert(encStats.quoteSeconds <= encStats.totalSeconds);
+    assert(encStats.writeSeconds == 0);
+    std::ostringstream oss;
+    oss << Hjson::StreamEncoder(root, encOpt);
+    assert(encStats.bytes == 2 * out.size());
+
+    auto bigRoot = Hjson::Unmarshal(big);
+    Hjson::EncoderStats bigEnc, bigEncMt;
+    encOpt.stats = &bigEnc;
+    auto bigOut = Hjson::Marshal(bigRoot, encOpt);
+    encOpt.stats = &bigEncMt;
+    encOpt.threads = 4;
+    assert(Hjson::Marshal(bigRoot, encOpt) == bigOut);
+    assert(bigEncMt.bytes == bigEnc.bytes);
+    for (int b = 0; b < 8; ++b) {
+      assert(bigEncMt.nodes[b] == bigEnc.nodes[b]);
+      assert(bigEnc.nodes[b] == bigStats.nodes[b]);
+    }
+  }
+
+  {
+    // MarshalBinary() keeps all types, the insertion order and comments.
+    Hjson::Value root;
+    root["undefined"] = Hjson::Value();
+    root["null"] = Hjson::Value(Hjson::Type::Null);
+    root["true"] = true;
+    root["false"] = false;
+    root["double"] = 3.0;
+    root["negZero"] = -0.0;
+    root["inf"] = std::numeric_limits<double>::infinity();
+    root["int"] = 3;
+    root["min"] = std::numeric_limits<std::int64_t>::min();
+    root["max"] = std::numeric_limits<std::int64_t>::max();
+    root["empty"] = "";
+    root["zero"] = std::string("a\0b", 3);
+    root["vec"] = Hjson::Value(Hjson::Type::Vector);
+    root["vec"].push_back(Hjson::Value());
+    root["vec"].push_back(Hjson::Value(Hjson::Type::Map));
+    root["vec"].push_back(-1);
+    root["map"]["z"] = 1;
+    root["map"]["a"] = 2;
+    root["map"]["z"].set_comment_before("# z\n");
+    root["map"].set_comment_inside(" /* in */ ");
+    root["vec"][2].set_comment_key(" /* k */ ");
+    root["vec"][2].set_comment_after(" # after");
+    root["a"] = "last";
+
+    auto bin = Hjson::MarshalBinary(root);
+    auto root2 = Hjson::UnmarshalBinary(bin);
+    assert(root2.deep_equal(root));
+    assert(root2.size() == root.size());
+    for (int a = 0; a < int(root.size()); ++a) {
+      assert(root2.key(a) == root.key(a));
+      assert(root2[a].type() == root[a].type());
+    }
+    assert(root2["undefined"].type() == Hjson::Type::Undefined);
+    assert(root2["double"].type() == Hjson::Type::Double);
+    assert(root2["int"].type() == Hjson::Type::Int64);
+    assert(std::signbit(static_cast<double>(root2["negZero"])));
+    assert(root2["min"] == std::numeric_limits<std::int64_t>::min());
+    assert(root2["max"] == std::numeric_limits<std::int64_t>::max());
+    assert(root2["zero"].to_string() == std::string("a\0b", 3));
+    assert(root2["vec"][0].type() == Hjson::Type::Undefined);
+    Hjson::Value map2 = root2["map"];
+    assert(map2.key(0) == "z");
+    assert(root2["map"]["z"].get_comment_before() == "# z\n");
+    assert(root2["map"].get_comment_inside() == " /* in */ ");
+    assert(root2["vec"][2].get_comment_key() == " /* k */ ");
+    assert(root2["vec"][2].get_comment_after() == " # after");
+    assert(Hjson::Marshal(root2) == Hjson::Marshal(root));
+
+    Hjson::DecoderOptions decOpt;
+    decOpt.comments = false;
+    assert(Hjson::UnmarshalBinary(bin, decOpt)["map"]["z"].get_comment_before() == "");
+    Hjson::EncoderOptions encOpt;
+    encOpt.comments = false;
+    auto binNoComments = Hjson::MarshalBinary(root, encOpt);
+    assert(binNoComments.size() < bin.size());
+    assert(Hjson::UnmarshalBinary(binNoComments)["vec"][2].get_comment_after() == "");
+    decOpt.comments = true;
+    decOpt.arena = true;
+    assert(Hjson::UnmarshalBinary(bin, decOpt).deep_equal(root));
+
+    // The comments of a decoded document are kept.
+    decOpt.arena = false;
+    decOpt.whitespaceAsComments = true;
+    auto text = Hjson::Unmarshal("# first\n{\n  a: 1 # one\n  b: [\n    x\n  ]\n}\n", decOpt);
+    assert(Hjson::Marshal(Hjson::UnmarshalBinary(Hjson::MarshalBinary(text))) ==
+      Hjson::Marshal(text));
+
+    // Invalid or truncated data throws syntax_error.
+    for (size_t a = 0; a < bin.size(); ++a) {
+      try {
+        Hjson::UnmarshalBinary(bin.data(), a);
+        assert(!"Did not throw error for truncated binary data");
+      } catch (const Hjson::syntax_error&) {
+      }
+    }
+    std::vector<std::string> invalid = { "HJC\x01\x01", std::string("HJB\x02\x01"),
+      bin + "x", std::string("HJB\x01\x09", 5), std::string("HJB\x01\x07\xff\0\0\0\0\0\0\0\0", 14),
+      // The element count is outside of an empty Vector.
+      std::string("HJB\x01\x07\0\0\0\0\0\0\0\0\x01\x06\xff\xff\x03", 18),
+      // The element count does not fit in the Vector.
+      std::string("HJB\x01\x07\x02\0\0\0\0\0\0\0\xff\xff\xff\xff\x0f", 17),
+      // A Map claiming more elements than there are bytes left.
+      std::string("HJB\x01\x08\x06\0\0\0\0\0\0\0\xff\xff\xff\xff\x7f\x00", 18) };
+    for (const auto& data : invalid) {
+      try {
+        Hjson::UnmarshalBinary(data);
+        assert(!"Did not throw error for invalid binary data");
+      } catch (const Hjson::syntax_error&) {
+      }
+    }
+    assert(Hjson::UnmarshalBinary(Hjson::MarshalBinary(Hjson::Value())).type() ==
+      Hjson::Type::Undefined);
+
+    // Deeply nested data does not use the call stack. Each level is a Vector
+    // with one element: tag, size and count, 10 bytes.
+    const int depth = 200000;
+    std::string deep("HJB\x01", 4);
+    for (int a = depth - 1; a >= 0; --a) {
+      deep.push_back('\x07');
+      std::uint64_t size = 10 * std::uint64_t(a) + 1;
+      for (int b = 0; b < 8; ++b) {
+        deep.push_back(static_cast<char>(size >> (8 * b)));
+      }
+      deep.push_back(a ? '\x01' : '\x00');
+    }
+    auto deepRoot = Hjson::UnmarshalBinary(deep);
+    assert(deepRoot.type() == Hjson::Type::Vector && deepRoot.size() == 1);
+    decOpt.arena = false;
+    decOpt.maxDepth = depth - 1;
+    std::vector<std::string> invalidDeep = { deep.substr(0, deep.size() - 1),
+      deep.substr(0, deep.size() / 2), deep + "x" };
+    for (const auto& data : invalidDeep) {
+      try {
+        Hjson::UnmarshalBinary(data);
+        assert(!"Did not throw error for invalid binary data");
+      } catch (const Hjson::syntax_error&) {
+      }
+    }
+    try {
+      Hjson::UnmarshalBinary(deep, decOpt);
+      assert(!"Did not throw error for exceeding maxDepth");
+    } catch (const Hjson::syntax_error& e) {
+      assert(std::string(e.what()).find("maximum depth") != std::string::npos);
+    }
+  }
+
+  {
+    // clone() and Merge() give trees that do not share any containers with
+    // their inputs, with comments and insertion order kept.
+    auto base = Hjson::Unmarshal(R"(# base
+{
+  z: 1 # one
+  a: {
+    x: [1, 2, {b: 3}]
+    y: text
+    w: {}
+  }
+  u: undefined
+  v: [1]
+}
+)");
+    base["u"] = Hjson::Value();
+    auto ext = Hjson::Unmarshal(R"({
+  a: {
+    y: /* k */ other
+    n: new
+    x: [4]
+  }
+  q: 5 # five
+  u: { c: 6 }
+  v: { d: 7 }
+})");
+    ext["a"]["m"] = Hjson::Value();
+
+    auto baseText = Hjson::Marshal(base);
+    auto extText = Hjson::Marshal(ext);
+    auto clone = base.clone();
+    assert(Hjson::Marshal(clone) == baseText);
+    assert(clone.deep_equal(base));
+    assert(clone.key(0) == "z" && clone.key(2) == "u");
+    assert(clone[0].get_comment_after() == " # one");
+    clone["a"]["x"][2]["b"] = 4;
+    clone["a"]["x"].push_back(5);
+    clone["a"]["w"]["new"] = 1;
+    clone["a"]["y"].set_comment_after(" # changed");
+    assert(Hjson::Marshal(base) == baseText);
+    base["a"]["x"][2]["c"] = 1;
+    assert(!clone["a"]["x"][2]["c"].defined());
+
+    auto merged = Hjson::Merge(base, ext);
+    assert(Hjson::Marshal(merged) == R"({
+  a: {
+    y: /* k */ other
+    n: new
+    x: [
+      4
+    ]
+    w: {}
+  }
+  q: 5 # five
+  u: {
+    c: 6
+  }
+  v: {
+    d: 7
+  }
+  z: 1 # one
+
+})");
+    assert(merged.key(0) == "a" && merged.key(4) == "z");
+    assert(merged[0].key(3) == "m" && !merged["a"]["m"].defined());
+    merged["a"]["w"]["new"] = 2;
+    merged["u"]["c"] = 7;
+    merged["z"] = 2;
+    assert(!base["a"]["w"]["new"].defined());
+    assert(ext["u"]["c"] == 6);
+    assert(base["z"] == 1);
+    assert(Hjson::Marshal(ext) == extText);
+    assert(Hjson::Merge(base, Hjson::Value()).deep_equal(base));
+    assert(Hjson::Merge(base, Hjson::Value(3)) == 3);
+  }
+
+  {
+    auto root = Hjson::Unmarshal(R"({
+  services: {
+    auth: {
+      timeouts: { read: 5, "a/b": 6, "c~d": 7, "": 8 }
+      hosts: [ "a", "b", { port: 80 } ]
+    }
+  }
+})");
+    Hjson::Path read("/services/auth/timeouts/read");
+    assert(read.find(root) == &root["services"]["auth"]["timeouts"].at("read"));
+    assert(read.at(root) == 5);
+    assert(Hjson::Path("/services/auth/timeouts/a~1b").at(root) == 6);
+    assert(Hjson::Path("/services/auth/timeouts/c~0d").at(root) == 7);
+    assert(Hjson::Path("/services/auth/timeouts/").at(root) == 8);
+    assert(Hjson::Path("/services/auth/hosts/2/port").at(root) == 80);
+    assert(Hjson::Path("").find(root) == &root);
+    assert(Hjson::Path(std::vector<std::string>{ "services", "auth", "timeouts",
+      "a/b" }).at(root) == 6);
+    assert(!Hjson::Path("/services/auth/hosts/3").find(root));
+    assert(!Hjson::Path("/services/auth/hosts/01").find(root));
+    assert(!Hjson::Path("/services/auth/hosts/-").find(root));
+    assert(!Hjson::Path("/services/auth/timeouts/read/x").find(root));
+    assert(!Hjson::Path("/services/none").find(root));
+    try {
+      Hjson::Path("/services/none").at(root);
+      assert(!"Did not throw error for a missing path");
+    } catch (const Hjson::index_out_of_bounds&) {
+    }
+    for (const char *invalid : { "services", "/a~2", "/a~" }) {
+      try {
+        Hjson::Path path(invalid);
+        assert(!"Did not throw error for invalid JSON pointer");
+      } catch (const Hjson::syntax_error&) {
+      }
+    }
+    read.at(root) = 9;
+    assert(root["services"]["auth"]["timeouts"]["read"] == 9);
+
+    // A CachedPath gives the same result as a Path after any changes.
+    Hjson::CachedPath cached(read);
+    Hjson::CachedPath cachedPort(Hjson::Path("/services/auth/hosts/2/port"));
+    assert(cached.find(root) == read.find(root));
+    assert(cached.at(root) == 9);
+    root["services"]["auth"]["timeouts"]["read"] = 10;
+    assert(cached.at(root) == 10);
+    root["services"]["auth"]["timeouts"].erase("read");
+    assert(!cached.find(root));
+    root["services"]["auth"]["timeouts"]["read"] = 11;
+    assert(cached.at(root) == 11);
+    root["services"]["auth"]["timeouts"] = Hjson::Unmarshal("{read: 12}");
+    assert(cached.at(root) == 12);
+    assert(cachedPort.at(root) == 80);
+    for (int a = 0; a < 100; ++a) {
+      root["services"]["auth"]["hosts"].push_back(a);
+      assert(cachedPort.find(root) == Hjson::Path("/services/auth/hosts/2/port").find(root));
+    }
+    root["services"]["auth"]["hosts"].erase(0);
+    assert(!cachedPort.find(root));
+    root["services"]["auth"]["hosts"].move(1, 3);
+    assert(cachedPort.at(root) == 80);
+    auto other = root.clone();
+    assert(cachedPort.find(other) == &other["services"]["auth"]["hosts"][2].at("port"));
+    other["services"]["auth"]["hosts"].clear();
+    assert(!cachedPort.find(other));
+    Hjson::CachedPath copy(cachedPort);
+    assert(copy.at(root) == 80);
+    root = Hjson::Value();
+    assert(!cachedPort.find(root));
+    assert(!copy.find(root));
+  }
+
+  {
+    auto root = Hjson::Unmarshal(R"(
+# before
+{
+  zName: "a long string value that does not fit in a small buffer"
+  # before a
+  a: 1 # after a
+  list: [ "x" ]
+}
+)");
+    const Hjson::Value& croot = root;
+    auto& str = croot.find("zName")->string_ref();
+    assert(str == "a long string value that does not fit in a small buffer");
+    assert(&str == &root.at("zName").string_ref());
+    assert(&root.key_ref(0) == &root.key_ref(0));
+    assert(root.key_ref(1) == "a");
+    assert(croot.find("a") == &croot.at("a"));
+    assert(!croot.find("b"));
+    assert(!Hjson::Value().find("b"));
+    assert(!root.find("b"));
+    assert(root.size() == 3);
+    *root.find("a") = 2;
+    assert(root["a"] == 2);
+    try {
+      croot.at("a").string_ref();
+      assert(!"Did not throw error for string_ref() on Int64");
+    } catch (const Hjson::type_mismatch&) {
+    }
+    try {
+      croot.at("list").find("x");
+      assert(!"Did not throw error for find() on Vector");
+    } catch (const Hjson::type_mismatch&) {
+    }
+    try {
+      croot.key_ref(3);
+      assert(!"Did not throw error for key_ref() out of bounds");
+    } catch (const Hjson::index_out_of_bounds&) {
+    }
+
+    assert(croot.get_comment_before_ref() == "\n# before\n");
+    assert(croot.get_comment_before_ref().str() == croot.get_comment_before());
+    assert(croot.at("a").get_comment_before_ref() == croot.at("a").get_comment_before());
+    assert(croot.at("a").get_comment_after_ref() == " # after a");
+    assert(croot.at("a").get_comment_key_ref().empty());
+    assert(Hjson::Value().get_comment_inside_ref().empty());
+    std::ostringstream oss;
+    oss << croot.at("a").get_comment_after_ref();
+    assert(oss.str() == " # after a");
+
+    std::vector<std::string> keys;
+    for (const auto& it : croot.insertion_order()) {
+      keys.push_back(it.first);
+      assert(&it.second == &croot.at(it.first));
+    }
+    assert(keys == std::vector<std::string>({ "zName", "a", "list" }));
+    for (auto& it : root.insertion_order()) {
+      it.second = 5;
+    }
+    assert(root["zName"] == 5 && root["a"] == 5 && root["list"] == 5);
+    assert(croot.at("a").get_comment_after_ref() == " # after a");
+    assert(Hjson::Value(1).insertion_order().begin() ==
+      Hjson::Value(1).insertion_order().end());
+
+    // Copies share the comments until one of them changes its comments.
+    Hjson::Value val = croot.at("a");
+    Hjson::Value copy = val;
+    assert(copy.get_comment_after_ref().data() == val.get_comment_after_ref().data());
+    copy.set_comment_after(" # changed");
+    assert(val.get_comment_after() == " # after a");
+    assert(copy.get_comment_after() == " # changed");
+    assert(root["a"].get_comment_after() == " # after a");
+    Hjson::Value other = 7;
+    other.set_comments(val);
+    val.set_comment_before("# new");
+    assert(other.get_comment_before() == "\n  # before a\n  ");
+    assert(croot.at("a").get_comment_before() == "\n  # before a\n  ");
+    root["a"].set_comment_key(" ");
+    assert(copy.get_comment_key().empty() && other.get_comment_key().empty());
+  }
+
+  {
+    Hjson::DecoderOptions decOpt;
+    decOpt.arena = true;
+    Hjson::Value child;
+    {
+      auto root = Hjson::Unmarshal(R"(
+# comment
+a: [1, 2, 3]
+b: {
+  c: some text that is long enough to not fit in a small string buffer
+}
+)", decOpt);
+      assert(root["a"].size() == 3);
+      assert(root.get_comment_before() == "");
+      assert(root[0].get_comment_before() == "\n# comment\n");
+      // The tree can be modified after the arena has been sealed.
+      for (int a = 0; a < 100; ++a) {
+        root["a"].push_back(a);
+      }
+      root["b"]["d"] = "new";
+      child = root["b"];
+    }
+    // The arena must stay alive as long as any part of the tree is alive.
+    assert(child["c"] == "some text that is long enough to not fit in a small string buffer");
+    assert(child["d"] == "new");
+    child.clear();
+    assert(child.empty());
+  }
+
+  {
+    // Large enough for the IncrementalDecoder to discard parsed input.
+    std::string data = "// start\n{\n";
+    for (int a = 0; a < 2000; ++a) {
+      auto sA = std::to_string(a);
+      data += "  key" + sA + ": value " + sA + " # comment\n"
+        "  ml" + sA + ":\n    '''\n    first\n      second\n    '''\n"
+        "  arr" + sA + ": [ 1, \"two\", { three: 3 } ] /* after */\n";
+    }
+    data += "  long: [" + std::string(10000, ' ') + "1, 2, 3]\n}\n";
+
+    auto root = Hjson::Unmarshal(data);
+    for (size_t chunkSize : {1, 13, 4096}) {
+      Hjson::IncrementalDecoder decoder;
+      for (size_t pos = 0; pos < data.size(); pos += chunkSize) {
+        decoder.feed(data.data() + pos, std::min(chunkSize, data.size() - pos));
+      }
+      auto root2 = decoder.finish();
+      assert(root2.deep_equal(root));
+      assert(Hjson::Marshal(root2) == Hjson::Marshal(root));
+      assert(root2["ml1999"] == "first\n  second");
+    }
+
+    // Syntax errors are reported with the same position as from Unmarshal(),
+    // as soon as they are found.
+    auto data2 = data;
+    data2.replace(data2.size() - 2000, 1, ":");
+    std::string errMsg;
+    try {
+      Hjson::Unmarshal(data2);
+    } catch (const Hjson::syntax_error& e) {
+      errMsg = e.what();
+    }
+    assert(!errMsg.empty());
+    Hjson::IncrementalDecoder decoder;
+    try {
+      decoder.feed(data2);
+      assert(!"Did not throw error for invalid input");
+    } catch (const Hjson::syntax_error& e) {
+      assert(errMsg == e.what());
+    }
+
+    // The decoder is reset after an error, and after finish().
+    decoder.feed("a: 1\n");
+    decoder.feed("b: 2");
+    auto root3 = decoder.finish();
+    assert(root3.size() == 2 && root3["b"] == 2);
+    decoder.feed("[]");
+    assert(decoder.finish().type() == Hjson::Type::Vector);
+    decoder.feed("some text, ");
+    decoder.feed("then more");
+    assert(decoder.finish() == "some text, then more");
+  }
+
+  {
+    // Numbers and booleans are copied, not shared.
+    Hjson::Value num = 1;
+    Hjson::Value num2 = num;
+    num2 += 1;
+    assert(num == 1 && num2 == 2);
+    Hjson::Value root;
+    root["a"] = 1.5;
+    root["a"] += 1;
+    assert(root["a"] == 2.5);
+    root["b"] = true;
+    root["c"] = 3;
+    assert(root["b"] == true && root[1] == true);
+    Hjson::Value vec;
+    vec.push_back(3);
+    vec[0] -= 1;
+    assert(vec[0] == 2);
+    assert(Hjson::Value(Hjson::Type::Int64) == 0);
+    assert(Hjson::Value(Hjson::Type::Double) == 0.0);
+    assert(Hjson::Value(Hjson::Type::Bool) == false);
+    assert(Hjson::Value(Hjson::Type::Null).type() == Hjson::Type::Null);
+
+    // Every type of scalar, and every operator that changes it in place.
+    Hjson::Value dbl = 1.5;
+    Hjson::Value dbl2 = dbl;
+    dbl2 *= 2;
+    ++dbl2;
+    assert(dbl == 1.5 && dbl2 == 4.0);
+    Hjson::Value int2;
+    int2 = num;
+    int2 -= 5;
+    int2--;
+    assert(num == 1 && int2 == -5);
+    Hjson::Value boolean = true;
+    Hjson::Value boolean2(boolean);
+    boolean2 = false;
+    assert(boolean == true);
+    Hjson::Value scalars;
+    scalars["n"] = 10;
+    Hjson::Value n = scalars["n"];
+    n %= 3;
+    assert(scalars["n"] == 10 && n == 1);
+
+    // Containers, strings and Undefined are still shared.
+    Hjson::Value str = "x";
+    Hjson::Value str2 = str;
+    str2 += "y";
+    assert(str == "xy");
+    Hjson::Value undef;
+    Hjson::Value undef2 = undef;
+    undef2["x"] = 1;
+    assert(undef["x"] == 1);
+    Hjson::Value vec2 = vec;
+    vec2.push_back(4);
+    assert(vec.size() == 2);
+    Hjson::Value vec3 = vec.clone();
+    vec3.push_back(5);
+    assert(vec.size() == 2 && vec3.size() == 3);
+  }
+
+  {
+    // Large enough to use the hash index.
+    Hjson::Value root;
+    for (int a = 99; a >= 0; --a) {
+      root["k" + std::to_string(a)] = a;
+    }
+    assert(root.size() == 100);
+    assert(root.key(0) == "k99" && root[0] == 99);
+    assert(root.key(99) == "k0" && root[99] == 0);
+    for (int a = 0; a < 100; ++a) {
+      assert(root["k" + std::to_string(a)] == a);
+      assert(root.at("k" + std::to_string(a)) == a);
+    }
+    assert(!root["k100"].defined());
+    assert(root.size() == 100);
+
+    std::string prevKey;
+    int count = 0;
+    for (const auto& it : root) {
+      assert(prevKey < it.first);
+      prevKey = it.first;
+      ++count;
+    }
+    assert(count == 100);
+    assert(root.begin()->first == "k0");
+
+    // Assignment through an iterator or a reference changes the element.
+    root.begin()->second = "zero";
+    assert(root["k0"] == "zero");
+    Hjson::Value& ref = root.at("k5");
+    for (int a = 100; a < 1000; ++a) {
+      root["k" + std::to_string(a)] = a;
+    }
+    ref = "five";
+    assert(root["k5"] == "five");
+    assert(root[999] == 999);
+
+    assert(root.erase("k50") == 1);
+    assert(root.erase("k50") == 0);
+    root.erase(0);
+    assert(root.size() == 998);
+    assert(!root["k50"].defined() && !root["k99"].defined());
+    assert(root["k51"] == 51 && root["k98"] == 98 && root["k999"] == 999);
+    assert(root.key(0) == "k98");
+
+    root.move(0, 998);
+    assert(root.key(997) == "k98" && root.key(0) == "k97");
+    assert(root["k98"] == 98 && root["k97"] == 97);
+    root.move(997, 0);
+    assert(root.key(0) == "k98" && root["k98"] == 98);
+
+    // Two proxies for the same new key only create one element.
+    {
+      auto&& p1 = root["new"];
+      auto&& p2 = root["new"];
+      p1 = 1;
+      p2 = 2;
+    }
+    assert(root.size() == 999);
+    assert(root["new"].defined());
+
+    root.clear();
+    assert(root.empty() && root.begin() == root.end());
+    root["a"] = 1;
+    assert(root.size() == 1 && root[0] == 1);
+  }
+
+  {
+    // Maps that grow past the size where they get a hash index, and shrink
+    // below it again.
+    Hjson::Value root;
+    for (int a = 0; a < 12; ++a) {
+      root["k" + std::to_string(a)] = a;
+    }
+    for (int a = 0; a < 6; ++a) {
+      root.erase("k" + std::to_string(a));
+    }
+    assert(root.size() == 6 && root["k6"] == 6 && !root["k0"].defined());
+    root.move(5, 0);
+    for (int a = 20; a < 30; ++a) {
+      root["k" + std::to_string(a)] = a;
+    }
+    assert(root.size() == 16 && root.key(0) == "k11");
+    for (int a = 6; a < 12; ++a) {
+      assert(root["k" + std::to_string(a)] == a);
+    }
+    assert(root["k29"] == 29);
+
+    // Records of different sizes after each other, the decoder reserves each
+    // Map with the size of the previous one at the same depth.
+    std::string data = "[{a: 1, b: {x: 1}}, {a: 2}, {k0: 0, k1: 1, k2: 2, k3: 3, "
+      "k4: 4, k5: 5, k6: 6, k7: 7, k8: 8, k9: 9}, {a: 3, b: {x: 3, y: 4}}]";
+    auto records = Hjson::Unmarshal(data);
+    assert(records[0]["b"]["x"] == 1 && records[1]["a"] == 2);
+    assert(records[2].size() == 10 && records[2]["k9"] == 9);
+    assert(records[3].size() == 2 && records[3]["b"]["y"] == 4);
+    assert(Hjson::Marshal(records) == Hjson::Marshal(Hjson::Unmarshal(
+      Hjson::Marshal(records))));
+  }
+
+  {
+    std::string data = "# first\n{\n  a: [1, 2.5, true, null]\n  \"b\": \"x\\ty\"\n"
+      "  c: quoteless\n  d: 'plain'\n  e: {} // last\n}\n";
+    _RecordingHandler h;
+    Hjson::Unmarshal(data, h);
+    assert(h.log == "c:# first\n { k:a [ i:1 d:2.500000 true null ] k:b s:x\ty "
+      "k:c s:quoteless k:d s:plain k:e { } c: // last } ");
+    // Strings without escapes point straight into the input.
+    assert(h.lastStr == data.c_str() + data.find("plain"));
+
+    Hjson::DecoderOptions decOpt;
+    decOpt.comments = false;
+    _RecordingHandler h2;
+    Hjson::Unmarshal(data.c_str(), data.size(), h2, decOpt);
+    assert(h2.log.find("c:") == std::string::npos);
+
+    // Roots without braces, and single values as root.
+    _RecordingHandler h3;
+    Hjson::Unmarshal("a: 1\nb: '''\n  ml\n  '''", h3);
+    assert(h3.log == "{ k:a i:1 k:b s:ml } ");
+    _RecordingHandler h4;
+    Hjson::Unmarshal("  -3 ", h4);
+    assert(h4.log == "i:-3 ");
+    _RecordingHandler h5;
+    Hjson::Unmarshal("", h5);
+    assert(h5.log == "{ } ");
+
+    // The same syntax errors as from Unmarshal() into a Value tree.
+    for (std::string bad : {"[1, 2", "a: 1\n}", "{a: 1}}", "a b: 1\nc: 2", "\"x"}) {
+      std::string errMsg;
+      try {
+        Hjson::Unmarshal(bad);
+      } catch (const Hjson::syntax_error& e) {
+        errMsg = e.what();
+      }
+      assert(!errMsg.empty());
+      Hjson::DecoderHandler nullHandler;
+      try {
+        Hjson::Unmarshal(bad, nullHandler);
+        assert(!"Did not throw error for invalid input");
+      } catch (const Hjson::syntax_error& e) {
+        assert(errMsg == e.what());
+      }
+    }
+
+    decOpt.duplicateKeyException = true;
+    try {
+      Hjson::DecoderHandler nullHandler;
+      Hjson::Unmarshal("{a: {a: 1}, b: 2, a: 3}", nullHandler, decOpt);
+      assert(!"Did not throw error for duplicate key");
+    } catch (const Hjson::syntax_error& e) {}
+  }
+
   {
     std::string str = R"(
 key: val1
@@ -1600,4 +2908,659 @@ key: val2
       assert(!"Did not throw error for duplicate key");
     } catch(const Hjson::syntax_error& e) {}
   }
+
+  {
+    std::string data = "// top\n{\n  a: [1, {b: 2}, [], {}, [3, [4]]] // after a\n"
+      "  c: {\n    # inside c\n    d: \"x\\ty\"\n    e: [{f: 'ml'}]\n  }\n"
+      "  g: { /* empty */ }\n  h: 5\n}\n";
+    Hjson::DecoderOptions decOpt;
+    decOpt.lazy = true;
+    for (int a = 0; a < 4; ++a) {
+      decOpt.comments = a & 1;
+      decOpt.arena = a & 2;
+      Hjson::DecoderOptions eagerOpt = decOpt;
+      eagerOpt.lazy = false;
+      auto lazy = Hjson::Unmarshal(data, decOpt);
+      assert(Hjson::Marshal(lazy) == Hjson::Marshal(Hjson::Unmarshal(data, eagerOpt)));
+    }
+
+    // Values from the tree keep working after the root is gone.
+    Hjson::Value e;
+    {
+      auto root = Hjson::Unmarshal(data, decOpt);
+      e = root["c"]["e"];
+      assert(root["a"][4][1][0] == 4);
+      root["a"].push_back(6);
+      assert(root["a"].size() == 6);
+      auto clone = root["c"].clone();
+      clone["d"] = 1;
+      assert(root["c"]["d"] == "x\ty");
+    }
+    assert(e[0]["f"] == "ml");
+
+    // Concurrent reads of the same const Value.
+    const auto root = Hjson::Unmarshal(data, decOpt);
+    std::vector<std::thread> threads;
+    std::atomic<int> found(0);
+    for (int a = 0; a < 4; ++a) {
+      threads.emplace_back([&]() {
+        if (root["c"]["e"][0]["f"] == "ml" && root["a"][1]["b"] == 2) {
+          ++found;
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    assert(found == 4);
+
+    // Syntax errors are thrown by Unmarshal() unless lazyValidate is false,
+    // and then only when the Vector or Map containing the error is decoded.
+    std::string bad = "{\n  a: {s: \"\\q\"}\n  b: [\"ok\", {a: 1, a: 2}]\n}";
+    decOpt.duplicateKeyException = true;
+    std::string errMsg;
+    try {
+      Hjson::Unmarshal(bad, decOpt);
+    } catch (const Hjson::syntax_error& e) {
+      errMsg = e.what();
+    }
+    assert(errMsg.find("Bad escape") != std::string::npos);
+    decOpt.lazyValidate = false;
+    auto partial = Hjson::Unmarshal(bad, decOpt);
+    assert(partial["b"][0] == "ok");
+    for (int a = 0; a < 2; ++a) {
+      try {
+        partial["a"].size();
+        assert(!"Did not throw error for bad escape");
+      } catch (const Hjson::syntax_error& e) {
+        assert(errMsg == e.what());
+      }
+    }
+    try {
+      partial["b"][1].size();
+      assert(!"Did not throw error for duplicate key");
+    } catch (const Hjson::syntax_error& e) {}
+    for (std::string bad : {"[1, 2", "{a: [}", "{a: \"x\ny\"}"}) {
+      try {
+        Hjson::Unmarshal(bad, decOpt);
+        assert(!"Did not throw error for invalid structure");
+      } catch (const Hjson::syntax_error& e) {}
+    }
+  }
+
+  {
+    // Deep trees don't use the call stack, and DecoderOptions::maxDepth
+    // limits the depth in the decoders.
+    const int depth = 100000;
+    std::string deep;
+    for (int a = 0; a < depth; ++a) {
+      deep += (a % 2 ? "{a:" : "[");
+    }
+    deep += "1";
+    for (int a = depth - 1; a >= 0; --a) {
+      deep += (a % 2 ? "}" : "]");
+    }
+    Hjson::EncoderOptions encOpt;
+    encOpt.indentBy = "";
+    encOpt.eol = " ";
+    for (int arena = 0; arena < 2; ++arena) {
+      Hjson::DecoderOptions decOpt;
+      decOpt.arena = arena;
+      auto root = Hjson::Unmarshal(deep, decOpt);
+      auto clone = root.clone();
+      assert(clone.deep_equal(root));
+      assert(Hjson::Marshal(clone, encOpt) == Hjson::Marshal(root, encOpt));
+      auto merged = Hjson::Merge(clone[0], root[0]);
+      assert(merged.deep_equal(root[0]));
+      auto leaf = &clone;
+      while (leaf->is_container()) {
+        leaf = (leaf->type() == Hjson::Type::Vector ? &(*leaf)[0] :
+          leaf->find("a"));
+      }
+      *leaf = 2;
+      assert(!clone.deep_equal(root));
+    }
+
+    Hjson::DecoderOptions decOpt;
+    decOpt.maxDepth = depth;
+    assert(Hjson::Unmarshal(deep, decOpt).is_container());
+    decOpt.maxDepth = depth - 1;
+    std::string errMsg;
+    try {
+      Hjson::Unmarshal(deep, decOpt);
+      assert(!"Did not throw error for exceeding maxDepth");
+    } catch (const Hjson::syntax_error& e) {
+      errMsg = e.what();
+    }
+    assert(errMsg.find("maximum depth") != std::string::npos);
+    Hjson::IncrementalDecoder decoder(decOpt);
+    try {
+      decoder.feed(deep);
+      decoder.finish();
+      assert(!"Did not throw error for exceeding maxDepth");
+    } catch (const Hjson::syntax_error& e) {
+      assert(std::string(e.what()).find("maximum depth") != std::string::npos);
+    }
+    decOpt.maxDepth = 2;
+    assert(Hjson::Unmarshal("a: []\nb: {c: 1}", decOpt).size() == 2);
+    for (std::string bad : {"a: [[[]]]", "[[[1]]]", "[{a: [1]}]"}) {
+      try {
+        Hjson::Unmarshal(bad, decOpt);
+        assert(!"Did not throw error for exceeding maxDepth");
+      } catch (const Hjson::syntax_error& e) {}
+      try {
+        Hjson::IncrementalDecoder decoder(decOpt);
+        decoder.feed(bad);
+        decoder.finish();
+        assert(!"Did not throw error for exceeding maxDepth");
+      } catch (const Hjson::syntax_error& e) {}
+      try {
+        Hjson::UnmarshalBinary(Hjson::MarshalBinary(Hjson::Unmarshal(bad)),
+          decOpt);
+        assert(!"Did not throw error for exceeding maxDepth");
+      } catch (const Hjson::syntax_error& e) {}
+    }
+  }
+
+  {
+    std::vector<std::string> docs = {
+      "{\n  # comment\n  a: 1\n  b: \"esc\\taped string\"\n  c: [1, 2.5, {d: 'x'}]\n}",
+      "text:\n  '''\n  multi\n  line\n  '''\n\"quoted \\\"key\\\"\": [true, null]",
+      "[\n  // first\n  1\n  {a: {b: {c: []}}}\n]",
+      "plain",
+    };
+    Hjson::DecoderOptions decOpt;
+    decOpt.comments = true;
+    Hjson::Decoder decoder(decOpt);
+    Hjson::EncoderOptions encOpt;
+    encOpt.comments = true;
+    Hjson::Encoder encoder(encOpt);
+    for (int round = 0; round < 3; ++round) {
+      for (const auto& doc : docs) {
+        auto val = decoder.unmarshal(doc);
+        auto expected = Hjson::Unmarshal(doc, decOpt);
+        assert(val.deep_equal(expected));
+        assert(encoder.marshal(val) == Hjson::Marshal(expected, encOpt));
+        assert(decoder.unmarshal(doc.c_str()).deep_equal(expected));
+      }
+      try {
+        decoder.unmarshal("{a: [1, {b: \"\\q\"}]}");
+        assert(!"Did not throw error for invalid escape");
+      } catch (const Hjson::syntax_error& e) {}
+    }
+    assert(!decoder.unmarshal(static_cast<const char*>(nullptr)).defined());
+    Hjson::EncoderOptions jsonOpt;
+    jsonOpt.bracesSameLine = true;
+    jsonOpt.quoteAlways = true;
+    jsonOpt.quoteKeys = true;
+    jsonOpt.separator = true;
+    jsonOpt.comments = false;
+    Hjson::Encoder jsonEncoder(jsonOpt);
+    auto val = Hjson::Unmarshal(docs[0]);
+    assert(jsonEncoder.marshal(val) == Hjson::MarshalJson(val));
+
+    std::string large = "[\n";
+    for (int a = 0; a < 5000; ++a) {
+      large += "  {id: " + std::to_string(a) +
+        ", s: \"x\\ty\", v: [1, {w: '''z'''}]}\n";
+    }
+    large += "]\n";
+    Hjson::DecoderOptions decOptMt;
+    decOptMt.threads = 4;
+    Hjson::Decoder decoderMt(decOptMt);
+    Hjson::EncoderOptions encOptMt;
+    encOptMt.threads = 4;
+    Hjson::Encoder encoderMt(encOptMt);
+    auto expected = Hjson::Unmarshal(large);
+    for (int round = 0; round < 2; ++round) {
+      auto valMt = decoderMt.unmarshal(large);
+      assert(valMt.deep_equal(expected));
+      assert(encoderMt.marshal(valMt) == Hjson::Marshal(expected));
+    }
+  }
+  {
+    // Each part of the input that DocumentReader reads as one document.
+    std::vector<std::string> parts = {
+      "{a: 1} // one",
+      "\n[1, 2]",
+      "\n\n# before\n{\n  b: [3]\n}",
+      "\n{c: 1}",
+      "{d: \"x\\ty\"}  ",
+      "\nkey: value\nother: 2",
+      "\n\n\ntext:\n  '''\n  multi\n\n  line\n  '''",
+      "\n\n42",
+      "\n\n\"str\" // trailing\n// end\n",
+    };
+    std::string input;
+    for (const auto& part : parts) {
+      input += part;
+    }
+
+    class Recorder : public Hjson::DecoderHandler {
+    public:
+      std::string events;
+
+      void on_object_begin() { events += "{"; }
+      void on_object_end() { events += "}"; }
+      void on_array_begin() { events += "["; }
+      void on_array_end() { events += "]"; }
+      void on_key(const char *key, size_t keySize) {
+        events += std::string(key, keySize) + ":";
+      }
+      void on_string(const char *str, size_t strSize) {
+        events += "'" + std::string(str, strSize) + "'";
+      }
+      void on_int64(std::int64_t i) { events += std::to_string(i) + ","; }
+      void on_comment(const char *comment, size_t commentSize) {
+        events += "#" + std::string(comment, commentSize);
+      }
+    };
+
+    Hjson::EncoderOptions encOpt;
+    for (int ws = 0; ws < 3; ++ws) {
+      Hjson::DecoderOptions decOpt;
+      decOpt.comments = ws > 0;
+      decOpt.whitespaceAsComments = ws > 1;
+      for (int source = 0; source < 3; ++source) {
+        std::istringstream in(input), in2(input);
+        Hjson::DocumentReader reader = source == 0 ?
+          Hjson::DocumentReader(input.data(), input.size(), decOpt) :
+          Hjson::DocumentReader(in, decOpt);
+        Hjson::DocumentReader handlerReader = source == 2 ?
+          Hjson::DocumentReader(in2, decOpt) :
+          Hjson::DocumentReader(input.data(), input.size(), decOpt);
+        for (const auto& part : parts) {
+          auto expected = Hjson::Unmarshal(part, decOpt);
+          Hjson::Value doc;
+          assert(reader.next(doc));
+          assert(doc.deep_equal(expected));
+          assert(Hjson::Marshal(doc, encOpt) == Hjson::Marshal(expected, encOpt));
+          Recorder got, want;
+          assert(handlerReader.next(got));
+          Hjson::Unmarshal(part, want, decOpt);
+          assert(got.events == want.events);
+        }
+        Hjson::Value doc;
+        assert(!reader.next(doc));
+        assert(!reader.next(doc));
+        Recorder rec;
+        assert(!handlerReader.next(rec));
+      }
+      assert(Hjson::UnmarshalDocuments(input, decOpt).size() == parts.size());
+    }
+
+    // Enough documents for several blocks from a stream, and for several
+    // threads in UnmarshalDocuments().
+    std::string large;
+    for (int a = 0; a < 20000; ++a) {
+      large += "{id: " + std::to_string(a) + ", tags: [\"x\", 'y']} # " +
+        std::to_string(a) + "\n";
+    }
+    large += "{last: true}\n";
+    Hjson::DecoderOptions decOpt;
+    decOpt.comments = true;
+    std::istringstream in(large);
+    Hjson::DocumentReader reader(in, decOpt);
+    Hjson::DecoderOptions decOptMt = decOpt;
+    decOptMt.threads = 4;
+    auto docsMt = Hjson::UnmarshalDocuments(large, decOptMt);
+    assert(docsMt.size() == 20001);
+    for (int a = 0; a <= 20000; ++a) {
+      Hjson::Value doc;
+      assert(reader.next(doc));
+      assert(doc.deep_equal(docsMt[a]));
+      assert(Hjson::Marshal(doc) == Hjson::Marshal(docsMt[a]));
+      if (a < 20000) {
+        assert(doc["id"] == a);
+        assert(doc.get_comment_after() == " # " + std::to_string(a));
+      }
+    }
+    Hjson::Value doc;
+    assert(!reader.next(doc));
+
+    // Syntax errors are reported at the same position in all readers.
+    std::string bad = large;
+    bad.insert(bad.find("{id: 15000"), "{a b: 1}\n");
+    std::vector<std::string> errors;
+    for (int a = 0; a < 3; ++a) {
+      std::istringstream badIn(bad);
+      try {
+        if (a == 0) {
+          Hjson::UnmarshalDocuments(bad, decOptMt);
+        } else {
+          Hjson::DocumentReader badReader = a == 1 ?
+            Hjson::DocumentReader(bad.data(), bad.size()) :
+            Hjson::DocumentReader(badIn);
+          size_t count = 0;
+          try {
+            while (badReader.next(doc)) {
+              ++count;
+            }
+          } catch (const Hjson::syntax_error&) {
+            assert(count == 15000);
+            assert(!badReader.next(doc));
+            throw;
+          }
+        }
+        assert(!"Did not throw error for invalid document");
+      } catch (const Hjson::syntax_error& e) {
+        errors.push_back(e.what());
+      }
+    }
+    assert(errors[0].find("line 15001") != std::string::npos);
+    assert(errors[1] == errors[0]);
+    assert(errors[2] == errors[0]);
+
+    // DocumentWriter writes documents that DocumentReader reads back.
+    std::vector<Hjson::Value> values = {
+      Hjson::Unmarshal("{a: 1, b: [1, 2, {c: 'x'}]}"),
+      Hjson::Unmarshal("[\"multi\\nline\", 3.5]"),
+      Hjson::Value("multi\nline\n\nstring"),
+      Hjson::Value("plain"),
+      Hjson::Value(7),
+      Hjson::Value(Hjson::Type::Map),
+      Hjson::Unmarshal("# comment\n{x: {y: 'z'}} // after"),
+    };
+    for (int omit = 0; omit < 2; ++omit) {
+      Hjson::EncoderOptions writeOpt;
+      writeOpt.omitRootBraces = omit;
+      std::ostringstream out;
+      {
+        Hjson::DocumentWriter writer(out, writeOpt);
+        for (const auto& val : values) {
+          writer.write(val);
+        }
+      }
+      auto read = Hjson::UnmarshalDocuments(out.str(), decOpt);
+      assert(read.size() == values.size());
+      for (size_t a = 0; a < values.size(); ++a) {
+        assert(read[a].deep_equal(values[a]));
+      }
+    }
+
+    const char *szTmp = "tmpTestFile.hjson";
+    {
+      std::ofstream outfile(szTmp, std::ofstream::binary);
+      outfile << input;
+    }
+    auto fileReader = Hjson::DocumentReader::fromFile(szTmp, decOpt);
+    for (const auto& part : parts) {
+      assert(fileReader.next(doc));
+      assert(doc.deep_equal(Hjson::Unmarshal(part, decOpt)));
+    }
+    assert(!fileReader.next(doc));
+    std::remove(szTmp);
+  }
+
+  {
+    Hjson::Value a = Hjson::Unmarshal("{a: 1, b: [1, 2.5, 'x'], c: {d: null}}");
+    Hjson::Value b = Hjson::Unmarshal("// comment\n{c: {d: null}, b: [1.0, 2.5, 'x'], a: 1.0}");
+    assert(a.deep_equal(b));
+    assert(b.deep_equal(a));
+    assert(a.hash() == b.hash());
+    assert(Hjson::Value(1).hash() == Hjson::Value(1.0).hash());
+    assert(Hjson::Value(0.0).hash() == Hjson::Value(-0.0).hash());
+    assert(Hjson::Value("1").hash() != Hjson::Value(1).hash());
+    assert(Hjson::Value().hash() != Hjson::Value(Hjson::Type::Null).hash());
+
+    // Same values under different keys.
+    Hjson::Value c = Hjson::Unmarshal("{a: 1, b: [1, 2.5, 'x'], e: {d: null}}");
+    assert(!a.deep_equal(c));
+    assert(a.hash() != c.hash());
+    Hjson::Value d = Hjson::Unmarshal("{b: [1, 2.5, 'x'], a: 1, e: {d: null}}");
+    assert(!a.deep_equal(d));
+    assert(!d.deep_equal(a));
+
+    // The order of Vector elements matters.
+    Hjson::Value v1 = Hjson::Unmarshal("[1, 2, [3, 4]]");
+    Hjson::Value v2 = Hjson::Unmarshal("[1, 2, [4, 3]]");
+    assert(!v1.deep_equal(v2));
+    assert(v1.hash() != v2.hash());
+
+    // Shared subtrees are equal without being traversed.
+    Hjson::Value shared;
+    shared["sub"] = a;
+    Hjson::Value shared2;
+    shared2["sub"] = a;
+    assert(shared.deep_equal(shared2));
+
+    // The hash is not cached, so a change in a nested element is seen.
+    size_t h = a.hash();
+    a["c"]["d"] = 2;
+    assert(a.hash() != h);
+    assert(!a.deep_equal(b));
+    b["c"]["d"] = 2.0;
+    assert(a.hash() == b.hash());
+    assert(a.deep_equal(b));
+
+    // Large Maps, looked up through the index when the order differs.
+    Hjson::Value m1, m2;
+    for (int i = 0; i < 1000; ++i) {
+      m1[std::to_string(i)] = i;
+      m2[std::to_string(999 - i)] = 999 - i;
+    }
+    assert(m1.deep_equal(m2));
+    assert(m1.hash() == m2.hash());
+    m2["500"] = 0;
+    assert(!m1.deep_equal(m2));
+    assert(m1.hash() != m2.hash());
+
+    // Deep trees.
+    Hjson::Value deep1(Hjson::Type::Vector), deep2(Hjson::Type::Vector);
+    Hjson::Value leaf1 = deep1, leaf2 = deep2;
+    for (int i = 0; i < 100000; ++i) {
+      Hjson::Value map1(Hjson::Type::Map), map2(Hjson::Type::Map);
+      Hjson::Value vec1(Hjson::Type::Vector), vec2(Hjson::Type::Vector);
+      map1["k"] = vec1;
+      map2["k"] = vec2;
+      leaf1.push_back(map1);
+      leaf2.push_back(map2);
+      leaf1 = vec1;
+      leaf2 = vec2;
+    }
+    assert(deep1.deep_equal(deep2));
+    assert(deep1.hash() == deep2.hash());
+    leaf2.push_back(1);
+    assert(!deep1.deep_equal(deep2));
+    assert(deep1.hash() != deep2.hash());
+  }
+
+  {
+    Hjson::Value from = Hjson::Unmarshal(R"(
+      // Servers.
+      servers: {
+        main: {host: "example.com", port: 80}
+        backup: {host: "example.org", port: 81}
+      }
+      list: [1, 2, 3, 4, 5]
+    )");
+    Hjson::Value to = from.clone();
+    to["servers"]["main"]["port"] = 8080;
+    Hjson::Value servers = from["servers"];
+
+    auto diff = Hjson::Diff(from, to);
+    assert(diff.changes.size() == 1);
+    assert(diff.changes[0].op == Hjson::Difference::Op::Replace);
+    assert(diff.changes[0].pointer() == "/servers/main/port");
+    assert(diff.changes[0].value == 8080);
+    Hjson::Patch(from, diff);
+    assert(from.deep_equal(to));
+    // The containers are changed in place and keep their comments.
+    assert(servers["main"]["port"] == 8080);
+    assert(from["servers"].get_comment_before().find("// Servers.") !=
+      std::string::npos);
+
+    assert(Hjson::Diff(from, to).changes.empty());
+    assert(Hjson::Diff(from, from).changes.empty());
+
+    // Additions, removals and reordering of keys, and Vectors that change at
+    // the start, in the middle and at the end.
+    Hjson::Value a = Hjson::Unmarshal("{a: 1, b: {x: 1}, c: [1, 2, 3, 4, 5, 6], d: 4, 'k/~': 1}");
+    Hjson::Value b = Hjson::Unmarshal("{d: 4, 'k/~': 2, b: {y: 2, x: 1}, e: 5, c: [0, 1, 2, 7, 5, 6, 8], a: 1}");
+    diff = Hjson::Diff(a, b);
+    bool foundEscaped = false;
+    for (const auto& change : diff.changes) {
+      foundEscaped = foundEscaped || change.pointer() == "/k~1~0";
+    }
+    assert(foundEscaped);
+    Hjson::Patch(a, diff);
+    assert(a.deep_equal(b));
+    assert(Hjson::Marshal(a) == Hjson::Marshal(b));
+
+    // A change of type, also at the root.
+    a = Hjson::Unmarshal("{a: [1]}");
+    b = Hjson::Unmarshal("{a: {b: 1}}");
+    Hjson::Patch(a, Hjson::Diff(a, b));
+    assert(Hjson::Marshal(a) == Hjson::Marshal(b));
+    diff = Hjson::Diff(a, Hjson::Value(3));
+    assert(diff.changes.size() == 1 && diff.changes[0].pointer() == "");
+    Hjson::Patch(a, diff);
+    assert(a == 3);
+
+    // The added values are cloned.
+    a = Hjson::Unmarshal("[]");
+    b = Hjson::Unmarshal("[{c: 1}]");
+    Hjson::Patch(a, Hjson::Diff(a, b));
+    b[0]["c"] = 2;
+    assert(a[0]["c"] == 1);
+
+    a = Hjson::Unmarshal("{a: [1, 2]}");
+    b = Hjson::Unmarshal("{a: [1]}");
+    diff = Hjson::Diff(a, b);
+    Hjson::Value other = Hjson::Unmarshal("{b: 1}");
+    bool thrown = false;
+    try {
+      Hjson::Patch(other, diff);
+    } catch (const Hjson::index_out_of_bounds&) {
+      thrown = true;
+    }
+    assert(thrown);
+
+    // Random trees.
+    std::uint32_t seed = 12345;
+    auto rnd = [&seed](std::uint32_t n) {
+      seed = seed * 1103515245 + 12345;
+      return (seed >> 16) % n;
+    };
+    std::function<Hjson::Value(int)> gen = [&](int depth) {
+      switch (depth > 3 ? 0 : rnd(4)) {
+      case 0:
+        return Hjson::Value(int(rnd(5)));
+      case 1:
+        return Hjson::Value(std::string(1, char('a' + rnd(3))));
+      case 2:
+        {
+          Hjson::Value vec(Hjson::Type::Vector);
+          for (int i = rnd(6); i > 0; --i) {
+            vec.push_back(gen(depth + 1));
+          }
+          return vec;
+        }
+      default:
+        {
+          Hjson::Value map(Hjson::Type::Map);
+          for (int i = rnd(6); i > 0; --i) {
+            map[std::string(1, char('a' + rnd(8)))] = gen(depth + 1);
+          }
+          return map;
+        }
+      }
+    };
+    for (int i = 0; i < 2000; ++i) {
+      a = gen(0);
+      b = gen(0);
+      Hjson::Value c = a.clone();
+      Hjson::Patch(c, Hjson::Diff(a, b));
+      assert(c.deep_equal(b));
+      assert(Hjson::Marshal(c) == Hjson::Marshal(b));
+    }
+  }
+
+  {
+    // Key names with control characters must be quoted.
+    Hjson::Value root;
+    root[std::string("\x01", 1)] = 1;
+    root[std::string("k\x00", 2)] = 2;
+    root["\x7f"] = 3;
+    auto text = Hjson::Marshal(root);
+    assert(text.find("\"\\u0001\"") != std::string::npos);
+    assert(text.find("\"k\\u0000\"") != std::string::npos);
+    assert(Hjson::Unmarshal(text).deep_equal(root));
+  }
+
+  {
+    // A root string with a colon, which is not an object without braces.
+    for (auto str : { "o:", "a: b", "x:y" }) {
+      Hjson::Value val(str);
+      auto text = Hjson::Marshal(val);
+      assert(text[0] == '"');
+      assert(Hjson::Unmarshal(text) == val);
+    }
+    // Not at the root.
+    Hjson::Value root;
+    root["c"] = "x:";
+    assert(Hjson::Marshal(root).find("c: x:") != std::string::npos);
+  }
+
+  {
+    // Strings that can not be written as a single line in the ''' format.
+    Hjson::Value root;
+    root["a"] = "1\t'";
+    root["b"] = "\tx";
+    root["c"] = " \\x";
+    auto text = Hjson::Marshal(root);
+    assert(text.find("'''") == std::string::npos);
+    assert(Hjson::Unmarshal(text).deep_equal(root));
+  }
+
+  {
+    // The decoder drops \r in multiline strings.
+    Hjson::Value root;
+    root["a"] = "a\rb";
+    root["b"] = "x\r\ny\\";
+    auto text = Hjson::Marshal(root);
+    assert(text.find("'''") == std::string::npos);
+    assert(text.find("\\r") != std::string::npos);
+    assert(Hjson::Unmarshal(text).deep_equal(root));
+  }
+
+  {
+    // A value missing at the end of the input. The root is then a single
+    // quoteless string.
+    assert(Hjson::Unmarshal("a:") == "a:");
+    assert(Hjson::Unmarshal("i:#") == "i:#");
+    assert(Hjson::Unmarshal(std::string("a:\0", 3)) == "a:");
+    bool thrown = false;
+    try {
+      Hjson::Unmarshal("{a:");
+    } catch (const Hjson::syntax_error& e) {
+      thrown = (std::string(e.what()).find("Found EOF while looking for a "
+        "value (check your syntax) at line 1,") == 0);
+    }
+    assert(thrown);
+  }
+
+  {
+    // A comment before an element, that does not start on a new line, must
+    // not be written right after a quoteless string.
+    Hjson::DecoderOptions decOpt;
+    decOpt.comments = true;
+    Hjson::EncoderOptions encOpt;
+    encOpt.comments = true;
+    for (auto str : { "{s:[\"00\",#\nl\n]}", "{a:x\n/*c*/b:y\n}" }) {
+      auto val = Hjson::Unmarshal(str, decOpt);
+      assert(Hjson::Unmarshal(Hjson::Marshal(val, encOpt)).deep_equal(val));
+    }
+    // Also where the elements are split between threads.
+    Hjson::Value vec(Hjson::Type::Vector);
+    for (int a = 0; a < 5000; ++a) {
+      Hjson::Value elem("x" + std::to_string(a));
+      elem.set_comment_before("/* c */");
+      vec.push_back(elem);
+    }
+    auto text = Hjson::Marshal(vec, encOpt);
+    assert(Hjson::Unmarshal(text).deep_equal(vec));
+    encOpt.threads = 4;
+    assert(Hjson::Marshal(vec, encOpt) == text);
+  }
 }